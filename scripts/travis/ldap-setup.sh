@@ -14,3 +14,7 @@ sleep 1
 
 # Add test data
 ldapadd -x -H ldap://127.0.0.1:3890/ -D "cn=admin,cn=config" -w secret -f src/tests/salt-test-server/salt/ldap/base.ldif
+
+# Start the servers which stall searches, and drop connections, for the async tests
+python scripts/travis/ldap/fake-server.py stall 127.0.0.1 3891
+python scripts/travis/ldap/fake-server.py close 127.0.0.1 3892
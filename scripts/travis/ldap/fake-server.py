@@ -0,0 +1,123 @@
+#!/usr/bin/env python
+#
+#  A minimal LDAP server, which misbehaves in the ways rlm_ldap has
+#  to cope with.
+#
+#  Binds, and searches of the rootDSE, succeed, so that connections
+#  can be opened.  Any other search is either:
+#
+#    stall	never answered, so the search times out.
+#    close	answered by closing the connection, so the search
+#		fails, and is retried on a new connection.
+#
+#  Usage: fake-server.py <stall|close> <address> <port>
+#
+import os
+import socket
+import sys
+import threading
+
+def read_exact(sock, n):
+	data = b''
+	while len(data) < n:
+		chunk = sock.recv(n - len(data))
+		if not chunk:
+			return None
+		data += chunk
+	return data
+
+#
+#  Read one BER encoded LDAPMessage
+#
+def read_message(sock):
+	hdr = read_exact(sock, 2)
+	if hdr is None:
+		return None
+
+	hdr = bytearray(hdr)
+	length = hdr[1]
+	if length & 0x80:
+		raw = read_exact(sock, length & 0x7f)
+		if raw is None:
+			return None
+		length = 0
+		for b in bytearray(raw):
+			length = (length << 8) | b
+
+	return read_exact(sock, length)
+
+#
+#  Split an LDAPMessage into the messageID TLV, the protocolOp tag,
+#  and the protocolOp's contents.
+#
+def parse_message(msg):
+	msg = bytearray(msg)
+	id_len = 2 + msg[1]
+	msgid = msg[:id_len]
+	op = msg[id_len]
+	length = msg[id_len + 1]
+	start = id_len + 2
+	if length & 0x80:
+		start += length & 0x7f
+
+	return msgid, op, msg[start:]
+
+#
+#  An LDAPResult with resultCode success, and empty matchedDN and
+#  diagnosticMessage.
+#
+def success(msgid, op):
+	body = bytearray([op, 0x07, 0x0a, 0x01, 0x00, 0x04, 0x00, 0x04, 0x00])
+	return bytes(bytearray([0x30, len(msgid) + len(body)]) + msgid + body)
+
+def handle(sock, mode):
+	try:
+		while True:
+			msg = read_message(sock)
+			if msg is None:
+				return
+
+			msgid, op, body = parse_message(msg)
+
+			if op == 0x60:				# BindRequest
+				sock.sendall(success(msgid, 0x61))
+
+			elif op == 0x63:			# SearchRequest
+				if body[:2] == bytearray([0x04, 0x00]):	# rootDSE
+					sock.sendall(success(msgid, 0x65))
+				elif mode == 'close':
+					return
+
+			elif op == 0x42:			# UnbindRequest
+				return
+
+			#  Anything else (e.g. AbandonRequest) is ignored
+	finally:
+		sock.close()
+
+def main():
+	if len(sys.argv) != 4 or sys.argv[1] not in ('stall', 'close'):
+		sys.stderr.write('Usage: %s <stall|close> <address> <port>\n' % sys.argv[0])
+		sys.exit(64)
+
+	mode = sys.argv[1]
+
+	listener = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+	listener.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+	listener.bind((sys.argv[2], int(sys.argv[3])))
+	listener.listen(16)
+
+	#
+	#  Detach, once we're listening
+	#
+	if os.fork() != 0:
+		os._exit(0)
+
+	while True:
+		sock, _ = listener.accept()
+		t = threading.Thread(target = handle, args = (sock, mode))
+		t.daemon = True
+		t.start()
+
+if __name__ == '__main__':
+	main()
@@ -23,6 +23,7 @@ HEADERS	= \
 	event.h \
 	hash.h \
 	heap.h \
+	histogram.h \
 	libradius.h \
 	md4.h \
 	md5.h \
@@ -44,6 +44,29 @@ typedef enum detail_entry_state_t {
 	STATE_REPLIED
 } detail_entry_state_t;
 
+/** A record read from the detail file, which is being processed by the server
+ *
+ */
+typedef struct detail_entry_t {
+	VALUE_PAIR	*vps;			//!< Attributes read from the record.
+	uint32_t	counter;		//!< Counter of the last packet sent for the record.
+	off_t		timestamp_offset;	//!< Offset of the "Timestamp" line, for marking the record done.
+	time_t		timestamp;		//!< When the record was written.
+	time_t		running;		//!< When the record was last sent.
+	time_t		retry;			//!< When to send the record again.  0 if it's outstanding.
+	fr_ipaddr_t	client_ip;		//!< Client the record originally came from.
+	int		tries;			//!< How many times the record has been sent.
+	bool		in_use;			//!< Whether the entry holds a record.
+} detail_entry_t;
+
+/** Passed from the server back to the reader thread when a packet is done with
+ *
+ */
+typedef struct detail_ack_t {
+	uint32_t	counter;		//!< Counter of the packet.
+	int32_t		rtt;			//!< Round trip time in microseconds, or -1 if there was no reply.
+} detail_ack_t;
+
 typedef struct listen_detail_t {
 	fr_event_timer_t	*ev;	/* has to be first entry (ugh) */
 	char const 	*name;			//!< Identifier used in log messages
@@ -62,23 +85,26 @@ typedef struct listen_detail_t {
 	detail_file_state_t 	file_state;
 	detail_entry_state_t 	entry_state;
 	time_t		timestamp;
-	time_t		running;
 	fr_ipaddr_t	client_ip;
 
 	off_t		last_offset;
 	off_t		timestamp_offset;
 	bool		done_entry;		//!< Are we done reading this entry?
 	bool		track;			//!< Do we track progress through the file?
+	bool		eof;			//!< Nothing more to read, close the file once all
+						//!< outstanding records have been replied to.
+	bool		unsynced;		//!< Records have been marked done, but not synced.
 
 	uint32_t	load_factor; /* 1..100 */
 	uint32_t	poll_interval;
 	uint32_t	retry_interval;
 
-	int		signal;
 	int		packets;
 	int		tries;
 	bool		one_shot;
-	int		outstanding;
+	uint32_t	max_outstanding;	//!< How many records may be processed at once.
+	uint32_t	outstanding;		//!< How many records are being processed.
+	detail_entry_t	*entries;		//!< Records being processed.
 	int		has_rtt;
 	int		srtt;
 	int		rttvar;
@@ -87,6 +87,15 @@ struct dict_attr {
 	fr_dict_attr_t const	**children;			//!< Children of this attribute.
 	fr_dict_attr_t const	*next;				//!< Next child in bin.
 
+	fr_dict_attr_t const	**child_index;			//!< Children by number, either indexed directly,
+								//!< or by perfect hash.  Built when the dictionary
+								//!< is loaded, and NULL while stale.
+	uint32_t		*child_index_disp;		//!< Perfect hash displacement for each bucket, or
+								//!< NULL if child_index is indexed directly.
+	uint32_t		child_index_len;		//!< Number of slots in child_index.
+	uint8_t			child_index_shift;		//!< Perfect hash shift for slots.
+	uint8_t			child_index_disp_shift;		//!< Perfect hash shift for buckets.
+
 	unsigned int		depth;				//!< Depth of nesting for this attribute.
 
 	fr_dict_attr_flags_t	flags;				//!< Flags.
@@ -145,6 +154,12 @@ typedef struct dict_vendor {
  */
 #define FR_DICT_ATTR_SIZE		(sizeof(fr_dict_attr_t) + FR_DICT_ATTR_MAX_NAME_LEN)
 
+/** Suffix of binary dictionary images
+ *
+ * fr_dict_from_file() uses dir/file.bin in place of dir/file, if it's up to date.
+ */
+#define FR_DICT_IMAGE_EXT		".bin"
+
 /** Characters that are allowed in dictionary attribute names
  *
  */
@@ -174,6 +189,8 @@ int			fr_dict_from_file(TALLOC_CTX *ctx, fr_dict_t **out,
 
 int			fr_dict_read(fr_dict_t *dict, char const *dir, char const *filename);
 
+int			fr_dict_image_write(fr_dict_t const *dict, char const *file);
+
 int			fr_dict_parse_str(fr_dict_t *dict, char *buf,
 					  fr_dict_attr_t const *parent, unsigned int vendor);
 
@@ -247,6 +264,10 @@ char const		*fr_dict_enum_name_by_da(fr_dict_t *dict, fr_dict_attr_t const *da,
 
 fr_dict_enum_t		*fr_dict_enum_by_name(fr_dict_t *dict, fr_dict_attr_t const *da, char const *val);
 
+int			fr_dict_vendor_walk(fr_dict_t *dict, fr_hash_table_walk_t callback, void *uctx);
+
+int			fr_dict_enum_walk(fr_dict_t *dict, fr_hash_table_walk_t callback, void *uctx);
+
 /*
  *	Validation
  */
@@ -25,6 +25,8 @@
  */
 RCSIDH(exfile_h, "$Id$")
 
+#include <sys/uio.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -40,6 +42,9 @@ exfile_t	*exfile_init(TALLOC_CTX *ctx, uint32_t entries, uint32_t idle, bool loc
 void		exfile_enable_triggers(exfile_t *ef, CONF_SECTION *cs, char const *trigger_prefix,
 				       VALUE_PAIR *trigger_args);
 
+int		exfile_enable_write_behind(exfile_t *ef, size_t buffer_size,
+					   uint32_t fsync_records, uint32_t fsync_interval);
+
 int		exfile_open(exfile_t *lf, REQUEST *request, char const *filename,
 			    mode_t permissions, bool append);
 
@@ -47,6 +52,9 @@ int		exfile_close(exfile_t *lf, REQUEST *request, int fd);
 
 int		exfile_unlock(exfile_t *lf, REQUEST *request, int fd);
 
+ssize_t		exfile_write(exfile_t *ef, REQUEST *request, char const *filename,
+			     mode_t permissions, gid_t gid, struct iovec const *vector, int iovcnt);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,51 @@
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+#ifndef _FR_HISTOGRAM_H
+#define _FR_HISTOGRAM_H
+/**
+ * $Id$
+ *
+ * @file include/histogram.h
+ * @brief Structures and prototypes for log-linear histograms.
+ *
+ * @copyright 2016  The FreeRADIUS server project
+ */
+RCSIDH(histogram_h, "$Id$")
+
+#include <stdint.h>
+#include <talloc.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct fr_histogram fr_histogram_t;
+
+fr_histogram_t	*fr_histogram_alloc(TALLOC_CTX *ctx, uint64_t highest, unsigned int precision);
+void		fr_histogram_add(fr_histogram_t *h, uint64_t value);
+int		fr_histogram_merge(fr_histogram_t *dst, fr_histogram_t const *src);
+void		fr_histogram_reset(fr_histogram_t *h);
+
+uint64_t	fr_histogram_count(fr_histogram_t const *h);
+uint64_t	fr_histogram_min(fr_histogram_t const *h);
+uint64_t	fr_histogram_max(fr_histogram_t const *h);
+double		fr_histogram_mean(fr_histogram_t const *h);
+uint64_t	fr_histogram_percentile(fr_histogram_t const *h, double percentile);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* _FR_HISTOGRAM_H */
@@ -226,12 +226,18 @@ ssize_t		fr_radius_recv_header(int sockfd, fr_ipaddr_t *src_ipaddr, uint16_t *sr
 
 int		fr_radius_verify(RADIUS_PACKET *packet, RADIUS_PACKET *original, char const *secret);
 
+int		fr_radius_verify_multi(RADIUS_PACKET * const *packets, RADIUS_PACKET * const *originals,
+				       char const * const *secrets, int *rcode, unsigned int num);
+
 int		fr_radius_decode(RADIUS_PACKET *packet, RADIUS_PACKET *original, char const *secret);
 
 int		fr_radius_encode(RADIUS_PACKET *packet, RADIUS_PACKET const *original, char const *secret);
 
 int		fr_radius_sign(RADIUS_PACKET *packet, RADIUS_PACKET const *original, char const *secret);
 
+int		fr_radius_sign_multi(RADIUS_PACKET * const *packets, RADIUS_PACKET const * const *originals,
+				     char const * const *secrets, int *rcode, unsigned int num);
+
 int		fr_radius_digest_cmp(uint8_t const *a, uint8_t const *b, size_t length);
 
 RADIUS_PACKET	*fr_radius_alloc(TALLOC_CTX *ctx, bool new_vector);
@@ -534,6 +540,7 @@ int		fr_socket_client_tcp(fr_ipaddr_t const *src_ipaddr, fr_ipaddr_t const *dst_
 int		fr_socket_wait_for_connect(int sockfd, struct timeval const *timeout);
 int		fr_socket_server_base(int proto, fr_ipaddr_t *ipaddr, int *port, char const *port_name, bool async);
 int		fr_socket_server_bind(int sockfd, fr_ipaddr_t *ipaddr, int *port, char const *interface);
+int		fr_socket_server_reuse_port(int sockfd);
 
 #ifdef __cplusplus
 }
@@ -85,6 +85,13 @@ void	fr_hmac_md5(uint8_t digest[MD5_DIGEST_LENGTH], uint8_t const *text, size_t
 
 /* md5.c */
 void	fr_md5_calc(uint8_t *out, uint8_t const *in, size_t inlen);
+void	fr_md5_init_secret(FR_MD5_CTX *ctx, uint8_t const *secret, size_t secret_len);
+
+/* md5_multi.c */
+void	fr_md5_calc_multi(uint8_t (*out)[MD5_DIGEST_LENGTH], uint8_t const * const *in, size_t const *inlen,
+			  uint8_t const * const *suffix, size_t const *suffix_len, unsigned int num);
+void	fr_hmac_md5_multi(uint8_t (*out)[MD5_DIGEST_LENGTH], uint8_t const * const *text, size_t const *text_len,
+			  uint8_t const * const *key, size_t const *key_len, unsigned int num);
 
 #ifdef __cplusplus
 }
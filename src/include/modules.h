@@ -254,6 +254,8 @@ typedef void (*fr_unlang_fd_callback_t)(REQUEST *request, void *instance, void *
  *
  * The resumed request cannot call the normal "authorize", etc. method.  It needs a separate callback.
  *
+ * If the module has to wait again, the callback may register new events, and return unlang_yield().
+ *
  * @param[in] request		the current request.
  * @param[in] instance		The module instance.
  * @param[in] thread		data specific to this module instance.
@@ -49,6 +49,7 @@ RADIUS_PACKET **fr_packet_list_find_byreply(fr_packet_list_t *pl,
 bool fr_packet_list_yank(fr_packet_list_t *pl,
 			 RADIUS_PACKET *request);
 uint32_t fr_packet_list_num_elements(fr_packet_list_t *pl);
+void fr_packet_list_fanout(fr_packet_list_t *pl, uint32_t watermark);
 bool fr_packet_list_id_alloc(fr_packet_list_t *pl, int proto,
 			    RADIUS_PACKET **request_p, void **pctx);
 bool fr_packet_list_id_free(fr_packet_list_t *pl,
@@ -26,6 +26,8 @@
 RCSIDH(radclient_h, "$Id$")
 
 #include <freeradius-devel/libradius.h>
+#include <freeradius-devel/event.h>
+#include <freeradius-devel/histogram.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -41,6 +43,8 @@ extern "C" {
 
 
 #define ERROR(fmt, ...)		if (do_output) fr_perror("radclient: " fmt, ## __VA_ARGS__)
+#undef WARN
+#define WARN(fmt, ...)		if (do_output) fr_perror("radclient: WARNING: " fmt, ## __VA_ARGS__)
 
 #define RDEBUG_ENABLED()	(do_output && (fr_debug_lvl > 0))
 #define RDEBUG_ENABLED2()	(do_output && (fr_debug_lvl > 1))
@@ -55,6 +59,8 @@ typedef struct rc_stats {
 	uint64_t lost;			//!< Requests to which we received no response
 	uint64_t passed;		//!< Requests which passed a filter
 	uint64_t failed;		//!< Requests which failed a fitler
+
+	fr_histogram_t *latency;	//!< Response times in microseconds.
 } rc_stats_t;
 
 typedef struct rc_file_pair {
@@ -75,6 +81,7 @@ struct rc_request {
 
 	VALUE_PAIR	*password;	//!< Cleartext-Password
 	time_t		timestamp;
+	struct timeval	sent;		//!< When the packet was last sent, for latency stats.
 
 	RADIUS_PACKET	*packet;	//!< The outgoing request.
 	RADIUS_PACKET	*reply;		//!< The incoming response.
@@ -85,6 +92,9 @@ struct rc_request {
 	int		tries;
 	bool		done;		//!< Whether the request is complete.
 
+	bool		clone;		//!< A copy made in rate mode.  Freed when it completes.
+	fr_event_timer_t *ev;		//!< Rate mode timeout.
+
 	char const	*name;		//!< Test name (as specified in the request).
 };
 
@@ -32,6 +32,17 @@ RCSIDH(radsniff_h, "$Id$")
 #include <freeradius-devel/libradius.h>
 #include <freeradius-devel/pcap.h>
 #include <freeradius-devel/event.h>
+#include <freeradius-devel/histogram.h>
+
+#ifdef HAVE_PTHREAD_H
+#  include <pthread.h>
+#  ifdef HAVE_STDATOMIC_H
+#    include <stdatomic.h>
+#  else
+#    include <freeradius-devel/stdatomic.h>
+#  endif
+#  include <freeradius-devel/util/atomic_queue.h>
+#endif
 
 #ifdef HAVE_COLLECTDC_H
 #  include <collectd/client.h>
@@ -42,8 +53,14 @@ RCSIDH(radsniff_h, "$Id$")
 #define RS_DEFAULT_TIMEOUT	5200		//!< Standard timeout of 5s + 300ms to cover network latency
 #define RS_FORCE_YIELD		1000		//!< Service another descriptor every X number of packets
 #define RS_RETRANSMIT_MAX	5		//!< Maximum number of times we expect to see a packet retransmitted
+#define RS_HISTOGRAM_HIGHEST	60000000	//!< Highest latency (in microseconds) histograms distinguish.
+#define RS_HISTOGRAM_PRECISION	7		//!< Histogram sub-bucket bits, gives better than 1% resolution.
 #define RS_MAX_ATTRS		50		//!< Maximum number of attributes we can filter on.
 #define RS_SOCKET_REOPEN_DELAY  5000		//!< How long we delay re-opening a collectd socket.
+#define RS_MAX_THREADS		64		//!< Maximum number of decode threads.
+#define RS_QUEUE_SIZE		2048		//!< Number of packets which can be queued for each decode thread.
+#define RS_IDLE_WAIT		100		//!< Longest time in ms a decode thread sleeps without checking
+						//!< for timeouts.
 
 /*
  *	Logging macros
@@ -86,6 +103,7 @@ typedef enum {
 } stats_out_t;
 
 typedef struct rs rs_t;
+typedef struct rs_shard rs_shard_t;
 
 #ifdef HAVE_COLLECTDC_H
 typedef struct rs_stats_tmpl rs_stats_tmpl_t;
@@ -96,6 +114,16 @@ typedef struct rs_counters {
 	uint64_t type[PW_CODE_MAX];
 } rs_counters_t;
 
+/** Latency percentiles for a single interval, in milliseconds
+ *
+ */
+typedef struct rs_percentiles {
+	double			p50;			//!< Median latency.
+	double			p90;			//!< 90th percentile latency.
+	double			p99;			//!< 99th percentile latency.
+	double			p999;			//!< 99.9th percentile latency.
+} rs_percentiles_t;
+
 /** Stats for a single interval
  *
  * And interval is defined as the time between a call to the stats output function.
@@ -106,6 +134,10 @@ typedef struct rs_latency {
 	double			latency_smoothed;		//!< Smoothed moving average.
 	uint64_t		latency_smoothed_count;		//!< Number of CMA datapoints processed.
 
+	fr_histogram_t		*histogram;			//!< Latency (in microseconds) of packets linked
+								//!< during the interval.  Only allocated for the
+								//!< codes we report stats for.
+
 	struct {
 		uint64_t		received_total;		//!< Total received over interval.
 		uint64_t		linked_total;		//!< Total request/response pairs over interval.
@@ -130,9 +162,27 @@ typedef struct rs_latency {
 
 		double			latency_high;		//!< Latency high water mark.
 		double			latency_low;		//!< Latency low water mark.
+
+		rs_percentiles_t	latency_percentile;	//!< Latency percentiles from the histogram.
 	} interval;
 } rs_latency_t;
 
+/** Latency for a single server
+ *
+ * Servers are identified by the address and port responses were sent from.
+ */
+typedef struct rs_server {
+	fr_ipaddr_t		ipaddr;			//!< Address of the server.
+	uint16_t		port;			//!< Port of the server.
+
+	fr_histogram_t		*histogram[PW_CODE_MAX];	//!< Latency (in microseconds) by request code.
+								//!< Allocated when we see the first response.
+	rs_percentiles_t	percentile[PW_CODE_MAX];	//!< Latency percentiles for the interval.
+#ifdef HAVE_COLLECTDC_H
+	bool			registered[PW_CODE_MAX];	//!< Whether we've created collectd templates.
+#endif
+} rs_server_t;
+
 typedef struct rs_malformed {
 	uint64_t		min_length_packet;
 	uint64_t		min_length_field;
@@ -158,6 +208,8 @@ typedef struct rs_stats {
 							//!< FreeRADIUS delay Access-Rejects, which would artificially
 							//!< increase latency stats for Access-Requests.
 
+	rbtree_t		*servers;		//!< Latency for each server we've seen a response from.
+
 	struct timeval		quiet;			//!< We may need to 'mute' the stats if libpcap starts
 							//!< dropping packets, or we run out of memory.
 } rs_stats_t;
@@ -174,6 +226,7 @@ typedef struct rs_capture {
  */
 typedef struct rs_request {
 	uint64_t		id;			//!< Monotonically increasing packet counter.
+	rs_shard_t		*shard;			//!< Shard whose trees and timers hold the request.
 	fr_event_timer_t		*event;			//!< Event created when we received the original request.
 
 	bool			logged;			//!< Whether any messages regarding this request were logged.
@@ -210,14 +263,59 @@ typedef struct rs_request {
  *
  */
 typedef struct rs_event {
-	fr_event_list_t		*list;			//!< The event list.
-
 	fr_pcap_t		*in;			//!< PCAP handle event occurred on.
 	fr_pcap_t		*out;			//!< Where to write output.
 
-	rs_stats_t		*stats;			//!< Where to write stats.
+	rs_shard_t		*shard;			//!< Where to link the packet, and write stats.
 } rs_event_t;
 
+#ifdef HAVE_PTHREAD_H
+/** A packet copied out of the capture buffer, waiting for a decode thread
+ *
+ */
+typedef struct rs_packet {
+	uint64_t		count;			//!< Packet counter assigned by the capture thread.
+	fr_pcap_t		*in;			//!< PCAP handle the packet was received on.
+	struct pcap_pkthdr	header;			//!< PCAP packet header.
+	uint8_t			data[SNAPLEN];		//!< PCAP packet data.
+} rs_packet_t;
+#endif
+
+/** State for linking requests with their responses
+ *
+ * When decoding with multiple threads, each thread has its own shard.  Packets are
+ * assigned to a shard by address and port, so a request and its response always end
+ * up in the same one, and no locking is needed to link them.
+ */
+struct rs_shard {
+	int			number;			//!< Shard number, for logging.
+
+	fr_event_list_t		*list;			//!< Cleanup timers for requests in this shard.
+	rbtree_t		*request_tree;		//!< Requests, keyed on the response we expect.
+	rbtree_t		*link_tree;		//!< Requests, keyed on the attributes used to link RTX.
+	rs_stats_t		*stats;			//!< Stats for packets processed by this shard.
+
+#ifdef HAVE_PTHREAD_H
+	rs_event_t		event;			//!< Passed to rs_packet_process by the decode thread.
+
+	pthread_t		thread;			//!< Decode thread.
+	pthread_mutex_t		mutex;			//!< Held by the decode thread while it processes
+							//!< packets, and by the capture thread while it
+							//!< merges the stats.
+	pthread_cond_t		cond;			//!< Signalled when packets are queued for an idle thread.
+	atomic_bool		idle;			//!< Decode thread is waiting for packets.
+	atomic_bool		merging;		//!< Capture thread is waiting for the mutex.
+	bool			exit;			//!< Decode thread should exit.  Protected by the mutex.
+
+	fr_atomic_queue_t	*queue;			//!< Packets waiting to be decoded.
+	fr_atomic_queue_t	*free;			//!< Empty packet buffers.
+	rs_packet_t		*packets;		//!< Packet buffers.
+
+	bool			pending;		//!< Packets were queued in this batch.
+	uint64_t		overflow;		//!< Packets dropped because the queue was full.
+#endif
+};
+
 typedef struct rs_update rs_update_t;
 
 /** Callback for printing stats header.
@@ -286,6 +384,8 @@ struct rs {
 	rs_packet_logger_t	logger;			//!< Packet logger
 
 	int			buffer_pkts;		//!< Size of the ring buffer to setup for live capture.
+	int			num_threads;		//!< Number of decode threads.  If 0, packets are
+							//!< decoded by the capture thread.
 	uint64_t		limit;			//!< Maximum number of packets to capture
 
 	struct {
@@ -336,6 +436,8 @@ struct rs_stats_tmpl
  */
 rs_stats_tmpl_t *rs_stats_collectd_init_latency(TALLOC_CTX *ctx, rs_stats_tmpl_t **out, rs_t *conf,
 						char const *type, rs_latency_t *stats, PW_CODE code);
+rs_stats_tmpl_t *rs_stats_collectd_init_server(TALLOC_CTX *ctx, rs_stats_tmpl_t **out, rs_t *conf,
+					       rs_server_t *server, PW_CODE code);
 void rs_stats_collectd_do_stats(rs_t *conf, rs_stats_tmpl_t *tmpls, struct timeval *now);
 int rs_stats_collectd_open(rs_t *conf);
 int rs_stats_collectd_close(rs_t *conf);
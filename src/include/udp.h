@@ -39,6 +39,29 @@ extern "C" {
 #define UDP_FLAGS_CONNECTED	(1 << 0)
 #define UDP_FLAGS_PEEK		(1 << 1)
 
+/*
+ *	Maximum number of packets read or written by a single call
+ *	to udp_recv_mmsg() or udp_send_mmsg().
+ */
+#define UDP_MMSG_MAX		(32)
+
+/** One packet in a batch passed to udp_recv_mmsg() or udp_send_mmsg()
+ *
+ */
+typedef struct udp_mmsg {
+	uint8_t			*data;		//!< Buffer to read the packet into, or to send it from.
+	size_t			data_len;	//!< Size of the buffer on input.  Length of the packet
+						//!< on output from udp_recv_mmsg().
+
+	fr_ipaddr_t		src_ipaddr;	//!< Source address of the packet.
+	uint16_t		src_port;	//!< Source port of the packet.
+	fr_ipaddr_t		dst_ipaddr;	//!< Destination address of the packet.
+	uint16_t		dst_port;	//!< Destination port of the packet.
+	int			if_index;	//!< Interface the packet was received on, or should be sent from.
+
+	struct timeval		when;		//!< When the packet was received.
+} udp_mmsg_t;
+
 ssize_t udp_send(int sockfd, void *data, size_t data_len, int flags,
 		 fr_ipaddr_t *src_ipaddr, uint16_t src_port, int if_index,
 		 fr_ipaddr_t *dst_ipaddr, uint16_t dst_port);
@@ -52,6 +75,10 @@ ssize_t udp_recv(int sockfd, void *data, size_t data_len, int flags,
 		 fr_ipaddr_t *dst_ipaddr, uint16_t *dst_port, int *if_index,
 		 struct timeval *when);
 
+int udp_recv_mmsg(int sockfd, udp_mmsg_t *packets, int num, int flags);
+
+int udp_send_mmsg(int sockfd, udp_mmsg_t *packets, int num, int flags);
+
 #ifdef __cplusplus
 }
 #endif
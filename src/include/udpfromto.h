@@ -41,6 +41,11 @@ int sendfromto(int s, void *buf, size_t len, int flags,
 	       struct sockaddr *from, socklen_t fromlen,
 	       struct sockaddr *to, socklen_t tolen,
 	       int if_index);
+
+void udpfromto_cmsg_read(struct msghdr *msgh, struct sockaddr *to, socklen_t *to_len,
+			 int *if_index, struct timeval *when);
+int udpfromto_cmsg_write(int fd, struct msghdr *msgh, void *cbuf, size_t cbuf_len,
+			 struct sockaddr *from, socklen_t from_len, int if_index);
 #endif
 
 #ifdef __cplusplus
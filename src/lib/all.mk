@@ -20,6 +20,7 @@ SOURCES		:= cbuff.c \
 		   missing.c \
 		   md4.c \
 		   md5.c \
+		   md5_multi.c \
 		   net.c \
 		   pair.c \
 		   pair_cursor.c \
@@ -44,6 +45,7 @@ SOURCES		:= cbuff.c \
 		   event.c \
 		   getaddrinfo.c \
 		   heap.c \
+		   histogram.c \
 		   tcp.c \
 		   udp.c \
 		   base64.c \
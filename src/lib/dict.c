@@ -29,11 +29,16 @@ RCSID("$Id$")
 #endif
 
 #include <ctype.h>
+#include <fcntl.h>
 
 #ifdef HAVE_SYS_STAT_H
 #  include <sys/stat.h>
 #endif
 
+#ifdef HAVE_SYS_MMAN_H
+#  include <sys/mman.h>
+#endif
+
 #define MAX_ARGV (16)
 
 /** Magic internal dictionary
@@ -52,7 +57,9 @@ fr_dict_t	*fr_dict_internal = NULL;	//!< Internal server dictionary.
  */
 typedef struct dict_stat_t {
 	struct dict_stat_t *next;
+	char const *path;
 	struct stat stat_buf;
+	bool absent;			//!< Optional dictionary which couldn't be opened.
 } dict_stat_t;
 
 typedef struct dict_enum_fixup_t {
@@ -235,6 +242,12 @@ bool const fr_dict_enum_types[PW_TYPE_MAX + 1] = {
 #define FNV_MAGIC_INIT (0x811c9dc5)
 #define FNV_MAGIC_PRIME (0x01000193)
 
+/*
+ *	Highest attribute number in the root of any dictionary.
+ *	Attributes defined without a number are allocated above it.
+ */
+static unsigned int max_attr = UINT8_MAX + 1;
+
 #ifdef __clang_analyzer__
 #  define INTERNAL_IF_NULL(_dict) do {\
 	if (!_dict) _dict = fr_dict_internal; \
@@ -425,15 +438,22 @@ static int dict_enum_value_cmp(void const *one, void const *two)
 }
 
 /** Add an entry to the list of stat buffers.
+ *
+ * A NULL stat_buf records a file which couldn't be opened.
  */
-static void dict_stat_add(fr_dict_t *dict, struct stat const *stat_buf)
+static void dict_stat_add(fr_dict_t *dict, char const *path, struct stat const *stat_buf)
 {
 	dict_stat_t *this;
 
 	this = talloc_zero(dict, dict_stat_t);
 	if (!this) return;
 
-	memcpy(&(this->stat_buf), stat_buf, sizeof(this->stat_buf));
+	this->path = talloc_strdup(this, path);
+	if (stat_buf) {
+		memcpy(&(this->stat_buf), stat_buf, sizeof(this->stat_buf));
+	} else {
+		this->absent = true;
+	}
 
 	if (!dict->stat_head) {
 		dict->stat_head = dict->stat_tail = this;
@@ -470,6 +490,7 @@ static int dict_stat_check(fr_dict_t *dict, char const *dir, char const *file)
 	 *	       to reload B at the minimum.
 	 */
 	for (this = dict->stat_head; this != NULL; this = this->next) {
+		if (this->absent) continue;
 		if (this->stat_buf.st_dev != stat_buf.st_dev) continue;
 		if (this->stat_buf.st_ino != stat_buf.st_ino) continue;
 
@@ -512,6 +533,32 @@ void fr_dict_dump(fr_dict_t *dict)
 	_fr_dict_dump(dict->root, 0);
 }
 
+/** Call a function for every vendor in a dictionary
+ *
+ * @param[in] dict	to walk.
+ * @param[in] callback	called with each #fr_dict_vendor_t.  A non-zero return
+ *			stops the walk.
+ * @param[in] uctx	passed to the callback.
+ * @return the value returned by the last callback.
+ */
+int fr_dict_vendor_walk(fr_dict_t *dict, fr_hash_table_walk_t callback, void *uctx)
+{
+	return fr_hash_table_walk(dict->vendors_by_name, callback, uctx);
+}
+
+/** Call a function for every enum value in a dictionary
+ *
+ * @param[in] dict	to walk.
+ * @param[in] callback	called with each #fr_dict_enum_t.  A non-zero return
+ *			stops the walk.
+ * @param[in] uctx	passed to the callback.
+ * @return the value returned by the last callback.
+ */
+int fr_dict_enum_walk(fr_dict_t *dict, fr_hash_table_walk_t callback, void *uctx)
+{
+	return fr_hash_table_walk(dict->values_by_name, callback, uctx);
+}
+
 /** Add a vendor to the dictionary
  *
  * Inserts a vendor entry into the vendor hash table.  This must be done before adding
@@ -586,6 +633,298 @@ int fr_dict_vendor_add(fr_dict_t *dict, char const *name, unsigned int num)
 	return 0;
 }
 
+/*
+ *	Once a dictionary is loaded, children are indexed by number, so
+ *	that decoding an attribute is one or two loads instead of a walk
+ *	along a bin.
+ *
+ *	If the numbers are dense enough the index is a plain array.
+ *	Otherwise (Vendor-Specific, Diameter style numbers, or vendors
+ *	which start at 1000) it's a perfect hash.  Numbers are split
+ *	into buckets, and each bucket gets a displacement, chosen so
+ *	that no two children land in the same slot of the table.
+ *
+ *	If we can't find displacements, the parent isn't indexed, and
+ *	lookups fall back to walking the bins.
+ */
+#define DICT_CHILD_INDEX_DIRECT_MIN	(64)		//!< Always index directly below this number.
+#define DICT_CHILD_INDEX_SPARSENESS	(4)		//!< Maximum slots per child in a direct index.
+#define DICT_CHILD_INDEX_TRIES		(4096)		//!< Displacements to try for each bucket.
+#define DICT_CHILD_INDEX_BUCKET_MUL	(0x9e3779b1)
+#define DICT_CHILD_INDEX_SLOT_MUL	(0x85ebca6b)
+
+static inline uint32_t dict_child_bucket(uint32_t attr, uint8_t shift)
+{
+	return (uint32_t) (attr * DICT_CHILD_INDEX_BUCKET_MUL) >> shift;
+}
+
+static inline uint32_t dict_child_slot(uint32_t attr, uint32_t disp, uint8_t shift)
+{
+	return (uint32_t) ((attr ^ disp) * DICT_CHILD_INDEX_SLOT_MUL) >> shift;
+}
+
+typedef struct dict_child_key {
+	fr_dict_attr_t const	*da;
+	uint32_t		order;		//!< Position in the bins.
+	uint32_t		bucket;		//!< Bucket for the current table size.
+} dict_child_key_t;
+
+typedef struct dict_child_run {
+	uint32_t		start;		//!< First key in the bucket.
+	uint32_t		len;		//!< Number of keys in the bucket.
+} dict_child_run_t;
+
+static int dict_child_key_cmp(void const *one, void const *two)
+{
+	dict_child_key_t const *a = one;
+	dict_child_key_t const *b = two;
+
+	if (a->da->attr != b->da->attr) return (a->da->attr > b->da->attr) - (a->da->attr < b->da->attr);
+
+	return (a->order > b->order) - (a->order < b->order);
+}
+
+static int dict_child_bucket_cmp(void const *one, void const *two)
+{
+	dict_child_key_t const *a = one;
+	dict_child_key_t const *b = two;
+
+	if (a->bucket != b->bucket) return (a->bucket > b->bucket) - (a->bucket < b->bucket);
+
+	return (a->da->attr > b->da->attr) - (a->da->attr < b->da->attr);
+}
+
+/*
+ *	Largest buckets first, so they're placed while the table is
+ *	still mostly empty.
+ */
+static int dict_child_run_cmp(void const *one, void const *two)
+{
+	dict_child_run_t const *a = one;
+	dict_child_run_t const *b = two;
+
+	if (a->len != b->len) return (a->len < b->len) - (a->len > b->len);
+
+	return (a->start > b->start) - (a->start < b->start);
+}
+
+/** Build a perfect hash of the children of an attribute
+ *
+ * @param[in] parent	to index.
+ * @param[in] keys	one per attribute number.
+ * @param[in] num	of keys.
+ * @param[in] bits	log2 of the table size.
+ * @return
+ *	- 1 if no displacements could be found.
+ *	- 0 on success.
+ *	- -1 on memory allocation error.
+ */
+static int dict_child_index_hash(fr_dict_attr_t *parent, dict_child_key_t *keys, uint32_t num, unsigned int bits)
+{
+	TALLOC_CTX		*tmp;
+	fr_dict_attr_t const	**slots;
+	uint32_t		*disp, *placed;
+	dict_child_run_t	*runs;
+	uint32_t		i, j, r, num_runs = 0, tries;
+	unsigned int		bucket_bits = (bits > 2) ? bits - 2 : 1;	/* ~2 keys per bucket */
+
+	tmp = talloc_new(NULL);
+	if (!tmp) return -1;
+
+	slots = talloc_zero_array(parent, fr_dict_attr_t const *, 1U << bits);
+	disp = talloc_zero_array(parent, uint32_t, 1U << bucket_bits);
+	runs = talloc_array(tmp, dict_child_run_t, num);
+	placed = talloc_array(tmp, uint32_t, num);
+	if (!slots || !disp || !runs || !placed) {
+		talloc_free(slots);
+		talloc_free(disp);
+		talloc_free(tmp);
+		return -1;
+	}
+
+	for (i = 0; i < num; i++) keys[i].bucket = dict_child_bucket(keys[i].da->attr, 32 - bucket_bits);
+	qsort(keys, num, sizeof(keys[0]), dict_child_bucket_cmp);
+
+	for (i = 0; i < num; i = j) {
+		for (j = i + 1; (j < num) && (keys[j].bucket == keys[i].bucket); j++);
+		runs[num_runs].start = i;
+		runs[num_runs].len = j - i;
+		num_runs++;
+	}
+	qsort(runs, num_runs, sizeof(runs[0]), dict_child_run_cmp);
+
+	for (r = 0; r < num_runs; r++) {
+		dict_child_key_t const *run = &keys[runs[r].start];
+
+		for (tries = 0; tries < DICT_CHILD_INDEX_TRIES; tries++) {
+			uint32_t d = tries * 0x9e3779b9;
+
+			/*
+			 *	Every key in the bucket needs a free
+			 *	slot, and a different one from the
+			 *	other keys in the bucket.
+			 */
+			for (i = 0; i < runs[r].len; i++) {
+				placed[i] = dict_child_slot(run[i].da->attr, d, 32 - bits);
+				if (slots[placed[i]]) break;
+
+				for (j = 0; j < i; j++) if (placed[j] == placed[i]) break;
+				if (j < i) break;
+			}
+			if (i < runs[r].len) continue;
+
+			for (i = 0; i < runs[r].len; i++) slots[placed[i]] = run[i].da;
+			disp[run[0].bucket] = d;
+			break;
+		}
+
+		if (tries == DICT_CHILD_INDEX_TRIES) {
+			talloc_free(slots);
+			talloc_free(disp);
+			talloc_free(tmp);
+			return 1;
+		}
+	}
+	talloc_free(tmp);
+
+	parent->child_index = slots;
+	parent->child_index_disp = disp;
+	parent->child_index_len = 1U << bits;
+	parent->child_index_shift = 32 - bits;
+	parent->child_index_disp_shift = 32 - bucket_bits;
+
+	return 0;
+}
+
+/** Free the index of an attribute's children
+ *
+ * Lookups walk the bins until the index is rebuilt.
+ *
+ * @param[in] parent	to free the index of.
+ */
+static void dict_attr_child_index_free(fr_dict_attr_t *parent)
+{
+	if (!parent->child_index) return;
+
+	talloc_free(parent->child_index);
+	talloc_free(parent->child_index_disp);
+	parent->child_index = NULL;
+	parent->child_index_disp = NULL;
+	parent->child_index_len = 0;
+	parent->child_index_shift = 0;
+	parent->child_index_disp_shift = 0;
+}
+
+/** Index the children of an attribute by number
+ *
+ * Replaces any existing index.
+ *
+ * @param[in] parent	to index.
+ * @return
+ *	- 0 on success, or if the children can't be indexed.
+ *	- -1 on memory allocation error.
+ */
+static int dict_attr_child_index(fr_dict_attr_t *parent)
+{
+	fr_dict_attr_t const	*da;
+	dict_child_key_t	*keys;
+	uint32_t		i, j, num = 0, max = 0;
+	size_t			len;
+	unsigned int		bits;
+	int			rcode = 0;
+
+	dict_attr_child_index_free(parent);
+
+	if (!parent->children) return 0;
+
+	len = talloc_array_length(parent->children);
+	for (i = 0; i < len; i++) {
+		for (da = parent->children[i]; da; da = da->next) {
+			if (da->attr > max) max = da->attr;
+			num++;
+		}
+	}
+	if (!num) return 0;
+
+	/*
+	 *	Children with the same number are found in bin order,
+	 *	so the first one we see for a number is the one to keep.
+	 */
+	if ((max < DICT_CHILD_INDEX_DIRECT_MIN) || (((uint64_t) max + 1) <= ((uint64_t) num * DICT_CHILD_INDEX_SPARSENESS))) {
+		fr_dict_attr_t const **index;
+
+		index = talloc_zero_array(parent, fr_dict_attr_t const *, max + 1);
+		if (!index) return -1;
+
+		for (i = 0; i < len; i++) {
+			for (da = parent->children[i]; da; da = da->next) {
+				if (!index[da->attr]) index[da->attr] = da;
+			}
+		}
+
+		parent->child_index = index;
+		parent->child_index_len = max + 1;
+
+		return 0;
+	}
+
+	keys = talloc_array(NULL, dict_child_key_t, num);
+	if (!keys) return -1;
+
+	num = 0;
+	for (i = 0; i < len; i++) {
+		for (da = parent->children[i]; da; da = da->next) {
+			keys[num].da = da;
+			keys[num].order = num;
+			num++;
+		}
+	}
+
+	qsort(keys, num, sizeof(keys[0]), dict_child_key_cmp);
+	for (i = 0, j = 0; i < num; i++) {
+		if ((j > 0) && (keys[j - 1].da->attr == keys[i].da->attr)) continue;
+		keys[j++] = keys[i];
+	}
+	num = j;
+
+	/*
+	 *	Start with a table at least twice the number of
+	 *	children, and let it grow a little if that's too tight.
+	 */
+	for (bits = 1; (1U << bits) < (num * 2); bits++);
+	for (; (bits < 31) && ((1U << bits) <= (num * 8)); bits++) {
+		rcode = dict_child_index_hash(parent, keys, num, bits);
+		if (rcode <= 0) break;
+	}
+	talloc_free(keys);
+
+	return (rcode < 0) ? -1 : 0;
+}
+
+/** Index the children of an attribute, and all of its descendents, if they're not already indexed
+ *
+ */
+static int dict_attr_child_index_all(fr_dict_attr_t const *da)
+{
+	fr_dict_attr_t		*mutable;
+	fr_dict_attr_t const	*child;
+	size_t			i, len;
+
+	if (!da->children) return 0;
+
+	memcpy(&mutable, &da, sizeof(mutable));
+	if (!da->child_index && (dict_attr_child_index(mutable) < 0)) return -1;
+
+	len = talloc_array_length(da->children);
+	for (i = 0; i < len; i++) {
+		for (child = da->children[i]; child; child = child->next) {
+			if (dict_attr_child_index_all(child) < 0) return -1;
+		}
+	}
+
+	return 0;
+}
+
 /** Add a child to a parent.
  *
  * @param parent we're adding a child to.
@@ -667,6 +1006,14 @@ static inline int fr_dict_attr_child_add(fr_dict_attr_t *parent, fr_dict_attr_t
 	child->next = *this;
 	*this = child;
 
+	/*
+	 *	Attributes added after the dictionary was loaded.
+	 *	The index is now stale, so drop it, and let lookups
+	 *	walk the bins.  fr_dict_read() rebuilds it once all
+	 *	of the new children have been added.
+	 */
+	dict_attr_child_index_free(parent);
+
 	return 0;
 }
 
@@ -817,6 +1164,49 @@ static fr_dict_attr_t *fr_dict_attr_alloc(TALLOC_CTX *ctx,
 	return da;
 }
 
+/** Add the IPv4 and IPv6 variants of a combo-ip attribute
+ *
+ * @param[in] dict	to add the variants to.
+ * @param[in] da	of type combo-ip.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int dict_attr_combo_add(fr_dict_t *dict, fr_dict_attr_t const *da)
+{
+	size_t		namelen = strlen(da->name);
+	fr_dict_attr_t	*v4, *v6;
+
+	v4 = (fr_dict_attr_t *)talloc_zero_array(dict->pool, uint8_t, sizeof(*v4) + namelen);
+	if (!v4) {
+	oom:
+		fr_strerror_printf("Out of memory");
+		return -1;
+	}
+	talloc_set_type(v4, fr_dict_attr_t);
+
+	v6 = (fr_dict_attr_t *)talloc_zero_array(dict->pool, uint8_t, sizeof(*v6) + namelen);
+	if (!v6) goto oom;
+	talloc_set_type(v6, fr_dict_attr_t);
+
+	memcpy(v4, da, sizeof(*v4) + namelen);
+	v4->type = PW_TYPE_IPV4_ADDR;
+
+	memcpy(v6, da, sizeof(*v6) + namelen);
+	v6->type = PW_TYPE_IPV6_ADDR;
+	if (!fr_hash_table_replace(dict->attributes_combo, v4)) {
+		fr_strerror_printf("Failed inserting IPv4 version of combo attribute");
+		return -1;
+	}
+
+	if (!fr_hash_table_replace(dict->attributes_combo, v6)) {
+		fr_strerror_printf("Failed inserting IPv6 version of combo attribute");
+		return -1;
+	}
+
+	return 0;
+}
+
 /** Add an attribute to the name table for the dictionary.
  *
  * @todo we need to check length of none vendor attributes.
@@ -874,8 +1264,6 @@ static fr_dict_attr_t *fr_dict_attr_add_by_name(fr_dict_t *dict, fr_dict_attr_t
 	/******************** sanity check attribute number ********************/
 
 	if (parent->flags.is_root) {
-		static unsigned int max_attr = UINT8_MAX + 1;
-
 		if (attr == -1) {
 			if (fr_dict_attr_by_name(dict, name)) return 0; /* exists, don't add it again */
 			attr = ++max_attr;
@@ -1415,7 +1803,6 @@ static fr_dict_attr_t *fr_dict_attr_add_by_name(fr_dict_t *dict, fr_dict_attr_t
 
 	n = fr_dict_attr_alloc(dict->pool, parent, name, vendor, attr, type, &flags);
 	if (!n) {
-	oom:
 		fr_strerror_printf("Out of memory");
 		goto error;
 	}
@@ -1458,32 +1845,7 @@ static fr_dict_attr_t *fr_dict_attr_add_by_name(fr_dict_t *dict, fr_dict_attr_t
 	/*
 	 *	Hacks for combo-IP
 	 */
-	if (n->type == PW_TYPE_COMBO_IP_ADDR) {
-		fr_dict_attr_t *v4, *v6;
-
-		v4 = (fr_dict_attr_t *)talloc_zero_array(dict->pool, uint8_t, sizeof(*v4) + namelen);
-		if (!v4) goto oom;
-		talloc_set_type(v4, fr_dict_attr_t);
-
-		v6 = (fr_dict_attr_t *)talloc_zero_array(dict->pool, uint8_t, sizeof(*v6) + namelen);
-		if (!v6) goto oom;
-		talloc_set_type(v6, fr_dict_attr_t);
-
-		memcpy(v4, n, sizeof(*v4) + namelen);
-		v4->type = PW_TYPE_IPV4_ADDR;
-
-		memcpy(v6, n, sizeof(*v6) + namelen);
-		v6->type = PW_TYPE_IPV6_ADDR;
-		if (!fr_hash_table_replace(dict->attributes_combo, v4)) {
-			fr_strerror_printf("Failed inserting IPv4 version of combo attribute");
-			goto error;
-		}
-
-		if (!fr_hash_table_replace(dict->attributes_combo, v6)) {
-			fr_strerror_printf("Failed inserting IPv6 version of combo attribute");
-			goto error;
-		}
-	}
+	if ((n->type == PW_TYPE_COMBO_IP_ADDR) && (dict_attr_combo_add(dict, n) < 0)) goto error;
 
 	return n;
 }
@@ -2282,6 +2644,16 @@ static int _dict_from_file(dict_from_file_ctx_t *ctx,
 	}
 
 	if ((fp = fopen(fn, "r")) == NULL) {
+		int err = errno;
+
+		/*
+		 *	Remember files we couldn't open, so that an
+		 *	image isn't used if they appear later.  Only
+		 *	$INCLUDE- carries on without them.
+		 */
+		dict_stat_add(ctx->dict, fn, NULL);
+		errno = err;
+
 		if (!src_file) {
 			fr_strerror_printf("%s: Couldn't open dictionary '%s': %s",
 					   __FUNCTION__, fn, fr_syserror(errno));
@@ -2319,7 +2691,7 @@ static int _dict_from_file(dict_from_file_ctx_t *ctx,
 	}
 #endif
 
-	dict_stat_add(ctx->dict, &statbuf);
+	dict_stat_add(ctx->dict, fn, &statbuf);
 
 	/*
 	 *	Seed the random pool with data.
@@ -2642,87 +3014,1031 @@ static int dict_from_file(fr_dict_t *dict,
 
 static bool defined_cast_types = false;
 
-/** (re)initialize a protocol dictionary
+/*
+ *	Binary dictionary images.
  *
- * Initialize the directory, then fix the attr member of all attributes.
+ *	An image holds a fully resolved dictionary as flat arrays of
+ *	vendors, attributes and enum values.  Records refer to each
+ *	other, and to their names, by index and offset, never by
+ *	pointer.  So the image can be mapped read-only at any address,
+ *	and turned back into a dictionary without parsing or validating
+ *	any text.
  *
- * First dictionary initialised will be set as the default internal dictionary.
+ *	Images are specific to the ABI of the build which wrote them.
+ *	An image which doesn't match, or whose source files have
+ *	changed, is ignored, and the text dictionaries are read instead.
+ *	Source files are compared by content, not by modification time,
+ *	so copying the dictionaries doesn't make the image stale.
+ */
+#define DICT_IMAGE_MAGIC	"FRDICTIM"
+#define DICT_IMAGE_VERSION	(2)
+#define DICT_IMAGE_ENDIAN	(0x01020304)
+#define DICT_IMAGE_ALIGN(_x)	(((_x) + 7) & ~((size_t) 7))
+
+typedef struct dict_image_hdr {
+	char			magic[8];		//!< DICT_IMAGE_MAGIC.
+	uint32_t		version;		//!< DICT_IMAGE_VERSION.
+	uint32_t		endian;			//!< DICT_IMAGE_ENDIAN in the byte order of the writer.
+	uint32_t		sizeof_attr;		//!< sizeof(dict_image_attr_t) of the writer.
+	uint32_t		len;			//!< Length of the image, including this header.
+
+	uint32_t		num_files;		//!< Number of source files.
+	uint32_t		num_vendors;		//!< Number of vendor records.
+	uint32_t		num_attrs;		//!< Number of attribute records.
+	uint32_t		num_enums;		//!< Number of enum value records.
+
+	uint32_t		files;			//!< Offset of the source file records.
+	uint32_t		vendors;		//!< Offset of the vendor records.
+	uint32_t		attrs;			//!< Offset of the attribute records.
+	uint32_t		enums;			//!< Offset of the enum value records.
+	uint32_t		strings;		//!< Offset of the string table.
+	uint32_t		strings_len;		//!< Length of the string table.
+} dict_image_hdr_t;
+
+typedef struct dict_image_file {
+	uint64_t		size;			//!< Size of the file when the image was written.
+	uint8_t			digest[SHA1_DIGEST_LENGTH];	//!< SHA1 of the file when the image was written.
+	uint32_t		path;			//!< Offset of the path in the string table.
+	uint32_t		absent;			//!< Optional file which didn't exist.
+} dict_image_file_t;
+
+typedef struct dict_image_vendor {
+	uint32_t		name;			//!< Offset of the name in the string table.
+	uint32_t		vendorpec;		//!< Private enterprise number.
+	uint32_t		type;			//!< Length of type data.
+	uint32_t		length;			//!< Length of length data.
+	uint32_t		flags;			//!< Vendor flags.
+	uint32_t		by_num;			//!< Whether this vendor is found by number.
+} dict_image_vendor_t;
+
+typedef struct dict_image_attr {
+	uint32_t		name;			//!< Offset of the name in the string table.
+	int32_t			parent;			//!< Index of the parent, or -1 for the root.
+	uint32_t		vendor;			//!< Vendor that defines this attribute.
+	uint32_t		attr;			//!< Attribute number.
+	uint32_t		type;			//!< Value type.
+	uint32_t		by_name;		//!< Whether this attribute is found by name.
+	fr_dict_attr_flags_t	flags;			//!< Flags, after all fixups.
+} dict_image_attr_t;
+
+typedef struct dict_image_enum {
+	int64_t			value;			//!< Enum value.
+	uint32_t		name;			//!< Offset of the name in the string table.
+	uint32_t		da;			//!< Index of the attribute.
+	uint32_t		by_value;		//!< Whether this name is found by value.
+	uint32_t		pad;
+} dict_image_enum_t;
+
+/** Maps an attribute to its index in the image
  *
- * @param[in] ctx to allocate the dictionary from.
- * @param[out] out Where to write a pointer to the new dictionary.  Will free existing
- *	dictionary if files have changed and *out is not NULL.
- * @param[in] dir to read dictionary files from.
- * @param[in] fn file name to read.
- * @param[in] name to use for the root attributes.
- * @return
- *	- 0 on success.
- *	- -1 on failure.
  */
-int fr_dict_from_file(TALLOC_CTX *ctx, fr_dict_t **out, char const *dir, char const *fn, char const *name)
-{
-	fr_dict_t *dict;
+typedef struct dict_image_idx {
+	fr_dict_attr_t const	*da;
+	uint32_t		idx;
+} dict_image_idx_t;
 
-	if (!*out) {
-		/* Pre-Allocate 5MB of pool memory for rapid startup */
-		dict = talloc_zero(ctx, fr_dict_t);
-		dict->pool = talloc_pool(dict, (1024 * 1024 * 5));
-	} else {
-		dict = *out;
-		if (dict_stat_check(dict, dir, fn)) return 0;
-	}
+/** Orders enum values by attribute index, value, then name
+ *
+ */
+typedef struct dict_image_enum_sort {
+	uint32_t		da;
+	fr_dict_enum_t const	*dval;
+} dict_image_enum_sort_t;
 
-	/*
-	 *	Free the old dictionaries
-	 */
-	if (*out == fr_dict_internal) fr_dict_internal = dict;
-	TALLOC_FREE(*out);
+/** Intermediary state for writing an image
+ *
+ */
+typedef struct dict_image_build {
+	fr_dict_attr_t const	**attrs;		//!< Attributes, parents first.
+	int32_t			*parents;		//!< Index of the parent of each attribute.
+	uint32_t		num_attrs;
 
-	/*
-	 *	Remove this at some point...
-	 */
-	if (!fr_dict_internal) fr_dict_internal = dict;
+	dict_image_idx_t	*idx;			//!< Attributes sorted by address.
 
-	/*
-	 *	Create the table of vendor by name.   There MAY NOT
-	 *	be multiple vendors of the same name.
-	 */
-	dict->vendors_by_name = fr_hash_table_create(dict, dict_vendor_name_hash, dict_vendor_name_cmp, hash_pool_free);
-	if (!dict->vendors_by_name) {
-	error:
-		talloc_free(dict);
-		return -1;
-	}
+	fr_dict_vendor_t const	**vendors;
+	uint32_t		num_vendors;
 
-	/*
-	 *	Create the table of vendors by value.  There MAY
-	 *	be vendors of the same value.  If there are, we
-	 *	pick the latest one.
-	 */
-	dict->vendors_by_num = fr_hash_table_create(dict, dict_vendor_vendorpec_hash, dict_vendor_vendorpec_cmp, NULL);
-	if (!dict->vendors_by_num) goto error;
+	fr_dict_enum_t const	**enums;
+	uint32_t		num_enums;
 
-	/*
-	 *	Create the table of attributes by name.   There MAY NOT
-	 *	be multiple attributes of the same name.
-	 */
-	dict->attributes_by_name = fr_hash_table_create(dict, dict_attr_name_hash, dict_attr_name_cmp, NULL);
-	if (!dict->attributes_by_name) goto error;
+	uint32_t		num_named;		//!< Entries in attributes_by_name.
 
-	/*
-	 *	Horrible hacks for combo-IP.
-	 */
-	dict->attributes_combo = fr_hash_table_create(dict, dict_attr_combo_hash, dict_attr_combo_cmp, hash_pool_free);
-	if (!dict->attributes_combo) goto error;
+	char			*strings;		//!< String table.
+	size_t			strings_len;
+} dict_image_build_t;
 
-	dict->values_by_name = fr_hash_table_create(dict, dict_enum_name_hash, dict_enum_name_cmp, hash_pool_free);
-	if (!dict->values_by_name) goto error;
+/** Add a string to the string table of an image
+ *
+ */
+static int dict_image_string(dict_image_build_t *build, uint32_t *out, char const *str)
+{
+	size_t	len = strlen(str) + 1;
+	char	*strings;
 
-	dict->values_by_da = fr_hash_table_create(dict, dict_enum_value_hash, dict_enum_value_cmp, hash_pool_free);
-	if (!dict->values_by_da) goto error;
+	strings = talloc_realloc(build, build->strings, char, build->strings_len + len);
+	if (!strings) {
+		fr_strerror_printf("Out of memory");
+		return -1;
+	}
+	memcpy(strings + build->strings_len, str, len);
 
-	/*
-	 *	Magic dictionary root attribute
-	 */
+	*out = build->strings_len;
+	build->strings = strings;
+	build->strings_len += len;
+
+	return 0;
+}
+
+/** Add the children of an attribute to the list of attributes to write
+ *
+ * Children are added bin by bin, in the order they appear in each bin, and
+ * before their own children.  Appending each attribute to its bin when loading
+ * then recreates the same tree.
+ */
+static int dict_image_attrs_add(dict_image_build_t *build, fr_dict_attr_t const *parent, int32_t parent_idx)
+{
+	size_t			i, len;
+	fr_dict_attr_t const	*da;
+
+	if (!parent->children) return 0;
+
+	len = talloc_array_length(parent->children);
+	for (i = 0; i < len; i++) {
+		for (da = parent->children[i]; da; da = da->next) {
+			int32_t idx;
+
+			if (da->flags.is_unknown) continue;
+
+			if (build->num_attrs == talloc_array_length(build->attrs)) {
+				size_t			size = build->num_attrs * 2;
+				fr_dict_attr_t const	**attrs;
+				int32_t			*parents;
+
+				attrs = talloc_realloc(build, build->attrs, fr_dict_attr_t const *, size);
+				if (!attrs) {
+				oom:
+					fr_strerror_printf("Out of memory");
+					return -1;
+				}
+				build->attrs = attrs;
+
+				parents = talloc_realloc(build, build->parents, int32_t, size);
+				if (!parents) goto oom;
+				build->parents = parents;
+			}
+
+			idx = build->num_attrs++;
+			build->attrs[idx] = da;
+			build->parents[idx] = parent_idx;
+
+			if (dict_image_attrs_add(build, da, idx) < 0) return -1;
+		}
+	}
+
+	return 0;
+}
+
+static int dict_image_idx_cmp(void const *one, void const *two)
+{
+	dict_image_idx_t const *a = one;
+	dict_image_idx_t const *b = two;
+
+	return (a->da > b->da) - (a->da < b->da);
+}
+
+/** Find the index of an attribute in the image
+ *
+ */
+static int dict_image_attr_idx(dict_image_build_t const *build, uint32_t *out, fr_dict_attr_t const *da)
+{
+	dict_image_idx_t	find, *found;
+
+	find.da = da;
+	found = bsearch(&find, build->idx, build->num_attrs, sizeof(build->idx[0]), dict_image_idx_cmp);
+	if (!found) {
+		fr_strerror_printf("Attribute '%s' isn't in the dictionary tree", da->name);
+		return -1;
+	}
+
+	*out = found->idx;
+	return 0;
+}
+
+static int dict_image_vendor_collect(void *ctx, void *data)
+{
+	dict_image_build_t *build = ctx;
+
+	build->vendors[build->num_vendors++] = data;
+
+	return 0;
+}
+
+static int dict_image_enum_collect(void *ctx, void *data)
+{
+	dict_image_build_t *build = ctx;
+
+	build->enums[build->num_enums++] = data;
+
+	return 0;
+}
+
+static int dict_image_named_count(void *ctx, UNUSED void *data)
+{
+	dict_image_build_t *build = ctx;
+
+	build->num_named++;
+
+	return 0;
+}
+
+/*
+ *	Vendors and enum values are written in a fixed order, so that
+ *	the same dictionaries always produce the same image.
+ */
+static int dict_image_vendor_cmp(void const *one, void const *two)
+{
+	fr_dict_vendor_t const *a = *(fr_dict_vendor_t const * const *) one;
+	fr_dict_vendor_t const *b = *(fr_dict_vendor_t const * const *) two;
+
+	if (a->vendorpec != b->vendorpec) return (a->vendorpec > b->vendorpec) - (a->vendorpec < b->vendorpec);
+
+	return strcmp(a->name, b->name);
+}
+
+static int dict_image_enum_cmp(void const *one, void const *two)
+{
+	dict_image_enum_sort_t const *a = one;
+	dict_image_enum_sort_t const *b = two;
+
+	if (a->da != b->da) return (a->da > b->da) - (a->da < b->da);
+	if (a->dval->value != b->dval->value) return (a->dval->value > b->dval->value) -
+						      (a->dval->value < b->dval->value);
+
+	return strcmp(a->dval->name, b->dval->name);
+}
+
+/** Replace a file, so that readers see either the old or the new contents
+ *
+ */
+static int dict_image_file_write(TALLOC_CTX *ctx, char const *file, uint8_t const *data, size_t len)
+{
+	char	*tmp;
+	int	fd;
+	size_t	done;
+	ssize_t	slen;
+
+	tmp = talloc_asprintf(ctx, "%s.XXXXXX", file);
+	if (!tmp) {
+		fr_strerror_printf("Out of memory");
+		return -1;
+	}
+
+	fd = mkstemp(tmp);
+	if (fd < 0) {
+		fr_strerror_printf("Failed creating %s: %s", tmp, fr_syserror(errno));
+		return -1;
+	}
+
+	for (done = 0; done < len; done += slen) {
+		slen = write(fd, data + done, len - done);
+		if (slen < 0) {
+			if (errno == EINTR) {
+				slen = 0;
+				continue;
+			}
+			break;
+		}
+	}
+
+	if ((done < len) || (fchmod(fd, 0644) < 0) || (fsync(fd) < 0)) {
+		fr_strerror_printf("Failed writing %s: %s", tmp, fr_syserror(errno));
+		close(fd);
+		unlink(tmp);
+		return -1;
+	}
+	close(fd);
+
+	if (rename(tmp, file) < 0) {
+		fr_strerror_printf("Failed renaming %s to %s: %s", tmp, file, fr_syserror(errno));
+		unlink(tmp);
+		return -1;
+	}
+
+	return 0;
+}
+
+/** Calculate the SHA1 digest of a dictionary file
+ *
+ * @param[out] digest	of the file's contents.
+ * @param[out] stat_buf	of the file, as it was read.
+ * @param[in] path	of the file.
+ * @return
+ *	- 0 on success.
+ *	- -1 if the file couldn't be read.
+ */
+static int dict_image_digest(uint8_t digest[SHA1_DIGEST_LENGTH], struct stat *stat_buf, char const *path)
+{
+	int		fd;
+	uint8_t		buffer[8192];
+	ssize_t		slen;
+	fr_sha1_ctx	sha1;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+	error:
+		fr_strerror_printf("Failed reading %s: %s", path, fr_syserror(errno));
+		return -1;
+	}
+
+	if (fstat(fd, stat_buf) < 0) {
+		close(fd);
+		goto error;
+	}
+
+	fr_sha1_init(&sha1);
+	while ((slen = read(fd, buffer, sizeof(buffer))) != 0) {
+		if (slen < 0) {
+			if (errno == EINTR) continue;
+			close(fd);
+			goto error;
+		}
+		fr_sha1_update(&sha1, buffer, slen);
+	}
+	fr_sha1_final(digest, &sha1);
+	close(fd);
+
+	return 0;
+}
+
+/** Write a binary image of a dictionary
+ *
+ * The image records the dictionary files which were read to build the
+ * dictionary, with their sizes and SHA1 digests, and any optional files
+ * which didn't exist.  It will be used in place of those files by
+ * #fr_dict_from_file, until they change.
+ *
+ * The image is written to a temporary file, which is then renamed, so that
+ * programs starting at the same time never see a partial image.
+ *
+ * @param[in] dict	to write.
+ * @param[in] file	to write the image to.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int fr_dict_image_write(fr_dict_t const *dict, char const *file)
+{
+	dict_image_build_t	*build;
+	dict_image_hdr_t	*hdr;
+	dict_image_file_t	*files;
+	dict_image_vendor_t	*vendors;
+	dict_image_attr_t	*attrs;
+	dict_image_enum_t	*enums;
+	dict_image_enum_sort_t	*sorted;
+	dict_stat_t const	*ds;
+	char const		*prefix;
+	size_t			prefix_len;
+	uint8_t			*image;
+	size_t			len, off_files, off_vendors, off_attrs, off_enums, off_strings;
+	uint32_t		i, num_files = 0, num_named = 0;
+
+	build = talloc_zero(NULL, dict_image_build_t);
+	if (!build) {
+	oom:
+		fr_strerror_printf("Out of memory");
+	error:
+		talloc_free(build);
+		return -1;
+	}
+
+	/*
+	 *	Attributes, parents first.
+	 */
+	build->attrs = talloc_array(build, fr_dict_attr_t const *, 1024);
+	build->parents = talloc_array(build, int32_t, 1024);
+	if (!build->attrs || !build->parents) goto oom;
+
+	if (dict_image_attrs_add(build, dict->root, -1) < 0) goto error;
+
+	build->idx = talloc_array(build, dict_image_idx_t, build->num_attrs);
+	if (!build->idx) goto oom;
+	for (i = 0; i < build->num_attrs; i++) {
+		build->idx[i].da = build->attrs[i];
+		build->idx[i].idx = i;
+	}
+	qsort(build->idx, build->num_attrs, sizeof(build->idx[0]), dict_image_idx_cmp);
+
+	/*
+	 *	Attributes which are only in the name table can't be
+	 *	recreated from the tree.
+	 */
+	fr_hash_table_walk(dict->attributes_by_name, dict_image_named_count, build);
+	for (i = 0; i < build->num_attrs; i++) {
+		if (fr_hash_table_finddata(dict->attributes_by_name, build->attrs[i]) == build->attrs[i]) num_named++;
+	}
+	if (num_named != build->num_named) {
+		fr_strerror_printf("Dictionary contains attributes which are not in the attribute tree");
+		goto error;
+	}
+
+	build->vendors = talloc_array(build, fr_dict_vendor_t const *, fr_hash_table_num_elements(dict->vendors_by_name));
+	build->enums = talloc_array(build, fr_dict_enum_t const *, fr_hash_table_num_elements(dict->values_by_name));
+	if (!build->vendors || !build->enums) goto oom;
+
+	fr_hash_table_walk(dict->vendors_by_name, dict_image_vendor_collect, build);
+	fr_hash_table_walk(dict->values_by_name, dict_image_enum_collect, build);
+	qsort(build->vendors, build->num_vendors, sizeof(build->vendors[0]), dict_image_vendor_cmp);
+
+	for (ds = dict->stat_head; ds; ds = ds->next) num_files++;
+	if (!num_files || !dict->stat_head->path) {
+		fr_strerror_printf("Dictionary wasn't read from files");
+		goto error;
+	}
+
+	/*
+	 *	Lay out the image.
+	 */
+	off_files = DICT_IMAGE_ALIGN(sizeof(*hdr));
+	off_vendors = DICT_IMAGE_ALIGN(off_files + (num_files * sizeof(*files)));
+	off_attrs = DICT_IMAGE_ALIGN(off_vendors + (build->num_vendors * sizeof(*vendors)));
+	off_enums = DICT_IMAGE_ALIGN(off_attrs + (build->num_attrs * sizeof(*attrs)));
+	off_strings = DICT_IMAGE_ALIGN(off_enums + (build->num_enums * sizeof(*enums)));
+
+	image = talloc_zero_array(build, uint8_t, off_strings);
+	if (!image) goto oom;
+
+	hdr = (dict_image_hdr_t *) image;
+	files = (dict_image_file_t *) (image + off_files);
+	vendors = (dict_image_vendor_t *) (image + off_vendors);
+	attrs = (dict_image_attr_t *) (image + off_attrs);
+	enums = (dict_image_enum_t *) (image + off_enums);
+
+	/*
+	 *	The first file is the top level dictionary.  Files in
+	 *	its directory are recorded relative to it, so that the
+	 *	image still works if the directory is moved.
+	 */
+	prefix = strrchr(dict->stat_head->path, '/');
+	prefix_len = prefix ? (prefix - dict->stat_head->path) + 1 : 0;
+
+	for (i = 0, ds = dict->stat_head; ds; ds = ds->next, i++) {
+		char const *path;
+
+		if (!ds->path) {
+			fr_strerror_printf("Dictionary source file name is unknown");
+			goto error;
+		}
+
+		if (ds->absent) {
+			files[i].absent = 1;
+		} else {
+			struct stat stat_buf;
+
+			/*
+			 *	Hash what's there now, and make sure
+			 *	it's still what was parsed.
+			 */
+			if (dict_image_digest(files[i].digest, &stat_buf, ds->path) < 0) goto error;
+			if ((stat_buf.st_size != ds->stat_buf.st_size) ||
+			    (stat_buf.st_mtime != ds->stat_buf.st_mtime)) {
+				fr_strerror_printf("%s changed after it was read", ds->path);
+				goto error;
+			}
+			files[i].size = stat_buf.st_size;
+		}
+
+		path = ds->path;
+		if (prefix_len && (strncmp(path, dict->stat_head->path, prefix_len) == 0)) path += prefix_len;
+		if (dict_image_string(build, &files[i].path, path) < 0) goto error;
+	}
+
+	for (i = 0; i < build->num_vendors; i++) {
+		fr_dict_vendor_t const *dv = build->vendors[i];
+
+		if (dict_image_string(build, &vendors[i].name, dv->name) < 0) goto error;
+		vendors[i].vendorpec = dv->vendorpec;
+		vendors[i].type = dv->type;
+		vendors[i].length = dv->length;
+		vendors[i].flags = dv->flags;
+		vendors[i].by_num = (fr_hash_table_finddata(dict->vendors_by_num, dv) == dv);
+	}
+
+	for (i = 0; i < build->num_attrs; i++) {
+		fr_dict_attr_t const *da = build->attrs[i];
+
+		if (dict_image_string(build, &attrs[i].name, da->name) < 0) goto error;
+		attrs[i].parent = build->parents[i];
+		attrs[i].vendor = da->vendor;
+		attrs[i].attr = da->attr;
+		attrs[i].type = da->type;
+		attrs[i].by_name = (fr_hash_table_finddata(dict->attributes_by_name, da) == da);
+		attrs[i].flags = da->flags;
+	}
+
+	/*
+	 *	Sort before adding the names, so that the string
+	 *	table doesn't depend on the order of the hash.
+	 */
+	sorted = talloc_array(build, dict_image_enum_sort_t, build->num_enums);
+	if (!sorted) goto oom;
+	for (i = 0; i < build->num_enums; i++) {
+		sorted[i].dval = build->enums[i];
+		if (dict_image_attr_idx(build, &sorted[i].da, sorted[i].dval->da) < 0) goto error;
+	}
+	qsort(sorted, build->num_enums, sizeof(sorted[0]), dict_image_enum_cmp);
+
+	for (i = 0; i < build->num_enums; i++) {
+		fr_dict_enum_t const *dval = sorted[i].dval;
+
+		enums[i].da = sorted[i].da;
+		if (dict_image_string(build, &enums[i].name, dval->name) < 0) goto error;
+		enums[i].value = dval->value;
+		enums[i].by_value = (fr_hash_table_finddata(dict->values_by_da, dval) == dval);
+	}
+
+	len = off_strings + build->strings_len;
+	if (len > UINT32_MAX) {
+		fr_strerror_printf("Dictionary is too large for an image");
+		goto error;
+	}
+
+	image = talloc_realloc(build, image, uint8_t, len);
+	if (!image) goto oom;
+	memcpy(image + off_strings, build->strings, build->strings_len);
+
+	hdr = (dict_image_hdr_t *) image;
+	memcpy(hdr->magic, DICT_IMAGE_MAGIC, sizeof(hdr->magic));
+	hdr->version = DICT_IMAGE_VERSION;
+	hdr->endian = DICT_IMAGE_ENDIAN;
+	hdr->sizeof_attr = sizeof(dict_image_attr_t);
+	hdr->len = len;
+	hdr->num_files = num_files;
+	hdr->num_vendors = build->num_vendors;
+	hdr->num_attrs = build->num_attrs;
+	hdr->num_enums = build->num_enums;
+	hdr->files = off_files;
+	hdr->vendors = off_vendors;
+	hdr->attrs = off_attrs;
+	hdr->enums = off_enums;
+	hdr->strings = off_strings;
+	hdr->strings_len = build->strings_len;
+
+	if (dict_image_file_write(build, file, image, len) < 0) goto error;
+
+	talloc_free(build);
+
+	return 0;
+}
+
+/** Check that an image is intact, and was written from the current source files
+ *
+ * @param[in] ctx		to allocate the stat buffers in.
+ * @param[out] out		stat buffers of the source files.
+ * @param[out] out_paths	paths of the source files, allocated in the stat buffers.
+ * @param[in] image		to check.
+ * @param[in] len		of the image.
+ * @param[in] dir		the image was loaded from.  Relative source paths are
+ *				resolved against it.
+ * @return
+ *	- 0 if the image can be used.
+ *	- -1 if it can't.
+ */
+static int dict_image_check(TALLOC_CTX *ctx, struct stat **out, char const ***out_paths,
+			    uint8_t const *image, size_t len, char const *dir)
+{
+	dict_image_hdr_t const		*hdr = (dict_image_hdr_t const *) image;
+	dict_image_file_t const		*files;
+	dict_image_vendor_t const	*vendors;
+	dict_image_attr_t const		*attrs;
+	dict_image_enum_t const		*enums;
+	char const			*strings;
+	char const			**paths;
+	struct stat			*stats;
+	uint8_t				digest[SHA1_DIGEST_LENGTH];
+	uint32_t			i;
+
+	if ((len < sizeof(*hdr)) || (memcmp(hdr->magic, DICT_IMAGE_MAGIC, sizeof(hdr->magic)) != 0)) {
+		fr_strerror_printf("Not a dictionary image");
+		return -1;
+	}
+
+	if ((hdr->version != DICT_IMAGE_VERSION) || (hdr->endian != DICT_IMAGE_ENDIAN) ||
+	    (hdr->sizeof_attr != sizeof(dict_image_attr_t))) {
+		fr_strerror_printf("Image was written by an incompatible build");
+		return -1;
+	}
+
+	if (hdr->len != len) {
+		fr_strerror_printf("Image is truncated");
+		return -1;
+	}
+
+#define SECTION_OK(_off, _num, _type) \
+	((((_off) & 0x07) == 0) && ((_off) >= sizeof(*hdr)) && \
+	 (((uint64_t) (_off) + ((uint64_t) (_num) * sizeof(_type))) <= len))
+
+	if (!SECTION_OK(hdr->files, hdr->num_files, dict_image_file_t) ||
+	    !SECTION_OK(hdr->vendors, hdr->num_vendors, dict_image_vendor_t) ||
+	    !SECTION_OK(hdr->attrs, hdr->num_attrs, dict_image_attr_t) ||
+	    !SECTION_OK(hdr->enums, hdr->num_enums, dict_image_enum_t) ||
+	    !SECTION_OK(hdr->strings, hdr->strings_len, char) ||
+	    (hdr->strings_len == 0) || (image[hdr->strings + hdr->strings_len - 1] != '\0')) {
+		fr_strerror_printf("Image is malformed");
+		return -1;
+	}
+
+	/*
+	 *	Check every reference, so that a bad image can't make
+	 *	us read past the end.
+	 */
+	files = (dict_image_file_t const *) (image + hdr->files);
+	vendors = (dict_image_vendor_t const *) (image + hdr->vendors);
+	attrs = (dict_image_attr_t const *) (image + hdr->attrs);
+	enums = (dict_image_enum_t const *) (image + hdr->enums);
+	strings = (char const *) (image + hdr->strings);
+
+	for (i = 0; i < hdr->num_files; i++) {
+		if (files[i].path >= hdr->strings_len) goto malformed;
+		if (files[i].absent > 1) goto malformed;
+	}
+	for (i = 0; i < hdr->num_vendors; i++) {
+		if (vendors[i].name >= hdr->strings_len) goto malformed;
+		if (strlen(strings + vendors[i].name) >= FR_DICT_VENDOR_MAX_NAME_LEN) goto malformed;
+	}
+	for (i = 0; i < hdr->num_attrs; i++) {
+		if (attrs[i].name >= hdr->strings_len) goto malformed;
+		if (strlen(strings + attrs[i].name) >= FR_DICT_ATTR_MAX_NAME_LEN) goto malformed;
+		if ((attrs[i].parent < -1) || (attrs[i].parent >= (int32_t) i)) goto malformed;
+		if (attrs[i].type >= PW_TYPE_MAX) goto malformed;
+	}
+	for (i = 0; i < hdr->num_enums; i++) {
+		if (enums[i].name >= hdr->strings_len) goto malformed;
+		if (strlen(strings + enums[i].name) >= FR_DICT_ENUM_MAX_NAME_LEN) goto malformed;
+		if (enums[i].da >= hdr->num_attrs) {
+		malformed:
+			fr_strerror_printf("Image is malformed");
+			return -1;
+		}
+	}
+
+	/*
+	 *	Check the source files by content.  The size is checked
+	 *	first, so most edits are noticed without reading the
+	 *	file.  Optional files which didn't exist must still not
+	 *	exist.
+	 */
+	stats = talloc_array(ctx, struct stat, hdr->num_files);
+	paths = talloc_array(stats, char const *, hdr->num_files);
+	if (!stats || !paths) {
+		fr_strerror_printf("Out of memory");
+		talloc_free(stats);
+		return -1;
+	}
+
+	for (i = 0; i < hdr->num_files; i++) {
+		char const *path = strings + files[i].path;
+
+		paths[i] = (path[0] == '/') ? path : talloc_asprintf(paths, "%s/%s", dir, path);
+		if (!paths[i]) {
+			fr_strerror_printf("Out of memory");
+			goto fail;
+		}
+
+		if (files[i].absent) {
+			if (stat(paths[i], &stats[i]) == 0) {
+				fr_strerror_printf("%s has been created", paths[i]);
+				goto fail;
+			}
+			continue;
+		}
+
+		if (stat(paths[i], &stats[i]) < 0) {
+			fr_strerror_printf("Failed reading %s: %s", paths[i], fr_syserror(errno));
+		fail:
+			talloc_free(stats);
+			return -1;
+		}
+
+		if (((uint64_t) stats[i].st_size == files[i].size) &&
+		    (dict_image_digest(digest, &stats[i], paths[i]) < 0)) goto fail;
+
+		if (((uint64_t) stats[i].st_size != files[i].size) ||
+		    (memcmp(digest, files[i].digest, sizeof(digest)) != 0)) {
+			fr_strerror_printf("%s has changed", paths[i]);
+			goto fail;
+		}
+	}
+
+	*out = stats;
+	*out_paths = paths;
+	return 0;
+}
+
+/** Rebuild a dictionary from a validated image
+ *
+ * The dictionary must be empty, with its hash tables and root attribute
+ * already allocated.
+ */
+static int dict_image_build(fr_dict_t *dict, uint8_t const *image, struct stat const *stats,
+			    char const * const *paths)
+{
+	dict_image_hdr_t const		*hdr = (dict_image_hdr_t const *) image;
+	dict_image_file_t const		*files = (dict_image_file_t const *) (image + hdr->files);
+	dict_image_vendor_t const	*vendors = (dict_image_vendor_t const *) (image + hdr->vendors);
+	dict_image_attr_t const		*attrs = (dict_image_attr_t const *) (image + hdr->attrs);
+	dict_image_enum_t const		*enums = (dict_image_enum_t const *) (image + hdr->enums);
+	char const			*strings = (char const *) (image + hdr->strings);
+	fr_dict_attr_t			**das;
+	uint32_t			i;
+
+	for (i = 0; i < hdr->num_vendors; i++) {
+		char const		*name = strings + vendors[i].name;
+		size_t			len = strlen(name);
+		fr_dict_vendor_t	*dv;
+
+		dv = (fr_dict_vendor_t *)talloc_zero_array(dict->pool, uint8_t, sizeof(*dv) + len);
+		if (!dv) {
+		oom:
+			fr_strerror_printf("Out of memory");
+			return -1;
+		}
+		talloc_set_type(dv, fr_dict_vendor_t);
+
+		strlcpy(dv->name, name, len + 1);
+		dv->vendorpec = vendors[i].vendorpec;
+		dv->type = vendors[i].type;
+		dv->length = vendors[i].length;
+		dv->flags = vendors[i].flags;
+
+		if (!fr_hash_table_insert(dict->vendors_by_name, dv)) {
+			fr_strerror_printf("Duplicate vendor name %s", name);
+			return -1;
+		}
+
+		if (vendors[i].by_num && !fr_hash_table_replace(dict->vendors_by_num, dv)) {
+			fr_strerror_printf("Failed inserting vendor %s", name);
+			return -1;
+		}
+	}
+
+	das = talloc_array(NULL, fr_dict_attr_t *, hdr->num_attrs);
+	if (!das && hdr->num_attrs) goto oom;
+
+	for (i = 0; i < hdr->num_attrs; i++) {
+		fr_dict_attr_t		*parent, *da, *last;
+		fr_dict_attr_t const	*p;
+
+		parent = (attrs[i].parent < 0) ? dict->root : das[attrs[i].parent];
+
+		da = fr_dict_attr_alloc(dict->pool, parent, strings + attrs[i].name,
+					attrs[i].vendor, attrs[i].attr, attrs[i].type, &attrs[i].flags);
+		if (!da) {
+		error:
+			talloc_free(das);
+			return -1;
+		}
+		das[i] = da;
+
+		/*
+		 *	Append to the bin.  Attributes were written in
+		 *	bin order, so this recreates the original tree.
+		 */
+		if (!parent->children) {
+			parent->children = talloc_zero_array(parent, fr_dict_attr_t const *, UINT8_MAX + 1);
+			if (!parent->children) {
+				talloc_free(das);
+				goto oom;
+			}
+		}
+		p = parent->children[da->attr & 0xff];
+		if (!p) {
+			parent->children[da->attr & 0xff] = da;
+		} else {
+			while (p->next) p = p->next;
+			memcpy(&last, &p, sizeof(last));
+			last->next = da;
+		}
+
+		if (attrs[i].by_name && !fr_hash_table_replace(dict->attributes_by_name, da)) {
+			fr_strerror_printf("Internal error storing attribute");
+			goto error;
+		}
+
+		if ((da->type == PW_TYPE_COMBO_IP_ADDR) && (dict_attr_combo_add(dict, da) < 0)) goto error;
+
+		/*
+		 *	Leave the same state behind as reading the text
+		 *	dictionaries would have done.
+		 */
+		if (parent->flags.is_root) {
+			if ((da->attr == (PW_CAST_BASE + da->type)) && (strncmp(da->name, "Tmp-Cast-", 9) == 0)) {
+				defined_cast_types = true;
+			} else if (da->attr > max_attr) {
+				max_attr = da->attr;
+			}
+		}
+	}
+
+	for (i = 0; i < hdr->num_enums; i++) {
+		char const	*name = strings + enums[i].name;
+		size_t		len = strlen(name);
+		fr_dict_enum_t	*dval;
+
+		dval = (fr_dict_enum_t *)talloc_zero_array(dict->pool, uint8_t, sizeof(*dval) + len);
+		if (!dval) {
+			talloc_free(das);
+			goto oom;
+		}
+		talloc_set_type(dval, fr_dict_enum_t);
+
+		strlcpy(dval->name, name, len + 1);
+		dval->value = enums[i].value;
+		dval->da = das[enums[i].da];
+
+		if (!fr_hash_table_insert(dict->values_by_name, dval)) {
+			fr_strerror_printf("Duplicate VALUE name '%s' for attribute '%s'", name, dval->da->name);
+			goto error;
+		}
+
+		if (enums[i].by_value && !fr_hash_table_replace(dict->values_by_da, dval)) {
+			fr_strerror_printf("Failed inserting value %s", name);
+			goto error;
+		}
+	}
+	talloc_free(das);
+
+	/*
+	 *	So that HUPs only re-read the files if they change.
+	 */
+	for (i = 0; i < hdr->num_files; i++) {
+		dict_stat_add(dict, paths[i], files[i].absent ? NULL : &stats[i]);
+	}
+
+	return 0;
+}
+
+/** Load a dictionary from an image, if there's a usable one
+ *
+ * @param[in] dict	to load.  Must be empty.
+ * @param[in] dir	containing the dictionaries.
+ * @param[in] file	to load the image from.
+ * @return
+ *	- 1 if there's no usable image.  The reason is in fr_strerror().
+ *	- 0 if the dictionary was loaded from the image.
+ *	- -1 on error.  The dictionary may be partially loaded.
+ */
+static int dict_image_load(fr_dict_t *dict, char const *dir, char const *file)
+{
+	int			fd, rcode;
+	struct stat		st;
+	uint8_t			*image;
+	struct stat		*stats = NULL;
+	char const		**paths = NULL;
+	size_t			len;
+
+	fd = open(file, O_RDONLY);
+	if (fd < 0) {
+		fr_strerror_printf("Failed opening %s: %s", file, fr_syserror(errno));
+		return 1;
+	}
+
+	if ((fstat(fd, &st) < 0) || (st.st_size < (off_t) sizeof(dict_image_hdr_t)) || (st.st_size > UINT32_MAX)) {
+		fr_strerror_printf("Not a dictionary image");
+		close(fd);
+		return 1;
+	}
+	len = st.st_size;
+
+#ifdef HAVE_SYS_MMAN_H
+	image = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (image == MAP_FAILED) {
+		fr_strerror_printf("Failed mapping %s: %s", file, fr_syserror(errno));
+		return 1;
+	}
+#else
+	image = talloc_array(NULL, uint8_t, len);
+	if (!image) {
+		close(fd);
+		fr_strerror_printf("Out of memory");
+		return -1;
+	}
+
+	{
+		size_t	done;
+		ssize_t	slen;
+
+		for (done = 0; done < len; done += slen) {
+			slen = read(fd, image + done, len - done);
+			if (slen <= 0) {
+				fr_strerror_printf("Failed reading %s", file);
+				close(fd);
+				talloc_free(image);
+				return 1;
+			}
+		}
+	}
+	close(fd);
+#endif
+
+	if (dict_image_check(NULL, &stats, &paths, image, len, dir) < 0) {
+		rcode = 1;
+	} else {
+		rcode = dict_image_build(dict, image, stats, paths);
+		talloc_free(stats);
+	}
+
+#ifdef HAVE_SYS_MMAN_H
+	munmap(image, len);
+#else
+	talloc_free(image);
+#endif
+
+	return rcode;
+}
+
+/** (re)initialize a protocol dictionary
+ *
+ * Initialize the directory, then fix the attr member of all attributes.
+ *
+ * First dictionary initialised will be set as the default internal dictionary.
+ *
+ * @param[in] ctx to allocate the dictionary from.
+ * @param[out] out Where to write a pointer to the new dictionary.  Will free existing
+ *	dictionary if files have changed and *out is not NULL.
+ * @param[in] dir to read dictionary files from.
+ * @param[in] fn file name to read.
+ * @param[in] name to use for the root attributes.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int fr_dict_from_file(TALLOC_CTX *ctx, fr_dict_t **out, char const *dir, char const *fn, char const *name)
+{
+	fr_dict_t	*dict;
+	char		image[2048];
+
+	if (!*out) {
+		/* Pre-Allocate 5MB of pool memory for rapid startup */
+		dict = talloc_zero(ctx, fr_dict_t);
+		dict->pool = talloc_pool(dict, (1024 * 1024 * 5));
+	} else {
+		dict = *out;
+		if (dict_stat_check(dict, dir, fn)) return 0;
+	}
+
+	/*
+	 *	Free the old dictionaries
+	 */
+	if (*out == fr_dict_internal) fr_dict_internal = dict;
+	TALLOC_FREE(*out);
+
+	/*
+	 *	Remove this at some point...
+	 */
+	if (!fr_dict_internal) fr_dict_internal = dict;
+
+	/*
+	 *	Create the table of vendor by name.   There MAY NOT
+	 *	be multiple vendors of the same name.
+	 */
+	dict->vendors_by_name = fr_hash_table_create(dict, dict_vendor_name_hash, dict_vendor_name_cmp, hash_pool_free);
+	if (!dict->vendors_by_name) {
+	error:
+		talloc_free(dict);
+		return -1;
+	}
+
+	/*
+	 *	Create the table of vendors by value.  There MAY
+	 *	be vendors of the same value.  If there are, we
+	 *	pick the latest one.
+	 */
+	dict->vendors_by_num = fr_hash_table_create(dict, dict_vendor_vendorpec_hash, dict_vendor_vendorpec_cmp, NULL);
+	if (!dict->vendors_by_num) goto error;
+
+	/*
+	 *	Create the table of attributes by name.   There MAY NOT
+	 *	be multiple attributes of the same name.
+	 */
+	dict->attributes_by_name = fr_hash_table_create(dict, dict_attr_name_hash, dict_attr_name_cmp, NULL);
+	if (!dict->attributes_by_name) goto error;
+
+	/*
+	 *	Horrible hacks for combo-IP.
+	 */
+	dict->attributes_combo = fr_hash_table_create(dict, dict_attr_combo_hash, dict_attr_combo_cmp, hash_pool_free);
+	if (!dict->attributes_combo) goto error;
+
+	dict->values_by_name = fr_hash_table_create(dict, dict_enum_name_hash, dict_enum_name_cmp, hash_pool_free);
+	if (!dict->values_by_name) goto error;
+
+	dict->values_by_da = fr_hash_table_create(dict, dict_enum_value_hash, dict_enum_value_cmp, hash_pool_free);
+	if (!dict->values_by_da) goto error;
+
+	/*
+	 *	Magic dictionary root attribute
+	 */
 	dict->root = (fr_dict_attr_t *)talloc_zero_array(dict, uint8_t, sizeof(fr_dict_attr_t) + strlen(name));
 	strcpy(dict->root->name, name);
 	talloc_set_type(dict->root, fr_dict_attr_t);
@@ -2733,6 +4049,24 @@ int fr_dict_from_file(TALLOC_CTX *ctx, fr_dict_t **out, char const *dir, char co
 
 	dict->enum_fixup = NULL;        /* just to be safe. */
 
+	/*
+	 *	Use a compiled image of the dictionaries if there's
+	 *	one, and the files haven't changed since it was
+	 *	written.  Otherwise, silently read the files.
+	 */
+	snprintf(image, sizeof(image), "%s/%s%s", dir, fn, FR_DICT_IMAGE_EXT);
+	switch (dict_image_load(dict, dir, image)) {
+	case 0:
+		goto finish;
+
+	case 1:
+		fr_strerror_printf(NULL);
+		break;
+
+	default:
+		goto error;
+	}
+
 	/*
 	 *	Add cast attributes.  We do it this way,
 	 *	so cast attributes get added automatically for new types.
@@ -2818,6 +4152,12 @@ int fr_dict_from_file(TALLOC_CTX *ctx, fr_dict_t **out, char const *dir, char co
 		}
 	}
 
+finish:
+	if (dict_attr_child_index_all(dict->root) < 0) {
+		fr_strerror_printf("Out of memory");
+		goto error;
+	}
+
 	/*
 	 *	Walk over all of the hash tables to ensure they're
 	 *	initialized.  We do this because the threads may perform
@@ -2844,7 +4184,17 @@ int fr_dict_read(fr_dict_t *dict, char const *dir, char const *filename)
 		return -1;
 	}
 
-	return dict_from_file(dict, dir, filename, NULL, 0);
+	if (dict_from_file(dict, dir, filename, NULL, 0) < 0) return -1;
+
+	/*
+	 *	Index any TLVs or vendors the files added.
+	 */
+	if (dict_attr_child_index_all(dict->root) < 0) {
+		fr_strerror_printf("Out of memory");
+		return -1;
+	}
+
+	return 0;
 }
 
 /*
@@ -4118,6 +5468,20 @@ inline fr_dict_attr_t const *fr_dict_attr_child_by_num(fr_dict_attr_t const *par
 {
 	fr_dict_attr_t const *bin;
 
+	/*
+	 *	Only parents which can have children are indexed.
+	 */
+	if (parent->child_index) {
+		uint32_t disp;
+
+		if (!parent->child_index_disp) return (attr < parent->child_index_len) ? parent->child_index[attr] : NULL;
+
+		disp = parent->child_index_disp[dict_child_bucket(attr, parent->child_index_disp_shift)];
+		bin = parent->child_index[dict_child_slot(attr, disp, parent->child_index_shift)];
+
+		return (bin && (bin->attr == attr)) ? bin : NULL;
+	}
+
 	if (!parent->children) return NULL;
 
 	/*
@@ -0,0 +1,262 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * @file lib/histogram.c
+ * @brief Non-thread-safe log-linear (HDR style) histograms.
+ *
+ * Values below 2^(precision + 1) each get their own bucket.  Above that, every
+ * power of two range is split into 2^precision equal sized buckets, so the
+ * relative error of any recorded value is at most 2^-precision, and memory use
+ * grows with the log of the highest trackable value.
+ *
+ * Recording a value is a handful of integer operations and one increment, so
+ * histograms are cheap enough to update once per packet.
+ *
+ * @copyright 2016  The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/libradius.h>
+#include <freeradius-devel/histogram.h>
+
+struct fr_histogram {
+	unsigned int	precision;	//!< Number of bits of sub-bucket resolution.
+	unsigned int	num_buckets;	//!< Length of the buckets array.
+	uint64_t	highest;	//!< Highest value we can distinguish.  Larger values
+					//!< are recorded in the last bucket.
+
+	uint64_t	count;		//!< Number of values recorded.
+	uint64_t	total;		//!< Sum of values recorded, for the mean.
+	uint64_t	min;		//!< Smallest value recorded.
+	uint64_t	max;		//!< Largest value recorded.
+
+	uint64_t	*buckets;	//!< Counts for each bucket.
+};
+
+/** Return the index of the most significant bit set in a non-zero value
+ *
+ */
+static inline unsigned int histogram_msb(uint64_t value)
+{
+#ifdef __GNUC__
+	return 63 - __builtin_clzll(value);
+#else
+	unsigned int msb = 0;
+
+	while (value >>= 1) msb++;
+
+	return msb;
+#endif
+}
+
+/** Map a value to its bucket
+ *
+ */
+static inline unsigned int histogram_bucket(unsigned int precision, uint64_t value)
+{
+	unsigned int shift;
+
+	if (value < (UINT64_C(2) << precision)) return value;
+
+	shift = histogram_msb(value) - precision;
+
+	return ((shift + 1) << precision) + (value >> shift) - (1 << precision);
+}
+
+/** Map a bucket to the lowest value it holds
+ *
+ */
+static inline uint64_t histogram_value(unsigned int precision, unsigned int bucket)
+{
+	unsigned int	range = bucket >> precision;
+	uint64_t	sub = bucket & ((1 << precision) - 1);
+
+	if (range <= 1) return bucket;
+
+	return ((UINT64_C(1) << precision) + sub) << (range - 1);
+}
+
+/** Allocate a new histogram
+ *
+ * @param[in] ctx	to allocate the histogram in.
+ * @param[in] highest	value the histogram needs to distinguish.  Any larger value
+ *			is counted in the last bucket (though min/max stay exact).
+ * @param[in] precision	sub-bucket bits, 1-14.  Recorded values are accurate to
+ *			within 1/2^precision, so 7 gives better than 1% resolution.
+ * @return
+ *	- A new histogram.
+ *	- NULL on error.
+ */
+fr_histogram_t *fr_histogram_alloc(TALLOC_CTX *ctx, uint64_t highest, unsigned int precision)
+{
+	fr_histogram_t *h;
+
+	if ((precision < 1) || (precision > 14)) {
+		fr_strerror_printf("Histogram precision must be between 1 and 14 bits");
+		return NULL;
+	}
+
+	if (highest < (UINT64_C(2) << precision)) highest = (UINT64_C(2) << precision) - 1;
+
+	h = talloc_zero(ctx, fr_histogram_t);
+	if (!h) {
+		fr_strerror_printf("Out of memory");
+		return NULL;
+	}
+
+	h->precision = precision;
+	h->highest = highest;
+	h->num_buckets = histogram_bucket(precision, highest) + 1;
+	h->buckets = talloc_zero_array(h, uint64_t, h->num_buckets);
+	if (!h->buckets) {
+		fr_strerror_printf("Out of memory");
+		talloc_free(h);
+		return NULL;
+	}
+	h->min = UINT64_MAX;
+
+	return h;
+}
+
+/** Record a value
+ *
+ * @param[in] h		to record the value in.
+ * @param[in] value	to record.
+ */
+void fr_histogram_add(fr_histogram_t *h, uint64_t value)
+{
+	h->count++;
+	h->total += value;
+	if (value < h->min) h->min = value;
+	if (value > h->max) h->max = value;
+
+	if (value > h->highest) value = h->highest;
+	h->buckets[histogram_bucket(h->precision, value)]++;
+}
+
+/** Add the counts from one histogram to another
+ *
+ * Both histograms must have been allocated with the same highest value and precision.
+ *
+ * @param[in] dst	histogram to add counts to.
+ * @param[in] src	histogram to read counts from.
+ * @return
+ *	- 0 on success.
+ *	- -1 if the histograms have different layouts.
+ */
+int fr_histogram_merge(fr_histogram_t *dst, fr_histogram_t const *src)
+{
+	unsigned int i;
+
+	if ((dst->precision != src->precision) || (dst->num_buckets != src->num_buckets)) {
+		fr_strerror_printf("Can't merge histograms with different layouts");
+		return -1;
+	}
+
+	if (!src->count) return 0;
+
+	for (i = 0; i < src->num_buckets; i++) dst->buckets[i] += src->buckets[i];
+
+	dst->count += src->count;
+	dst->total += src->total;
+	if (src->min < dst->min) dst->min = src->min;
+	if (src->max > dst->max) dst->max = src->max;
+
+	return 0;
+}
+
+/** Discard all recorded values
+ *
+ * @param[in] h		to reset.
+ */
+void fr_histogram_reset(fr_histogram_t *h)
+{
+	memset(h->buckets, 0, sizeof(h->buckets[0]) * h->num_buckets);
+	h->count = 0;
+	h->total = 0;
+	h->min = UINT64_MAX;
+	h->max = 0;
+}
+
+/** Return the number of values recorded
+ *
+ */
+uint64_t fr_histogram_count(fr_histogram_t const *h)
+{
+	return h->count;
+}
+
+/** Return the smallest value recorded, or 0 if the histogram is empty
+ *
+ */
+uint64_t fr_histogram_min(fr_histogram_t const *h)
+{
+	return h->count ? h->min : 0;
+}
+
+/** Return the largest value recorded, or 0 if the histogram is empty
+ *
+ */
+uint64_t fr_histogram_max(fr_histogram_t const *h)
+{
+	return h->max;
+}
+
+/** Return the mean of the values recorded, or 0 if the histogram is empty
+ *
+ */
+double fr_histogram_mean(fr_histogram_t const *h)
+{
+	if (!h->count) return 0;
+
+	return (double) h->total / h->count;
+}
+
+/** Return the value at a given percentile
+ *
+ * The result is the highest value which falls into the same bucket as the
+ * value at that percentile, clamped to the range of values recorded.
+ *
+ * @param[in] h			to query.
+ * @param[in] percentile	between 0 and 100, e.g. 99.9.
+ * @return the value, or 0 if the histogram is empty.
+ */
+uint64_t fr_histogram_percentile(fr_histogram_t const *h, double percentile)
+{
+	uint64_t	target, seen = 0, value;
+	unsigned int	i;
+
+	if (!h->count) return 0;
+
+	if (percentile <= 0) return h->min;
+	if (percentile >= 100) return h->max;
+
+	target = (uint64_t) ((percentile / 100.0) * h->count + 0.5);
+	if (target == 0) target = 1;
+
+	for (i = 0; i < h->num_buckets; i++) {
+		seen += h->buckets[i];
+		if (seen >= target) break;
+	}
+	if (i == h->num_buckets) return h->max;
+
+	value = histogram_value(h->precision, i + 1) - 1;
+	if (value < h->min) return h->min;
+	if (value > h->max) return h->max;
+
+	return value;
+}
@@ -34,6 +34,77 @@ void fr_md5_calc(uint8_t *out, uint8_t const *in, size_t inlen)
 	fr_md5_final(out, &ctx);
 }
 
+/*
+ *	Secrets shorter than an MD5 block never get run through the
+ *	compression function on their own, so "absorbing" them is
+ *	just a copy into the context buffer, and caching gains nothing.
+ */
+#define MD5_SECRET_CACHE_MIN	64
+#define MD5_SECRET_CACHE_SIZE	32	/* must be a power of 2 */
+
+typedef struct md5_secret {
+	uint8_t		*secret;	//!< Copy of the secret, to detect collisions.
+	size_t		secret_len;	//!< Length of the secret.
+	FR_MD5_CTX	ctx;		//!< State after absorbing the secret.
+} md5_secret_t;
+
+fr_thread_local_setup(md5_secret_t *, md5_secret_cache)	/* macro */
+
+static void _md5_secret_cache_free(void *arg)
+{
+	talloc_free(arg);
+}
+
+/** Initialise an MD5 context, and absorb a shared secret into it
+ *
+ * The password and tunnel password codecs hash the same per-client secret
+ * for every attribute of every packet.  For long secrets, the state after
+ * absorbing the secret is kept in a small per-thread cache, so each call
+ * costs a hash lookup and a copy instead of one or more MD5 compressions.
+ *
+ * The cache is keyed by the contents of the secret, so it's safe to call
+ * with secrets which are freed, or which change on HUP.
+ *
+ * @param[out] ctx		to initialise.
+ * @param[in] secret		to absorb.
+ * @param[in] secret_len	length of the secret.
+ */
+void fr_md5_init_secret(FR_MD5_CTX *ctx, uint8_t const *secret, size_t secret_len)
+{
+	md5_secret_t	*cache, *entry;
+
+	if (secret_len < MD5_SECRET_CACHE_MIN) goto uncached;
+
+	cache = md5_secret_cache;
+	if (!cache) {
+		cache = talloc_zero_array(NULL, md5_secret_t, MD5_SECRET_CACHE_SIZE);
+		if (!cache) goto uncached;
+		fr_thread_local_set_destructor(md5_secret_cache, _md5_secret_cache_free, cache);
+	}
+
+	entry = &cache[fr_hash(secret, secret_len) & (MD5_SECRET_CACHE_SIZE - 1)];
+	if (!entry->secret || (entry->secret_len != secret_len) ||
+	    (memcmp(entry->secret, secret, secret_len) != 0)) {
+		talloc_free(entry->secret);
+		entry->secret = talloc_memdup(cache, secret, secret_len);
+		if (!entry->secret) {
+			entry->secret_len = 0;
+			goto uncached;
+		}
+		entry->secret_len = secret_len;
+
+		fr_md5_init(&entry->ctx);
+		fr_md5_update(&entry->ctx, secret, secret_len);
+	}
+
+	fr_md5_copy(ctx, &entry->ctx);
+	return;
+
+uncached:
+	fr_md5_init(ctx);
+	fr_md5_update(ctx, secret, secret_len);
+}
+
 #ifndef HAVE_OPENSSL_EVP_H
 /*
  * This code implements the MD5 message-digest algorithm.
@@ -0,0 +1,426 @@
+/*
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Lesser General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2.1 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *   Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file md5_multi.c
+ * @brief Multi-buffer MD5 and HMAC-MD5.
+ *
+ * MD5 is a serial chain of dependent operations, so a single digest can't use
+ * more than one execution unit.  Independent messages can, though.  Here
+ * MD5_LANES messages are hashed at once, with word n of every message held in
+ * a single vector, so each step of the MD5 round operates on all the lanes.
+ *
+ * The vectors use the GCC vector extensions rather than intrinsics, so the
+ * compiler picks the widest instructions the build targets: SSE2 on any x86_64,
+ * AVX2 if built with -mavx2 (or -march=native), NEON on ARM.  Compilers without
+ * vector extensions get a single lane, which is no slower than fr_md5_calc.
+ *
+ * Messages in a batch may be of different lengths.  Lanes which run out of blocks
+ * keep running, but the results are masked out of their state.
+ *
+ * @copyright 2016 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/libradius.h>
+#include <freeradius-devel/md5.h>
+
+#ifdef __GNUC__
+#  define MD5_LANES 8
+typedef uint32_t md5_vec_t __attribute__((vector_size(MD5_LANES * sizeof(uint32_t))));
+#else
+#  define MD5_LANES 1
+typedef uint32_t md5_vec_t;
+#endif
+
+#define MD5_BLOCK_LEN 64
+
+/** Allows individual lanes of a vector to be read and written
+ *
+ */
+typedef union {
+	md5_vec_t	v;
+	uint32_t	w[MD5_LANES];
+} md5_lanes_t;
+
+/** One message being hashed
+ *
+ * A message is made up of two segments, so we don't need to copy the packet to
+ * append the shared secret.
+ */
+typedef struct {
+	uint32_t	state[4];	//!< Initial state, replaced by the final state.
+	uint64_t	offset;		//!< Number of bytes already hashed into state.
+
+	uint8_t const	*in;		//!< First segment of the message.
+	size_t		inlen;		//!< Length of the first segment.
+	uint8_t const	*suffix;	//!< Second segment of the message, may be NULL.
+	size_t		suffix_len;	//!< Length of the second segment.
+
+	bool		final;		//!< Whether to append padding and the message length.
+	size_t		blocks;		//!< Number of blocks to hash, including padding.
+} md5_lane_t;
+
+static const uint32_t md5_iv[4] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 };
+
+#define F1(x, y, z)	(z ^ (x & (y ^ z)))
+#define F2(x, y, z)	F1(z, x, y)
+#define F3(x, y, z)	(x ^ y ^ z)
+#define F4(x, y, z)	(y ^ (x | ~z))
+
+#define MD5STEP(f, w, x, y, z, data, s) \
+	(w += f(x, y, z) + data, w = (w << s) | (w >> (32 - s)), w += x)
+
+/** Run the MD5 compression function over one block from each lane
+ *
+ * @param[in,out] state	of each lane.
+ * @param[in] in	16 words from each lane.
+ */
+static inline void md5_multi_transform(md5_vec_t state[4], md5_vec_t const in[16])
+{
+	md5_vec_t a, b, c, d;
+
+	a = state[0];
+	b = state[1];
+	c = state[2];
+	d = state[3];
+
+	MD5STEP(F1, a, b, c, d, in[ 0] + 0xd76aa478,  7);
+	MD5STEP(F1, d, a, b, c, in[ 1] + 0xe8c7b756, 12);
+	MD5STEP(F1, c, d, a, b, in[ 2] + 0x242070db, 17);
+	MD5STEP(F1, b, c, d, a, in[ 3] + 0xc1bdceee, 22);
+	MD5STEP(F1, a, b, c, d, in[ 4] + 0xf57c0faf,  7);
+	MD5STEP(F1, d, a, b, c, in[ 5] + 0x4787c62a, 12);
+	MD5STEP(F1, c, d, a, b, in[ 6] + 0xa8304613, 17);
+	MD5STEP(F1, b, c, d, a, in[ 7] + 0xfd469501, 22);
+	MD5STEP(F1, a, b, c, d, in[ 8] + 0x698098d8,  7);
+	MD5STEP(F1, d, a, b, c, in[ 9] + 0x8b44f7af, 12);
+	MD5STEP(F1, c, d, a, b, in[10] + 0xffff5bb1, 17);
+	MD5STEP(F1, b, c, d, a, in[11] + 0x895cd7be, 22);
+	MD5STEP(F1, a, b, c, d, in[12] + 0x6b901122,  7);
+	MD5STEP(F1, d, a, b, c, in[13] + 0xfd987193, 12);
+	MD5STEP(F1, c, d, a, b, in[14] + 0xa679438e, 17);
+	MD5STEP(F1, b, c, d, a, in[15] + 0x49b40821, 22);
+
+	MD5STEP(F2, a, b, c, d, in[ 1] + 0xf61e2562,  5);
+	MD5STEP(F2, d, a, b, c, in[ 6] + 0xc040b340,  9);
+	MD5STEP(F2, c, d, a, b, in[11] + 0x265e5a51, 14);
+	MD5STEP(F2, b, c, d, a, in[ 0] + 0xe9b6c7aa, 20);
+	MD5STEP(F2, a, b, c, d, in[ 5] + 0xd62f105d,  5);
+	MD5STEP(F2, d, a, b, c, in[10] + 0x02441453,  9);
+	MD5STEP(F2, c, d, a, b, in[15] + 0xd8a1e681, 14);
+	MD5STEP(F2, b, c, d, a, in[ 4] + 0xe7d3fbc8, 20);
+	MD5STEP(F2, a, b, c, d, in[ 9] + 0x21e1cde6,  5);
+	MD5STEP(F2, d, a, b, c, in[14] + 0xc33707d6,  9);
+	MD5STEP(F2, c, d, a, b, in[ 3] + 0xf4d50d87, 14);
+	MD5STEP(F2, b, c, d, a, in[ 8] + 0x455a14ed, 20);
+	MD5STEP(F2, a, b, c, d, in[13] + 0xa9e3e905,  5);
+	MD5STEP(F2, d, a, b, c, in[ 2] + 0xfcefa3f8,  9);
+	MD5STEP(F2, c, d, a, b, in[ 7] + 0x676f02d9, 14);
+	MD5STEP(F2, b, c, d, a, in[12] + 0x8d2a4c8a, 20);
+
+	MD5STEP(F3, a, b, c, d, in[ 5] + 0xfffa3942,  4);
+	MD5STEP(F3, d, a, b, c, in[ 8] + 0x8771f681, 11);
+	MD5STEP(F3, c, d, a, b, in[11] + 0x6d9d6122, 16);
+	MD5STEP(F3, b, c, d, a, in[14] + 0xfde5380c, 23);
+	MD5STEP(F3, a, b, c, d, in[ 1] + 0xa4beea44,  4);
+	MD5STEP(F3, d, a, b, c, in[ 4] + 0x4bdecfa9, 11);
+	MD5STEP(F3, c, d, a, b, in[ 7] + 0xf6bb4b60, 16);
+	MD5STEP(F3, b, c, d, a, in[10] + 0xbebfbc70, 23);
+	MD5STEP(F3, a, b, c, d, in[13] + 0x289b7ec6,  4);
+	MD5STEP(F3, d, a, b, c, in[ 0] + 0xeaa127fa, 11);
+	MD5STEP(F3, c, d, a, b, in[ 3] + 0xd4ef3085, 16);
+	MD5STEP(F3, b, c, d, a, in[ 6] + 0x04881d05, 23);
+	MD5STEP(F3, a, b, c, d, in[ 9] + 0xd9d4d039,  4);
+	MD5STEP(F3, d, a, b, c, in[12] + 0xe6db99e5, 11);
+	MD5STEP(F3, c, d, a, b, in[15] + 0x1fa27cf8, 16);
+	MD5STEP(F3, b, c, d, a, in[ 2] + 0xc4ac5665, 23);
+
+	MD5STEP(F4, a, b, c, d, in[ 0] + 0xf4292244,  6);
+	MD5STEP(F4, d, a, b, c, in[ 7] + 0x432aff97, 10);
+	MD5STEP(F4, c, d, a, b, in[14] + 0xab9423a7, 15);
+	MD5STEP(F4, b, c, d, a, in[ 5] + 0xfc93a039, 21);
+	MD5STEP(F4, a, b, c, d, in[12] + 0x655b59c3,  6);
+	MD5STEP(F4, d, a, b, c, in[ 3] + 0x8f0ccc92, 10);
+	MD5STEP(F4, c, d, a, b, in[10] + 0xffeff47d, 15);
+	MD5STEP(F4, b, c, d, a, in[ 1] + 0x85845dd1, 21);
+	MD5STEP(F4, a, b, c, d, in[ 8] + 0x6fa87e4f,  6);
+	MD5STEP(F4, d, a, b, c, in[15] + 0xfe2ce6e0, 10);
+	MD5STEP(F4, c, d, a, b, in[ 6] + 0xa3014314, 15);
+	MD5STEP(F4, b, c, d, a, in[13] + 0x4e0811a1, 21);
+	MD5STEP(F4, a, b, c, d, in[ 4] + 0xf7537e82,  6);
+	MD5STEP(F4, d, a, b, c, in[11] + 0xbd3af235, 10);
+	MD5STEP(F4, c, d, a, b, in[ 2] + 0x2ad7d2bb, 15);
+	MD5STEP(F4, b, c, d, a, in[ 9] + 0xeb86d391, 21);
+
+	state[0] += a;
+	state[1] += b;
+	state[2] += c;
+	state[3] += d;
+}
+
+/** Return a pointer to block n of a lane's message
+ *
+ * Blocks which lie entirely within the first segment are returned in place.
+ * Anything else is assembled in the caller's buffer, along with any padding.
+ */
+static uint8_t const *md5_lane_block(md5_lane_t const *lane, size_t n, uint8_t buff[MD5_BLOCK_LEN])
+{
+	size_t	start = n * MD5_BLOCK_LEN;
+	size_t	end = start + MD5_BLOCK_LEN;
+	size_t	total = lane->inlen + lane->suffix_len;
+
+	if (end <= lane->inlen) return lane->in + start;
+
+	memset(buff, 0, MD5_BLOCK_LEN);
+
+	if (start < lane->inlen) memcpy(buff, lane->in + start, lane->inlen - start);
+
+	if (lane->suffix_len && (start < total) && (end > lane->inlen)) {
+		size_t from = (start > lane->inlen) ? start : lane->inlen;
+		size_t to = (end < total) ? end : total;
+
+		memcpy(buff + (from - start), lane->suffix + (from - lane->inlen), to - from);
+	}
+
+	if (!lane->final) return buff;
+
+	if ((total >= start) && (total < end)) buff[total - start] = 0x80;
+
+	/*
+	 *	Message length in bits goes in the last 8 bytes
+	 *	of the last block.
+	 */
+	if (n == (lane->blocks - 1)) {
+		uint64_t	bits = (lane->offset + total) << 3;
+		int		i;
+
+		for (i = 0; i < 8; i++) buff[56 + i] = bits >> (i * 8);
+	}
+
+	return buff;
+}
+
+/** Hash up to MD5_LANES messages at once
+ *
+ * @param[in,out] lanes	to hash.  The final state of each is written back to lane->state.
+ * @param[in] num	number of lanes, between 1 and MD5_LANES.
+ */
+static void md5_multi_lanes(md5_lane_t *lanes, unsigned int num)
+{
+	static uint8_t const	zero[MD5_BLOCK_LEN];
+
+	md5_lanes_t		state[4], in[16], active;
+	md5_vec_t		prev[4];
+	uint8_t			buff[MD5_LANES][MD5_BLOCK_LEN];
+	size_t			blocks = 0, n;
+	unsigned int		i, j;
+
+	memset(state, 0, sizeof(state));
+
+	for (i = 0; i < num; i++) {
+		md5_lane_t *lane = &lanes[i];
+		size_t total = lane->inlen + lane->suffix_len;
+
+		if (lane->final) {
+			lane->blocks = ((total + 8) / MD5_BLOCK_LEN) + 1;
+		} else {
+			lane->blocks = total / MD5_BLOCK_LEN;
+		}
+		if (lane->blocks > blocks) blocks = lane->blocks;
+
+		for (j = 0; j < 4; j++) state[j].w[i] = lane->state[j];
+	}
+
+	for (n = 0; n < blocks; n++) {
+		for (i = 0; i < MD5_LANES; i++) {
+			uint8_t const *p;
+
+			if ((i < num) && (n < lanes[i].blocks)) {
+				p = md5_lane_block(&lanes[i], n, buff[i]);
+				active.w[i] = UINT32_MAX;
+			} else {
+				p = zero;
+				active.w[i] = 0;
+			}
+
+			for (j = 0; j < 16; j++) {
+				in[j].w[i] = (uint32_t) p[j * 4] |
+					     ((uint32_t) p[(j * 4) + 1] << 8) |
+					     ((uint32_t) p[(j * 4) + 2] << 16) |
+					     ((uint32_t) p[(j * 4) + 3] << 24);
+			}
+		}
+
+		for (j = 0; j < 4; j++) prev[j] = state[j].v;
+
+		md5_multi_transform(&state[0].v, &in[0].v);
+
+		/*
+		 *	Lanes which have run out of blocks keep
+		 *	their previous state.
+		 */
+		for (j = 0; j < 4; j++) state[j].v = (state[j].v & active.v) | (prev[j] & ~active.v);
+	}
+
+	for (i = 0; i < num; i++) {
+		for (j = 0; j < 4; j++) lanes[i].state[j] = state[j].w[i];
+	}
+}
+
+/** Write a final MD5 state out as a digest
+ *
+ */
+static inline void md5_state_to_digest(uint8_t out[MD5_DIGEST_LENGTH], uint32_t const state[4])
+{
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		out[(i * 4)] = state[i];
+		out[(i * 4) + 1] = state[i] >> 8;
+		out[(i * 4) + 2] = state[i] >> 16;
+		out[(i * 4) + 3] = state[i] >> 24;
+	}
+}
+
+/** Calculate the MD5 digests of multiple messages
+ *
+ * Each message is the concatenation of in[i] and (optionally) suffix[i], which
+ * is the form used for RADIUS Request and Response Authenticators.
+ *
+ * @param[out] out		Where to write the digests, one per message.
+ * @param[in] in		First segment of each message.
+ * @param[in] inlen		Length of the first segment of each message.
+ * @param[in] suffix		Second segment of each message.  May be NULL, and individual
+ *				entries may be NULL if suffix_len is 0.
+ * @param[in] suffix_len	Length of the second segment of each message.  May be NULL
+ *				if suffix is NULL.
+ * @param[in] num		Number of messages.
+ */
+void fr_md5_calc_multi(uint8_t (*out)[MD5_DIGEST_LENGTH], uint8_t const * const *in, size_t const *inlen,
+		       uint8_t const * const *suffix, size_t const *suffix_len, unsigned int num)
+{
+	md5_lane_t	lanes[MD5_LANES];
+	unsigned int	i, j, todo;
+
+	for (i = 0; i < num; i += todo) {
+		todo = ((num - i) > MD5_LANES) ? MD5_LANES : (num - i);
+
+		memset(lanes, 0, sizeof(lanes[0]) * todo);
+		for (j = 0; j < todo; j++) {
+			memcpy(lanes[j].state, md5_iv, sizeof(lanes[j].state));
+			lanes[j].in = in[i + j];
+			lanes[j].inlen = inlen[i + j];
+			if (suffix) {
+				lanes[j].suffix = suffix[i + j];
+				lanes[j].suffix_len = suffix_len[i + j];
+			}
+			lanes[j].final = true;
+		}
+
+		md5_multi_lanes(lanes, todo);
+
+		for (j = 0; j < todo; j++) md5_state_to_digest(out[i + j], lanes[j].state);
+	}
+}
+
+/** Calculate HMAC-MD5 for multiple messages
+ *
+ * Produces the same output as calling #fr_hmac_md5 for each message.
+ *
+ * @param[out] out	Where to write the digests, one per message.
+ * @param[in] text	to authenticate.
+ * @param[in] text_len	Length of each message.
+ * @param[in] key	for each message.
+ * @param[in] key_len	Length of each key.
+ * @param[in] num	Number of messages.
+ */
+void fr_hmac_md5_multi(uint8_t (*out)[MD5_DIGEST_LENGTH], uint8_t const * const *text, size_t const *text_len,
+		       uint8_t const * const *key, size_t const *key_len, unsigned int num)
+{
+	md5_lane_t	ipad[MD5_LANES], opad[MD5_LANES];
+	uint8_t		k_ipad[MD5_LANES][MD5_BLOCK_LEN];
+	uint8_t		k_opad[MD5_LANES][MD5_BLOCK_LEN];
+	uint8_t		inner[MD5_LANES][MD5_DIGEST_LENGTH];
+	unsigned int	i, j, todo;
+	int		k;
+
+	for (i = 0; i < num; i += todo) {
+		todo = ((num - i) > MD5_LANES) ? MD5_LANES : (num - i);
+
+		memset(ipad, 0, sizeof(ipad[0]) * todo);
+		memset(opad, 0, sizeof(opad[0]) * todo);
+
+		for (j = 0; j < todo; j++) {
+			uint8_t const	*this_key = key[i + j];
+			size_t		this_key_len = key_len[i + j];
+			uint8_t		tk[MD5_DIGEST_LENGTH];
+
+			/* if key is longer than 64 bytes reset it to key=MD5(key) */
+			if (this_key_len > MD5_BLOCK_LEN) {
+				fr_md5_calc(tk, this_key, this_key_len);
+				this_key = tk;
+				this_key_len = sizeof(tk);
+			}
+
+			memset(k_ipad[j], 0, MD5_BLOCK_LEN);
+			memcpy(k_ipad[j], this_key, this_key_len);
+			memcpy(k_opad[j], k_ipad[j], MD5_BLOCK_LEN);
+			for (k = 0; k < MD5_BLOCK_LEN; k++) {
+				k_ipad[j][k] ^= 0x36;
+				k_opad[j][k] ^= 0x5c;
+			}
+
+			memcpy(ipad[j].state, md5_iv, sizeof(ipad[j].state));
+			ipad[j].in = k_ipad[j];
+			ipad[j].inlen = MD5_BLOCK_LEN;
+
+			memcpy(opad[j].state, md5_iv, sizeof(opad[j].state));
+			opad[j].in = k_opad[j];
+			opad[j].inlen = MD5_BLOCK_LEN;
+		}
+
+		/*
+		 *	MD5(K XOR ipad, text)
+		 */
+		md5_multi_lanes(ipad, todo);
+		for (j = 0; j < todo; j++) {
+			ipad[j].offset = MD5_BLOCK_LEN;
+			ipad[j].in = text[i + j];
+			ipad[j].inlen = text_len[i + j];
+			ipad[j].final = true;
+		}
+		md5_multi_lanes(ipad, todo);
+
+		/*
+		 *	MD5(K XOR opad, inner)
+		 */
+		md5_multi_lanes(opad, todo);
+		for (j = 0; j < todo; j++) {
+			md5_state_to_digest(inner[j], ipad[j].state);
+
+			opad[j].offset = MD5_BLOCK_LEN;
+			opad[j].in = inner[j];
+			opad[j].inlen = MD5_DIGEST_LENGTH;
+			opad[j].final = true;
+		}
+		md5_multi_lanes(opad, todo);
+
+		for (j = 0; j < todo; j++) md5_state_to_digest(out[i + j], opad[j].state);
+	}
+}
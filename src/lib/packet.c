@@ -255,7 +255,12 @@ typedef struct fr_packet_socket_t {
 	int		proto;
 #endif
 
-	uint8_t		id[32];
+	uint8_t		id[32];			//!< Bitmap of IDs in use.
+
+	uint8_t		free_ids[256];		//!< FIFO of free IDs, the least recently
+						//!< freed one first.  There are
+						//!< 256 - num_outgoing entries.
+	uint8_t		free_head;		//!< Index of the next free ID.
 } fr_packet_socket_t;
 
 
@@ -264,6 +269,9 @@ typedef struct fr_packet_socket_t {
 #define SOCKOFFSET_MASK (MAX_SOCKETS - 1)
 #define SOCK2OFFSET(sockfd) ((sockfd * FNV_MAGIC_PRIME) & SOCKOFFSET_MASK)
 
+#define DST_HINT_SIZE (64)
+#define DST_HINT_MASK (DST_HINT_SIZE - 1)
+
 /*
  *	Structure defining a list of packets (incoming or outgoing)
  *	that should be managed.
@@ -276,6 +284,15 @@ struct fr_packet_list_t {
 	int		last_recv;
 	int		num_sockets;
 
+	uint32_t	fanout;			//!< Ask for a new socket when all sockets
+						//!< to a destination have this many IDs in use.
+	bool		fanout_pending[DST_HINT_SIZE]; //!< We asked for a new socket for a destination,
+						//!< and its next allocation may use busy sockets.
+						//!< Indexed like dst_hint.
+
+	uint8_t		dst_hint[DST_HINT_SIZE]; //!< Socket to try first for a destination,
+						//!< indexed by a hash of dst IP, port and proto.
+
 	fr_packet_socket_t sockets[MAX_SOCKETS];
 };
 
@@ -395,6 +412,20 @@ bool fr_packet_list_socket_add(fr_packet_list_t *pl, int sockfd, int proto,
 
 	memset(ps, 0, sizeof(*ps));
 	ps->ctx = ctx;
+
+	/*
+	 *	Seed the free list with the IDs in a random order, so
+	 *	that IDs aren't predictable.  After that, they're
+	 *	re-used in the order they're freed.
+	 */
+	for (i = 0; i < 256; i++) ps->free_ids[i] = i;
+	for (i = 255; i > 0; i--) {
+		int	j = fr_rand() % (i + 1);
+		uint8_t	tmp = ps->free_ids[i];
+
+		ps->free_ids[i] = ps->free_ids[j];
+		ps->free_ids[j] = tmp;
+	}
 #ifdef WITH_TCP
 	ps->proto = proto;
 #endif
@@ -583,6 +614,135 @@ uint32_t fr_packet_list_num_elements(fr_packet_list_t *pl)
 	return rbtree_num_elements(pl->tree);
 }
 
+/** Open more sockets before a destination runs out of IDs
+ *
+ * When every socket to a destination has at least @p watermark IDs in use,
+ * fr_packet_list_id_alloc() fails once for that destination, so that the
+ * caller opens another socket (as it does when the IDs run out).  The next
+ * call will use a busy socket if the caller didn't, or couldn't, add one.
+ *
+ * Without fan-out, requests are spread round-robin over the sockets to a
+ * destination.
+ *
+ * Spreading requests over more source ports before the ID space is full
+ * keeps IDs from being re-used too quickly.
+ *
+ * @param[in] pl		to set the watermark for.
+ * @param[in] watermark		number of IDs in use, 1-256.  0 disables fan-out.
+ */
+void fr_packet_list_fanout(fr_packet_list_t *pl, uint32_t watermark)
+{
+	if (!pl) return;
+
+	if (watermark > 256) watermark = 256;
+	pl->fanout = watermark;
+}
+
+/*
+ *	Which slot of dst_hint to use for a request.
+ */
+static uint32_t packet_dst_hash(RADIUS_PACKET const *request, int proto)
+{
+	uint32_t hash;
+
+	hash = fr_hash(&request->dst_port, sizeof(request->dst_port));
+	hash = fr_hash_update(&proto, sizeof(proto), hash);
+	if (request->dst_ipaddr.af == AF_INET) {
+		hash = fr_hash_update(&request->dst_ipaddr.ipaddr.ip4addr,
+				      sizeof(request->dst_ipaddr.ipaddr.ip4addr), hash);
+	} else {
+		hash = fr_hash_update(&request->dst_ipaddr.ipaddr.ip6addr,
+				      sizeof(request->dst_ipaddr.ipaddr.ip6addr), hash);
+	}
+
+	return hash & DST_HINT_MASK;
+}
+
+/*
+ *	Whether a socket can be used to send a request.
+ */
+static bool packet_socket_usable(fr_packet_socket_t const *ps, RADIUS_PACKET const *request,
+				 UNUSED int proto, int src_any)
+{
+	if (ps->sockfd == -1) return false; /* paranoia */
+
+	/*
+	 *	This socket is marked as "don't use for new
+	 *	packets".  But we can still receive packets
+	 *	that are outstanding.
+	 */
+	if (ps->dont_use) return false;
+
+	/*
+	 *	All IDs are allocated: ignore it.
+	 */
+	if (ps->num_outgoing == 256) return false;
+
+#ifdef WITH_TCP
+	if (ps->proto != proto) return false;
+#endif
+
+	/*
+	 *	Address families don't match, skip it.
+	 */
+	if (ps->src_ipaddr.af != request->dst_ipaddr.af) return false;
+
+	/*
+	 *	MUST match dst port, if we have one.
+	 */
+	if ((ps->dst_port != 0) &&
+	    (ps->dst_port != request->dst_port)) return false;
+
+	/*
+	 *	MUST match requested src port, if one has been given.
+	 */
+	if ((request->src_port != 0) &&
+	    (ps->src_port != request->src_port)) return false;
+
+	/*
+	 *	We don't care about the source IP, but this
+	 *	socket is link local, and the requested
+	 *	destination is not link local.  Ignore it.
+	 */
+	if (src_any && (ps->src_ipaddr.af == AF_INET) &&
+	    (((ps->src_ipaddr.ipaddr.ip4addr.s_addr >> 24) & 0xff) == 127) &&
+	    (((request->dst_ipaddr.ipaddr.ip4addr.s_addr >> 24) & 0xff) != 127)) return false;
+
+	/*
+	 *	We're sourcing from *, and they asked for a
+	 *	specific source address: ignore it.
+	 */
+	if (ps->src_any && !src_any) return false;
+
+	/*
+	 *	We're sourcing from a specific IP, and they
+	 *	asked for a source IP that isn't us: ignore
+	 *	it.
+	 */
+	if (!ps->src_any && !src_any &&
+	    (fr_ipaddr_cmp(&request->src_ipaddr,
+			   &ps->src_ipaddr) != 0)) return false;
+
+	/*
+	 *	UDP sockets are allowed to match
+	 *	destination IPs exactly, OR a socket
+	 *	with destination * is allowed to match
+	 *	any requested destination.
+	 *
+	 *	TCP sockets must match the destination
+	 *	exactly.  They *always* have dst_any=0,
+	 *	so the first check always matches.
+	 */
+	if (!ps->dst_any &&
+	    (fr_ipaddr_cmp(&request->dst_ipaddr,
+			   &ps->dst_ipaddr) != 0)) return false;
+
+	/*
+	 *	Otherwise, this socket is OK to use.
+	 */
+	return true;
+}
+
 
 /*
  *	1 == ID was allocated & assigned
@@ -606,9 +766,10 @@ uint32_t fr_packet_list_num_elements(fr_packet_list_t *pl)
 bool fr_packet_list_id_alloc(fr_packet_list_t *pl, int proto,
 			    RADIUS_PACKET **request_p, void **pctx)
 {
-	int i, j, k, fd, id, start_i, start_j, start_k;
+	int i, id, start;
+	uint32_t hint;
 	int src_any = 0;
-	fr_packet_socket_t *ps= NULL;
+	fr_packet_socket_t *ps, *busy;
 	RADIUS_PACKET *request = *request_p;
 
 	if ((request->dst_ipaddr.af == AF_UNSPEC) ||
@@ -647,143 +808,68 @@ bool fr_packet_list_id_alloc(fr_packet_list_t *pl, int proto,
 	}
 
 	/*
-	 *	FIXME: Go to an LRU system.  This prevents ID re-use
-	 *	for as long as possible.  The main problem with that
-	 *	approach is that it requires us to populate the
-	 *	LRU/FIFO when we add a new socket, or a new destination,
-	 *	which can be expensive.
+	 *	When fanning out, start with the socket we last used
+	 *	for this destination.  It's usually still OK, which
+	 *	makes finding a socket O(1).  Otherwise, look at the
+	 *	rest of them, skipping busy ones.
 	 *
-	 *	The LRU can be avoided if the caller takes care to free
-	 *	Id's only when all responses have been received, OR after
-	 *	a timeout.
-	 *
-	 *	Right now, the random approach is almost OK... it's
-	 *	brute-force over all of the available ID's, BUT using
-	 *	random numbers for everything spreads the load a bit.
-	 *
-	 *	The old method had a hash lookup on allocation AND
-	 *	on free.  The new method has brute-force on allocation,
-	 *	and near-zero cost on free.
+	 *	Without fan-out, the hint is the socket after the one
+	 *	we last used, so requests are spread round-robin over
+	 *	all of the sockets to a destination.
 	 */
+	hint = packet_dst_hash(request, proto);
+	start = pl->dst_hint[hint];
 
-	id = fd = -1;
-	start_i = fr_rand() & SOCKOFFSET_MASK;
-
-#define ID_i ((i + start_i) & SOCKOFFSET_MASK)
+	ps = busy = NULL;
 	for (i = 0; i < MAX_SOCKETS; i++) {
-		if (pl->sockets[ID_i].sockfd == -1) continue; /* paranoia */
-
-		ps = &(pl->sockets[ID_i]);
-
-		/*
-		 *	This socket is marked as "don't use for new
-		 *	packets".  But we can still receive packets
-		 *	that are outstanding.
-		 */
-		if (ps->dont_use) continue;
-
-		/*
-		 *	All IDs are allocated: ignore it.
-		 */
-		if (ps->num_outgoing == 256) continue;
-
-#ifdef WITH_TCP
-		if (ps->proto != proto) continue;
-#endif
-
-		/*
-		 *	Address families don't match, skip it.
-		 */
-		if (ps->src_ipaddr.af != request->dst_ipaddr.af) continue;
-
-		/*
-		 *	MUST match dst port, if we have one.
-		 */
-		if ((ps->dst_port != 0) &&
-		    (ps->dst_port != request->dst_port)) continue;
-
-		/*
-		 *	MUST match requested src port, if one has been given.
-		 */
-		if ((request->src_port != 0) &&
-		    (ps->src_port != request->src_port)) continue;
+		fr_packet_socket_t *this = &pl->sockets[(start + i) & SOCKOFFSET_MASK];
 
-		/*
-		 *	We don't care about the source IP, but this
-		 *	socket is link local, and the requested
-		 *	destination is not link local.  Ignore it.
-		 */
-		if (src_any && (ps->src_ipaddr.af == AF_INET) &&
-		    (((ps->src_ipaddr.ipaddr.ip4addr.s_addr >> 24) & 0xff) == 127) &&
-		    (((request->dst_ipaddr.ipaddr.ip4addr.s_addr >> 24) & 0xff) != 127)) continue;
-
-		/*
-		 *	We're sourcing from *, and they asked for a
-		 *	specific source address: ignore it.
-		 */
-		if (ps->src_any && !src_any) continue;
+		if (!packet_socket_usable(this, request, proto, src_any)) continue;
 
-		/*
-		 *	We're sourcing from a specific IP, and they
-		 *	asked for a source IP that isn't us: ignore
-		 *	it.
-		 */
-		if (!ps->src_any && !src_any &&
-		    (fr_ipaddr_cmp(&request->src_ipaddr,
-				   &ps->src_ipaddr) != 0)) continue;
+		if (pl->fanout && (this->num_outgoing >= pl->fanout)) {
+			if (!busy) busy = this;
+			continue;
+		}
 
-		/*
-		 *	UDP sockets are allowed to match
-		 *	destination IPs exactly, OR a socket
-		 *	with destination * is allowed to match
-		 *	any requested destination.
-		 *
-		 *	TCP sockets must match the destination
-		 *	exactly.  They *always* have dst_any=0,
-		 *	so the first check always matches.
-		 */
-		if (!ps->dst_any &&
-		    (fr_ipaddr_cmp(&request->dst_ipaddr,
-				   &ps->dst_ipaddr) != 0)) continue;
+		ps = this;
+		break;
+	}
 
+	if (!ps) {
 		/*
-		 *	Otherwise, this socket is OK to use.
+		 *	Ask the caller to allocate a new socket.
 		 */
+		if (!busy) {
+			fr_strerror_printf("Failed finding socket, caller must allocate a new one");
+			return false;
+		}
 
 		/*
-		 *	Look for a free Id, starting from a random number.
+		 *	All of the sockets for this destination are
+		 *	busy.  Ask for a new one once, but if that
+		 *	doesn't happen, use the busy ones.
 		 */
-		start_j = fr_rand() & 0x1f;
-#define ID_j ((j + start_j) & 0x1f)
-		for (j = 0; j < 32; j++) {
-			if (ps->id[ID_j] == 0xff) continue;
-
+		if (!pl->fanout_pending[hint] && (pl->num_sockets < MAX_SOCKETS)) {
+			pl->fanout_pending[hint] = true;
+			fr_strerror_printf("All sockets are busy, caller should allocate a new one");
+			return false;
+		}
 
-			start_k = fr_rand() & 0x07;
-#define ID_k ((k + start_k) & 0x07)
-			for (k = 0; k < 8; k++) {
-				if ((ps->id[ID_j] & (1 << ID_k)) != 0) continue;
+		ps = busy;
+	}
+	pl->fanout_pending[hint] = false;
 
-				ps->id[ID_j] |= (1 << ID_k);
-				id = (ID_j * 8) + ID_k;
-				fd = i;
-				break;
-			}
-			if (fd >= 0) break;
-		}
-#undef ID_i
-#undef ID_j
-#undef ID_k
-		break;
+	if (pl->fanout) {
+		pl->dst_hint[hint] = ps - pl->sockets;
+	} else {
+		pl->dst_hint[hint] = ((ps - pl->sockets) + 1) & SOCKOFFSET_MASK;
 	}
 
 	/*
-	 *	Ask the caller to allocate a new ID.
+	 *	Take the least recently freed ID.
 	 */
-	if (fd < 0) {
-		fr_strerror_printf("Failed finding socket, caller must allocate a new one");
-		return false;
-	}
+	id = ps->free_ids[ps->free_head++];
+	ps->id[(id >> 3) & 0x1f] |= (1 << (id & 0x07));
 
 	/*
 	 *	Set the ID, source IP, and source port.
@@ -805,10 +891,11 @@ bool fr_packet_list_id_alloc(fr_packet_list_t *pl, int proto,
 	}
 
 	/*
-	 *	Mark the ID as free.  This is the one line from
-	 *	id_free() that we care about here.
+	 *	Mark the ID as free, and put it back at the front
+	 *	of the free list.
 	 */
 	ps->id[(request->id >> 3) & 0x1f] &= ~(1 << (request->id & 0x07));
+	ps->free_head--;
 
 	request->id = -1;
 	request->sockfd = -1;
@@ -834,14 +921,24 @@ bool fr_packet_list_id_free(fr_packet_list_t *pl,
 	ps = fr_socket_find(pl, request->sockfd);
 	if (!ps) return false;
 
-#if 0
-	if (!ps->id[(request->id >> 3) & 0x1f] & (1 << (request->id & 0x07))) {
-		fr_exit(1);
+	/*
+	 *	The ID isn't allocated.  Don't add it to the free
+	 *	list twice.
+	 */
+	if ((request->id < 0) || (request->id > 255) ||
+	    !(ps->id[(request->id >> 3) & 0x1f] & (1 << (request->id & 0x07)))) {
+		fr_strerror_printf("ID %d is not allocated", request->id);
+		return false;
 	}
-#endif
 
 	ps->id[(request->id >> 3) & 0x1f] &= ~(1 << (request->id & 0x07));
 
+	/*
+	 *	Add it to the end of the free list, so that it's
+	 *	re-used as late as possible.
+	 */
+	ps->free_ids[(uint8_t) (ps->free_head + (256 - ps->num_outgoing))] = request->id;
+
 	ps->num_outgoing--;
 	pl->num_outgoing--;
 
@@ -34,6 +34,7 @@ RCSID("$Id$")
  * @param vp to free.
  * @return 0
  */
+#if !defined(NDEBUG) || defined(TALLOC_DEBUG)
 static int _fr_pair_free(NDEBUG_UNUSED VALUE_PAIR *vp)
 {
 #ifndef NDEBUG
@@ -45,6 +46,7 @@ static int _fr_pair_free(NDEBUG_UNUSED VALUE_PAIR *vp)
 #endif
 	return 0;
 }
+#endif
 
 
 static VALUE_PAIR *fr_pair_alloc(TALLOC_CTX *ctx)
@@ -61,7 +63,14 @@ static VALUE_PAIR *fr_pair_alloc(TALLOC_CTX *ctx)
 	vp->tag = TAG_ANY;
 	vp->type = VT_NONE;
 
+	/*
+	 *	The destructor only does anything in debug builds.
+	 *	Don't make talloc call an empty function for every
+	 *	pair of every packet otherwise.
+	 */
+#if !defined(NDEBUG) || defined(TALLOC_DEBUG)
 	talloc_set_destructor(vp, _fr_pair_free);
+#endif
 
 	return vp;
 }
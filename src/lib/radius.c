@@ -49,6 +49,19 @@ typedef struct radius_packet_t {
  *	Some messages get printed out only in debugging mode.
  */
 #define FR_DEBUG_STRERROR_PRINTF if (fr_debug_lvl) fr_strerror_printf
+
+/*
+ *	How many packets fr_radius_sign_multi() and fr_radius_verify_multi()
+ *	hash together.
+ */
+#define RADIUS_MULTI_BATCH	64
+
+/*
+ *	Most attributes which the talloc pool of a received packet
+ *	is sized for.  Any more are allocated outside of the pool.
+ */
+#define RADIUS_POOL_MAX_ATTRS	64
+
 FR_NAME_NUMBER const fr_request_types[] = {
 	{ "auth",	PW_CODE_ACCESS_REQUEST },
 	{ "challenge",	PW_CODE_ACCESS_CHALLENGE },
@@ -352,37 +365,167 @@ invalid:
 	return packet_len;
 }
 
+/** Allocate a RADIUS_PACKET for a received packet, with a talloc pool for its attributes
+ *
+ * The pool is sized from the packet, and holds the packet data, and the
+ * VALUE_PAIRs (and their values) created when the packet is decoded.
+ * That means decoding an average packet doesn't touch the system allocator,
+ * and the pairs for one packet are close together in memory.
+ *
+ * The attributes are counted with a quick walk over their headers, and the
+ * count is capped at #RADIUS_POOL_MAX_ATTRS so that packets full of tiny
+ * attributes don't get huge pools.  Anything which doesn't fit in the pool
+ * is allocated normally by talloc.
+ *
+ * @param[in] ctx	to allocate the packet in.
+ * @param[in] data	the packet, which hasn't been validated yet.
+ * @param[in] data_len	length of the packet.
+ * @return the new packet, or NULL on error.
+ */
+static RADIUS_PACKET *radius_alloc_received(TALLOC_CTX *ctx,
+					     UNUSED uint8_t const *data, UNUSED size_t data_len)
+{
+	RADIUS_PACKET	*packet;
+#ifdef HAVE_TALLOC_POOLED_OBJECT
+	uint8_t const	*p, *end;
+	size_t		num_attributes = 0;
+
+	/*
+	 *	The lengths haven't been checked yet, so stop at
+	 *	anything which doesn't look like an attribute.
+	 */
+	p = data + RADIUS_HDR_LEN;
+	end = data + data_len;
+	while (((p + 2) <= end) && (p[1] >= 2) && (num_attributes < RADIUS_POOL_MAX_ATTRS)) {
+		num_attributes++;
+		p += p[1];
+	}
+
+	/*
+	 *	One chunk for the packet data, and for each attribute,
+	 *	one for the VALUE_PAIR and one for its value.  The value
+	 *	buffers can't be larger than the packet.
+	 */
+	packet = talloc_pooled_object(ctx, RADIUS_PACKET, 1 + (num_attributes * 2),
+				      data_len + (num_attributes * sizeof(VALUE_PAIR)) + data_len);
+	if (!packet) return NULL;
+	memset(packet, 0, sizeof(*packet));
+#else
+	packet = talloc_zero(ctx, RADIUS_PACKET);
+	if (!packet) return NULL;
+#endif
+	packet->id = -1;
+	packet->offset = -1;
+
+	return packet;
+}
+
 /** Wrapper for recvfrom, which handles recvfromto, IPv6, and all possible combinations
  *
+ * The packet is read with one system call, into a buffer large enough for
+ * any valid packet.  We don't peek at the header first to find out how
+ * large it is.
+ *
+ * Callers are driven by the socket being readable, one packet per event, so
+ * packets are not read in batches here.  Reading ahead would leave packets
+ * which the event loop doesn't know about.  The network threads in
+ * src/util/ use udp_recv_mmsg() instead.
+ *
+ * @param[in] ctx		to allocate the packet in.
+ * @param[out] packet_p		the packet which was read, or NULL if nothing was read.
+ * @param[in] sockfd		to read from.
+ * @param[in] flags		to pass to udp_recv.
+ * @return
+ *	- The number of bytes read.
+ *	- 0 if no packet was available.
+ *	- -1 on error.
  */
-static ssize_t rad_recvfrom(int sockfd, RADIUS_PACKET *packet, int flags)
+static ssize_t rad_recvfrom(TALLOC_CTX *ctx, RADIUS_PACKET **packet_p, int sockfd, int flags)
 {
-	ssize_t			data_len;
+	RADIUS_PACKET		*packet;
+	uint8_t			buffer[MAX_PACKET_LEN];
+	fr_ipaddr_t		src_ipaddr, dst_ipaddr;
+	uint16_t		src_port, dst_port;
+	int			if_index = 0;
+	struct timeval		when;
+	ssize_t			data_len, packet_len;
+
+	*packet_p = NULL;
+
+	/*
+	 *	Connected sockets don't fill in the addresses.
+	 */
+	memset(&src_ipaddr, 0, sizeof(src_ipaddr));
+	memset(&dst_ipaddr, 0, sizeof(dst_ipaddr));
+	memset(&when, 0, sizeof(when));
+	src_port = dst_port = 0;
 
-	data_len = fr_radius_recv_header(sockfd, &packet->src_ipaddr, &packet->src_port, &packet->code);
+	data_len = udp_recv(sockfd, buffer, sizeof(buffer), flags,
+			    &src_ipaddr, &src_port, &dst_ipaddr, &dst_port, &if_index, &when);
 	if (data_len < 0) {
 		if ((errno == EAGAIN) || (errno == EINTR)) return 0;
 		return -1;
 	}
 
-	if (data_len == 0) return -1; /* invalid packet */
+	/*
+	 *	Too little data is available, discard the packet.
+	 */
+	if (data_len < 4) {
+		FR_DEBUG_STRERROR_PRINTF("Expected at least 4 bytes of header data, got %zu bytes", data_len);
+		return -1;
+	}
+
+	/*
+	 *	See how long the packet says it is.  Anything after
+	 *	that is padding, and is ignored.
+	 */
+	packet_len = (buffer[2] * 256) + buffer[3];
+	if (packet_len < RADIUS_HDR_LEN) {
+		FR_DEBUG_STRERROR_PRINTF("Expected at least " STRINGIFY(RADIUS_HDR_LEN)  " bytes of packet "
+					 "data, got %zu bytes", packet_len);
+		return -1;
+	}
 
-	packet->data = talloc_array(packet, uint8_t, data_len);
+	if (packet_len > MAX_PACKET_LEN) {
+		FR_DEBUG_STRERROR_PRINTF("Length field value too large, expected maximum of "
+					 STRINGIFY(MAX_PACKET_LEN) " bytes, got %zu bytes", packet_len);
+		return -1;
+	}
+
+	/*
+	 *	The packet says it's this long, but the actual UDP
+	 *	size could still be smaller.  fr_radius_ok() checks
+	 *	that.
+	 */
+	if (data_len > packet_len) data_len = packet_len;
+
+	packet = radius_alloc_received(ctx, buffer, data_len);
+	if (!packet) return -1;
+	*packet_p = packet;
+
+	packet->src_ipaddr = src_ipaddr;
+	packet->src_port = src_port;
+	packet->dst_ipaddr = dst_ipaddr;
+	packet->dst_port = dst_port;
+	packet->if_index = if_index;
+	packet->timestamp = when;
+	packet->code = buffer[0];
+
+	packet->data = talloc_memdup(packet, buffer, data_len);
 	if (!packet->data) return -1;
 
 	packet->data_len = data_len;
 
-	return udp_recv(sockfd, packet->data, packet->data_len, flags,
-			&packet->src_ipaddr, &packet->src_port,
-			&packet->dst_ipaddr, &packet->dst_port,
-			&packet->if_index, &packet->timestamp);
+	return data_len;
 }
 
-/** Sign a previously encoded packet
+/** Set up the authentication vectors of a packet prior to signing it
  *
+ * packet->vector is set to zero, or to the vector of the original request,
+ * and if there's a Message-Authenticator, the header vector is set up so
+ * that the HMAC can be calculated over packet->data.
  */
-int fr_radius_sign(RADIUS_PACKET *packet, RADIUS_PACKET const *original,
-		   char const *secret)
+static int radius_sign_prepare(RADIUS_PACKET *packet, RADIUS_PACKET const *original)
 {
 	radius_packet_t	*hdr = (radius_packet_t *)packet->data;
 
@@ -432,12 +575,10 @@ int fr_radius_sign(RADIUS_PACKET *packet, RADIUS_PACKET const *original,
 	}
 
 	/*
-	 *	If there's a Message-Authenticator, update it
-	 *	now.
+	 *	If there's a Message-Authenticator, set up the
+	 *	header vector the HMAC is calculated over.
 	 */
 	if (packet->offset > 0) {
-		uint8_t calc_auth_vector[AUTH_VECTOR_LEN];
-
 		switch (packet->code) {
 		case PW_CODE_ACCOUNTING_RESPONSE:
 			if (original && original->code == PW_CODE_STATUS_SERVER) {
@@ -465,6 +606,43 @@ int fr_radius_sign(RADIUS_PACKET *packet, RADIUS_PACKET const *original,
 		case PW_CODE_STATUS_SERVER:
 			break;
 		}
+	}
+
+	return 0;
+}
+
+/** Whether the Request/Response Authenticator of a packet is an MD5 signature
+ *
+ */
+static inline bool radius_sign_digest(RADIUS_PACKET const *packet)
+{
+	/*
+	 *	Request packets are not signed, but
+	 *	have a random authentication vector.
+	 *
+	 *	Everything else is signed with the
+	 *	authentication vector of the request,
+	 *	or with zero.
+	 */
+	return (packet->code != PW_CODE_ACCESS_REQUEST) && (packet->code != PW_CODE_STATUS_SERVER);
+}
+
+/** Sign a previously encoded packet
+ *
+ */
+int fr_radius_sign(RADIUS_PACKET *packet, RADIUS_PACKET const *original,
+		   char const *secret)
+{
+	radius_packet_t	*hdr = (radius_packet_t *)packet->data;
+
+	if (radius_sign_prepare(packet, original) < 0) return -1;
+
+	/*
+	 *	If there's a Message-Authenticator, update it
+	 *	now.
+	 */
+	if (packet->offset > 0) {
+		uint8_t calc_auth_vector[AUTH_VECTOR_LEN];
 
 		/*
 		 *	Calculate the HMAC, and put it
@@ -482,41 +660,124 @@ int fr_radius_sign(RADIUS_PACKET *packet, RADIUS_PACKET const *original,
 	 */
 	memcpy(hdr->vector, packet->vector, AUTH_VECTOR_LEN);
 
-	/*
-	 *	Switch over the packet code, deciding how to
-	 *	sign the packet.
-	 */
-	switch (packet->code) {
+	if (radius_sign_digest(packet)) {
+		uint8_t digest[16];
+
+		FR_MD5_CTX	context;
+		fr_md5_init(&context);
+		fr_md5_update(&context, packet->data, packet->data_len);
+		fr_md5_update(&context, (uint8_t const *) secret,
+			     talloc_array_length(secret) - 1);
+		fr_md5_final(digest, &context);
+
+		memcpy(hdr->vector, digest, AUTH_VECTOR_LEN);
+		memcpy(packet->vector, digest, AUTH_VECTOR_LEN);
+	}
+
+	return 0;
+}
+
+/** Sign multiple previously encoded packets
+ *
+ * Produces the same result as calling fr_radius_sign() on each packet, but
+ * calculates the Message-Authenticator HMACs and the Response Authenticators
+ * of up to #RADIUS_MULTI_BATCH packets at a time with the multi-buffer MD5
+ * functions.
+ *
+ * @param[in,out] packets	to sign.
+ * @param[in] originals		the request each packet is a reply to.  The array,
+ *				or any of its entries, may be NULL.
+ * @param[in] secrets		shared secret to sign each packet with.
+ * @param[out] rcode		result of signing each packet, 0 on success, -1 on
+ *				error.  May be NULL.
+ * @param[in] num		number of packets.
+ * @return
+ *	- 0 if all packets were signed.
+ *	- -1 if one or more packets could not be signed.
+ */
+int fr_radius_sign_multi(RADIUS_PACKET * const *packets, RADIUS_PACKET const * const *originals,
+			 char const * const *secrets, int *rcode, unsigned int num)
+{
+	unsigned int	i, j, base, todo, jobs;
+	int		ret = 0;
+
+	uint8_t const	*in[RADIUS_MULTI_BATCH];
+	size_t		inlen[RADIUS_MULTI_BATCH];
+	uint8_t const	*key[RADIUS_MULTI_BATCH];
+	size_t		key_len[RADIUS_MULTI_BATCH];
+	unsigned int	job[RADIUS_MULTI_BATCH];
+	uint8_t		digest[RADIUS_MULTI_BATCH][MD5_DIGEST_LENGTH];
+	bool		ok[RADIUS_MULTI_BATCH];
+
+	for (base = 0; base < num; base += todo) {
+		todo = num - base;
+		if (todo > RADIUS_MULTI_BATCH) todo = RADIUS_MULTI_BATCH;
+
 		/*
-		 *	Request packets are not signed, but
-		 *	have a random authentication vector.
+		 *	Set up the vectors, and gather the packets
+		 *	which need a Message-Authenticator.
 		 */
-	case PW_CODE_ACCESS_REQUEST:
-	case PW_CODE_STATUS_SERVER:
-		break;
+		for (i = 0, jobs = 0; i < todo; i++) {
+			RADIUS_PACKET *packet = packets[base + i];
+
+			ok[i] = (radius_sign_prepare(packet, originals ? originals[base + i] : NULL) == 0);
+			if (!ok[i]) {
+				if (rcode) rcode[base + i] = -1;
+				ret = -1;
+				continue;
+			}
+			if (rcode) rcode[base + i] = 0;
+			if (packet->offset <= 0) continue;
+
+			in[jobs] = packet->data;
+			inlen[jobs] = packet->data_len;
+			key[jobs] = (uint8_t const *) secrets[base + i];
+			key_len[jobs] = talloc_array_length(secrets[base + i]) - 1;
+			job[jobs++] = i;
+		}
+
+		if (jobs) {
+			fr_hmac_md5_multi(digest, in, inlen, key, key_len, jobs);
+
+			for (j = 0; j < jobs; j++) {
+				RADIUS_PACKET *packet = packets[base + job[j]];
+
+				memcpy(packet->data + packet->offset + 2, digest[j], AUTH_VECTOR_LEN);
+			}
+		}
 
 		/*
-		 *	Reply packets are signed with the
-		 *	authentication vector of the request.
+		 *	Copy the request authenticator over to the
+		 *	packets, and gather the ones which need signing.
 		 */
-	default:
-		{
-			uint8_t digest[16];
-
-			FR_MD5_CTX	context;
-			fr_md5_init(&context);
-			fr_md5_update(&context, packet->data, packet->data_len);
-			fr_md5_update(&context, (uint8_t const *) secret,
-				     talloc_array_length(secret) - 1);
-			fr_md5_final(digest, &context);
-
-			memcpy(hdr->vector, digest, AUTH_VECTOR_LEN);
-			memcpy(packet->vector, digest, AUTH_VECTOR_LEN);
-			break;
+		for (i = 0, jobs = 0; i < todo; i++) {
+			RADIUS_PACKET	*packet = packets[base + i];
+
+			if (!ok[i]) continue;
+
+			memcpy(packet->data + 4, packet->vector, AUTH_VECTOR_LEN);
+			if (!radius_sign_digest(packet)) continue;
+
+			in[jobs] = packet->data;
+			inlen[jobs] = packet->data_len;
+			key[jobs] = (uint8_t const *) secrets[base + i];
+			key_len[jobs] = talloc_array_length(secrets[base + i]) - 1;
+			job[jobs++] = i;
 		}
-	}/* switch over packet codes */
 
-	return 0;
+		if (!jobs) continue;
+
+		fr_md5_calc_multi(digest, in, inlen, key, key_len, jobs);
+
+		for (j = 0; j < jobs; j++) {
+			RADIUS_PACKET *packet = packets[base + job[j]];
+
+			memcpy(packet->data + 4, digest[j], AUTH_VECTOR_LEN);
+			memcpy(packet->vector, digest[j], AUTH_VECTOR_LEN);
+		}
+	}
+
+	return ret;
 }
 
 /** Reply to the request
@@ -1067,21 +1328,21 @@ RADIUS_PACKET *fr_radius_recv(TALLOC_CTX *ctx, int fd, int flags, bool require_m
 	RADIUS_PACKET		*packet;
 
 	/*
-	 *	Allocate the new request data structure
+	 *	Allocate the new request data structure, and read
+	 *	the packet into it.
 	 */
-	packet = fr_radius_alloc(ctx, false);
-	if (!packet) {
-		fr_strerror_printf("out of memory");
-		return NULL;
-	}
-
-	data_len = rad_recvfrom(fd, packet, flags);
+	data_len = rad_recvfrom(ctx, &packet, fd, flags);
 	if (data_len < 0) {
 		FR_DEBUG_STRERROR_PRINTF("Error receiving packet: %s", fr_syserror(errno));
 		fr_radius_free(&packet);
 		return NULL;
 	}
 
+	if (!packet) {
+		FR_DEBUG_STRERROR_PRINTF("Empty packet: Socket is not ready");
+		return NULL;
+	}
+
 #ifdef WITH_VERIFY_PTR
 	/*
 	 *	Double-check that the fields we want are filled in.
@@ -1152,6 +1413,47 @@ RADIUS_PACKET *fr_radius_recv(TALLOC_CTX *ctx, int fd, int flags, bool require_m
 	return packet;
 }
 
+/** Set up the header vector of a received packet prior to checking its Message-Authenticator
+ *
+ */
+static int radius_verify_ma_prepare(RADIUS_PACKET *packet, RADIUS_PACKET const *original)
+{
+	switch (packet->code) {
+	default:
+		break;
+
+	case PW_CODE_ACCOUNTING_RESPONSE:
+		if (original &&
+		    (original->code == PW_CODE_STATUS_SERVER)) {
+			goto do_ack;
+		}
+
+	case PW_CODE_ACCOUNTING_REQUEST:
+	case PW_CODE_DISCONNECT_REQUEST:
+	case PW_CODE_COA_REQUEST:
+		memset(packet->data + 4, 0, AUTH_VECTOR_LEN);
+		break;
+
+	do_ack:
+	case PW_CODE_ACCESS_ACCEPT:
+	case PW_CODE_ACCESS_REJECT:
+	case PW_CODE_ACCESS_CHALLENGE:
+	case PW_CODE_DISCONNECT_ACK:
+	case PW_CODE_DISCONNECT_NAK:
+	case PW_CODE_COA_ACK:
+	case PW_CODE_COA_NAK:
+		if (!original) {
+			fr_strerror_printf("Cannot validate Message-Authenticator in response "
+					   "packet without a request packet");
+			return -1;
+		}
+		memcpy(packet->data + 4, original->vector, AUTH_VECTOR_LEN);
+		break;
+	}
+
+	return 0;
+}
+
 /** Verify the Request/Response Authenticator (and Message-Authenticator if present) of a packet
  *
  */
@@ -1189,38 +1491,7 @@ int fr_radius_verify(RADIUS_PACKET *packet, RADIUS_PACKET *original, char const
 			memcpy(msg_auth_vector, &ptr[2], sizeof(msg_auth_vector));
 			memset(&ptr[2], 0, AUTH_VECTOR_LEN);
 
-			switch (packet->code) {
-			default:
-				break;
-
-			case PW_CODE_ACCOUNTING_RESPONSE:
-				if (original &&
-				    (original->code == PW_CODE_STATUS_SERVER)) {
-					goto do_ack;
-				}
-
-			case PW_CODE_ACCOUNTING_REQUEST:
-			case PW_CODE_DISCONNECT_REQUEST:
-			case PW_CODE_COA_REQUEST:
-				memset(packet->data + 4, 0, AUTH_VECTOR_LEN);
-				break;
-
-		do_ack:
-			case PW_CODE_ACCESS_ACCEPT:
-			case PW_CODE_ACCESS_REJECT:
-			case PW_CODE_ACCESS_CHALLENGE:
-			case PW_CODE_DISCONNECT_ACK:
-			case PW_CODE_DISCONNECT_NAK:
-			case PW_CODE_COA_ACK:
-			case PW_CODE_COA_NAK:
-				if (!original) {
-					fr_strerror_printf("Cannot validate Message-Authenticator in response "
-							   "packet without a request packet");
-					return -1;
-				}
-				memcpy(packet->data + 4, original->vector, AUTH_VECTOR_LEN);
-				break;
-			}
+			if (radius_verify_ma_prepare(packet, original) < 0) return -1;
 
 			fr_hmac_md5(calc_auth_vector, packet->data, packet->data_len,
 				    (uint8_t const *) secret, talloc_array_length(secret) - 1);
@@ -1326,6 +1597,197 @@ int fr_radius_verify(RADIUS_PACKET *packet, RADIUS_PACKET *original, char const
 	return 0;
 }
 
+/** Verify the authenticators of multiple packets
+ *
+ * Produces the same result as calling fr_radius_verify() on each packet, but
+ * calculates the Message-Authenticator HMACs and the Request/Response
+ * Authenticators of up to #RADIUS_MULTI_BATCH packets at a time with the
+ * multi-buffer MD5 functions.
+ *
+ * Packets which fail verification, or which can't be checked in bulk, are
+ * passed to fr_radius_verify(), so the error messages (and the error buffer
+ * left behind) are exactly those of the single packet path.
+ *
+ * @param[in] packets		to verify.
+ * @param[in] originals		the request each packet is a reply to.  The array,
+ *				or any of its entries, may be NULL.
+ * @param[in] secrets		shared secret each packet was signed with.
+ * @param[out] rcode		result of verifying each packet, as returned by
+ *				fr_radius_verify().  May be NULL.
+ * @param[in] num		number of packets.
+ * @return
+ *	- 0 if all packets were valid.
+ *	- -1 if one or more packets failed verification.
+ */
+int fr_radius_verify_multi(RADIUS_PACKET * const *packets, RADIUS_PACKET * const *originals,
+			   char const * const *secrets, int *rcode, unsigned int num)
+{
+	unsigned int	i, j, base, todo, jobs;
+	int		ret = 0;
+
+	uint8_t const	*in[RADIUS_MULTI_BATCH];
+	size_t		inlen[RADIUS_MULTI_BATCH];
+	uint8_t const	*key[RADIUS_MULTI_BATCH];
+	size_t		key_len[RADIUS_MULTI_BATCH];
+	unsigned int	job[RADIUS_MULTI_BATCH];
+	uint8_t		*msg_auth[RADIUS_MULTI_BATCH];
+	uint8_t		msg_auth_vector[RADIUS_MULTI_BATCH][AUTH_VECTOR_LEN];
+	uint8_t		digest[RADIUS_MULTI_BATCH][MD5_DIGEST_LENGTH];
+	bool		slow[RADIUS_MULTI_BATCH];
+	bool		reply[RADIUS_MULTI_BATCH];
+
+	for (base = 0; base < num; base += todo) {
+		todo = num - base;
+		if (todo > RADIUS_MULTI_BATCH) todo = RADIUS_MULTI_BATCH;
+
+		/*
+		 *	Find the Message-Authenticators, and set up
+		 *	the packets for calculating the HMACs.
+		 *
+		 *	Anything unusual goes down the slow path.
+		 */
+		for (i = 0, jobs = 0; i < todo; i++) {
+			RADIUS_PACKET	*packet = packets[base + i];
+			RADIUS_PACKET	*original = originals ? originals[base + i] : NULL;
+			uint8_t		*ptr, *ma = NULL;
+			int		length;
+
+			slow[i] = true;
+			if (!packet || !packet->data) continue;
+			if ((packet->code == 0) || (packet->code >= FR_MAX_PACKET_CODE)) continue;
+
+			ptr = packet->data + RADIUS_HDR_LEN;
+			length = packet->data_len - RADIUS_HDR_LEN;
+			while (length > 0) {
+				if (ptr[1] < 2) break;
+				if (ptr[0] == PW_MESSAGE_AUTHENTICATOR) {
+					if (ma) break;
+					ma = ptr;
+				}
+				length -= ptr[1];
+				ptr += ptr[1];
+			}
+			if (length > 0) continue;	/* malformed, or more than one Message-Authenticator */
+
+			slow[i] = false;
+			if (!ma) continue;
+
+			memcpy(msg_auth_vector[jobs], &ma[2], AUTH_VECTOR_LEN);
+			memset(&ma[2], 0, AUTH_VECTOR_LEN);
+			if (radius_verify_ma_prepare(packet, original) < 0) {
+				memcpy(&ma[2], msg_auth_vector[jobs], AUTH_VECTOR_LEN);
+				slow[i] = true;
+				continue;
+			}
+
+			msg_auth[jobs] = ma;
+			in[jobs] = packet->data;
+			inlen[jobs] = packet->data_len;
+			key[jobs] = (uint8_t const *) secrets[base + i];
+			key_len[jobs] = talloc_array_length(secrets[base + i]) - 1;
+			job[jobs++] = i;
+		}
+
+		if (jobs) {
+			fr_hmac_md5_multi(digest, in, inlen, key, key_len, jobs);
+
+			/*
+			 *	Reinitialize Authenticators.
+			 */
+			for (j = 0; j < jobs; j++) {
+				RADIUS_PACKET *packet = packets[base + job[j]];
+
+				if (fr_radius_digest_cmp(digest[j], msg_auth_vector[j], AUTH_VECTOR_LEN) != 0) {
+					slow[job[j]] = true;
+				}
+				memcpy(&msg_auth[j][2], msg_auth_vector[j], AUTH_VECTOR_LEN);
+				memcpy(packet->data + 4, packet->vector, AUTH_VECTOR_LEN);
+			}
+		}
+
+		/*
+		 *	Gather the packets with a Request or Response
+		 *	Authenticator to check.
+		 */
+		for (i = 0, jobs = 0; i < todo; i++) {
+			RADIUS_PACKET	*packet = packets[base + i];
+			RADIUS_PACKET	*original = originals ? originals[base + i] : NULL;
+
+			if (slow[i]) continue;
+
+			switch (packet->code) {
+			case PW_CODE_COA_REQUEST:
+			case PW_CODE_DISCONNECT_REQUEST:
+			case PW_CODE_ACCOUNTING_REQUEST:
+				memset(packet->data + 4, 0, AUTH_VECTOR_LEN);
+				reply[jobs] = false;
+				break;
+
+			case PW_CODE_ACCESS_ACCEPT:
+			case PW_CODE_ACCESS_REJECT:
+			case PW_CODE_ACCESS_CHALLENGE:
+			case PW_CODE_ACCOUNTING_RESPONSE:
+			case PW_CODE_DISCONNECT_ACK:
+			case PW_CODE_DISCONNECT_NAK:
+			case PW_CODE_COA_ACK:
+			case PW_CODE_COA_NAK:
+				if (!original) {
+					slow[i] = true;
+					continue;
+				}
+				memcpy(packet->data + 4, original->vector, AUTH_VECTOR_LEN);
+				reply[jobs] = true;
+				break;
+
+			case PW_CODE_ACCESS_REQUEST:
+			case PW_CODE_STATUS_SERVER:
+				continue;
+
+			default:
+				slow[i] = true;
+				continue;
+			}
+
+			in[jobs] = packet->data;
+			inlen[jobs] = packet->data_len;
+			key[jobs] = (uint8_t const *) secrets[base + i];
+			key_len[jobs] = talloc_array_length(secrets[base + i]) - 1;
+			job[jobs++] = i;
+		}
+
+		if (jobs) {
+			fr_md5_calc_multi(digest, in, inlen, key, key_len, jobs);
+
+			for (j = 0; j < jobs; j++) {
+				RADIUS_PACKET *packet = packets[base + job[j]];
+
+				/*
+				 *	Request packets are left with a zero
+				 *	vector, just as fr_radius_verify() does.
+				 */
+				if (reply[j]) memcpy(packet->data + 4, packet->vector, AUTH_VECTOR_LEN);
+
+				if (fr_radius_digest_cmp(digest[j], packet->vector, AUTH_VECTOR_LEN) != 0) {
+					slow[job[j]] = true;
+				}
+			}
+		}
+
+		for (i = 0; i < todo; i++) {
+			int r = 0;
+
+			if (slow[i]) {
+				r = fr_radius_verify(packets[base + i], originals ? originals[base + i] : NULL,
+						     secrets[base + i]);
+				if (r < 0) ret = -1;
+			}
+			if (rcode) rcode[base + i] = r;
+		}
+	}
+
+	return ret;
+}
+
 /** Encode a packet
  *
  */
@@ -1500,6 +1962,10 @@ int fr_radius_encode(RADIUS_PACKET *packet, RADIUS_PACKET const *original,
 }
 
 /** Calculate/check digest, and decode radius attributes
+ *
+ * The attributes are allocated in the context of the packet.  For packets
+ * read with fr_radius_recv(), that is a talloc pool sized from the packet
+ * length, so decoding doesn't need a separate allocation for each pair.
  *
  * @return
  *	- 0 on success
@@ -75,8 +75,7 @@ ssize_t fr_radius_decode_tunnel_password(uint8_t *passwd, size_t *pwlen, char co
 	 */
 	secretlen = talloc_array_length(secret) - 1;
 
-	fr_md5_init(&context);
-	fr_md5_update(&context, (uint8_t const *) secret, secretlen);
+	fr_md5_init_secret(&context, (uint8_t const *) secret, secretlen);
 	fr_md5_copy(&old, &context); /* save intermediate work */
 
 	/*
@@ -179,8 +178,7 @@ ssize_t fr_radius_decode_password(char *passwd, size_t pwlen, char const *secret
 	 */
 	secretlen = talloc_array_length(secret) - 1;
 
-	fr_md5_init(&context);
-	fr_md5_update(&context, (uint8_t const *) secret, secretlen);
+	fr_md5_init_secret(&context, (uint8_t const *) secret, secretlen);
 	fr_md5_copy(&old, &context);	/* save intermediate work */
 
 	/*
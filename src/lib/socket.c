@@ -602,6 +602,35 @@ int fr_socket_server_base(int proto, fr_ipaddr_t *ipaddr, int *port, char const
 	return sockfd;
 }
 
+/** Allow multiple sockets to bind to the same IP address and port
+ *
+ *  Each network thread can then have it's own socket, and the kernel
+ *  distributes incoming packets across all of them.  This MUST be
+ *  called after fr_socket_server_base(), and before
+ *  fr_socket_server_bind().
+ *
+ * @param[in] sockfd the socket which was opened via fr_socket_server_base()
+ * @return
+ *	- 0 on success
+ *	- -1 on failure.
+ */
+int fr_socket_server_reuse_port(int sockfd)
+{
+#ifdef SO_REUSEPORT
+	int on = 1;
+
+	if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) {
+		fr_strerror_printf("Failed to reuse port: %s", fr_syserror(errno));
+		return -1;
+	}
+
+	return 0;
+#else
+	fr_strerror_printf("SO_REUSEPORT is not supported on this system");
+	return -1;
+#endif
+}
+
 /** Bind to an IPv4 / IPv6, and UDP / TCP socket, server side.
  *
  * @param[in] sockfd the socket which was opened via fr_socket_server_base()
@@ -239,3 +239,249 @@ ssize_t udp_recv(int sockfd, void *data, size_t data_len, int flags,
 
 	return received;
 }
+
+
+/** Read multiple UDP packets with a single system call
+ *
+ * Uses recvmmsg() where available, otherwise falls back to reading a
+ * single packet with udp_recv().
+ *
+ * Packets with an unknown source address family, or which were larger
+ * than the buffer they were read into, are returned with a data_len of 0,
+ * and should be ignored by the caller.
+ *
+ * @param[in] sockfd we're reading from.
+ * @param[in,out] packets to read into.  On input, data and data_len of each
+ *	entry describe the buffer to write the packet to.  On output, data_len
+ *	is the length of the packet, and the remaining fields are populated.
+ * @param[in] num number of entries in packets.  At most #UDP_MMSG_MAX packets
+ *	will be read.
+ * @param[in] flags for things.  UDP_FLAGS_PEEK is ignored.
+ * @return
+ *	- > 0 the number of packets read.
+ *	- 0 if no packets were available.
+ *	- < 0 on failure.
+ */
+int udp_recv_mmsg(int sockfd, udp_mmsg_t *packets, int num, int flags)
+{
+#ifdef HAVE_RECVMMSG
+	struct mmsghdr		msgvec[UDP_MMSG_MAX];
+	struct iovec		iov[UDP_MMSG_MAX];
+	struct sockaddr_storage	src[UDP_MMSG_MAX];
+#ifdef WITH_UDPFROMTO
+	char			cbuf[UDP_MMSG_MAX][256];
+#endif
+	struct sockaddr_storage	dst;
+	socklen_t		sizeof_dst = sizeof(dst);
+	struct timeval		now;
+	int			i, received;
+	bool			connected = ((flags & UDP_FLAGS_CONNECTED) != 0);
+
+	if (num <= 0) return 0;
+	if (num > UDP_MMSG_MAX) num = UDP_MMSG_MAX;
+
+	/*
+	 *	IP_PKTINFO and friends don't give us the destination
+	 *	port, so start from the address the socket is bound to.
+	 */
+	if (!connected && (getsockname(sockfd, (struct sockaddr *)&dst, &sizeof_dst) < 0)) {
+		fr_strerror_printf("udp_recv_mmsg failed getting socket name: %s", fr_syserror(errno));
+		return -1;
+	}
+
+	memset(msgvec, 0, sizeof(msgvec[0]) * num);
+	for (i = 0; i < num; i++) {
+		iov[i].iov_base = packets[i].data;
+		iov[i].iov_len = packets[i].data_len;
+
+		msgvec[i].msg_hdr.msg_iov = &iov[i];
+		msgvec[i].msg_hdr.msg_iovlen = 1;
+
+		if (connected) continue;
+
+		msgvec[i].msg_hdr.msg_name = &src[i];
+		msgvec[i].msg_hdr.msg_namelen = sizeof(src[i]);
+#ifdef WITH_UDPFROMTO
+		msgvec[i].msg_hdr.msg_control = cbuf[i];
+		msgvec[i].msg_hdr.msg_controllen = sizeof(cbuf[i]);
+#endif
+	}
+
+	/*
+	 *	Return as soon as we have one packet, rather than
+	 *	blocking until the whole batch is full.
+	 */
+#ifdef MSG_WAITFORONE
+	received = recvmmsg(sockfd, msgvec, num, MSG_WAITFORONE, NULL);
+#else
+	received = recvmmsg(sockfd, msgvec, num, 0, NULL);
+#endif
+	if (received < 0) {
+		if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)) return 0;
+
+		fr_strerror_printf("udp_recv_mmsg failed: %s", fr_syserror(errno));
+		return -1;
+	}
+
+	gettimeofday(&now, NULL);
+
+	for (i = 0; i < received; i++) {
+		udp_mmsg_t		*packet = &packets[i];
+		struct sockaddr_storage	to;
+		socklen_t		sizeof_to = sizeof_dst;
+
+		packet->data_len = msgvec[i].msg_len;
+		packet->if_index = 0;
+		packet->when = now;
+
+		/*
+		 *	The packet was larger than the buffer.  We
+		 *	only have part of it, so discard it.
+		 */
+		if ((msgvec[i].msg_hdr.msg_flags & MSG_TRUNC) != 0) {
+			FR_DEBUG_STRERROR_PRINTF("Packet truncated to %zu bytes", packet->data_len);
+			packet->data_len = 0;
+			continue;
+		}
+
+		if (connected) continue;
+
+		to = dst;
+#ifdef WITH_UDPFROMTO
+		udpfromto_cmsg_read(&msgvec[i].msg_hdr, (struct sockaddr *)&to, &sizeof_to,
+				    &packet->if_index, &packet->when);
+#endif
+
+		/*
+		 *	Convert AF.  If unknown, discard packet.
+		 */
+		if (!fr_ipaddr_from_sockaddr(&src[i], msgvec[i].msg_hdr.msg_namelen,
+					     &packet->src_ipaddr, &packet->src_port)) {
+			FR_DEBUG_STRERROR_PRINTF("Unknown address family");
+			packet->data_len = 0;
+			continue;
+		}
+
+		fr_ipaddr_from_sockaddr(&to, sizeof_to, &packet->dst_ipaddr, &packet->dst_port);
+	}
+
+	return received;
+#else
+	ssize_t			received;
+
+	if (num <= 0) return 0;
+
+	received = udp_recv(sockfd, packets[0].data, packets[0].data_len, flags & ~UDP_FLAGS_PEEK,
+			    &packets[0].src_ipaddr, &packets[0].src_port,
+			    &packets[0].dst_ipaddr, &packets[0].dst_port, &packets[0].if_index,
+			    &packets[0].when);
+	if (received < 0) {
+		if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)) return 0;
+
+		return -1;
+	}
+
+	packets[0].data_len = received;
+
+	return 1;
+#endif
+}
+
+
+/** Send multiple UDP packets with a single system call
+ *
+ * Uses sendmmsg() where available, otherwise falls back to sending
+ * each packet with udp_send().
+ *
+ * @param[in] sockfd we're writing to.
+ * @param[in] packets to send.  data and data_len describe the packet.  The
+ *	source address, port and if_index are used to set the source of the
+ *	packet if we were built with udpfromto.
+ * @param[in] num number of entries in packets.  At most #UDP_MMSG_MAX packets
+ *	will be sent.
+ * @param[in] flags for things.
+ * @return
+ *	- >= 0 the number of packets sent.  May be less than num if the
+ *	  socket buffer is full.
+ *	- < 0 on failure.
+ */
+int udp_send_mmsg(int sockfd, udp_mmsg_t *packets, int num, int flags)
+{
+#ifdef HAVE_SENDMMSG
+	struct mmsghdr		msgvec[UDP_MMSG_MAX];
+	struct iovec		iov[UDP_MMSG_MAX];
+	struct sockaddr_storage	dst[UDP_MMSG_MAX];
+#ifdef WITH_UDPFROMTO
+	char			cbuf[UDP_MMSG_MAX][256];
+#endif
+	int			i, sent;
+	bool			connected = ((flags & UDP_FLAGS_CONNECTED) != 0);
+
+	if (num <= 0) return 0;
+	if (num > UDP_MMSG_MAX) num = UDP_MMSG_MAX;
+
+	memset(msgvec, 0, sizeof(msgvec[0]) * num);
+	for (i = 0; i < num; i++) {
+		socklen_t		sizeof_dst;
+
+		iov[i].iov_base = packets[i].data;
+		iov[i].iov_len = packets[i].data_len;
+
+		msgvec[i].msg_hdr.msg_iov = &iov[i];
+		msgvec[i].msg_hdr.msg_iovlen = 1;
+
+		if (connected) continue;
+
+		if (!fr_ipaddr_to_sockaddr(&packets[i].dst_ipaddr, packets[i].dst_port, &dst[i], &sizeof_dst)) {
+			return -1;
+		}
+		msgvec[i].msg_hdr.msg_name = &dst[i];
+		msgvec[i].msg_hdr.msg_namelen = sizeof_dst;
+
+#ifdef WITH_UDPFROMTO
+		/*
+		 *	And if they don't specify a source IP address, don't
+		 *	use udpfromto.
+		 */
+		if ((packets[i].src_ipaddr.af != AF_UNSPEC) && !fr_is_inaddr_any(&packets[i].src_ipaddr)) {
+			struct sockaddr_storage	src;
+			socklen_t		sizeof_src;
+
+			fr_ipaddr_to_sockaddr(&packets[i].src_ipaddr, packets[i].src_port, &src, &sizeof_src);
+
+			if (udpfromto_cmsg_write(sockfd, &msgvec[i].msg_hdr, cbuf[i], sizeof(cbuf[i]),
+						 (struct sockaddr *)&src, sizeof_src, packets[i].if_index) < 0) {
+				fr_strerror_printf("udp_send_mmsg failed: %s", fr_syserror(errno));
+				return -1;
+			}
+		}
+#endif
+	}
+
+	sent = sendmmsg(sockfd, msgvec, num, 0);
+	if (sent < 0) {
+		if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)) return 0;
+
+		fr_strerror_printf("udp_send_mmsg failed: %s", fr_syserror(errno));
+		return -1;
+	}
+
+	return sent;
+#else
+	int			i;
+
+	if (num <= 0) return 0;
+	if (num > UDP_MMSG_MAX) num = UDP_MMSG_MAX;
+
+	for (i = 0; i < num; i++) {
+		if (udp_send(sockfd, packets[i].data, packets[i].data_len, flags,
+			     &packets[i].src_ipaddr, packets[i].src_port, packets[i].if_index,
+			     &packets[i].dst_ipaddr, packets[i].dst_port) < 0) {
+			if (i == 0) return -1;
+			break;
+		}
+	}
+
+	return i;
+#endif
+}
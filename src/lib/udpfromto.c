@@ -90,6 +90,15 @@ RCSID("$Id$")
 #  endif
 #endif
 
+/*
+ *	fd is only needed for the FreeBSD workaround in udpfromto_cmsg_write()
+ */
+#ifdef __FreeBSD__
+#  define UDPFROMTO_UNUSED
+#else
+#  define UDPFROMTO_UNUSED UNUSED
+#endif
+
 int udpfromto_init(int s)
 {
 	int proto, flag = 0, opt = 1;
@@ -157,6 +166,86 @@ int udpfromto_init(int s)
 	return setsockopt(s, proto, flag, &opt, sizeof(opt));
 }
 
+/** Process the control messages returned by recvmsg() or recvmmsg()
+ *
+ * Updates the destination address with the more specific address given by
+ * IP_PKTINFO, IP_RECVDSTADDR or IPV6_PKTINFO, and retrieves the interface
+ * index and receive time.
+ *
+ * @param[in] msgh	as populated by recvmsg().
+ * @param[in,out] to	Destination address.  Must be initialised with the
+ *			address the socket is bound to.
+ * @param[in,out] to_len	Length of the structure pointed to by to.
+ * @param[out] if_index	The interface which received the datagram (may be NULL).
+ * @param[out] when	the packet was received (may be NULL).
+ */
+void udpfromto_cmsg_read(struct msghdr *msgh, struct sockaddr *to, socklen_t *to_len,
+			 int *if_index, struct timeval *when)
+{
+	struct cmsghdr		*cmsg;
+
+	if (if_index) *if_index = 0;
+	if (when) {
+		when->tv_sec = 0;
+		when->tv_usec = 0;
+	}
+
+	/* Process auxiliary received data in msgh */
+	for (cmsg = CMSG_FIRSTHDR(msgh);
+	     cmsg != NULL;
+	     cmsg = CMSG_NXTHDR(msgh, cmsg)) {
+
+#ifdef IP_PKTINFO
+		if ((cmsg->cmsg_level == SOL_IP) &&
+		    (cmsg->cmsg_type == IP_PKTINFO)) {
+			struct in_pktinfo *i = (struct in_pktinfo *) CMSG_DATA(cmsg);
+
+			((struct sockaddr_in *)to)->sin_addr = i->ipi_addr;
+			*to_len = sizeof(struct sockaddr_in);
+
+			if (if_index) *if_index = i->ipi_ifindex;
+
+			break;
+		}
+#endif
+
+#ifdef IP_RECVDSTADDR
+		if ((cmsg->cmsg_level == IPPROTO_IP) &&
+		    (cmsg->cmsg_type == IP_RECVDSTADDR)) {
+			struct in_addr *i = (struct in_addr *) CMSG_DATA(cmsg);
+
+			((struct sockaddr_in *)to)->sin_addr = *i;
+
+			*to_len = sizeof(struct sockaddr_in);
+
+			break;
+		}
+#endif
+
+#ifdef IPV6_PKTINFO
+		if ((cmsg->cmsg_level == IPPROTO_IPV6) &&
+		    (cmsg->cmsg_type == IPV6_PKTINFO)) {
+			struct in6_pktinfo *i = (struct in6_pktinfo *) CMSG_DATA(cmsg);
+
+			((struct sockaddr_in6 *)to)->sin6_addr = i->ipi6_addr;
+			*to_len = sizeof(struct sockaddr_in6);
+
+			if (if_index) *if_index = i->ipi6_ifindex;
+
+			break;
+		}
+#endif
+
+#ifdef SO_TIMESTAMP
+		if (when && (cmsg->cmsg_level == SOL_IP) && (cmsg->cmsg_type == SO_TIMESTAMP)) {
+			memcpy(when, CMSG_DATA(cmsg), sizeof(*when));
+		}
+#endif
+	}
+
+	if (when && !when->tv_sec) gettimeofday(when, NULL);
+}
+
 /** Read a packet from a file descriptor, retrieving additional header information
  *
  * Abstracts away the complexity of using the complexity of using recvmsg().
@@ -190,7 +279,6 @@ int recvfromto(int fd, void *buf, size_t len, int flags,
 	       int *if_index, struct timeval *when)
 {
 	struct msghdr		msgh;
-	struct cmsghdr		*cmsg;
 	struct iovec		iov;
 	char			cbuf[256];
 	int			ret;
@@ -293,96 +381,32 @@ int recvfromto(int fd, void *buf, size_t len, int flags,
 
 	if (from_len) *from_len = msgh.msg_namelen;
 
-	if (if_index) *if_index = 0;
-	if (when) {
-		when->tv_sec = 0;
-		when->tv_usec = 0;
-	}
-
-	/* Process auxiliary received data in msgh */
-	for (cmsg = CMSG_FIRSTHDR(&msgh);
-	     cmsg != NULL;
-	     cmsg = CMSG_NXTHDR(&msgh, cmsg)) {
-
-#ifdef IP_PKTINFO
-		if ((cmsg->cmsg_level == SOL_IP) &&
-		    (cmsg->cmsg_type == IP_PKTINFO)) {
-			struct in_pktinfo *i = (struct in_pktinfo *) CMSG_DATA(cmsg);
-
-			((struct sockaddr_in *)to)->sin_addr = i->ipi_addr;
-			*to_len = sizeof(struct sockaddr_in);
-
-			if (if_index) *if_index = i->ipi_ifindex;
-
-			break;
-		}
-#endif
-
-#ifdef IP_RECVDSTADDR
-		if ((cmsg->cmsg_level == IPPROTO_IP) &&
-		    (cmsg->cmsg_type == IP_RECVDSTADDR)) {
-			struct in_addr *i = (struct in_addr *) CMSG_DATA(cmsg);
-
-			((struct sockaddr_in *)to)->sin_addr = *i;
-
-			*to_len = sizeof(struct sockaddr_in);
-
-			break;
-		}
-#endif
-
-#ifdef IPV6_PKTINFO
-		if ((cmsg->cmsg_level == IPPROTO_IPV6) &&
-		    (cmsg->cmsg_type == IPV6_PKTINFO)) {
-			struct in6_pktinfo *i = (struct in6_pktinfo *) CMSG_DATA(cmsg);
-
-			((struct sockaddr_in6 *)to)->sin6_addr = i->ipi6_addr;
-			*to_len = sizeof(struct sockaddr_in6);
-
-			if (if_index) *if_index = i->ipi6_ifindex;
-
-			break;
-		}
-#endif
-
-#ifdef SO_TIMESTAMP
-		if (when && (cmsg->cmsg_level == SOL_IP) && (cmsg->cmsg_type == SO_TIMESTAMP)) {
-			memcpy(when, CMSG_DATA(cmsg), sizeof(*when));
-		}
-#endif
-	}
-
-	if (when && !when->tv_sec) gettimeofday(when, NULL);
+	udpfromto_cmsg_read(&msgh, to, to_len, if_index, when);
 
 	return ret;
 }
 
-/** Send packet via a file descriptor, setting the src address and outbound interface
+/** Add the control messages needed to set the src address and outbound interface
  *
- * Abstracts away the complexity of using the complexity of using sendmsg().
+ * Used by sendfromto(), and by callers building their own msghdr arrays for sendmmsg().
  *
- * @param[in] fd	The file descriptor to write to.
- * @param[in] buf	Where to read datagram data from.
- * @param[in] len	of datagram data.
- * @param[in] flags	passed unmolested to sendmsg.
- * @param[in] from	The source address.
+ * @param[in] fd	The file descriptor the datagram will be written to.
+ * @param[in,out] msgh	to add the control messages to.
+ * @param[in] cbuf	Buffer to hold the control messages.  Must remain valid
+ *			until the datagram has been sent.
+ * @param[in] cbuf_len	Length of cbuf.
+ * @param[in] from	The source address.  May be NULL.
  * @param[in] from_len	Length of the structure pointed to by from.
- * @param[in] to	The destination address.
- * @param[in] to_len	Length of the structure pointed to by to.
  * @param[in] if_index	The interface on which to send the datagram.
  *			If automatic interface selection is desired, value should be 0.
  * @return
- *	- 0 on success.
+ *	- 1 if control messages were added.
+ *	- 0 if the source address can't or needn't be set, and sendto() should be used.
  *	- -1 on failure.
  */
-int sendfromto(int fd, void *buf, size_t len, int flags,
-	       struct sockaddr *from, socklen_t from_len,
-	       struct sockaddr *to, socklen_t to_len, int if_index)
+int udpfromto_cmsg_write(UDPFROMTO_UNUSED int fd, struct msghdr *msgh, void *cbuf, size_t cbuf_len,
+			 struct sockaddr *from, socklen_t from_len, int if_index)
 {
-	struct msghdr	msgh;
-	struct iovec	iov;
-	char		cbuf[256];
-
 	/*
 	 *	Unknown address family, die.
 	 */
@@ -435,21 +459,18 @@ int sendfromto(int fd, void *buf, size_t len, int flags,
 #  endif
 
 	/*
-	 *	No "from", just use regular sendto.
+	 *	No "from", the caller should use regular sendto.
 	 */
-	if (!from || (from_len == 0)) return sendto(fd, buf, len, flags, to, to_len);
+	if (!from || (from_len == 0)) return 0;
 
-	/* Set up control buffer iov and msgh structures. */
-	memset(&cbuf, 0, sizeof(cbuf));
-	memset(&msgh, 0, sizeof(msgh));
-	memset(&iov, 0, sizeof(iov));
-	iov.iov_base = buf;
-	iov.iov_len = len;
-
-	msgh.msg_iov = &iov;
-	msgh.msg_iovlen = 1;
-	msgh.msg_name = to;
-	msgh.msg_namelen = to_len;
+	/*
+	 *	Big enough for any of the control messages below.
+	 */
+	if (cbuf_len < CMSG_SPACE(sizeof(struct sockaddr_storage))) {
+		errno = EINVAL;
+		return -1;
+	}
+	memset(cbuf, 0, cbuf_len);
 
 # if defined(IP_PKTINFO) || defined(IP_SENDSRCADDR)
 	if (from->sa_family == AF_INET) {
@@ -459,10 +480,10 @@ int sendfromto(int fd, void *buf, size_t len, int flags,
 		struct cmsghdr *cmsg;
 		struct in_pktinfo *pkt;
 
-		msgh.msg_control = cbuf;
-		msgh.msg_controllen = CMSG_SPACE(sizeof(*pkt));
+		msgh->msg_control = cbuf;
+		msgh->msg_controllen = CMSG_SPACE(sizeof(*pkt));
 
-		cmsg = CMSG_FIRSTHDR(&msgh);
+		cmsg = CMSG_FIRSTHDR(msgh);
 		cmsg->cmsg_level = SOL_IP;
 		cmsg->cmsg_type = IP_PKTINFO;
 		cmsg->cmsg_len = CMSG_LEN(sizeof(*pkt));
@@ -477,10 +498,10 @@ int sendfromto(int fd, void *buf, size_t len, int flags,
 		struct cmsghdr *cmsg;
 		struct in_addr *in;
 
-		msgh.msg_control = cbuf;
-		msgh.msg_controllen = CMSG_SPACE(sizeof(*in));
+		msgh->msg_control = cbuf;
+		msgh->msg_controllen = CMSG_SPACE(sizeof(*in));
 
-		cmsg = CMSG_FIRSTHDR(&msgh);
+		cmsg = CMSG_FIRSTHDR(msgh);
 		cmsg->cmsg_level = IPPROTO_IP;
 		cmsg->cmsg_type = IP_SENDSRCADDR;
 		cmsg->cmsg_len = CMSG_LEN(sizeof(*in));
@@ -498,10 +519,10 @@ int sendfromto(int fd, void *buf, size_t len, int flags,
 		struct cmsghdr *cmsg;
 		struct in6_pktinfo *pkt;
 
-		msgh.msg_control = cbuf;
-		msgh.msg_controllen = CMSG_SPACE(sizeof(*pkt));
+		msgh->msg_control = cbuf;
+		msgh->msg_controllen = CMSG_SPACE(sizeof(*pkt));
 
-		cmsg = CMSG_FIRSTHDR(&msgh);
+		cmsg = CMSG_FIRSTHDR(msgh);
 		cmsg->cmsg_level = IPPROTO_IPV6;
 		cmsg->cmsg_type = IPV6_PKTINFO;
 		cmsg->cmsg_len = CMSG_LEN(sizeof(*pkt));
@@ -513,9 +534,58 @@ int sendfromto(int fd, void *buf, size_t len, int flags,
 	}
 #  endif	/* IPV6_PKTINFO */
 
-	return sendmsg(fd, &msgh, flags);
+	return 1;
 }
 
+/** Send packet via a file descriptor, setting the src address and outbound interface
+ *
+ * Abstracts away the complexity of using the complexity of using sendmsg().
+ *
+ * @param[in] fd	The file descriptor to write to.
+ * @param[in] buf	Where to read datagram data from.
+ * @param[in] len	of datagram data.
+ * @param[in] flags	passed unmolested to sendmsg.
+ * @param[in] from	The source address.
+ * @param[in] from_len	Length of the structure pointed to by from.
+ * @param[in] to	The destination address.
+ * @param[in] to_len	Length of the structure pointed to by to.
+ * @param[in] if_index	The interface on which to send the datagram.
+ *			If automatic interface selection is desired, value should be 0.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int sendfromto(int fd, void *buf, size_t len, int flags,
+	       struct sockaddr *from, socklen_t from_len,
+	       struct sockaddr *to, socklen_t to_len, int if_index)
+{
+	struct msghdr	msgh;
+	struct iovec	iov;
+	char		cbuf[256];
+	int		ret;
+
+	memset(&msgh, 0, sizeof(msgh));
+
+	ret = udpfromto_cmsg_write(fd, &msgh, cbuf, sizeof(cbuf), from, from_len, if_index);
+	if (ret < 0) return -1;
+
+	/*
+	 *	No "from", just use regular sendto.
+	 */
+	if (ret == 0) return sendto(fd, buf, len, flags, to, to_len);
+
+	/* Set up iov and msgh structures. */
+	memset(&iov, 0, sizeof(iov));
+	iov.iov_base = buf;
+	iov.iov_len = len;
+
+	msgh.msg_iov = &iov;
+	msgh.msg_iovlen = 1;
+	msgh.msg_name = to;
+	msgh.msg_namelen = to_len;
+
+	return sendmsg(fd, &msgh, flags);
+}
 
 #ifdef TESTING
 /*
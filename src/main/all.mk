@@ -1,5 +1,6 @@
 SUBMAKEFILES := \
     radclient.mk \
+    raddict.mk \
     radiusd.mk \
     radsniff.mk \
     radmin.mk \
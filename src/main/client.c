@@ -40,13 +40,29 @@ RCSID("$Id$")
 #endif
 #endif
 
+typedef struct client_trie_node client_trie_node_t;
+
+/** A node in the client prefix trie
+ *
+ * The trie is a path compressed binary radix tree.  Each node holds the
+ * address bits it represents, and the clients configured with exactly
+ * that network.  Nodes with no clients only exist where two branches
+ * diverge.
+ */
+struct client_trie_node {
+	uint8_t			key[16];	//!< Network address, masked to prefix bits.
+	uint8_t			prefix;		//!< Number of significant bits in key.
+	RADCLIENT		**clients;	//!< Clients for this network (talloc array).
+	client_trie_node_t	*child[2];	//!< Children, selected by bit 'prefix' of the address.
+};
+
 /** Group of clients
  *
  */
 struct radclient_list {
-	char const	*name;			//!< Name of the client list.
-	rbtree_t	*trees[129];		//!< For 0..128, inclusive.
-	uint32_t       	min_prefix;
+	char const		*name;		//!< Name of the client list.
+	rbtree_t		*trees[129];	//!< For 0..128, inclusive.
+	client_trie_node_t	*trie[2];	//!< Longest prefix match index, for IPv4 and IPv6.
 };
 
 #ifdef WITH_STATS
@@ -146,6 +162,275 @@ static int client_num_cmp(void const *one, void const *two)
 }
 #endif
 
+#define CLIENT_TRIE_BIT(_key, _bit) (((_key)[(_bit) >> 3] >> (7 - ((_bit) & 0x07))) & 0x01)
+
+/** Get the trie key for an IP address
+ *
+ * @param[out] key	Address bytes, masked to the prefix length.
+ * @param[in] ipaddr	to get the key for.
+ * @param[in] prefix	to mask the address to.
+ * @return
+ *	- The index of the trie for the address family.
+ *	- -1 if the address family isn't supported.
+ */
+static int client_trie_key(uint8_t key[16], fr_ipaddr_t const *ipaddr, uint8_t prefix)
+{
+	fr_ipaddr_t masked;
+
+	memset(key, 0, 16);
+
+	masked = *ipaddr;
+	fr_ipaddr_mask(&masked, prefix);
+
+	switch (masked.af) {
+	case AF_INET:
+		memcpy(key, &masked.ipaddr.ip4addr, sizeof(masked.ipaddr.ip4addr));
+		return 0;
+
+	case AF_INET6:
+		memcpy(key, &masked.ipaddr.ip6addr, sizeof(masked.ipaddr.ip6addr));
+		return 1;
+
+	default:
+		return -1;
+	}
+}
+
+/** Find how many leading bits two keys have in common
+ *
+ * @param[in] a		first key.
+ * @param[in] b		second key.
+ * @param[in] max	number of bits to compare.
+ * @return the number of leading bits which are the same, up to max.
+ */
+static int client_trie_common(uint8_t const *a, uint8_t const *b, int max)
+{
+	int	i;
+	uint8_t	diff;
+
+	for (i = 0; i < max; i += 8) {
+		diff = a[i >> 3] ^ b[i >> 3];
+		if (!diff) continue;
+
+		while (!(diff & 0x80)) {
+			diff <<= 1;
+			i++;
+		}
+
+		return (i < max) ? i : max;
+	}
+
+	return max;
+}
+
+/** Allocate a new trie node
+ *
+ */
+static client_trie_node_t *client_trie_node_alloc(TALLOC_CTX *ctx, uint8_t const *key, int prefix)
+{
+	client_trie_node_t *node;
+
+	node = talloc_zero(ctx, client_trie_node_t);
+	if (!node) return NULL;
+
+	memcpy(node->key, key, sizeof(node->key));
+	node->prefix = prefix;
+
+	/*
+	 *	Only keep the significant bits, so that nodes created
+	 *	by splitting a branch don't carry the bits of the
+	 *	key which split it.
+	 */
+	if (prefix < 128) {
+		node->key[prefix >> 3] &= ~(0xff >> (prefix & 0x07));
+		if ((prefix >> 3) < 15) memset(node->key + (prefix >> 3) + 1, 0, 15 - (prefix >> 3));
+	}
+
+	return node;
+}
+
+/** Add a client to the prefix trie
+ *
+ * @param[in] clients	list to add the client to.
+ * @param[in] client	to add.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int client_trie_insert(RADCLIENT_LIST *clients, RADCLIENT *client)
+{
+	client_trie_node_t	**pp, *node, *split;
+	uint8_t			key[16];
+	int			prefix = client->ipaddr.prefix;
+	int			common, af;
+	size_t			num;
+
+	af = client_trie_key(key, &client->ipaddr, prefix);
+	if (af < 0) return -1;
+	pp = &clients->trie[af];
+
+	while ((node = *pp) != NULL) {
+		common = client_trie_common(node->key, key, (node->prefix < prefix) ? node->prefix : prefix);
+
+		/*
+		 *	The new network diverges from this branch, or
+		 *	contains it.  Insert a node above this one.
+		 */
+		if (common < node->prefix) {
+			split = client_trie_node_alloc(clients, key, common);
+			if (!split) return -1;
+
+			split->child[CLIENT_TRIE_BIT(node->key, common)] = node;
+			*pp = split;
+
+			if (common == prefix) {
+				node = split;
+				break;
+			}
+
+			node = client_trie_node_alloc(clients, key, prefix);
+			if (!node) return -1;
+
+			split->child[CLIENT_TRIE_BIT(key, common)] = node;
+			break;
+		}
+
+		if (node->prefix == prefix) break;
+
+		pp = &node->child[CLIENT_TRIE_BIT(key, node->prefix)];
+	}
+
+	if (!node) {
+		node = client_trie_node_alloc(clients, key, prefix);
+		if (!node) return -1;
+		*pp = node;
+	}
+
+	num = node->clients ? talloc_array_length(node->clients) : 0;
+	node->clients = talloc_realloc(node, node->clients, RADCLIENT *, num + 1);
+	if (!node->clients) return -1;
+	node->clients[num] = client;
+
+	return 0;
+}
+
+#ifdef WITH_DYNAMIC_CLIENTS
+/** Remove a client from the prefix trie
+ *
+ * @param[in] clients	list to remove the client from.
+ * @param[in] client	to remove.
+ */
+static void client_trie_delete(RADCLIENT_LIST *clients, RADCLIENT *client)
+{
+	client_trie_node_t	**pp, **parent_p = NULL, *node, *parent;
+	uint8_t			key[16];
+	int			prefix = client->ipaddr.prefix;
+	int			af;
+	size_t			i, num;
+
+	af = client_trie_key(key, &client->ipaddr, prefix);
+	if (af < 0) return;
+	pp = &clients->trie[af];
+
+	while ((node = *pp) != NULL) {
+		if (node->prefix >= prefix) break;
+
+		parent_p = pp;
+		pp = &node->child[CLIENT_TRIE_BIT(key, node->prefix)];
+	}
+	if (!node || (node->prefix != prefix) || !node->clients ||
+	    (client_trie_common(node->key, key, prefix) < prefix)) return;
+
+	num = talloc_array_length(node->clients);
+	for (i = 0; i < num; i++) {
+		if (node->clients[i] != client) continue;
+
+		memmove(&node->clients[i], &node->clients[i + 1], (num - i - 1) * sizeof(node->clients[0]));
+		num--;
+		break;
+	}
+
+	if (num > 0) {
+		node->clients = talloc_realloc(node, node->clients, RADCLIENT *, num);
+		return;
+	}
+	TALLOC_FREE(node->clients);
+
+	/*
+	 *	Remove nodes which are no longer needed to join two
+	 *	branches.
+	 */
+	if (node->child[0] && node->child[1]) return;
+
+	*pp = node->child[0] ? node->child[0] : node->child[1];
+	talloc_free(node);
+
+	/*
+	 *	If that was a leaf, and its parent only existed to
+	 *	join it to another branch, merge the parent into the
+	 *	other branch too.  Nodes without clients always have
+	 *	two children, so nothing above the parent changes.
+	 */
+	if (*pp || !parent_p) return;
+
+	parent = *parent_p;
+	if (parent->clients) return;
+
+	*parent_p = parent->child[0] ? parent->child[0] : parent->child[1];
+	talloc_free(parent);
+}
+#endif
+
+/** Find the client for the longest matching network in the prefix trie
+ *
+ * @param[in] clients	list to search.
+ * @param[in] ipaddr	to find the client for.
+ * @param[in] proto	the packet was received on.
+ * @return
+ *	- The most specific client.
+ *	- NULL if no client matches.
+ */
+static RADCLIENT *client_trie_find(RADCLIENT_LIST const *clients, fr_ipaddr_t const *ipaddr, int proto)
+{
+	client_trie_node_t	*node;
+	RADCLIENT		*found = NULL;
+	uint8_t			key[16];
+	int			max_prefix, af;
+	size_t			i, num;
+
+	max_prefix = (ipaddr->af == AF_INET6) ? 128 : 32;
+
+	af = client_trie_key(key, ipaddr, max_prefix);
+	if (af < 0) return NULL;
+
+	for (node = clients->trie[af]; node; node = node->child[CLIENT_TRIE_BIT(key, node->prefix)]) {
+		if (client_trie_common(node->key, key, node->prefix) < node->prefix) break;
+
+		if (node->clients) {
+			num = talloc_array_length(node->clients);
+			for (i = 0; i < num; i++) {
+				RADCLIENT *client = node->clients[i];
+
+				if ((ipaddr->af == AF_INET6) && (client->ipaddr.zone_id != ipaddr->zone_id)) continue;
+#ifdef WITH_TCP
+				if ((client->proto != IPPROTO_IP) && (proto != IPPROTO_IP) &&
+				    (client->proto != proto)) continue;
+#endif
+				found = client;
+				break;
+			}
+		}
+
+		if (node->prefix >= max_prefix) break;
+	}
+
+#ifndef WITH_TCP
+	(void) proto;
+#endif
+
+	return found;
+}
+
 /** Return a new client list
  *
  * @note The container won't contain any clients.
@@ -161,7 +446,6 @@ RADCLIENT_LIST *client_list_init(CONF_SECTION *cs)
 	if (!clients) return NULL;
 
 	clients->name = talloc_strdup(clients, cs ? cf_section_name1(cs) : "root");
-	clients->min_prefix = 128;
 
 	return clients;
 }
@@ -317,6 +601,12 @@ bool client_add(RADCLIENT_LIST *clients, RADCLIENT *client)
 		return false;
 	}
 
+	if (client_trie_insert(clients, client) < 0) {
+		rbtree_deletebydata(clients->trees[client->ipaddr.prefix], client);
+		ERROR("Failed indexing client %s", client->shortname);
+		return false;
+	}
+
 #ifdef WITH_STATS
 	if (!tree_num) {
 		tree_num = rbtree_create(clients, client_num_cmp, NULL, 0);
@@ -349,10 +639,6 @@ bool client_add(RADCLIENT_LIST *clients, RADCLIENT *client)
 	if (tree_num) rbtree_insert(tree_num, client);
 #endif
 
-	if (client->ipaddr.prefix < clients->min_prefix) {
-		clients->min_prefix = client->ipaddr.prefix;
-	}
-
 	(void) talloc_steal(clients, client); /* reparent it */
 
 	return true;
@@ -376,6 +662,7 @@ void client_delete(RADCLIENT_LIST *clients, RADCLIENT *client)
 	rbtree_deletebydata(tree_num, client);
 #endif
 	rbtree_deletebydata(clients->trees[client->ipaddr.prefix], client);
+	client_trie_delete(clients, client);
 }
 #endif
 
@@ -412,43 +699,18 @@ RADCLIENT *client_findbynumber(UNUSED const RADCLIENT_LIST *clients, UNUSED int
 
 /*
  *	Find a client in the RADCLIENTS list.
+ *
+ *	The most specific network containing the address wins.  The
+ *	lookup walks the prefix trie, so it costs at most one node
+ *	per distinct prefix on the path to the address.
  */
 RADCLIENT *client_find(RADCLIENT_LIST const *clients, fr_ipaddr_t const *ipaddr, int proto)
 {
-	int32_t i, max_prefix;
-	RADCLIENT myclient;
-
 	if (!clients) clients = root_clients;
 
 	if (!clients || !ipaddr) return NULL;
 
-	switch (ipaddr->af) {
-	case AF_INET:
-		max_prefix = 32;
-		break;
-
-	case AF_INET6:
-		max_prefix = 128;
-		break;
-
-	default :
-		return NULL;
-	}
-
-	for (i = max_prefix; i >= (int32_t) clients->min_prefix; i--) {
-		void *data;
-
-		if (!clients->trees[i]) continue;
-
-		myclient.ipaddr = *ipaddr;
-		myclient.proto = proto;
-		fr_ipaddr_mask(&myclient.ipaddr, i);
-
-		data = rbtree_finddata(clients->trees[i], &myclient);
-		if (data) return data;
-	}
-
-	return NULL;
+	return client_trie_find(clients, ipaddr, proto);
 }
 
 /*
@@ -264,6 +264,14 @@ rs_stats_tmpl_t *rs_stats_collectd_init_latency(TALLOC_CTX *ctx, rs_stats_tmpl_t
 		{ NULL, 0, NULL, NULL }
 	};
 
+	rs_stats_value_tmpl_t const _latency_pct[] = {
+		{ &stats->interval.latency_percentile.p50, LCC_TYPE_GAUGE, _copy_double_to_double, NULL },
+		{ &stats->interval.latency_percentile.p90, LCC_TYPE_GAUGE, _copy_double_to_double, NULL },
+		{ &stats->interval.latency_percentile.p99, LCC_TYPE_GAUGE, _copy_double_to_double, NULL },
+		{ &stats->interval.latency_percentile.p999, LCC_TYPE_GAUGE, _copy_double_to_double, NULL },
+		{ NULL, 0, NULL, NULL }
+	};
+
 #define INIT_STATS(_ti, _v) do {\
 		strlcpy(buffer, fr_packet_codes[code], sizeof(buffer)); \
 		for (p = buffer; *p; ++p) *p = tolower(*p);\
@@ -296,9 +304,51 @@ rs_stats_tmpl_t *rs_stats_collectd_init_latency(TALLOC_CTX *ctx, rs_stats_tmpl_t
 
 	INIT_STATS("radius_rtx", rtx);
 
+	/*
+	 *	Sent after the existing types, so they keep their order.
+	 */
+	if (stats->histogram) INIT_STATS("radius_latency_pct", _latency_pct);
+
 	return last;
 }
 
+/** Setup stats templates for the latency of a single server
+ *
+ * The plugin instance is derived from the server's address and port, and the type
+ * instance from the request code.
+ */
+rs_stats_tmpl_t *rs_stats_collectd_init_server(TALLOC_CTX *ctx, rs_stats_tmpl_t **out, rs_t *conf,
+					       rs_server_t *server, PW_CODE code)
+{
+	char plugin_instance[LCC_NAME_LEN];
+	char type_instance[LCC_NAME_LEN];
+	char addr[INET6_ADDRSTRLEN];
+	char *p;
+
+	/* not static so were thread safe */
+	rs_stats_value_tmpl_t const _latency_pct[] = {
+		{ &server->percentile[code].p50, LCC_TYPE_GAUGE, _copy_double_to_double, NULL },
+		{ &server->percentile[code].p90, LCC_TYPE_GAUGE, _copy_double_to_double, NULL },
+		{ &server->percentile[code].p99, LCC_TYPE_GAUGE, _copy_double_to_double, NULL },
+		{ &server->percentile[code].p999, LCC_TYPE_GAUGE, _copy_double_to_double, NULL },
+		{ NULL, 0, NULL, NULL }
+	};
+
+	inet_ntop(server->ipaddr.af, &server->ipaddr.ipaddr, addr, sizeof(addr));
+	snprintf(plugin_instance, sizeof(plugin_instance), "server_%s_%u", addr, server->port);
+	for (p = plugin_instance; *p; ++p) {
+		if ((*p == '.') || (*p == ':')) *p = '_';
+	}
+
+	strlcpy(type_instance, fr_packet_codes[code], sizeof(type_instance));
+	for (p = type_instance; *p; ++p) *p = tolower(*p);
+
+	*out = rs_stats_collectd_init(ctx, conf, plugin_instance, "radius_latency_pct", type_instance,
+				      server, _latency_pct);
+
+	return *out;
+}
+
 /** Refresh and send the stats to the collectd server
  *
  */
@@ -2760,6 +2760,7 @@ static int command_stats_detail(rad_listen_t *listener, int argc, char *argv[])
 	if (stat(data->filename_work, &buf) < 0) {
 		cprintf(listener, "packets\t0\n");
 		cprintf(listener, "tries\t0\n");
+		cprintf(listener, "outstanding\t0\n");
 		cprintf(listener, "offset\t0\n");
 		cprintf(listener, "size\t0\n");
 		return CMD_OK;
@@ -2767,6 +2768,7 @@ static int command_stats_detail(rad_listen_t *listener, int argc, char *argv[])
 
 	cprintf(listener, "packets\t%d\n", data->packets);
 	cprintf(listener, "tries\t%d\n", data->tries);
+	cprintf(listener, "outstanding\t%u\n", data->outstanding);
 	cprintf(listener, "offset\t%u\n", (unsigned int) data->offset);
 	cprintf(listener, "size\t%u\n", (unsigned int) buf.st_size);
 
@@ -34,6 +34,13 @@ RCSID("$Id$")
 #include <freeradius-devel/rad_assert.h>
 
 typedef struct fr_connection fr_connection_t;
+typedef struct fr_connection_thread_cache fr_connection_thread_cache_t;
+
+/*
+ *	Upper limit on the number of connections each thread may keep
+ *	in its local cache.
+ */
+#define FR_CONNECTION_THREAD_CACHE_MAX	(8)
 
 static int fr_connection_pool_check(fr_connection_pool_t *pool, REQUEST *request);
 
@@ -70,6 +77,41 @@ struct fr_connection {
 #endif
 };
 
+/** Connections kept by a single thread, outside of the shared heap
+ *
+ * Connections in the cache are marked as in use, and are counted as active,
+ * so the pool never hands them to another thread.  The owning thread can then
+ * reserve and release them without touching the pool mutex.
+ *
+ * The held time of cached connections is recorded in the cache, and added
+ * to the pool's stats when the pool checks the caches.
+ *
+ * The cache has its own mutex, which is only contended when the pool checks
+ * the cache for expired connections.  When both are needed, the pool mutex
+ * is locked first.
+ *
+ * @see fr_connection_pool_t
+ */
+struct fr_connection_thread_cache {
+	fr_connection_pool_t		*pool;		//!< Pool the connections belong to.
+	pthread_mutex_t			mutex;		//!< Protects the entries.
+
+	fr_connection_thread_cache_t	*prev;		//!< Previous cache in the pool's list.
+	fr_connection_thread_cache_t	*next;		//!< Next cache in the pool's list.
+
+	fr_stats_t			held_stats;	//!< How long cached connections were held for,
+							//!< since the pool last collected them.
+	struct timeval			last_released;	//!< Last time a cached connection was released.
+	time_t				last_held_min;	//!< Last time we fired the "min" trigger.
+	time_t				last_held_max;	//!< Last time we fired the "max" trigger.
+
+	uint32_t			num;		//!< Number of connections in the cache.
+	struct {
+		fr_connection_t		*this;		//!< Cached connection.
+		bool			lent;		//!< Whether the thread is currently using it.
+	} entry[FR_CONNECTION_THREAD_CACHE_MAX];
+};
+
 /** A connection pool
  *
  * Defines the configuration of the connection pool, all the counters and
@@ -111,6 +153,12 @@ struct fr_connection_pool_t {
 	fr_connection_t	*head;			//!< Start of the connection list.
 	fr_connection_t	*tail;			//!< End of the connection list.
 
+	uint32_t	thread_cache;		//!< How many connections each thread may keep for
+						//!< itself.  0 disables the per-thread cache.
+	bool		thread_key_init;	//!< Whether thread_key has been created.
+	pthread_key_t	thread_key;		//!< Key for finding this thread's cache.
+	fr_connection_thread_cache_t *caches;	//!< List of all the per-thread caches.
+
 	pthread_mutex_t	mutex;			//!< Mutex used to keep consistent state when making
 						//!< modifications in threaded mode.
 	pthread_cond_t	done_spawn;		//!< Threads that need to ensure no spawning is in progress,
@@ -157,6 +205,7 @@ static const CONF_PARSER connection_config[] = {
 	{ FR_CONF_OFFSET("held_trigger_max", PW_TYPE_TIMEVAL, fr_connection_pool_t, held_trigger_max), .dflt = "0.5" },
 	{ FR_CONF_OFFSET("retry_delay", PW_TYPE_INTEGER, fr_connection_pool_t, retry_delay), .dflt = "1" },
 	{ FR_CONF_OFFSET("spread", PW_TYPE_BOOLEAN, fr_connection_pool_t, spread), .dflt = "no" },
+	{ FR_CONF_OFFSET("thread_cache", PW_TYPE_INTEGER, fr_connection_pool_t, thread_cache), .dflt = "0" },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -634,6 +683,105 @@ static int fr_connection_manage(fr_connection_pool_t *pool,
 }
 
 
+/** Check whether a connection has hit its idle_timeout, lifetime, or max_uses limits
+ *
+ * The same limits as fr_connection_manage(), without the logging, for
+ * connections in a thread's cache.
+ *
+ * @param[in] pool	the connection belongs to.
+ * @param[in] this	Connection to check.
+ * @param[in] now	Current time.
+ * @return
+ *	- true if the connection should be closed.
+ *	- false if it can still be used.
+ */
+static bool fr_connection_expired(fr_connection_pool_t *pool, fr_connection_t *this, time_t now)
+{
+	return (this->needs_reconnecting ||
+		((pool->max_uses > 0) && (this->num_uses >= pool->max_uses)) ||
+		((pool->lifetime > 0) && ((this->created + pool->lifetime) < now)) ||
+		((pool->idle_timeout > 0) && ((this->last_released.tv_sec + pool->idle_timeout) < now)));
+}
+
+/** Return a connection from a thread's cache, to the shared heap
+ *
+ * The connection is then subject to the normal idle_timeout, lifetime,
+ * and max_uses checks.
+ *
+ * @note Must be called with the mutex held.
+ *
+ * @param[in] pool	the connection belongs to.
+ * @param[in] this	Connection to return.
+ */
+static void fr_connection_thread_cache_return(fr_connection_pool_t *pool, fr_connection_t *this)
+{
+	this->in_use = false;
+	fr_heap_insert(pool->heap, this);
+
+	rad_assert(pool->state.active != 0);
+	pool->state.active--;
+}
+
+/** Add the held time stats of a thread's cache to the pool's stats
+ *
+ * @note Must be called with the mutex, and the cache's mutex held.
+ *
+ * @param[in] pool	to add the stats to.
+ * @param[in] cache	to collect the stats from.
+ */
+static void fr_connection_thread_cache_stats(fr_connection_pool_t *pool, fr_connection_thread_cache_t *cache)
+{
+	size_t i;
+
+	for (i = 0; i < (sizeof(cache->held_stats.elapsed) / sizeof(cache->held_stats.elapsed[0])); i++) {
+		pool->state.held_stats.elapsed[i] += cache->held_stats.elapsed[i];
+		cache->held_stats.elapsed[i] = 0;
+	}
+
+	if (fr_timeval_cmp(&cache->last_released, &pool->state.last_released) > 0) {
+		pool->state.last_released = cache->last_released;
+	}
+}
+
+/** Return idle connections which have expired, from every thread's cache
+ *
+ * This lets idle_timeout and lifetime apply to cached connections,
+ * even when the thread which owns the cache isn't using the pool.
+ * The held time stats of each cache are collected at the same time.
+ *
+ * @note Must be called with the mutex held.  Locks each cache's mutex
+ *	in turn.
+ *
+ * @param[in] pool	to check.
+ * @param[in] now	Current time.
+ */
+static void fr_connection_thread_cache_check(fr_connection_pool_t *pool, time_t now)
+{
+	fr_connection_thread_cache_t	*cache;
+	uint32_t			i;
+
+	for (cache = pool->caches; cache; cache = cache->next) {
+		pthread_mutex_lock(&cache->mutex);
+
+		fr_connection_thread_cache_stats(pool, cache);
+
+		i = 0;
+		while (i < cache->num) {
+			fr_connection_t *this = cache->entry[i].this;
+
+			if (cache->entry[i].lent || !fr_connection_expired(pool, this, now)) {
+				i++;
+				continue;
+			}
+
+			cache->entry[i] = cache->entry[--cache->num];
+			fr_connection_thread_cache_return(pool, this);
+		}
+
+		pthread_mutex_unlock(&cache->mutex);
+	}
+}
+
 /** Check whether any connections need to be removed from the pool
  *
  * Maintains the number of connections in the pool as per the configuration
@@ -784,6 +932,12 @@ static int fr_connection_pool_check(fr_connection_pool_t *pool, REQUEST *request
 		pool->delay_interval += pool->state.next_delay;
 	}
 
+	/*
+	 *	Idle connections in the thread caches are handed back
+	 *	first, so that they're closed below if they've expired.
+	 */
+	if (pool->caches) fr_connection_thread_cache_check(pool, now);
+
 	/*
 	 *	Pass over all of the connections in the pool, limiting
 	 *	lifetime, idle time, max requests, etc.
@@ -800,6 +954,349 @@ done:
 	return 1;
 }
 
+/** Record how long a connection was held for
+ *
+ * Updates the held time stats, and works out which of the held
+ * triggers should fire.  The caller fires them once the mutex
+ * has been released.
+ *
+ * Connections released into the pool use the pool's stats, and
+ * connections released into a thread's cache use the cache's.
+ *
+ * @note Must be called with the mutex protecting the stats held.
+ *
+ * @param[in] pool		the connection belongs to.
+ * @param[in] this		Connection being released.
+ * @param[in] stats		to record the held time in.
+ * @param[out] last_released	set to when the connection was released.
+ * @param[in,out] last_held_min	when the "min" trigger last fired.
+ * @param[in,out] last_held_max	when the "max" trigger last fired.
+ * @param[out] trigger_min	whether to fire the "min" trigger.
+ * @param[out] trigger_max	whether to fire the "max" trigger.
+ */
+static void fr_connection_held(fr_connection_pool_t *pool, fr_connection_t *this, fr_stats_t *stats,
+			       struct timeval *last_released, time_t *last_held_min, time_t *last_held_max,
+			       bool *trigger_min, bool *trigger_max)
+{
+	struct timeval	held;
+
+	/*
+	 *	Record when the connection was last released
+	 */
+	gettimeofday(&this->last_released, NULL);
+	*last_released = this->last_released;
+
+	/*
+	 *	This is done inside the mutex to ensure
+	 *	updates are atomic.
+	 */
+	fr_timeval_subtract(&held, &this->last_released, &this->last_reserved);
+
+	/*
+	 *	Check we've not exceeded out trigger limits
+	 */
+	if ((pool->held_trigger_min.tv_sec || pool->held_trigger_min.tv_usec) &&
+	    (fr_timeval_cmp(&held, &pool->held_trigger_min) < 0) &&
+	    (*last_held_min != this->last_released.tv_sec)) {
+	    	*trigger_min = true;
+	    	*last_held_min = this->last_released.tv_sec;
+	}
+
+	if ((pool->held_trigger_max.tv_sec || pool->held_trigger_min.tv_usec) &&
+	    (fr_timeval_cmp(&held, &pool->held_trigger_max) > 0) &&
+	    (*last_held_max != this->last_released.tv_sec)) {
+	    	*trigger_max = true;
+	    	*last_held_max = this->last_released.tv_sec;
+	}
+
+	fr_stats_bins(stats, &this->last_reserved, &this->last_released);
+}
+
+/** Destroy the mutex of a thread's cache
+ *
+ */
+static int _fr_connection_thread_cache_destroy(fr_connection_thread_cache_t *cache)
+{
+	pthread_mutex_destroy(&cache->mutex);
+
+	return 0;
+}
+
+/** Return all connections in a thread's cache to the pool, and free the cache
+ *
+ * Called by pthreads when a thread with a cache exits.
+ *
+ * @param[in] arg	the fr_connection_thread_cache_t to free.
+ */
+static void _fr_connection_thread_cache_free(void *arg)
+{
+	fr_connection_thread_cache_t	*cache = arg;
+	fr_connection_pool_t		*pool = cache->pool;
+	uint32_t			i;
+
+	pthread_mutex_lock(&pool->mutex);
+	pthread_mutex_lock(&cache->mutex);
+
+	fr_connection_thread_cache_stats(pool, cache);
+
+	for (i = 0; i < cache->num; i++) {
+		rad_assert(!cache->entry[i].lent);
+
+		fr_connection_thread_cache_return(pool, cache->entry[i].this);
+	}
+	cache->num = 0;
+
+	if (cache->prev) {
+		cache->prev->next = cache->next;
+	} else {
+		pool->caches = cache->next;
+	}
+	if (cache->next) cache->next->prev = cache->prev;
+
+	pthread_mutex_unlock(&cache->mutex);
+
+	/*
+	 *	The cache is parented by the pool, so it has to be
+	 *	freed with the mutex held.
+	 */
+	talloc_free(cache);
+
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+/** Reserve a connection from this thread's cache
+ *
+ * Connections which need to be closed are handed back to the pool,
+ * which will close them.
+ *
+ * @note Must be called with the mutex free.  Only locks the mutex if
+ *	a connection has to be handed back to the pool.
+ *
+ * @param[in] pool	to reserve the connection from.
+ * @param[in] request	The current request.
+ * @return
+ *	- A connection.
+ *	- NULL if the cache has no usable connections.
+ */
+static fr_connection_t *fr_connection_thread_cache_get(fr_connection_pool_t *pool, REQUEST *request)
+{
+	fr_connection_thread_cache_t	*cache;
+	fr_connection_t			*this, *found = NULL;
+	fr_connection_t			*expired[FR_CONNECTION_THREAD_CACHE_MAX];
+	time_t				now;
+	uint32_t			i, num_expired = 0;
+
+	cache = pthread_getspecific(pool->thread_key);
+	if (!cache) return NULL;
+
+	now = time(NULL);
+
+	pthread_mutex_lock(&cache->mutex);
+
+	i = 0;
+	while (i < cache->num) {
+		if (cache->entry[i].lent) {
+			i++;
+			continue;
+		}
+
+		this = cache->entry[i].this;
+
+		/*
+		 *	We can't close the connection without the
+		 *	mutex, so hand it back to the pool, which
+		 *	will.
+		 *
+		 *	needs_reconnecting is set by another thread,
+		 *	if we miss the update, we'll see it the next
+		 *	time around.
+		 */
+		if (fr_connection_expired(pool, this, now)) {
+			cache->entry[i] = cache->entry[--cache->num];
+			expired[num_expired++] = this;
+			continue;
+		}
+
+		cache->entry[i].lent = true;
+		this->num_uses++;
+		gettimeofday(&this->last_reserved, NULL);
+
+#ifdef PTHREAD_DEBUG
+		this->pthread_id = pthread_self();
+#endif
+		found = this;
+		break;
+	}
+
+	pthread_mutex_unlock(&cache->mutex);
+
+	if (num_expired) {
+		pthread_mutex_lock(&pool->mutex);
+		for (i = 0; i < num_expired; i++) fr_connection_thread_cache_return(pool, expired[i]);
+		fr_connection_pool_check(pool, request);	/* Releases the mutex */
+	}
+
+	if (found) {
+		ROPTIONAL(RDEBUG2, DEBUG2, "Reserved connection (%" PRIu64 ") from thread cache", found->number);
+	}
+
+	return found;
+}
+
+/** Add a connection which has just been reserved, to this thread's cache
+ *
+ * The connection is marked as lent, and will stay in the cache when
+ * it's released.
+ *
+ * @note Must be called with the mutex free.
+ *
+ * @param[in] pool	the connection was reserved from.
+ * @param[in] this	connection to add.
+ */
+static void fr_connection_thread_cache_add(fr_connection_pool_t *pool, fr_connection_t *this)
+{
+	fr_connection_thread_cache_t *cache;
+
+	cache = pthread_getspecific(pool->thread_key);
+	if (!cache) {
+		/*
+		 *	The cache is parented by the pool, so it has
+		 *	to be allocated with the mutex held.
+		 */
+		pthread_mutex_lock(&pool->mutex);
+		cache = talloc_zero(pool, fr_connection_thread_cache_t);
+		if (!cache) {
+			pthread_mutex_unlock(&pool->mutex);
+			return;
+		}
+
+		if (pthread_mutex_init(&cache->mutex, NULL) != 0) {
+			talloc_free(cache);
+			pthread_mutex_unlock(&pool->mutex);
+			return;
+		}
+		talloc_set_destructor(cache, _fr_connection_thread_cache_destroy);
+
+		cache->pool = pool;
+
+		if (pthread_setspecific(pool->thread_key, cache) != 0) {
+			talloc_free(cache);
+			pthread_mutex_unlock(&pool->mutex);
+			return;
+		}
+
+		cache->next = pool->caches;
+		if (cache->next) cache->next->prev = cache;
+		pool->caches = cache;
+		pthread_mutex_unlock(&pool->mutex);
+	}
+
+	pthread_mutex_lock(&cache->mutex);
+	if (cache->num < pool->thread_cache) {
+		cache->entry[cache->num].this = this;
+		cache->entry[cache->num].lent = true;
+		cache->num++;
+	}
+	pthread_mutex_unlock(&cache->mutex);
+}
+
+/** Find a connection in this thread's cache
+ *
+ * @note Must be called with the cache mutex held.
+ *
+ * @param[in] cache	to search.
+ * @param[in] conn	handle to find.
+ * @return
+ *	- The index of the entry.
+ *	- -1 if the connection isn't in the cache.
+ */
+static int fr_connection_thread_cache_find(fr_connection_thread_cache_t *cache, void *conn)
+{
+	uint32_t i;
+
+	for (i = 0; i < cache->num; i++) {
+		if (cache->entry[i].this->connection == conn) return i;
+	}
+
+	return -1;
+}
+
+/** Release a connection back to this thread's cache
+ *
+ * The held time is recorded in the cache, and the held triggers fire,
+ * just as they do for connections released into the pool.  The "min"
+ * and "max" triggers are rate limited per cache, instead of per pool.
+ *
+ * The pool isn't checked here, so releasing a cached connection never
+ * locks the pool mutex.  Other threads' caches are checked when a
+ * connection is released into the pool, or on a cache miss.
+ *
+ * @note Must be called with the mutex free.
+ *
+ * @param[in] pool	the connection was reserved from.
+ * @param[in] request	The current request.
+ * @param[in] conn	handle to release.
+ * @return
+ *	- true if the connection was released into the cache.
+ *	- false if the connection isn't in the cache, and should be released
+ *	  into the pool.
+ */
+static bool fr_connection_thread_cache_release(fr_connection_pool_t *pool, REQUEST *request, void *conn)
+{
+	fr_connection_thread_cache_t	*cache;
+	fr_connection_t			*this;
+	bool				trigger_min = false, trigger_max = false;
+	int				i;
+
+	cache = pthread_getspecific(pool->thread_key);
+	if (!cache) return false;
+
+	pthread_mutex_lock(&cache->mutex);
+	i = fr_connection_thread_cache_find(cache, conn);
+	if (i < 0) {
+		pthread_mutex_unlock(&cache->mutex);
+		return false;
+	}
+	rad_assert(cache->entry[i].lent);
+	this = cache->entry[i].this;
+
+	fr_connection_held(pool, this, &cache->held_stats, &cache->last_released,
+			   &cache->last_held_min, &cache->last_held_max, &trigger_min, &trigger_max);
+	cache->entry[i].lent = false;
+	pthread_mutex_unlock(&cache->mutex);
+
+	ROPTIONAL(RDEBUG2, DEBUG2, "Released connection (%" PRIu64 ") to thread cache", this->number);
+
+	if (trigger_min) fr_connection_trigger_exec(pool, request, "min");
+	if (trigger_max) fr_connection_trigger_exec(pool, request, "max");
+
+	return true;
+}
+
+/** Remove a connection from this thread's cache
+ *
+ * Used before a connection is closed or reconnected, so that the
+ * cache doesn't hold a pointer to a freed connection.
+ *
+ * @note Must be called with the mutex free.
+ *
+ * @param[in] pool	the connection was reserved from.
+ * @param[in] conn	handle to remove.
+ */
+static void fr_connection_thread_cache_remove(fr_connection_pool_t *pool, void *conn)
+{
+	fr_connection_thread_cache_t	*cache;
+	int				i;
+
+	cache = pthread_getspecific(pool->thread_key);
+	if (!cache) return;
+
+	pthread_mutex_lock(&cache->mutex);
+	i = fr_connection_thread_cache_find(cache, conn);
+	if (i >= 0) cache->entry[i] = cache->entry[--cache->num];
+	pthread_mutex_unlock(&cache->mutex);
+}
+
 /** Get a connection from the connection pool
  *
  * @note Must be called with the mutex free.
@@ -818,8 +1315,27 @@ static void *fr_connection_get_internal(fr_connection_pool_t *pool, REQUEST *req
 
 	if (!pool) return NULL;
 
+	/*
+	 *	Try this thread's cache first, it doesn't need the
+	 *	mutex.
+	 */
+	if (pool->thread_cache) {
+		this = fr_connection_thread_cache_get(pool, request);
+		if (this) return this->connection;
+	}
+
 	pthread_mutex_lock(&pool->mutex);
 
+	/*
+	 *	Releases into the thread caches don't check the pool,
+	 *	so a cache miss does.  This also expires idle
+	 *	connections in the other threads' caches.
+	 */
+	if (pool->thread_cache) {
+		fr_connection_pool_check(pool, request);	/* Releases the mutex */
+		pthread_mutex_lock(&pool->mutex);
+	}
+
 	now = time(NULL);
 
 	/*
@@ -891,6 +1407,8 @@ do_return:
 
 	ROPTIONAL(RDEBUG2, DEBUG2, "Reserved connection (%" PRIu64 ")", this->number);
 
+	if (pool->thread_cache) fr_connection_thread_cache_add(pool, this);
+
 	return this->connection;
 }
 
@@ -1070,6 +1588,7 @@ fr_connection_pool_t *fr_connection_pool_init(TALLOC_CTX *ctx,
 	FR_INTEGER_BOUND_CHECK("max", pool->max, <=, 1024);
 	FR_INTEGER_BOUND_CHECK("start", pool->start, <=, pool->max);
 	FR_INTEGER_BOUND_CHECK("spare", pool->spare, <=, (pool->max - pool->min));
+	FR_INTEGER_BOUND_CHECK("thread_cache", pool->thread_cache, <=, FR_CONNECTION_THREAD_CACHE_MAX);
 
 	if (pool->lifetime > 0) {
 		FR_INTEGER_COND_CHECK("idle_timeout", pool->idle_timeout, (pool->idle_timeout <= pool->lifetime), 0);
@@ -1093,9 +1612,22 @@ fr_connection_pool_t *fr_connection_pool_init(TALLOC_CTX *ctx,
 	 */
 	if (check_config) {
 		pool->start = pool->min = pool->max = 1;
+		pool->thread_cache = 0;
 		return pool;
 	}
 
+	/*
+	 *	Connections cached by a thread are returned to the
+	 *	pool when the thread exits.
+	 */
+	if (pool->thread_cache) {
+		if (pthread_key_create(&pool->thread_key, _fr_connection_thread_cache_free) != 0) {
+			ERROR("%s: Failed creating thread cache key", __FUNCTION__);
+			goto error;
+		}
+		pool->thread_key_init = true;
+	}
+
 	/*
 	 *	Create all of the connections, unless the admin says
 	 *	not to.
@@ -1306,6 +1838,35 @@ void fr_connection_pool_free(fr_connection_pool_t *pool)
 
 	pthread_mutex_lock(&pool->mutex);
 
+	/*
+	 *	Stop the per-thread caches from being used, or being
+	 *	freed on thread exit.  The connections they hold are
+	 *	handed back to the pool, and closed below.  Locking
+	 *	each cache ensures its thread has finished with it.
+	 */
+	if (pool->thread_key_init) {
+		fr_connection_thread_cache_t *cache, *next;
+		uint32_t i;
+
+		pthread_key_delete(pool->thread_key);
+		pool->thread_key_init = false;
+		pool->thread_cache = 0;
+
+		for (cache = pool->caches; cache; cache = next) {
+			next = cache->next;
+
+			pthread_mutex_lock(&cache->mutex);
+			for (i = 0; i < cache->num; i++) {
+				fr_connection_thread_cache_return(pool, cache->entry[i].this);
+			}
+			cache->num = 0;
+			pthread_mutex_unlock(&cache->mutex);
+
+			talloc_free(cache);
+		}
+		pool->caches = NULL;
+	}
+
 	/*
 	 *	Don't loop over the list.  Just keep removing the head
 	 *	until they're all gone.
@@ -1369,44 +1930,17 @@ void *fr_connection_get(fr_connection_pool_t *pool, REQUEST *request)
 void fr_connection_release(fr_connection_pool_t *pool, REQUEST *request, void *conn)
 {
 	fr_connection_t *this;
-	struct timeval	held;
 	bool trigger_min = false, trigger_max = false;
 
+	if (pool && pool->thread_cache && fr_connection_thread_cache_release(pool, request, conn)) return;
+
 	this = fr_connection_find(pool, conn);
 	if (!this) return;
 
 	this->in_use = false;
 
-	/*
-	 *	Record when the connection was last released
-	 */
-	gettimeofday(&this->last_released, NULL);
-	pool->state.last_released = this->last_released;
-
-	/*
-	 *	This is done inside the mutex to ensure
-	 *	updates are atomic.
-	 */
-	fr_timeval_subtract(&held, &this->last_released, &this->last_reserved);
-
-	/*
-	 *	Check we've not exceeded out trigger limits
-	 */
-	if ((pool->held_trigger_min.tv_sec || pool->held_trigger_min.tv_usec) &&
-	    (fr_timeval_cmp(&held, &pool->held_trigger_min) < 0) &&
-	    (pool->state.last_held_min != this->last_released.tv_sec)) {
-	    	trigger_min = true;
-	    	pool->state.last_held_min = this->last_released.tv_sec;
-	}
-
-	if ((pool->held_trigger_max.tv_sec || pool->held_trigger_min.tv_usec) &&
-	    (fr_timeval_cmp(&held, &pool->held_trigger_max) > 0) &&
-	    (pool->state.last_held_max != this->last_released.tv_sec)) {
-	    	trigger_max = true;
-	    	pool->state.last_held_max = this->last_released.tv_sec;
-	}
-
-	fr_stats_bins(&pool->state.held_stats, &this->last_reserved, &this->last_released);
+	fr_connection_held(pool, this, &pool->state.held_stats, &pool->state.last_released,
+			   &pool->state.last_held_min, &pool->state.last_held_max, &trigger_min, &trigger_max);
 
 	/*
 	 *	Insert the connection in the heap.
@@ -1465,6 +1999,8 @@ void *fr_connection_reconnect(fr_connection_pool_t *pool, REQUEST *request, void
 
 	if (!pool || !conn) return NULL;
 
+	if (pool->thread_cache) fr_connection_thread_cache_remove(pool, conn);
+
 	/*
 	 *	If fr_connection_find is successful the pool is now locked
 	 */
@@ -1500,6 +2036,8 @@ int fr_connection_close(fr_connection_pool_t *pool, REQUEST *request, void *conn
 {
 	fr_connection_t *this;
 
+	if (pool && pool->thread_cache) fr_connection_thread_cache_remove(pool, conn);
+
 	this = fr_connection_find(pool, conn);
 	if (!this) return 0;
 
@@ -26,18 +26,60 @@
 #include <freeradius-devel/radiusd.h>
 #include <freeradius-devel/rad_assert.h>
 #include <freeradius-devel/exfile.h>
+#include <freeradius-devel/util/ring_buffer.h>
 
 #include <sys/stat.h>
 #include <fcntl.h>
 
-typedef struct exfile_entry_t {
+typedef struct exfile_entry_t exfile_entry_t;
+
+struct exfile_entry_t {
 	int			fd;			//!< File descriptor associated with an entry.
 	int			dup;
 	uint32_t		hash;			//!< Hash for cheap comparison.
 	time_t			last_used;		//!< Last time the entry was used.
 	char			*filename;		//!< Filename.
-} exfile_entry_t;
+	bool			dirty;			//!< Written to by the write-behind thread, and
+							//!< not yet fsync()d.
+
+	exfile_entry_t		*prev;			//!< Previous (more recently used) entry.
+	exfile_entry_t		*next;			//!< Next (less recently used) entry, or
+							//!< next entry in the free list.
+};
+
+
+typedef struct exfile_record_t exfile_record_t;
+
+/** A record queued for the write-behind thread
+ *
+ * Records are allocated from the write-behind ring buffer, and are
+ * followed by the filename, and then the data to write.
+ */
+struct exfile_record_t {
+	exfile_record_t		*next;			//!< Next record in the queue.
+	size_t			size;			//!< Size of the record in the ring buffer.
+	uint32_t		hash;			//!< Hash of the filename.
+	mode_t			permissions;		//!< To use when creating the file.
+	gid_t			gid;			//!< Group to set on the file, or -1.
+	size_t			filename_len;		//!< Length of the filename, including the '\0'.
+	size_t			data_len;		//!< Length of the data.
+	bool			written;		//!< Written, or discarded.  Records which
+							//!< aren't are retried on the next batch.
+
+	exfile_record_t		*next_in_bucket;	//!< Next file in the same hash bucket of the batch.
+	exfile_record_t		*next_for_file;		//!< Next record in the batch for the same file.
+	exfile_record_t		*last_for_file;		//!< Last record in the batch for the same file.
+							//!< Only set on the first record for each file.
+};
 
+#define EXFILE_RECORD_FILENAME(_rec)	((char *) ((_rec) + 1))
+#define EXFILE_RECORD_DATA(_rec)	((uint8_t *) ((_rec) + 1) + (_rec)->filename_len)
+
+#define EXFILE_WRITE_BEHIND_BUFFER_SIZE	(1 << 20)	//!< Default size of the write-behind buffer.
+#define EXFILE_WRITE_BEHIND_MAX_IOV	(64)		//!< Most records we pass to a single writev().
+#define EXFILE_WRITE_BEHIND_BUCKETS	(64)		//!< Hash buckets used to group a batch by file.
+#define EXFILE_WRITE_BEHIND_RETRY	(1)		//!< Seconds to wait before retrying records
+							//!< for files we couldn't open or lock.
 
 struct exfile_t {
 	uint32_t		max_entries;		//!< How many file descriptors we keep track of.
@@ -45,7 +87,33 @@ struct exfile_t {
 	time_t			last_cleaned;
 	pthread_mutex_t		mutex;
 	exfile_entry_t		*entries;
+
+	fr_hash_table_t		*files;			//!< Open entries, indexed by filename.
+	exfile_entry_t		*head;			//!< Most recently used entry.
+	exfile_entry_t		*tail;			//!< Least recently used entry.
+	exfile_entry_t		*free;			//!< Entries with no file open.
+	exfile_entry_t		*reserved;		//!< Entry returned by the last call to exfile_open().
+
 	bool			locking;
+
+	struct {
+		bool			enabled;		//!< Whether the write-behind thread is running.
+		bool			stop;			//!< Tell the write-behind thread to exit.
+		pthread_t		thread;			//!< Write-behind thread.
+		pthread_mutex_t		mutex;			//!< Protects the ring buffer and queue.
+		pthread_cond_t		queued;			//!< Signalled when records are queued.
+		pthread_cond_t		space;			//!< Signalled when space is freed in the
+								//!< ring buffer.
+		fr_ring_buffer_t	*rb;			//!< Records waiting to be written.
+		exfile_record_t		*head;			//!< Oldest queued record.
+		exfile_record_t		*tail;			//!< Newest queued record.
+
+		uint32_t		fsync_records;		//!< fsync() after this many records.
+		uint32_t		fsync_interval;		//!< fsync() at least this often (seconds).
+		uint32_t		unsynced;		//!< Records written since the last fsync().
+		time_t			last_synced;		//!< When we last called fsync().
+	} write_behind;
+
 	CONF_SECTION		*conf;			//!< Conf section to search for triggers.
 	char const		*trigger_prefix;	//!< Trigger path in the global trigger section.
 	VALUE_PAIR		*trigger_args;		//!< Arguments to pass to trigger.
@@ -94,13 +162,81 @@ static inline void exfile_trigger_exec(exfile_t *ef, REQUEST *request, exfile_en
 }
 
 
+static uint32_t exfile_entry_hash(void const *data)
+{
+	exfile_entry_t const *entry = data;
+
+	return entry->hash;
+}
+
+static int exfile_entry_cmp(void const *one, void const *two)
+{
+	exfile_entry_t const *a = one;
+	exfile_entry_t const *b = two;
+
+	if (a->hash < b->hash) return -1;
+	if (a->hash > b->hash) return +1;
+
+	return strcmp(a->filename, b->filename);
+}
+
+/** Remove an entry from the LRU list
+ *
+ * @param[in] ef	the entry belongs to.
+ * @param[in] entry	to remove.
+ */
+static inline void exfile_entry_unlink(exfile_t *ef, exfile_entry_t *entry)
+{
+	if (entry->prev) {
+		entry->prev->next = entry->next;
+	} else {
+		ef->head = entry->next;
+	}
+
+	if (entry->next) {
+		entry->next->prev = entry->prev;
+	} else {
+		ef->tail = entry->prev;
+	}
+
+	entry->prev = entry->next = NULL;
+}
+
+/** Insert an entry at the head (most recently used end) of the LRU list
+ *
+ * @param[in] ef	the entry belongs to.
+ * @param[in] entry	to insert.
+ */
+static inline void exfile_entry_link(exfile_t *ef, exfile_entry_t *entry)
+{
+	entry->prev = NULL;
+	entry->next = ef->head;
+
+	if (ef->head) {
+		ef->head->prev = entry;
+	} else {
+		ef->tail = entry;
+	}
+	ef->head = entry;
+}
+
 static void exfile_cleanup_entry(exfile_t *ef, REQUEST *request, exfile_entry_t *entry)
 {
-	TALLOC_FREE(entry->filename);
+	if (ef->reserved == entry) ef->reserved = NULL;
+
+	/*
+	 *	Entries which are in the hash table are also in the
+	 *	LRU list.
+	 */
+	if (fr_hash_table_yank(ef->files, entry)) exfile_entry_unlink(ef, entry);
+
+	if (entry->dirty) {
+		(void) fsync(entry->fd);
+		entry->dirty = false;
+	}
 
 	close(entry->fd);
 
-	entry->hash = 0;
 	entry->fd = -1;
 	entry->dup = -1;
 
@@ -108,20 +244,38 @@ static void exfile_cleanup_entry(exfile_t *ef, REQUEST *request, exfile_entry_t
 	 *	Issue close trigger *after* we've closed the fd
 	 */
 	exfile_trigger_exec(ef, request, entry, "close");
+
+	TALLOC_FREE(entry->filename);
+	entry->hash = 0;
+
+	entry->prev = NULL;
+	entry->next = ef->free;
+	ef->free = entry;
 }
 
 
 static int _exfile_free(exfile_t *ef)
 {
-	uint32_t i;
+	/*
+	 *	Let the write-behind thread drain the queue, and exit.
+	 */
+	if (ef->write_behind.enabled) {
+		pthread_mutex_lock(&ef->write_behind.mutex);
+		ef->write_behind.stop = true;
+		pthread_cond_signal(&ef->write_behind.queued);
+		pthread_mutex_unlock(&ef->write_behind.mutex);
+
+		pthread_join(ef->write_behind.thread, NULL);
+
+		pthread_cond_destroy(&ef->write_behind.space);
+		pthread_cond_destroy(&ef->write_behind.queued);
+		pthread_mutex_destroy(&ef->write_behind.mutex);
+		ef->write_behind.enabled = false;
+	}
 
 	pthread_mutex_lock(&ef->mutex);
 
-	for (i = 0; i < ef->max_entries; i++) {
-		if (!ef->entries[i].filename) continue;
-
-		exfile_cleanup_entry(ef, NULL, &ef->entries[i]);
-	}
+	while (ef->head) exfile_cleanup_entry(ef, NULL, ef->head);
 
 	pthread_mutex_unlock(&ef->mutex);
 	pthread_mutex_destroy(&ef->mutex);
@@ -142,6 +296,7 @@ static int _exfile_free(exfile_t *ef)
 exfile_t *exfile_init(TALLOC_CTX *ctx, uint32_t max_entries, uint32_t max_idle, bool locking)
 {
 	exfile_t *ef;
+	uint32_t i;
 
 	ef = talloc_zero(NULL, exfile_t);
 	if (!ef) return NULL;
@@ -154,6 +309,22 @@ exfile_t *exfile_init(TALLOC_CTX *ctx, uint32_t max_entries, uint32_t max_idle,
 		return NULL;
 	}
 
+	ef->files = fr_hash_table_create(ef, exfile_entry_hash, exfile_entry_cmp, NULL);
+	if (!ef->files) {
+		talloc_free(ef);
+		return NULL;
+	}
+
+	/*
+	 *	All entries start off on the free list.
+	 */
+	for (i = max_entries; i > 0; i--) {
+		ef->entries[i - 1].fd = -1;
+		ef->entries[i - 1].dup = -1;
+		ef->entries[i - 1].next = ef->free;
+		ef->free = &ef->entries[i - 1];
+	}
+
 	if (pthread_mutex_init(&ef->mutex, NULL) != 0) {
 		talloc_free(ef);
 		return NULL;
@@ -194,6 +365,353 @@ void exfile_enable_triggers(exfile_t *ef, CONF_SECTION *conf, char const *trigge
 }
 
 
+/** Write all of an I/O vector, restarting after short writes
+ *
+ * @param[in] fd	to write to.
+ * @param[in] vector	to write.  Will be modified.
+ * @param[in] iovcnt	number of elements in vector.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure, with errno set.
+ */
+static int exfile_writev(int fd, struct iovec *vector, int iovcnt)
+{
+	ssize_t slen;
+
+	while (iovcnt > 0) {
+		slen = writev(fd, vector, iovcnt);
+		if (slen < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+
+		while ((iovcnt > 0) && ((size_t) slen >= vector->iov_len)) {
+			slen -= vector->iov_len;
+			vector++;
+			iovcnt--;
+		}
+
+		if (iovcnt > 0) {
+			vector->iov_base = ((uint8_t *) vector->iov_base) + slen;
+			vector->iov_len -= slen;
+		}
+	}
+
+	return 0;
+}
+
+/** fsync() all files which the write-behind thread has written to
+ *
+ * @param[in] ef	to sync files for.
+ * @param[in] now	the current time.
+ */
+static void exfile_write_behind_sync(exfile_t *ef, time_t now)
+{
+	exfile_entry_t *entry;
+
+	pthread_mutex_lock(&ef->mutex);
+	for (entry = ef->head; entry; entry = entry->next) {
+		if (!entry->dirty) continue;
+
+		if (fsync(entry->fd) < 0) ERROR("Failed syncing %s: %s", entry->filename, fr_syserror(errno));
+		entry->dirty = false;
+	}
+	pthread_mutex_unlock(&ef->mutex);
+
+	ef->write_behind.unsynced = 0;
+	ef->write_behind.last_synced = now;
+}
+
+/** Write a batch of records
+ *
+ * Records are grouped by file in one pass over the batch, and the records
+ * for each file are coalesced into as few writev() calls as possible.
+ * Records for a file are written in the order they were queued.
+ *
+ * Records are marked as written once they have been passed to writev().
+ * If a file can't be opened or locked (e.g. the detail reader holds the
+ * lock), its records are left unwritten, so that the caller can retry
+ * them.
+ *
+ * @param[in] ef	the records were queued for.
+ * @param[in] head	of the batch.
+ * @param[in] discard	records for files we can't open, instead of leaving
+ *			them to be retried.
+ */
+static void exfile_write_behind_batch(exfile_t *ef, exfile_record_t *head, bool discard)
+{
+	exfile_record_t	*bucket[EXFILE_WRITE_BEHIND_BUCKETS];
+	exfile_record_t	*first, *rec;
+	struct iovec	vector[EXFILE_WRITE_BEHIND_MAX_IOV];
+	int		iovcnt;
+
+	/*
+	 *	The first record for each file heads a list of all of
+	 *	the records for that file.  Hash comparisons are fast,
+	 *	so we only compare filenames when the hashes match.
+	 */
+	memset(bucket, 0, sizeof(bucket));
+	for (rec = head; rec; rec = rec->next) {
+		exfile_record_t **slot = &bucket[rec->hash & (EXFILE_WRITE_BEHIND_BUCKETS - 1)];
+
+		rec->next_for_file = NULL;
+		rec->last_for_file = NULL;
+
+		if (rec->written) continue;
+
+		for (first = *slot; first; first = first->next_in_bucket) {
+			if ((first->hash == rec->hash) &&
+			    (strcmp(EXFILE_RECORD_FILENAME(first), EXFILE_RECORD_FILENAME(rec)) == 0)) break;
+		}
+
+		if (first) {
+			first->last_for_file->next_for_file = rec;
+			first->last_for_file = rec;
+			continue;
+		}
+
+		rec->last_for_file = rec;
+		rec->next_in_bucket = *slot;
+		*slot = rec;
+	}
+
+	for (first = head; first; first = first->next) {
+		char const	*filename;
+		int		fd;
+
+		if (!first->last_for_file) continue;
+
+		filename = EXFILE_RECORD_FILENAME(first);
+
+		/*
+		 *	If we can't open the file, its records are
+		 *	left for the next batch.
+		 */
+		fd = exfile_open(ef, NULL, filename, first->permissions, true);
+		if (fd < 0) {
+			if (!discard) {
+				WARN("Failed to open %s: %s.  Will retry", filename, fr_strerror());
+				continue;
+			}
+
+			ERROR("Failed to open %s: %s.  Discarding its records", filename, fr_strerror());
+			for (rec = first; rec; rec = rec->next_for_file) rec->written = true;
+			continue;
+		}
+
+		if ((first->gid != (gid_t) -1) && (chown(filename, -1, first->gid) < 0)) {
+			WARN("Unable to change system group of \"%s\": %s", filename, fr_syserror(errno));
+		}
+
+		/*
+		 *	exfile_open() returns holding the mutex, so
+		 *	the reserved entry is still ours.
+		 */
+		if (ef->write_behind.fsync_records || ef->write_behind.fsync_interval) ef->reserved->dirty = true;
+
+		/*
+		 *	Don't block other threads opening files while we
+		 *	write.  The dup'd descriptor is ours until we
+		 *	close it.
+		 */
+		exfile_unlock(ef, NULL, fd);
+
+		/*
+		 *	We can't tell how much of a failed writev()
+		 *	made it to disk, so records aren't retried
+		 *	once we've tried to write them.
+		 */
+		for (rec = first; rec; rec = rec->next_for_file) rec->written = true;
+
+		iovcnt = 0;
+		for (rec = first; rec; rec = rec->next_for_file) {
+			vector[iovcnt].iov_base = EXFILE_RECORD_DATA(rec);
+			vector[iovcnt].iov_len = rec->data_len;
+			iovcnt++;
+			ef->write_behind.unsynced++;
+
+			if ((iovcnt < EXFILE_WRITE_BEHIND_MAX_IOV) && rec->next_for_file) continue;
+
+			if (exfile_writev(fd, vector, iovcnt) < 0) {
+				ERROR("Failed writing to %s: %s", filename, fr_syserror(errno));
+				break;
+			}
+			iovcnt = 0;
+		}
+
+		close(fd); /* releases the fcntl lock */
+	}
+}
+
+/** Write queued records to disk
+ *
+ * Records for files we can't open or lock are held, and retried every
+ * EXFILE_WRITE_BEHIND_RETRY seconds, or when more records are queued.
+ * As the ring buffer is freed in order, every record queued after a
+ * held one also stays in the buffer until the held record is written.
+ *
+ * @param[in] arg	the exfile_t to write records for.
+ * @return NULL.
+ */
+static void *exfile_write_behind_thread(void *arg)
+{
+	exfile_t	*ef = arg;
+	exfile_record_t	*head, *rec, **last;
+	exfile_record_t	*held = NULL;
+	size_t		used;
+	time_t		now, retry = 0;
+	bool		stop;
+
+	pthread_mutex_lock(&ef->write_behind.mutex);
+
+	for (;;) {
+		while (!ef->write_behind.head && !ef->write_behind.stop) {
+			struct timespec when;
+			time_t wake = 0;
+
+			/*
+			 *	Wake up in time to sync the data we've
+			 *	already written, or to retry the records
+			 *	we couldn't write.
+			 */
+			if (ef->write_behind.fsync_interval && ef->write_behind.unsynced) {
+				wake = ef->write_behind.last_synced + ef->write_behind.fsync_interval;
+			}
+			if (held && (!wake || (retry < wake))) wake = retry;
+
+			if (!wake) {
+				pthread_cond_wait(&ef->write_behind.queued, &ef->write_behind.mutex);
+				continue;
+			}
+
+			when.tv_sec = wake;
+			when.tv_nsec = 0;
+			if (pthread_cond_timedwait(&ef->write_behind.queued, &ef->write_behind.mutex, &when) != ETIMEDOUT) {
+				continue;
+			}
+
+			now = time(NULL);
+			if (ef->write_behind.fsync_interval && ef->write_behind.unsynced &&
+			    (now >= (ef->write_behind.last_synced + (time_t) ef->write_behind.fsync_interval))) {
+				pthread_mutex_unlock(&ef->write_behind.mutex);
+				exfile_write_behind_sync(ef, now);
+				pthread_mutex_lock(&ef->write_behind.mutex);
+			}
+
+			if (held && (now >= retry)) break;
+		}
+
+		/*
+		 *	Only exit once everything has been written.
+		 */
+		if (!ef->write_behind.head && !held) break;
+
+		head = ef->write_behind.head;
+		ef->write_behind.head = ef->write_behind.tail = NULL;
+		stop = ef->write_behind.stop;
+		pthread_mutex_unlock(&ef->write_behind.mutex);
+
+		/*
+		 *	Held records were queued first, so they go
+		 *	first.
+		 */
+		if (held) {
+			for (last = &held; *last; last = &(*last)->next);
+			*last = head;
+			head = held;
+		}
+
+		/*
+		 *	When we're exiting, no one will retry the records
+		 *	we can't write, so they're discarded.
+		 */
+		exfile_write_behind_batch(ef, head, stop);
+
+		now = time(NULL);
+		if ((ef->write_behind.fsync_records && (ef->write_behind.unsynced >= ef->write_behind.fsync_records)) ||
+		    (ef->write_behind.fsync_interval &&
+		     (now >= (ef->write_behind.last_synced + (time_t) ef->write_behind.fsync_interval)))) {
+			exfile_write_behind_sync(ef, now);
+		}
+
+		/*
+		 *	Records are freed in the order they were
+		 *	allocated, so we free everything before the
+		 *	first record we couldn't write, and hold the
+		 *	rest.
+		 */
+		used = 0;
+		for (rec = head; rec && rec->written; rec = rec->next) used += rec->size;
+
+		held = rec;
+		if (held) retry = now + EXFILE_WRITE_BEHIND_RETRY;
+
+		pthread_mutex_lock(&ef->write_behind.mutex);
+		if (used) {
+			fr_ring_buffer_free(ef->write_behind.rb, used);
+			pthread_cond_broadcast(&ef->write_behind.space);
+		}
+	}
+
+	pthread_mutex_unlock(&ef->write_behind.mutex);
+
+	if (ef->write_behind.unsynced) exfile_write_behind_sync(ef, time(NULL));
+
+	return NULL;
+}
+
+/** Enable write-behind for an exfiles handle
+ *
+ * Data passed to exfile_write() is copied to a ring buffer, and written
+ * to disk by a dedicated thread.  Records for the same file are coalesced
+ * into large writev() calls, so the callers don't block on disk I/O.
+ *
+ * @param[in] ef		to enable write-behind for.
+ * @param[in] buffer_size	of the ring buffer.  0 for the default.
+ * @param[in] fsync_records	fsync() files after this many records have been written.
+ *				0 to disable.
+ * @param[in] fsync_interval	fsync() files at least this often (in seconds).
+ *				0 to disable.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int exfile_enable_write_behind(exfile_t *ef, size_t buffer_size, uint32_t fsync_records, uint32_t fsync_interval)
+{
+	if (ef->write_behind.enabled) return 0;
+
+	if (!buffer_size) buffer_size = EXFILE_WRITE_BEHIND_BUFFER_SIZE;
+
+	ef->write_behind.rb = fr_ring_buffer_create(ef, buffer_size);
+	if (!ef->write_behind.rb) {
+		fr_strerror_printf("Failed allocating write-behind buffer");
+		return -1;
+	}
+
+	ef->write_behind.fsync_records = fsync_records;
+	ef->write_behind.fsync_interval = fsync_interval;
+	ef->write_behind.last_synced = time(NULL);
+
+	pthread_mutex_init(&ef->write_behind.mutex, NULL);
+	pthread_cond_init(&ef->write_behind.queued, NULL);
+	pthread_cond_init(&ef->write_behind.space, NULL);
+
+	if (pthread_create(&ef->write_behind.thread, NULL, exfile_write_behind_thread, ef) != 0) {
+		fr_strerror_printf("Failed creating write-behind thread: %s", fr_syserror(errno));
+
+		pthread_cond_destroy(&ef->write_behind.space);
+		pthread_cond_destroy(&ef->write_behind.queued);
+		pthread_mutex_destroy(&ef->write_behind.mutex);
+		TALLOC_FREE(ef->write_behind.rb);
+		return -1;
+	}
+
+	ef->write_behind.enabled = true;
+
+	return 0;
+}
+
+
 /** Open a new log file, or maybe an existing one.
  *
  * When multithreaded, the FD is locked via a mutex.  This way we're
@@ -210,99 +728,86 @@ void exfile_enable_triggers(exfile_t *ef, CONF_SECTION *conf, char const *trigge
  */
 int exfile_open(exfile_t *ef, REQUEST *request, char const *filename, mode_t permissions, bool append)
 {
-	int i, tries, unused = -1, found = -1, oldest = -1;
-	bool do_cleanup = false;
-	uint32_t hash;
+	int tries;
 	time_t now = time(NULL);
 	struct stat st;
+	exfile_entry_t *entry, my_entry;
 
 	if (!ef || !filename) return -1;
 
-	hash = fr_hash_string(filename);
-	unused = -1;
+	memcpy(&my_entry.filename, &filename, sizeof(my_entry.filename));
+	my_entry.hash = fr_hash_string(filename);
 
 	pthread_mutex_lock(&ef->mutex);
 
-	if (now > (ef->last_cleaned + 1)) do_cleanup = true;
-
 	/*
-	 *	Find the matching entry, or an unused one.
-	 *
-	 *	Also track which entry is the oldest, in case there
-	 *	are no unused entries.
+	 *	Hash comparisons are fast.  String comparisons are
+	 *	slow.  The hash table does the string comparison only
+	 *	when the hashes match.
 	 */
-	for (i = 0; i < (int) ef->max_entries; i++) {
-		if (!ef->entries[i].filename) {
-			if (unused < 0) unused = i;
-			continue;
-		}
-
-		if ((oldest < 0) ||
-		    (ef->entries[i].last_used < ef->entries[oldest].last_used)) {
-			oldest = i;
-		}
-
+	entry = fr_hash_table_finddata(ef->files, &my_entry);
+	if (entry) {
 		/*
-		 *	Hash comparisons are fast.  String comparisons are slow.
-		 *
-		 *	But we still need to do string comparisons if
-		 *	the hash matches, because 1/2^16 filenames
-		 *	will result in a hash collision.  And that's
-		 *	enough filenames in a long-running server to
-		 *	ensure that it happens.
+		 *	Move it to the head of the LRU list, so that
+		 *	it isn't expired below.
 		 */
-		if ((found < 0) &&
-		    (ef->entries[i].hash == hash) &&
-		    (strcmp(ef->entries[i].filename, filename) == 0)) {
-			found = i;
-
-			/*
-			 *	If we're not cleanin up, stop now.
-			 */
-			if (!do_cleanup) break;
-
-			/*
-			 *	If we are cleaning up, and only
-			 *	entries OTHER than the one we found,
-			 *	do so now.
-			 */
-		} else if (do_cleanup) {
-			if ((ef->entries[i].last_used + ef->max_idle) >= now) continue;
-
-			exfile_cleanup_entry(ef, request, &ef->entries[i]);
+		entry->last_used = now;
+		if (ef->head != entry) {
+			exfile_entry_unlink(ef, entry);
+			exfile_entry_link(ef, entry);
 		}
 	}
 
-	if (do_cleanup) ef->last_cleaned = now;
+	/*
+	 *	Close entries which have been idle for too long.  The
+	 *	LRU list is ordered by last_used, so we only look at
+	 *	the entries we close, plus one.
+	 */
+	if (now > (ef->last_cleaned + 1)) {
+		while (ef->tail && ((ef->tail->last_used + ef->max_idle) < now)) {
+			exfile_cleanup_entry(ef, request, ef->tail);
+		}
+		ef->last_cleaned = now;
+	}
 
 	/*
 	 *	We found an existing entry, return that
 	 */
-	if (found >= 0) {
-		i = found;
-		goto do_return;
-	}
+	if (entry) goto do_return;
 
 	/*
 	 *	There are no unused entries, free the oldest one.
 	 */
-	if (unused < 0) {
-		exfile_cleanup_entry(ef, request, &ef->entries[oldest]);
-		unused = oldest;
+	if (!ef->free) {
+		rad_assert(ef->tail != NULL);
+		exfile_cleanup_entry(ef, request, ef->tail);
 	}
 
 	/*
 	 *	Create a new entry.
 	 */
-	i = unused;
+	entry = ef->free;
+	ef->free = entry->next;
 
-	ef->entries[i].hash = hash;
-	ef->entries[i].filename = talloc_strdup(ef->entries, filename);
-	ef->entries[i].fd = -1;
-	ef->entries[i].dup = -1;
+	entry->hash = my_entry.hash;
+	entry->filename = talloc_strdup(ef->entries, filename);
+	entry->fd = -1;
+	entry->dup = -1;
+	entry->last_used = now;
+
+	if (!fr_hash_table_insert(ef->files, entry)) {
+		fr_strerror_printf("Failed tracking file %s", filename);
+		TALLOC_FREE(entry->filename);
+		entry->next = ef->free;
+		ef->free = entry;
 
-	ef->entries[i].fd = open(filename, O_RDWR | O_APPEND | O_CREAT, permissions);
-	if (ef->entries[i].fd < 0) {
+		pthread_mutex_unlock(&(ef->mutex));
+		return -1;
+	}
+	exfile_entry_link(ef, entry);
+
+	entry->fd = open(filename, O_RDWR | O_APPEND | O_CREAT, permissions);
+	if (entry->fd < 0) {
 		mode_t dirperm;
 		char *p, *dir;
 
@@ -336,27 +841,27 @@ int exfile_open(exfile_t *ef, REQUEST *request, char const *filename, mode_t per
 		}
 		talloc_free(dir);
 
-		ef->entries[i].fd = open(filename, O_WRONLY | O_CREAT, permissions);
-		if (ef->entries[i].fd < 0) {
+		entry->fd = open(filename, O_WRONLY | O_CREAT, permissions);
+		if (entry->fd < 0) {
 			fr_strerror_printf("Failed to open file %s: %s",
 					   filename, strerror(errno));
 			goto error;
 		} /* else fall through to creating the rest of the entry */
 
-		exfile_trigger_exec(ef, request, &ef->entries[i], "create");
+		exfile_trigger_exec(ef, request, entry, "create");
 	} /* else the file was already opened */
 
-	exfile_trigger_exec(ef, request, &ef->entries[i], "open");
+	exfile_trigger_exec(ef, request, entry, "open");
 
 do_return:
 	/*
 	 *	Lock from the start of the file.
 	 */
-	if (lseek(ef->entries[i].fd, 0, SEEK_SET) < 0) {
+	if (lseek(entry->fd, 0, SEEK_SET) < 0) {
 		fr_strerror_printf("Failed to seek in file %s: %s", filename, strerror(errno));
 
 	error:
-		exfile_cleanup_entry(ef, request, &ef->entries[i]);
+		exfile_cleanup_entry(ef, request, entry);
 
 		pthread_mutex_unlock(&(ef->mutex));
 		return -1;
@@ -370,16 +875,16 @@ do_return:
 	 */
 	if (ef->locking) {
 		for (tries = 0; tries < MAX_TRY_LOCK; tries++) {
-			if (rad_lockfd_nonblock(ef->entries[i].fd, 0) >= 0) break;
+			if (rad_lockfd_nonblock(entry->fd, 0) >= 0) break;
 
 			if (errno != EAGAIN) {
 				fr_strerror_printf("Failed to lock file %s: %s", filename, strerror(errno));
 				goto error;
 			}
 
-			close(ef->entries[i].fd);
-			ef->entries[i].fd = open(filename, O_WRONLY | O_CREAT, permissions);
-			if (ef->entries[i].fd < 0) {
+			close(entry->fd);
+			entry->fd = open(filename, O_WRONLY | O_CREAT, permissions);
+			if (entry->fd < 0) {
 				fr_strerror_printf("Failed to open file %s: %s",
 						   filename, strerror(errno));
 				goto error;
@@ -396,15 +901,15 @@ do_return:
 	 *	Maybe someone deleted the file while we were waiting
 	 *	for the lock.  If so, re-open it.
 	 */
-	if (fstat(ef->entries[i].fd, &st) < 0) {
+	if (fstat(entry->fd, &st) < 0) {
 		fr_strerror_printf("Failed to stat file %s: %s", filename, strerror(errno));
 		goto error;
 	}
 
 	if (st.st_nlink == 0) {
-		close(ef->entries[i].fd);
-		ef->entries[i].fd = open(filename, O_WRONLY | O_CREAT, permissions);
-		if (ef->entries[i].fd < 0) {
+		close(entry->fd);
+		entry->fd = open(filename, O_WRONLY | O_CREAT, permissions);
+		if (entry->fd < 0) {
 			fr_strerror_printf("Failed to open file %s: %s",
 					   filename, strerror(errno));
 			goto error;
@@ -415,21 +920,23 @@ do_return:
 	 *	Seek to the end of the file before returning the FD to
 	 *	the caller.
 	 */
-	if (append) lseek(ef->entries[i].fd, 0, SEEK_END);
+	if (append) lseek(entry->fd, 0, SEEK_END);
 
 	/*
 	 *	Return holding the mutex for the entry.
 	 */
-	ef->entries[i].last_used = now;
-	ef->entries[i].dup = dup(ef->entries[i].fd);
-	if (ef->entries[i].dup < 0) {
+	entry->last_used = now;
+	entry->dup = dup(entry->fd);
+	if (entry->dup < 0) {
 		fr_strerror_printf("Failed calling dup(): %s", strerror(errno));
 		goto error;
 	}
 
-	exfile_trigger_exec(ef, request, &ef->entries[i], "reserve");
+	ef->reserved = entry;
+
+	exfile_trigger_exec(ef, request, entry, "reserve");
 
-	return ef->entries[i].dup;
+	return entry->dup;
 }
 
 /** Close the log file.  Really just return it to the pool.
@@ -447,25 +954,27 @@ do_return:
  */
 int exfile_close(exfile_t *ef, REQUEST *request, int fd)
 {
-	uint32_t i;
+	exfile_entry_t *entry = ef->reserved;
 
-	for (i = 0; i < ef->max_entries; i++) {
-		if (!ef->entries[i].filename) continue;
+	/*
+	 *	We hold the mutex, so the entry we returned from
+	 *	exfile_open() is the only one which can be reserved.
+	 */
+	if (entry && (entry->dup == fd)) {
+		ef->reserved = NULL;
 
 		/*
 		 *	Unlock the bytes that we had previously locked.
 		 */
-		if (ef->entries[i].dup == fd) {
-			if (ef->locking) (void) rad_unlockfd(ef->entries[i].dup, 0);
-			close(ef->entries[i].dup); /* releases the fcntl lock */
-			ef->entries[i].dup = -1;
+		if (ef->locking) (void) rad_unlockfd(entry->dup, 0);
+		close(entry->dup); /* releases the fcntl lock */
+		entry->dup = -1;
 
-			pthread_mutex_unlock(&(ef->mutex));
+		pthread_mutex_unlock(&(ef->mutex));
 
-			exfile_trigger_exec(ef, request, &ef->entries[i], "release");
+		exfile_trigger_exec(ef, request, entry, "release");
 
-			return 0;
-		}
+		return 0;
 	}
 
 	pthread_mutex_unlock(&(ef->mutex));
@@ -479,20 +988,17 @@ int exfile_close(exfile_t *ef, REQUEST *request, int fd)
  */
 int exfile_unlock(exfile_t *ef, REQUEST *request, int fd)
 {
-	uint32_t i;
+	exfile_entry_t *entry = ef->reserved;
 
-	for (i = 0; i < ef->max_entries; i++) {
-		if (!ef->entries[i].filename) continue;
+	if (entry && (entry->dup == fd)) {
+		ef->reserved = NULL;
+		entry->dup = -1;
 
-		if (ef->entries[i].dup == fd) {
-			ef->entries[i].dup = -1;
-
-			pthread_mutex_unlock(&(ef->mutex));
+		pthread_mutex_unlock(&(ef->mutex));
 
-			exfile_trigger_exec(ef, request, &ef->entries[i], "release");
+		exfile_trigger_exec(ef, request, entry, "release");
 
-			return 0;
-		}
+		return 0;
 	}
 
 	pthread_mutex_unlock(&(ef->mutex));
@@ -500,3 +1006,119 @@ int exfile_unlock(exfile_t *ef, REQUEST *request, int fd)
 	fr_strerror_printf("Attempt to unlock file which does not exist");
 	return -1;
 }
+
+/** Append data to a file
+ *
+ * If write-behind is enabled, the data is queued for the write-behind
+ * thread, and this function only blocks if the queue is full.  Otherwise
+ * the data is written before this function returns.
+ *
+ * @param[in] ef		The logfile context returned from exfile_init().
+ * @param[in] request		The current request.
+ * @param[in] filename		the file to write to.
+ * @param[in] permissions	to use if the file is created.
+ * @param[in] gid		group to set on the file, or -1 to leave it unchanged.
+ * @param[in] vector		data to write.
+ * @param[in] iovcnt		number of elements in vector.
+ * @return
+ *	- The amount of data written, or queued.
+ *	- -1 on failure.
+ */
+ssize_t exfile_write(exfile_t *ef, REQUEST *request, char const *filename,
+		     mode_t permissions, gid_t gid, struct iovec const *vector, int iovcnt)
+{
+	exfile_record_t	*rec;
+	uint8_t		*p;
+	size_t		data_len = 0, filename_len, size;
+	int		i;
+
+	for (i = 0; i < iovcnt; i++) data_len += vector[i].iov_len;
+
+	if (!ef->write_behind.enabled) {
+		struct iovec	my_vector[EXFILE_WRITE_BEHIND_MAX_IOV], *to_write = my_vector;
+		int		fd, ret;
+
+		fd = exfile_open(ef, request, filename, permissions, true);
+		if (fd < 0) return -1;
+
+		if ((gid != (gid_t) -1) && (chown(filename, -1, gid) < 0)) {
+			ROPTIONAL(RWDEBUG, WARN, "Unable to change system group of \"%s\": %s",
+				  filename, fr_syserror(errno));
+		}
+
+		/*
+		 *	exfile_writev() modifies the vector.
+		 */
+		if (iovcnt > EXFILE_WRITE_BEHIND_MAX_IOV) MEM(to_write = talloc_array(NULL, struct iovec, iovcnt));
+		memcpy(to_write, vector, sizeof(to_write[0]) * iovcnt);
+
+		ret = exfile_writev(fd, to_write, iovcnt);
+		if (ret < 0) fr_strerror_printf("Failed writing to %s: %s", filename, fr_syserror(errno));
+
+		if (to_write != my_vector) talloc_free(to_write);
+		exfile_close(ef, request, fd);
+
+		if (ret < 0) return -1;
+
+		return data_len;
+	}
+
+	/*
+	 *	Keep records aligned, so that the next header in the
+	 *	ring buffer is too.
+	 */
+	filename_len = strlen(filename) + 1;
+	size = (sizeof(*rec) + filename_len + data_len + 7) & ~((size_t) 7);
+
+	if (size > fr_ring_buffer_size(ef->write_behind.rb)) {
+		fr_strerror_printf("Record of %zu bytes is too large for the write-behind buffer", data_len);
+		return -1;
+	}
+
+	pthread_mutex_lock(&ef->write_behind.mutex);
+
+	/*
+	 *	The disk is falling behind.  Wait for the write-behind
+	 *	thread to make room.
+	 */
+	while (!(p = fr_ring_buffer_alloc(ef->write_behind.rb, size))) {
+		if (ef->write_behind.stop) {
+			pthread_mutex_unlock(&ef->write_behind.mutex);
+			fr_strerror_printf("Write-behind thread is exiting");
+			return -1;
+		}
+
+		pthread_cond_wait(&ef->write_behind.space, &ef->write_behind.mutex);
+	}
+
+	rec = (exfile_record_t *) p;
+	rec->next = NULL;
+	rec->size = size;
+	rec->hash = fr_hash_string(filename);
+	rec->permissions = permissions;
+	rec->gid = gid;
+	rec->filename_len = filename_len;
+	rec->data_len = data_len;
+	rec->written = false;
+	rec->last_for_file = NULL;
+
+	memcpy(EXFILE_RECORD_FILENAME(rec), filename, filename_len);
+
+	p = EXFILE_RECORD_DATA(rec);
+	for (i = 0; i < iovcnt; i++) {
+		memcpy(p, vector[i].iov_base, vector[i].iov_len);
+		p += vector[i].iov_len;
+	}
+
+	if (ef->write_behind.tail) {
+		ef->write_behind.tail->next = rec;
+	} else {
+		ef->write_behind.head = rec;
+		pthread_cond_signal(&ef->write_behind.queued);
+	}
+	ef->write_behind.tail = rec;
+
+	pthread_mutex_unlock(&ef->write_behind.mutex);
+
+	return data_len;
+}
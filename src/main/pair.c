@@ -382,6 +382,10 @@ int paircompare_register_byname(char const *name, fr_dict_attr_t const *from,
 }
 
 /** Register a function as compare function.
+ *
+ * Must be called when the module is bootstrapped.  Modules which look at check
+ * items when they're instantiated (e.g. rlm_files) need to know which attributes
+ * have comparison functions.
  *
  * @param attribute to register comparison function for.
  * @param from the attribute we want to compare with. Normally this is the same as attribute.
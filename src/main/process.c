@@ -2178,14 +2178,16 @@ static int insert_into_proxy_hash(REQUEST *request)
 
 		if (tries > 0) continue; /* try opening new socket only once */
 
-		if (proxy_no_new_sockets) break;
+		/*
+		 *	The allocation may have failed only because
+		 *	the existing sockets are busy.  If we can't
+		 *	open a new one, the second try will use them.
+		 */
+		if (proxy_no_new_sockets) continue;
 
 		RDEBUG3("proxy: Trying to open a new listener to the home server");
 		this = proxy_new_listener(proxy_ctx, request->proxy->home_server, 0);
-		if (!this) {
-			pthread_mutex_unlock(&proxy_mutex);
-			goto fail;
-		}
+		if (!this) continue;
 
 		request->proxy->packet->src_port = 0; /* Use any new socket */
 		proxy_listener = this;
@@ -5346,6 +5348,13 @@ int radius_event_start(bool have_children)
 		 */
 		MEM(proxy_list = fr_packet_list_create(1));
 
+		/*
+		 *	Open a new source port when 3/4 of the IDs
+		 *	on every socket to a home server are in use,
+		 *	instead of waiting until there are none left.
+		 */
+		fr_packet_list_fanout(proxy_list, 192);
+
 		if (pthread_mutex_init(&proxy_mutex, NULL) != 0) {
 			ERROR("Failed to initialize proxy mutex: %s", fr_syserror(errno));
 			return -1;
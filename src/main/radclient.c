@@ -26,6 +26,7 @@ RCSID("$Id$")
 
 #include <freeradius-devel/radclient.h>
 #include <freeradius-devel/conf.h>
+#include <freeradius-devel/udp.h>
 #include <ctype.h>
 
 #ifdef HAVE_GETOPT_H
@@ -39,6 +40,8 @@ typedef struct REQUEST REQUEST;	/* to shut up warnings about mschap.h */
 #include "smbdes.h"
 #include "mschap.h"
 
+#define USEC (1000000)
+
 static int retries = 3;
 static float timeout = 5;
 static char *secret = NULL;
@@ -55,8 +58,8 @@ static bool print_filename = false;
 
 static fr_ipaddr_t client_ipaddr;
 static uint16_t client_port = 0;
+static int num_sockets = 1;
 
-static int sockfd;
 static int last_used_id = -1;
 
 #ifdef WITH_TCP
@@ -66,12 +69,26 @@ static int ipproto = IPPROTO_UDP;
 
 static rbtree_t *filename_tree = NULL;
 static fr_packet_list_t *pl = NULL;
+static fr_event_list_t *events = NULL;
 
 static int sleep_time = -1;
 
 static rc_request_t *request_head = NULL;
 static rc_request_t *rc_request_tail = NULL;
 
+/*
+ *	Rate mode.  Copies of the requests are sent on a fixed
+ *	schedule, whether or not the server has replied yet.
+ */
+static uint32_t rate = 0;
+static uint64_t rate_total = 0;
+static uint64_t rate_sent = 0;
+static struct timeval rate_start;
+static rc_request_t *rate_next = NULL;
+static fr_event_timer_t *rate_ev = NULL;
+
+#define RATE_BURST (256)
+
 static char const *radclient_version = RADIUSD_VERSION_STRING_BUILD("radclient");
 
 static void NEVER_RETURNS usage(void)
@@ -90,10 +107,12 @@ static void NEVER_RETURNS usage(void)
 	fprintf(stderr, "  -h                     Print usage help information.\n");
 	fprintf(stderr, "  -i <id>                Set request id to 'id'.  Values may be 0..255\n");
 	fprintf(stderr, "  -n <num>               Send N requests/s\n");
+	fprintf(stderr, "  -N <num>               Open 'num' source sockets, and spread packets across them.\n");
 	fprintf(stderr, "  -p <num>               Send 'num' packets from a file in parallel.\n");
 	fprintf(stderr, "  -q                     Do not print anything out.\n");
 	fprintf(stderr, "  -r <retries>           If timeout, retry sending the packet 'retries' times.\n");
-	fprintf(stderr, "  -s                     Print out summary information of auth results.\n");
+	fprintf(stderr, "  -R <rate>              Send packets at a constant 'rate' per second, without waiting for replies.\n");
+	fprintf(stderr, "  -s                     Print out summary information of auth results and response times.\n");
 	fprintf(stderr, "  -S <file>              read secret from file, not command line.\n");
 	fprintf(stderr, "  -t <timeout>           Wait 'timeout' seconds before retrying (may be a floating point number).\n");
 	fprintf(stderr, "  -v                     Show program version information.\n");
@@ -814,6 +833,37 @@ static void deallocate_id(rc_request_t *request)
 	if (request->reply) fr_radius_free(&request->reply);
 }
 
+static void rc_recv(fr_event_list_t *el, int sockfd, void *ctx);
+
+/*
+ *	Open a new source socket, and listen for replies on it.
+ */
+static void rc_socket_add(fr_ipaddr_t *dst_ipaddr, uint16_t dst_port, uint16_t src_port)
+{
+	int mysockfd;
+
+#ifdef WITH_TCP
+	if (proto) {
+		mysockfd = fr_socket_client_tcp(NULL, dst_ipaddr, dst_port, false);
+	} else
+#endif
+	mysockfd = fr_socket(&client_ipaddr, src_port);
+	if (mysockfd < 0) {
+		ERROR("Failed opening socket");
+		exit(1);
+	}
+
+	if (!fr_packet_list_socket_add(pl, mysockfd, ipproto, dst_ipaddr, dst_port, NULL)) {
+		ERROR("Can't add new socket");
+		exit(1);
+	}
+
+	if (fr_event_fd_insert(events, mysockfd, rc_recv, NULL, NULL, NULL) < 0) {
+		ERROR("Can't listen on new socket");
+		exit(1);
+	}
+}
+
 /*
  *	Send one packet.
  */
@@ -844,26 +894,7 @@ static int send_one_packet(rc_request_t *request)
 		request->packet->src_ipaddr.af = server_ipaddr.af;
 		rcode = fr_packet_list_id_alloc(pl, ipproto, &request->packet, NULL);
 		if (!rcode) {
-			int mysockfd;
-
-#ifdef WITH_TCP
-			if (proto) {
-				mysockfd = fr_socket_client_tcp(NULL,
-								&request->packet->dst_ipaddr,
-								request->packet->dst_port, false);
-			} else
-#endif
-			mysockfd = fr_socket(&client_ipaddr, 0);
-			if (mysockfd < 0) {
-				ERROR("Failed opening socket");
-				exit(1);
-			}
-			if (!fr_packet_list_socket_add(pl, mysockfd, ipproto,
-						       &request->packet->dst_ipaddr,
-						       request->packet->dst_port, NULL)) {
-				ERROR("Can't add new socket");
-				exit(1);
-			}
+			rc_socket_add(&request->packet->dst_ipaddr, request->packet->dst_port, 0);
 			goto retry;
 		}
 
@@ -961,6 +992,7 @@ static int send_one_packet(rc_request_t *request)
 	/*
 	 *	Send the packet.
 	 */
+	gettimeofday(&request->sent, NULL);
 	if (fr_radius_send(request->packet, NULL, secret) < 0) {
 		REDEBUG("Failed to send packet for ID %d", request->packet->id);
 		deallocate_id(request);
@@ -975,46 +1007,13 @@ static int send_one_packet(rc_request_t *request)
 }
 
 /*
- *	Receive one packet, maybe.
+ *	Process a reply which has been read from one of our sockets.
  */
-static int recv_one_packet(int wait_time)
+static void rc_process_reply(RADIUS_PACKET *reply)
 {
-	fd_set		set;
-	struct timeval  tv;
 	rc_request_t	*request;
-	RADIUS_PACKET	*reply, **packet_p;
-	volatile int max_fd;
-
-	/* And wait for reply, timing out as necessary */
-	FD_ZERO(&set);
-
-	max_fd = fr_packet_list_fd_set(pl, &set);
-	if (max_fd < 0) exit(1); /* no sockets to listen on! */
-
-	tv.tv_sec = (wait_time <= 0) ? 0 : wait_time;
-	tv.tv_usec = 0;
-
-	/*
-	 *	No packet was received.
-	 */
-	if (select(max_fd, &set, NULL, NULL, &tv) <= 0) return 0;
-
-	/*
-	 *	Look for the packet.
-	 */
-	reply = fr_packet_list_recv(pl, &set);
-	if (!reply) {
-		ERROR("Received bad packet");
-#ifdef WITH_TCP
-		/*
-		 *	If the packet is bad, we close the socket.
-		 *	I'm not sure how to do that now, so we just
-		 *	die...
-		 */
-		if (proto) exit(1);
-#endif
-		return -1;	/* bad packet */
-	}
+	RADIUS_PACKET	**packet_p;
+	struct timeval	now, elapsed;
 
 	/*
 	 *	We don't use udpfromto.  So if we bind to "*", we want
@@ -1047,7 +1046,7 @@ static int recv_one_packet(int wait_time)
 		ERROR("Received reply to request we did not send. (id=%d socket %d)",
 		      reply->id, reply->sockfd);
 		fr_radius_free(&reply);
-		return -1;	/* got reply to packet we didn't send */
+		return;		/* got reply to packet we didn't send */
 	}
 	request = fr_packet2myptr(rc_request_t, packet, packet_p);
 
@@ -1061,6 +1060,10 @@ static int recv_one_packet(int wait_time)
 		goto packet_done; /* shared secret is incorrect */
 	}
 
+	gettimeofday(&now, NULL);
+	fr_timeval_subtract(&elapsed, &now, &request->sent);
+	fr_histogram_add(stats.latency, ((uint64_t) elapsed.tv_sec * USEC) + elapsed.tv_usec);
+
 	if (print_filename) {
 		RDEBUG("%s response code %d", request->files->packets, reply->code);
 	}
@@ -1136,12 +1139,214 @@ static int recv_one_packet(int wait_time)
 	}
 
 packet_done:
-fr_radius_free(&request->reply);
+	fr_radius_free(&request->reply);
 	fr_radius_free(&reply);	/* may be NULL */
 
+	/*
+	 *	Copies made in rate mode are never re-sent.
+	 */
+	if (request->clone) {
+		if (request->ev) fr_event_timer_delete(events, &request->ev);
+		deallocate_id(request);
+		talloc_free(request);
+	}
+}
+
+/*
+ *	Read a reply from a socket.
+ */
+static void rc_recv(UNUSED fr_event_list_t *el, int sockfd, UNUSED void *ctx)
+{
+	RADIUS_PACKET *reply;
+
+#ifdef WITH_TCP
+	if (proto) {
+		reply = fr_tcp_recv(sockfd, false);
+	} else
+#endif
+	reply = fr_radius_recv(NULL, sockfd, UDP_FLAGS_NONE, false);
+	if (!reply) {
+		ERROR("Received bad packet");
+#ifdef WITH_TCP
+		/*
+		 *	If the packet is bad, we close the socket.
+		 *	I'm not sure how to do that now, so we just
+		 *	die...
+		 */
+		if (proto) exit(1);
+#endif
+		return;
+	}
+
+#ifdef WITH_TCP
+	reply->proto = ipproto;
+#endif
+
+	rc_process_reply(reply);
+}
+
+/*
+ *	Nothing to do, the timer just limits how long we wait for replies.
+ */
+static void rc_wakeup(UNUSED struct timeval *now, UNUSED void *ctx)
+{
+}
+
+/*
+ *	Receive packets, waiting up to wait_time seconds for the first one.
+ */
+static int recv_one_packet(int wait_time)
+{
+	fr_event_timer_t *ev = NULL;
+
+	if (wait_time > 0) {
+		struct timeval when;
+
+		gettimeofday(&when, NULL);
+		when.tv_sec += wait_time;
+
+		if (fr_event_timer_insert(events, rc_wakeup, NULL, &when, &ev) < 0) {
+			ERROR("Failed inserting timer");
+			exit(1);
+		}
+	}
+
+	if (fr_event_corral(events, (wait_time > 0)) < 0) {
+		if (ev) fr_event_timer_delete(events, &ev);
+		return -1;
+	}
+	fr_event_service(events);
+
+	if (ev) fr_event_timer_delete(events, &ev);
+
 	return 0;
 }
 
+
+/*
+ *	A copy sent in rate mode didn't get a reply in time.  It's
+ *	never re-sent, as that would change the load we're offering.
+ */
+static void rc_rate_timeout(UNUSED struct timeval *now, void *ctx)
+{
+	rc_request_t *request = talloc_get_type_abort(ctx, rc_request_t);
+
+	REDEBUG("No reply from server for ID %d socket %d",
+		request->packet->id, request->packet->sockfd);
+	deallocate_id(request);
+	stats.lost++;
+	talloc_free(request);
+}
+
+/*
+ *	Send a copy of the next request in the list.
+ */
+static void rc_rate_send_one(void)
+{
+	rc_request_t	*request, *original = rate_next;
+	struct timeval	when;
+	int		i;
+
+	rate_next = original->next ? original->next : request_head;
+	rate_sent++;
+
+	request = talloc_zero(NULL, rc_request_t);
+	if (!request) {
+	oom:
+		ERROR("Out of memory");
+		exit(1);
+	}
+	request->num = original->num;
+	request->files = original->files;
+	request->password = original->password;
+	request->filter = original->filter;
+	request->filter_code = original->filter_code;
+	request->name = original->name;
+	request->clone = true;
+
+	request->packet = fr_radius_copy(request, original->packet);
+	if (!request->packet) goto oom;
+
+	for (i = 0; i < 4; i++) {
+		((uint32_t *) request->packet->vector)[i] = fr_rand();
+	}
+
+	if (send_one_packet(request) < 0) {
+		talloc_free(request);
+		return;
+	}
+
+	when = request->sent;
+	when.tv_sec += (int) timeout;
+	when.tv_usec += (timeout - (int) timeout) * USEC;
+	if (when.tv_usec >= USEC) {
+		when.tv_sec++;
+		when.tv_usec -= USEC;
+	}
+
+	if (fr_event_timer_insert(events, rc_rate_timeout, request, &when, &request->ev) < 0) {
+		ERROR("Failed inserting timer");
+		exit(1);
+	}
+}
+
+/*
+ *	Send every packet which is due, and schedule the next batch.
+ *
+ *	The schedule is based on when we started, and not on when
+ *	replies arrive.  So a slow server sees the same load as a fast
+ *	one, and the response times aren't skewed by us backing off.
+ */
+static void rc_rate_send(struct timeval *now, UNUSED void *ctx)
+{
+	struct timeval	elapsed, when;
+	uint64_t	due, usec;
+	int		burst = 0;
+
+	fr_timeval_subtract(&elapsed, now, &rate_start);
+	due = (((((uint64_t) elapsed.tv_sec * USEC) + elapsed.tv_usec) * rate) / USEC) + 1;
+	if (due > rate_total) due = rate_total;
+
+	/*
+	 *	Limit the burst, so that we still read replies if we
+	 *	fall behind.
+	 */
+	while ((rate_sent < due) && (burst++ < RATE_BURST)) rc_rate_send_one();
+
+	if (rate_sent == rate_total) return;
+
+	usec = (rate_sent * USEC) / rate;
+	when.tv_sec = rate_start.tv_sec + (usec / USEC);
+	when.tv_usec = rate_start.tv_usec + (usec % USEC);
+	if (when.tv_usec >= USEC) {
+		when.tv_sec++;
+		when.tv_usec -= USEC;
+	}
+
+	if (fr_event_timer_insert(events, rc_rate_send, NULL, &when, &rate_ev) < 0) {
+		ERROR("Failed inserting timer");
+		exit(1);
+	}
+}
+
+/*
+ *	Send 'count' copies of each request at a constant rate, and
+ *	wait for the replies.
+ */
+static void rc_rate_run(uint64_t num_requests)
+{
+	rate_next = request_head;
+	rate_total = num_requests * resend_count;
+
+	gettimeofday(&rate_start, NULL);
+	rc_rate_send(&rate_start, NULL);
+
+	while ((rate_sent < rate_total) || (fr_packet_list_num_elements(pl) > 0)) {
+		if (fr_event_corral(events, true) < 0) break;
+		fr_event_service(events);
+	}
+}
+
 int main(int argc, char **argv)
 {
 	int		c;
@@ -1152,6 +1357,7 @@ int main(int argc, char **argv)
 	int		do_summary = false;
 	int		persec = 0;
 	int		parallel = 1;
+	uint64_t	num_requests = 0;
 	rc_request_t	*this;
 	int		force_af = AF_UNSPEC;
 	fr_dict_t	*dict = NULL;
@@ -1180,7 +1386,7 @@ int main(int argc, char **argv)
 		exit(1);
 	}
 
-	while ((c = getopt(argc, argv, "46c:d:D:f:Fhi:n:p:qr:sS:t:vx"
+	while ((c = getopt(argc, argv, "46c:d:D:f:Fhi:n:N:p:qr:R:sS:t:vx"
 #ifdef WITH_TCP
 		"P:"
 #endif
@@ -1246,6 +1452,11 @@ int main(int argc, char **argv)
 			if (persec <= 0) usage();
 			break;
 
+		case 'N':
+			num_sockets = atoi(optarg);
+			if ((num_sockets <= 0) || (num_sockets > 256)) usage();
+			break;
+
 			/*
 			 *	Note that sending MANY requests in
 			 *	parallel can over-run the kernel
@@ -1285,6 +1496,12 @@ int main(int argc, char **argv)
 			if ((retries == 0) || (retries > 1000)) usage();
 			break;
 
+		case 'R':
+			if (!isdigit((int) *optarg)) usage();
+			rate = atoi(optarg);
+			if (rate == 0) usage();
+			break;
+
 		case 's':
 			do_summary = true;
 			break;
@@ -1364,6 +1581,9 @@ int main(int argc, char **argv)
 	}
 	fr_strerror();	/* Clear the error buffer */
 
+	stats.latency = fr_histogram_alloc(talloc_autofree_context(), 60 * USEC, 7);
+	if (!stats.latency) goto oom;
+
 	/*
 	 *	Get the request type
 	 */
@@ -1440,14 +1660,9 @@ int main(int argc, char **argv)
 
 	client_port = request_head->packet->src_port;
 
-#ifdef WITH_TCP
-	if (proto) {
-		sockfd = fr_socket_client_tcp(NULL, &server_ipaddr, server_port, false);
-	} else
-#endif
-	sockfd = fr_socket(&client_ipaddr, client_port);
-	if (sockfd < 0) {
-		ERROR("Error opening socket");
+	events = fr_event_list_create(talloc_autofree_context(), NULL, NULL);
+	if (!events) {
+		ERROR("Failed creating event list");
 		exit(1);
 	}
 
@@ -1457,10 +1672,20 @@ int main(int argc, char **argv)
 		exit(1);
 	}
 
-	if (!fr_packet_list_socket_add(pl, sockfd, ipproto, &server_ipaddr,
-				       server_port, NULL)) {
-		ERROR("Out of memory");
-		exit(1);
+	rc_socket_add(&server_ipaddr, server_port, client_port);
+
+	/*
+	 *	More sockets means more IDs, and more source ports for
+	 *	the server to spread the load over.  The extra ones
+	 *	get random ports, so they're no use if the requests
+	 *	ask for a particular source port.
+	 */
+	if ((num_sockets > 1) && client_port) {
+		WARN("Ignoring -N, as the requests use a fixed source port");
+	} else {
+		int i;
+
+		for (i = 1; i < num_sockets; i++) rc_socket_add(&server_ipaddr, server_port, 0);
 	}
 
 	/*
@@ -1473,6 +1698,16 @@ int main(int argc, char **argv)
 		if (radclient_sane(this) != 0) {
 			exit(1);
 		}
+		num_requests++;
+	}
+
+	/*
+	 *	In rate mode, the requests are templates for the
+	 *	packets we send, and are never sent themselves.
+	 */
+	if (rate) {
+		rc_rate_run(num_requests);
+		goto finish;
 	}
 
 	/*
@@ -1613,7 +1848,9 @@ int main(int argc, char **argv)
 		}
 	} while (!done);
 
+finish:
 	rbtree_free(filename_tree);
+	talloc_free(events);
 	fr_packet_list_free(pl);
 	while (request_head) TALLOC_FREE(request_head);
 	talloc_free(dict);
@@ -1632,6 +1869,25 @@ int main(int argc, char **argv)
 		      stats.passed,
 		      stats.failed
 		);
+
+		if (fr_histogram_count(stats.latency) > 0) {
+			DEBUG("Response times:\n"
+			      "\tMinimum       : %.3f ms\n"
+			      "\tMean          : %.3f ms\n"
+			      "\t50th          : %.3f ms\n"
+			      "\t90th          : %.3f ms\n"
+			      "\t99th          : %.3f ms\n"
+			      "\t99.9th        : %.3f ms\n"
+			      "\tMaximum       : %.3f ms",
+			      fr_histogram_min(stats.latency) / 1000.0,
+			      fr_histogram_mean(stats.latency) / 1000.0,
+			      fr_histogram_percentile(stats.latency, 50) / 1000.0,
+			      fr_histogram_percentile(stats.latency, 90) / 1000.0,
+			      fr_histogram_percentile(stats.latency, 99) / 1000.0,
+			      fr_histogram_percentile(stats.latency, 99.9) / 1000.0,
+			      fr_histogram_max(stats.latency) / 1000.0
+			);
+		}
 	}
 
 	if ((stats.lost > 0) || (stats.failed > 0)) {
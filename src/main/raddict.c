@@ -0,0 +1,109 @@
+/*
+ * raddict.c	Compile the dictionaries into a binary image.
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * Copyright 2016  The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include <freeradius-devel/libradius.h>
+
+#ifdef HAVE_GETOPT_H
+#	include <getopt.h>
+#endif
+
+/*
+ *	Print usage message and exit.
+ */
+static void NEVER_RETURNS usage(int status)
+{
+	FILE *output = status ? stderr : stdout;
+
+	fprintf(output, "Usage: raddict [-D dict_dir] [-o file] [-h]\n");
+	fprintf(output, "  -D <dict_dir>        Set the dictionary directory (default is %s).\n", DICTDIR);
+	fprintf(output, "  -o <file>            Write the image to <file> (default is <dict_dir>/%s%s).\n",
+		FR_DICTIONARY_FILE, FR_DICT_IMAGE_EXT);
+	fprintf(output, "  -h                   Print this help message.\n");
+	fprintf(output, "\n");
+	fprintf(output, "The image is used automatically at startup until any of the dictionaries\n");
+	fprintf(output, "it was built from change, after which they're parsed as text again.\n");
+	exit(status);
+}
+
+int main(int argc, char **argv)
+{
+	int		c;
+	char const	*dict_dir = DICTDIR;
+	char const	*file = NULL;
+	char		buffer[2048];
+	fr_dict_t	*dict = NULL;
+
+#ifndef NDEBUG
+	if (fr_fault_setup(getenv("PANIC_ACTION"), argv[0]) < 0) {
+		fr_perror("raddict");
+		exit(EXIT_FAILURE);
+	}
+#endif
+
+	talloc_set_log_stderr();
+
+	while ((c = getopt(argc, argv, "D:ho:")) != EOF) switch (c) {
+		case 'D':
+			dict_dir = optarg;
+			break;
+
+		case 'o':
+			file = optarg;
+			break;
+
+		case 'h':
+			usage(0);	/* never returns */
+
+		default:
+			usage(1);	/* never returns */
+	}
+
+	/*
+	 *	Mismatch between the binary and the libraries it depends on
+	 */
+	if (fr_check_lib_magic(RADIUSD_MAGIC_NUMBER) < 0) {
+		fr_perror("raddict");
+		return 1;
+	}
+
+	if (fr_dict_from_file(NULL, &dict, dict_dir, FR_DICTIONARY_FILE, "radius") < 0) {
+		fr_perror("raddict");
+		return 1;
+	}
+
+	if (!file) {
+		snprintf(buffer, sizeof(buffer), "%s/%s%s", dict_dir, FR_DICTIONARY_FILE, FR_DICT_IMAGE_EXT);
+		file = buffer;
+	}
+
+	if (fr_dict_image_write(dict, file) < 0) {
+		fr_perror("raddict");
+		talloc_free(dict);
+		return 1;
+	}
+
+	talloc_free(dict);
+
+	return 0;
+}
@@ -7,5 +7,5 @@ endif
 SOURCES		:= radmin.c conduit.c
 
 TGT_INSTALLDIR  := ${sbindir}
-TGT_PREREQS	:= libfreeradius-server.a libfreeradius-radius.a
+TGT_PREREQS	:= libfreeradius-server.a libfreeradius-util.a libfreeradius-radius.a
 TGT_LDLIBS	:= $(LIBS) $(LIBREADLINE)
@@ -45,13 +45,19 @@ RCSID("$Id$")
 
 static rs_t *conf;
 static struct timeval start_pcap = {0, 0};
-static char timestr[50];
+static _Thread_local char timestr[50];
 
-static rbtree_t *request_tree = NULL;
-static rbtree_t *link_tree = NULL;
+static rs_shard_t **shards;			//!< One per decode thread, or a single shard if
+						//!< packets are decoded by the capture thread.
 static fr_event_list_t *events;
 static bool cleanup;
 
+#ifdef HAVE_PTHREAD_H
+static atomic_uint_fast64_t captured;		//!< Packets processed, checked against the capture limit.
+#else
+static uint64_t captured;			//!< Packets processed, checked against the capture limit.
+#endif
+
 static int self_pipe[2] = {-1, -1};		//!< Signals from sig handlers
 
 typedef int (*rbcmp)(void const *, void const *);
@@ -86,6 +92,7 @@ static const FR_NAME_NUMBER rs_events[] = {
 };
 
 static void NEVER_RETURNS usage(int status);
+static void rs_signal_self(int sig);
 
 /** Fork and kill the parent process, writing out our PID
  *
@@ -162,7 +169,7 @@ static void rs_tv_add_ms(struct timeval const *start, unsigned long interval, st
     result->tv_sec = start->tv_sec + (interval / 1000);
     result->tv_usec = start->tv_usec + ((interval % 1000) * 1000);
 
-    if (result->tv_usec > USEC) {
+    if (result->tv_usec >= USEC) {
 	result->tv_usec -= USEC;
 	result->tv_sec++;
     }
@@ -172,6 +179,7 @@ static void rs_time_print(char *out, size_t len, struct timeval const *t)
 {
 	size_t ret;
 	struct timeval now;
+	struct tm tm;
 	uint32_t usec;
 
 	if (!t) {
@@ -179,7 +187,7 @@ static void rs_time_print(char *out, size_t len, struct timeval const *t)
 		t = &now;
 	}
 
-	ret = strftime(out, len, "%Y-%m-%d %H:%M:%S", localtime(&t->tv_sec));
+	ret = strftime(out, len, "%Y-%m-%d %H:%M:%S", localtime_r(&t->tv_sec, &tm));
 	if (ret >= len) {
 		return;
 	}
@@ -519,6 +527,135 @@ static int rs_check_pcap_drop(fr_pcap_t *in)
 	return ret;
 }
 
+/** Compare servers by address and port
+ *
+ */
+static int rs_server_cmp(void const *one, void const *two)
+{
+	rs_server_t const	*a = one;
+	rs_server_t const	*b = two;
+	int			ret;
+
+	ret = fr_ipaddr_cmp(&a->ipaddr, &b->ipaddr);
+	if (ret != 0) return ret;
+
+	return (a->port > b->port) - (a->port < b->port);
+}
+
+/** Find the stats for a server, creating them if this is the first time we've seen it
+ *
+ * @param[in] stats	to search for the server in.
+ * @param[in] ipaddr	of the server.
+ * @param[in] port	of the server.
+ * @return
+ *	- The server's stats.
+ *	- NULL if we couldn't allocate them.
+ */
+static rs_server_t *rs_server_find(rs_stats_t *stats, fr_ipaddr_t const *ipaddr, uint16_t port)
+{
+	rs_server_t	*server;
+	rs_server_t	find;
+
+	/* Only the fields rs_server_cmp uses need to be set */
+	find.ipaddr = *ipaddr;
+	find.port = port;
+
+	server = rbtree_finddata(stats->servers, &find);
+	if (server) return server;
+
+	server = talloc_zero(stats->servers, rs_server_t);
+	if (!server) return NULL;
+
+	server->ipaddr = *ipaddr;
+	server->port = port;
+
+	if (!rbtree_insert(stats->servers, server)) {
+		talloc_free(server);
+		return NULL;
+	}
+
+	return server;
+}
+
+/** Allocate a set of stats, with latency histograms for the codes we report on
+ *
+ * @param[in] ctx	to allocate the stats in.
+ * @return
+ *	- New stats.
+ *	- NULL on error.
+ */
+static rs_stats_t *rs_stats_alloc(TALLOC_CTX *ctx)
+{
+	rs_stats_t	*stats;
+	size_t		i;
+	size_t		rs_codes_len = (sizeof(rs_useful_codes) / sizeof(*rs_useful_codes));
+
+	stats = talloc_zero(ctx, rs_stats_t);
+	if (!stats) return NULL;
+
+	for (i = 0; i < rs_codes_len; i++) {
+		rs_latency_t *latency = &stats->exchange[rs_useful_codes[i]];
+
+		latency->histogram = fr_histogram_alloc(stats, RS_HISTOGRAM_HIGHEST, RS_HISTOGRAM_PRECISION);
+		if (!latency->histogram) {
+		error:
+			talloc_free(stats);
+			return NULL;
+		}
+	}
+
+	stats->servers = rbtree_create(stats, rs_server_cmp, NULL, 0);
+	if (!stats->servers) goto error;
+
+	return stats;
+}
+
+/** Calculate latency percentiles (in milliseconds) from a histogram
+ *
+ * If nothing was recorded, the percentiles are set to NaN for the same reason as the
+ * other latency values in #rs_stats_process_latency.
+ */
+static void rs_stats_process_percentiles(rs_percentiles_t *out, fr_histogram_t const *histogram)
+{
+	if (!histogram || !fr_histogram_count(histogram)) {
+		double unk = strtod("NAN()", (char **) NULL);
+
+		out->p50 = out->p90 = out->p99 = out->p999 = unk;
+		return;
+	}
+
+	out->p50 = fr_histogram_percentile(histogram, 50) / 1000.0;
+	out->p90 = fr_histogram_percentile(histogram, 90) / 1000.0;
+	out->p99 = fr_histogram_percentile(histogram, 99) / 1000.0;
+	out->p999 = fr_histogram_percentile(histogram, 99.9) / 1000.0;
+}
+
+static int _rs_server_process(UNUSED void *ctx, void *data)
+{
+	rs_server_t	*server = data;
+	int		i;
+
+	for (i = 0; i < PW_CODE_MAX; i++) {
+		if (!server->histogram[i]) continue;
+
+		rs_stats_process_percentiles(&server->percentile[i], server->histogram[i]);
+	}
+
+	return 0;
+}
+
+static int _rs_server_reset(UNUSED void *ctx, void *data)
+{
+	rs_server_t	*server = data;
+	int		i;
+
+	for (i = 0; i < PW_CODE_MAX; i++) {
+		if (server->histogram[i]) fr_histogram_reset(server->histogram[i]);
+	}
+
+	return 0;
+}
+
 /** Update smoothed average
  *
  */
@@ -538,6 +675,7 @@ static void rs_stats_process_latency(rs_latency_t *stats)
 		stats->interval.latency_average = unk;
 		stats->interval.latency_high = unk;
 		stats->interval.latency_low = unk;
+		rs_stats_process_percentiles(&stats->interval.latency_percentile, NULL);
 
 		/*
 		 *	We've not yet been able to determine latency, so latency_smoothed is also NaN
@@ -552,6 +690,8 @@ static void rs_stats_process_latency(rs_latency_t *stats)
 		stats->interval.latency_average = (stats->interval.latency_total / stats->interval.linked_total);
 	}
 
+	rs_stats_process_percentiles(&stats->interval.latency_percentile, stats->histogram);
+
 	if (isnan(stats->latency_smoothed)) {
 		stats->latency_smoothed = 0;
 	}
@@ -601,6 +741,12 @@ static void rs_stats_print_code_fancy(rs_latency_t *stats, PW_CODE code)
 		INFO("\tLow       : %.3lfms", stats->interval.latency_low);
 		INFO("\tAverage   : %.3lfms", stats->interval.latency_average);
 		INFO("\tMA        : %.3lfms", stats->latency_smoothed);
+		if (stats->histogram) {
+			INFO("\tp50       : %.3lfms", stats->interval.latency_percentile.p50);
+			INFO("\tp90       : %.3lfms", stats->interval.latency_percentile.p90);
+			INFO("\tp99       : %.3lfms", stats->interval.latency_percentile.p99);
+			INFO("\tp99.9     : %.3lfms", stats->interval.latency_percentile.p999);
+		}
 	}
 
 	if (have_rt || stats->interval.lost || stats->interval.reused) {
@@ -621,6 +767,31 @@ static void rs_stats_print_code_fancy(rs_latency_t *stats, PW_CODE code)
 	}
 }
 
+static int _rs_server_print_fancy(UNUSED void *ctx, void *data)
+{
+	rs_server_t	*server = data;
+	char		addr[INET6_ADDRSTRLEN];
+	int		i;
+
+	inet_ntop(server->ipaddr.af, &server->ipaddr.ipaddr, addr, sizeof(addr));
+
+	for (i = 0; i < PW_CODE_MAX; i++) {
+		if (!server->histogram[i] || !fr_histogram_count(server->histogram[i])) continue;
+
+		if (is_radius_code(i)) {
+			INFO("%s:%u %s latency:", addr, server->port, fr_packet_codes[i]);
+		} else {
+			INFO("%s:%u %i latency:", addr, server->port, i);
+		}
+		INFO("\tp50       : %.3lfms", server->percentile[i].p50);
+		INFO("\tp90       : %.3lfms", server->percentile[i].p90);
+		INFO("\tp99       : %.3lfms", server->percentile[i].p99);
+		INFO("\tp99.9     : %.3lfms", server->percentile[i].p999);
+	}
+
+	return 0;
+}
+
 static void rs_stats_print_fancy(rs_update_t *this, rs_stats_t *stats, struct timeval *now)
 {
 	fr_pcap_t		*in_p;
@@ -666,6 +837,8 @@ static void rs_stats_print_fancy(rs_update_t *this, rs_stats_t *stats, struct ti
 			rs_stats_print_code_fancy(&stats->exchange[rs_useful_codes[i]], rs_useful_codes[i]);
 		}
 	}
+
+	if (fr_debug_lvl > 0) rbtree_walk(stats->servers, RBTREE_IN_ORDER, _rs_server_print_fancy, NULL);
 }
 
 static void rs_stats_print_csv_header(rs_update_t *this)
@@ -713,6 +886,24 @@ static void rs_stats_print_csv_header(rs_update_t *this)
 		}
 	}
 
+	/*
+	 *	Percentiles go after all of the other columns, so that
+	 *	existing consumers still find those where they were.
+	 */
+	for (i = 0; i < rs_codes_len; i++) {
+		char const *name = fr_packet_codes[rs_useful_codes[i]];
+
+		fprintf(stdout,
+			",\"%s lat p50 (ms)\""
+			",\"%s lat p90 (ms)\""
+			",\"%s lat p99 (ms)\""
+			",\"%s lat p99.9 (ms)\"",
+			name,
+			name,
+			name,
+			name);
+	}
+
 	fprintf(stdout , "\n");
 }
 
@@ -741,9 +932,23 @@ static ssize_t rs_stats_print_code_csv(char *out, size_t outlen, rs_latency_t *s
 	return p - out;
 }
 
+static ssize_t rs_stats_print_percentiles_csv(char *out, size_t outlen, rs_latency_t *stats)
+{
+	size_t	len;
+
+	len = snprintf(out, outlen, ",%.3lf,%.3lf,%.3lf,%.3lf",
+		       stats->interval.latency_percentile.p50,
+		       stats->interval.latency_percentile.p90,
+		       stats->interval.latency_percentile.p99,
+		       stats->interval.latency_percentile.p999);
+	if (len >= outlen) return -1;
+
+	return len;
+}
+
 static void rs_stats_print_csv(rs_update_t *this, rs_stats_t *stats, UNUSED struct timeval *now)
 {
-	char buffer[2048], *p = buffer, *end = buffer + sizeof(buffer);
+	char buffer[4096], *p = buffer, *end = buffer + sizeof(buffer);
 	fr_pcap_t	*in_p;
 	size_t		i;
 	size_t		rs_codes_len = (sizeof(rs_useful_codes) / sizeof(*rs_useful_codes));
@@ -780,9 +985,142 @@ static void rs_stats_print_csv(rs_update_t *this, rs_stats_t *stats, UNUSED stru
 		if (p >= end) goto oob;
 	}
 
+	for (i = 0; i < rs_codes_len; i++) {
+		ssize_t slen;
+
+		slen = rs_stats_print_percentiles_csv(p, sizeof(buffer) - (p - buffer),
+						      &stats->exchange[rs_useful_codes[i]]);
+		if (slen < 0) goto oob;
+
+		p += (size_t)slen;
+		if (p >= end) goto oob;
+	}
+
 	fprintf(stdout , "%s\n", buffer);
 }
 
+#ifdef HAVE_PTHREAD_H
+/** Add a decode thread's server latency to the stats we report
+ *
+ */
+static int _rs_server_merge(void *ctx, void *data)
+{
+	rs_stats_t	*stats = ctx;
+	rs_server_t	*in = data;
+	rs_server_t	*out;
+	int		i;
+
+	out = rs_server_find(stats, &in->ipaddr, in->port);
+	if (!out) return -1;
+
+	for (i = 0; i < PW_CODE_MAX; i++) {
+		if (!in->histogram[i] || !fr_histogram_count(in->histogram[i])) continue;
+
+		if (!out->histogram[i]) {
+			out->histogram[i] = fr_histogram_alloc(out, RS_HISTOGRAM_HIGHEST, RS_HISTOGRAM_PRECISION);
+			if (!out->histogram[i]) return -1;
+		}
+
+		(void) fr_histogram_merge(out->histogram[i], in->histogram[i]);
+		fr_histogram_reset(in->histogram[i]);
+	}
+
+	return 0;
+}
+
+/** Add the interval counters from each decode thread to the stats we report
+ *
+ * The decode threads are paused while we copy their counters, so this must only be
+ * called from the capture thread.
+ *
+ * @param[in] stats	to add the counters to.
+ * @return
+ *	- 0 no packets were dropped.
+ *	- -1 if any of the decode threads couldn't keep up, and packets were dropped.
+ */
+static int rs_shard_stats_merge(rs_stats_t *stats)
+{
+	size_t	i;
+	size_t	rs_codes_len = (sizeof(rs_useful_codes) / sizeof(*rs_useful_codes));
+	int	j, k;
+	int	ret = 0;
+
+	for (j = 0; j < conf->num_threads; j++) {
+		rs_shard_t *shard = shards[j];
+
+		atomic_store(&shard->merging, true);
+		pthread_mutex_lock(&shard->mutex);
+		atomic_store(&shard->merging, false);
+
+		for (i = 0; i < rs_codes_len; i++) {
+			rs_latency_t *in = &shard->stats->exchange[rs_useful_codes[i]];
+			rs_latency_t *out = &stats->exchange[rs_useful_codes[i]];
+
+			out->interval.received_total += in->interval.received_total;
+			out->interval.linked_total += in->interval.linked_total;
+			out->interval.unlinked_total += in->interval.unlinked_total;
+			out->interval.reused_total += in->interval.reused_total;
+			out->interval.lost_total += in->interval.lost_total;
+			for (k = 0; k <= RS_RETRANSMIT_MAX; k++) {
+				out->interval.rt_total[k] += in->interval.rt_total[k];
+			}
+
+			out->interval.latency_total += in->interval.latency_total;
+			if (in->interval.latency_high > out->interval.latency_high) {
+				out->interval.latency_high = in->interval.latency_high;
+			}
+			if (in->interval.latency_low &&
+			    (!out->interval.latency_low || (in->interval.latency_low < out->interval.latency_low))) {
+				out->interval.latency_low = in->interval.latency_low;
+			}
+
+			(void) fr_histogram_merge(out->histogram, in->histogram);
+			fr_histogram_reset(in->histogram);
+
+			memset(&in->interval, 0, sizeof(in->interval));
+		}
+
+		rbtree_walk(shard->stats->servers, RBTREE_IN_ORDER, _rs_server_merge, stats);
+
+		pthread_mutex_unlock(&shard->mutex);
+
+		if (shard->overflow) {
+			ERROR("Decode thread %i dropped %" PRIu64 " packets", shard->number, shard->overflow);
+			shard->overflow = 0;
+			ret = -1;
+		}
+	}
+
+	return ret;
+}
+#endif
+
+#ifdef HAVE_COLLECTDC_H
+/** Create collectd templates for servers we've not seen before
+ *
+ */
+static int _rs_server_collectd_register(UNUSED void *ctx, void *data)
+{
+	rs_server_t	*server = data;
+	rs_stats_tmpl_t	**next = &conf->stats.tmpl;
+	int		i;
+
+	for (i = 0; i < PW_CODE_MAX; i++) {
+		if (!server->histogram[i] || server->registered[i] || !is_radius_code(i)) continue;
+
+		while (*next) next = &(*next)->next;
+
+		if (!rs_stats_collectd_init_server(conf, next, conf, server, i)) {
+			ERROR("Error allocating memory for stats template");
+			return -1;
+		}
+		server->registered[i] = true;
+	}
+
+	return 0;
+}
+#endif
+
 /** Process stats for a single interval
  *
  */
@@ -801,6 +1139,15 @@ static void rs_stats_process(struct timeval *now, void *ctx)
 
 	stats->intervals++;
 
+#ifdef HAVE_PTHREAD_H
+	if (conf->num_threads && (rs_shard_stats_merge(stats) < 0)) {
+		ERROR("Muting stats for the next %i milliseconds", conf->stats.timeout);
+
+		rs_tv_add_ms(now, conf->stats.timeout, &stats->quiet);
+		goto clear;
+	}
+#endif
+
 	for (in_p = this->in;
 	     in_p;
 	     in_p = in_p->next) {
@@ -822,6 +1169,7 @@ static void rs_stats_process(struct timeval *now, void *ctx)
 		rs_stats_process_latency(&stats->exchange[rs_useful_codes[i]]);
 		rs_stats_process_counters(&stats->exchange[rs_useful_codes[i]]);
 	}
+	rbtree_walk(stats->servers, RBTREE_IN_ORDER, _rs_server_process, NULL);
 
 	if (this->body) this->body(this, stats, now);
 
@@ -831,6 +1179,7 @@ static void rs_stats_process(struct timeval *now, void *ctx)
 	 *	initialised earlier.
 	 */
 	if ((conf->stats.out == RS_STATS_OUT_COLLECTD) && conf->stats.handle) {
+		rbtree_walk(stats->servers, RBTREE_IN_ORDER, _rs_server_collectd_register, NULL);
 		rs_stats_collectd_do_stats(conf, conf->stats.tmpl, now);
 	}
 #endif
@@ -842,7 +1191,9 @@ clear:
 	for (i = 0; i < rs_codes_len; i++) {
 		memset(&stats->exchange[rs_useful_codes[i]].interval, 0,
 		       sizeof(stats->exchange[rs_useful_codes[i]].interval));
+		fr_histogram_reset(stats->exchange[rs_useful_codes[i]].histogram);
 	}
+	rbtree_walk(stats->servers, RBTREE_IN_ORDER, _rs_server_reset, NULL);
 
 	{
 		static fr_event_timer_t *event;
@@ -875,6 +1226,26 @@ static void rs_stats_update_latency(rs_latency_t *stats, struct timeval *latency
 	}
 	stats->interval.latency_total += lint;
 
+	if (stats->histogram) fr_histogram_add(stats->histogram, (latency->tv_sec * USEC) + latency->tv_usec);
+}
+
+/** Update latency statistics for the server which sent a response
+ *
+ */
+static void rs_stats_update_server(rs_stats_t *stats, RADIUS_PACKET const *response, PW_CODE code,
+				   struct timeval *latency)
+{
+	rs_server_t *server;
+
+	server = rs_server_find(stats, &response->src_ipaddr, response->src_port);
+	if (!server) return;
+
+	if (!server->histogram[code]) {
+		server->histogram[code] = fr_histogram_alloc(server, RS_HISTOGRAM_HIGHEST, RS_HISTOGRAM_PRECISION);
+		if (!server->histogram[code]) return;
+	}
+
+	fr_histogram_add(server->histogram[code], (latency->tv_sec * USEC) + latency->tv_usec);
 }
 
 static int rs_install_stats_processor(rs_stats_t *stats, fr_event_list_t *el,
@@ -974,17 +1345,17 @@ static int _request_free(rs_request_t *request)
 	 *	something has gone very badly wrong.
 	 */
 	if (request->in_request_tree) {
-		ret = rbtree_deletebydata(request_tree, request);
+		ret = rbtree_deletebydata(request->shard->request_tree, request);
 		RS_ASSERT(ret);
 	}
 
 	if (request->in_link_tree) {
-		ret = rbtree_deletebydata(link_tree, request);
+		ret = rbtree_deletebydata(request->shard->link_tree, request);
 		RS_ASSERT(ret);
 	}
 
 	if (request->event) {
-		ret = fr_event_timer_delete(events, &request->event);
+		ret = fr_event_timer_delete(request->shard->list, &request->event);
 		RS_ASSERT(ret);
 	}
 
@@ -1175,7 +1546,8 @@ static inline int rs_request_to_pcap(rs_event_t *event, rs_request_t *request, s
 
 static void rs_packet_process(uint64_t count, rs_event_t *event, struct pcap_pkthdr const *header, uint8_t const *data)
 {
-	rs_stats_t		*stats = event->stats;
+	rs_shard_t		*shard = event->shard;
+	rs_stats_t		*stats = shard->stats;
 	struct timeval		elapsed = {0, 0};
 	struct timeval		latency;
 
@@ -1192,13 +1564,13 @@ static void rs_packet_process(uint64_t count, rs_event_t *event, struct pcap_pkt
 	bool			response;		/* Was it a response code */
 
 	decode_fail_t		reason;			/* Why we failed decoding the packet */
-	static uint64_t		captured = 0;
 
 	rs_status_t		status = RS_NORMAL;	/* Any special conditions (RTX, Unlinked, ID-Reused) */
 	RADIUS_PACKET		*current;		/* Current packet were processing */
 	rs_request_t		*original = NULL;
 
 	rs_request_t		search;
+	uint64_t		seen;
 
 	memset(&search, 0, sizeof(search));
 
@@ -1297,7 +1669,7 @@ static void rs_packet_process(uint64_t count, rs_event_t *event, struct pcap_pkt
 	 *	recover once some requests timeout, so make an effort to deal
 	 *	with allocation failures gracefully.
 	 */
-	current = fr_radius_alloc(conf, false);
+	current = fr_radius_alloc(shard, false);
 	if (!current) {
 		REDEBUG("Failed allocating memory to hold decoded packet");
 		rs_tv_add_ms(&header->ts, conf->stats.timeout, &stats->quiet);
@@ -1353,7 +1725,7 @@ static void rs_packet_process(uint64_t count, rs_event_t *event, struct pcap_pkt
 	{
 		/* look for a matching request and use it for decoding */
 		search.expect = current;
-		original = rbtree_finddata(request_tree, &search);
+		original = rbtree_finddata(shard->request_tree, &search);
 
 		/*
 		 *	Verify this code is allowed
@@ -1374,7 +1746,7 @@ static void rs_packet_process(uint64_t count, rs_event_t *event, struct pcap_pkt
 			int ret;
 			FILE *log_fp = fr_log_fp;
 
-			fr_log_fp = NULL;
+			if (!conf->num_threads) fr_log_fp = NULL;
 			ret = fr_radius_verify(current, original->expect, conf->radius_secret);
 			fr_log_fp = log_fp;
 			if (ret != 0) {
@@ -1392,7 +1764,7 @@ static void rs_packet_process(uint64_t count, rs_event_t *event, struct pcap_pkt
 			int ret;
 			FILE *log_fp = fr_log_fp;
 
-			fr_log_fp = NULL;
+			if (!conf->num_threads) fr_log_fp = NULL;
 			ret = fr_radius_decode(current, original ? original->expect : NULL, conf->radius_secret);
 			fr_log_fp = log_fp;
 			if (ret != 0) {
@@ -1424,7 +1796,7 @@ static void rs_packet_process(uint64_t count, rs_event_t *event, struct pcap_pkt
 				original->rt_rsp++;
 
 				fr_radius_free(&original->linked);
-				fr_event_timer_delete(event->list, &original->event);
+				fr_event_timer_delete(shard->list, &original->event);
 			/*
 			 *	...nope it's the first response to a request.
 			 */
@@ -1439,7 +1811,7 @@ static void rs_packet_process(uint64_t count, rs_event_t *event, struct pcap_pkt
 			 */
 			original->linked = talloc_steal(original, current);
 			rs_tv_add_ms(&header->ts, conf->stats.timeout, &original->when);
-			if (fr_event_timer_insert(event->list, _rs_event, original, &original->when, &original->event) < 0) {
+			if (fr_event_timer_insert(shard->list, _rs_event, original, &original->when, &original->event) < 0) {
 				REDEBUG("Failed inserting new event");
 				/*
 				 *	Delete the original request/event, it's no longer valid
@@ -1498,7 +1870,7 @@ static void rs_packet_process(uint64_t count, rs_event_t *event, struct pcap_pkt
 			int ret;
 			FILE *log_fp = fr_log_fp;
 
-			fr_log_fp = NULL;
+			if (!conf->num_threads) fr_log_fp = NULL;
 			ret = fr_radius_decode(current, NULL, conf->radius_secret);
 			fr_log_fp = log_fp;
 
@@ -1540,8 +1912,8 @@ static void rs_packet_process(uint64_t count, rs_event_t *event, struct pcap_pkt
 		if (search.link_vps) {
 			rs_request_t *tuple;
 
-			original = rbtree_finddata(link_tree, &search);
-			tuple = rbtree_finddata(request_tree, &search);
+			original = rbtree_finddata(shard->link_tree, &search);
+			tuple = rbtree_finddata(shard->request_tree, &search);
 
 			/*
 			 *	If the packet we matched using attributes is not the same
@@ -1555,7 +1927,7 @@ static void rs_packet_process(uint64_t count, rs_event_t *event, struct pcap_pkt
 		 *	Detect duplicates using the normal 5-tuple of src/dst ips/ports id
 		 */
 		} else {
-			original = rbtree_finddata(request_tree, &search);
+			original = rbtree_finddata(shard->request_tree, &search);
 			if (original && (memcmp(original->expect->vector, current->vector,
 			    			sizeof(original->expect->vector)) != 0)) {
 				/*
@@ -1601,22 +1973,23 @@ static void rs_packet_process(uint64_t count, rs_event_t *event, struct pcap_pkt
 
 			/* Request may need to be reinserted as the 5 tuple of the response may of changed */
 			if (rs_packet_cmp(original, &search) != 0) {
-				rbtree_deletebydata(request_tree, original);
+				rbtree_deletebydata(shard->request_tree, original);
 			}
 
 			fr_radius_free(&original->expect);
 			original->expect = talloc_steal(original, search.expect);
 
 			/* Disarm the timer for the cleanup event for the original request */
-			fr_event_timer_delete(event->list, &original->event);
+			fr_event_timer_delete(shard->list, &original->event);
 		/*
 		 *	...nope it's a new request.
 		 */
 		} else {
-			original = talloc_zero(conf, rs_request_t);
+			original = talloc_zero(shard, rs_request_t);
 			talloc_set_destructor(original, _request_free);
 
 			original->id = count;
+			original->shard = shard;
 			original->in = event->in;
 			original->stats_req = &stats->exchange[current->code];
 
@@ -1639,7 +2012,7 @@ static void rs_packet_process(uint64_t count, rs_event_t *event, struct pcap_pkt
 				original->link_vps = search.link_vps;
 
 				/* We should never have conflicts */
-				ret = rbtree_insert(link_tree, original);
+				ret = rbtree_insert(shard->link_tree, original);
 				RS_ASSERT(ret);
 				original->in_link_tree = true;
 			}
@@ -1659,7 +2032,7 @@ static void rs_packet_process(uint64_t count, rs_event_t *event, struct pcap_pkt
 			bool ret;
 
 			/* We should never have conflicts */
-			ret = rbtree_insert(request_tree, original);
+			ret = rbtree_insert(shard->request_tree, original);
 			RS_ASSERT(ret);
 			original->in_request_tree = true;
 		}
@@ -1669,7 +2042,7 @@ static void rs_packet_process(uint64_t count, rs_event_t *event, struct pcap_pkt
 		 */
 		original->packet->timestamp = header->ts;
 		rs_tv_add_ms(&header->ts, conf->stats.timeout, &original->when);
-		if (fr_event_timer_insert(event->list, _rs_event, original,
+		if (fr_event_timer_insert(shard->list, _rs_event, original,
 					  &original->when, &original->event) < 0) {
 			REDEBUG("Failed inserting new event");
 
@@ -1712,6 +2085,7 @@ static void rs_packet_process(uint64_t count, rs_event_t *event, struct pcap_pkt
 		 */
 		rs_stats_update_latency(&stats->exchange[current->code], &latency);
 		rs_stats_update_latency(&stats->exchange[original->expect->code], &latency);
+		rs_stats_update_server(stats, current, original->packet->code, &latency);
 
 		/*
 		 *	Were filtering on response, now print out the full data from the request
@@ -1749,16 +2123,221 @@ static void rs_packet_process(uint64_t count, rs_event_t *event, struct pcap_pkt
 		fr_radius_free(&current);
 	}
 
-	captured++;
+#ifdef HAVE_PTHREAD_H
+	seen = atomic_fetch_add(&captured, 1) + 1;
+#else
+	seen = ++captured;
+#endif
 	/*
 	 *	We've hit our capture limit, break out of the event loop
 	 */
-	if ((conf->limit > 0) && (captured >= conf->limit)) {
-		INFO("Captured %" PRIu64 " packets, exiting...", captured);
-		fr_event_loop_exit(events, 1);
+	if ((conf->limit > 0) && (seen == conf->limit)) {
+		INFO("Captured %" PRIu64 " packets, exiting...", seen);
+
+		/*
+		 *	Decode threads can't touch the main event list,
+		 *	so tell the capture thread to exit as if we'd
+		 *	been signalled.
+		 */
+		if (conf->num_threads) {
+			rs_signal_self(SIGTERM);
+		} else {
+			fr_event_loop_exit(events, 1);
+		}
+	}
+}
+
+#ifdef HAVE_PTHREAD_H
+/** Pick the shard which will decode a packet
+ *
+ * A request and its response must be decoded by the same thread, so each endpoint
+ * is hashed separately and the results are combined with XOR, which gives the same
+ * answer for both directions.
+ *
+ * If we're linking retransmissions using attributes, the source port may change
+ * between retransmissions, so only the addresses are used.
+ *
+ * Packets we can't parse go to the first shard, which will log the error.
+ */
+static rs_shard_t *rs_shard_select(fr_pcap_t *in, struct pcap_pkthdr const *header, uint8_t const *data)
+{
+	ssize_t			len;
+	uint8_t const		*p = data;
+	uint8_t const		*src_addr, *dst_addr;
+	size_t			addr_len;
+	udp_header_t const	*udp;
+	uint32_t		src, dst;
+
+	len = fr_link_layer_offset(data, header->caplen, in->link_layer);
+	if ((len < 0) || ((size_t) len >= header->caplen)) return shards[0];
+	p += len;
+
+	switch ((p[0] & 0xf0) >> 4) {
+	case 4:
+	{
+		ip_header_t const *ip = (ip_header_t const *) p;
+
+		if ((size_t) ((p - data) + sizeof(*ip)) > header->caplen) return shards[0];
+
+		src_addr = (uint8_t const *) &ip->ip_src;
+		dst_addr = (uint8_t const *) &ip->ip_dst;
+		addr_len = sizeof(ip->ip_src);
+		p += (0x0f & ip->ip_vhl) * 4;
+	}
+		break;
+
+	case 6:
+	{
+		ip_header6_t const *ip6 = (ip_header6_t const *) p;
+
+		if ((size_t) ((p - data) + sizeof(*ip6)) > header->caplen) return shards[0];
+
+		src_addr = (uint8_t const *) &ip6->ip_src;
+		dst_addr = (uint8_t const *) &ip6->ip_dst;
+		addr_len = sizeof(ip6->ip_src);
+		p += sizeof(*ip6);
+	}
+		break;
+
+	default:
+		return shards[0];
+	}
+
+	if ((size_t) ((p - data) + sizeof(*udp)) > header->caplen) return shards[0];
+	udp = (udp_header_t const *) p;
+
+	src = fr_hash(src_addr, addr_len);
+	dst = fr_hash(dst_addr, addr_len);
+	if (!conf->link_da_num) {
+		src = fr_hash_update(&udp->src, sizeof(udp->src), src);
+		dst = fr_hash_update(&udp->dst, sizeof(udp->dst), dst);
 	}
+
+	return shards[(src ^ dst) % conf->num_threads];
 }
 
+/** Copy a packet out of the capture buffer, and queue it for a decode thread
+ *
+ * If the decode thread has fallen too far behind, the packet is dropped, and the
+ * drop is reported with the next set of stats.
+ */
+static void rs_packet_dispatch(uint64_t count, fr_pcap_t *in, struct pcap_pkthdr const *header, uint8_t const *data)
+{
+	rs_shard_t	*shard;
+	rs_packet_t	*packet;
+
+	/*
+	 *	Set here, so the decode threads only ever read it.
+	 */
+	if (!start_pcap.tv_sec) {
+		start_pcap = header->ts;
+	}
+
+	shard = rs_shard_select(in, header, data);
+	if (!fr_atomic_queue_pop(shard->free, (void **) &packet)) {
+		shard->overflow++;
+		return;
+	}
+
+	packet->count = count;
+	packet->in = in;
+	packet->header = *header;
+	if (packet->header.caplen > sizeof(packet->data)) packet->header.caplen = sizeof(packet->data);
+	memcpy(packet->data, data, packet->header.caplen);
+
+	/*
+	 *	Can't fail, there are only as many buffers as there are queue slots.
+	 */
+	fr_atomic_queue_push(shard->queue, packet);
+	shard->pending = true;
+}
+
+/** Wake any idle decode threads we queued packets for
+ *
+ */
+static void rs_shard_wake(void)
+{
+	int i;
+
+	for (i = 0; i < conf->num_threads; i++) {
+		rs_shard_t *shard = shards[i];
+
+		if (!shard->pending) continue;
+		shard->pending = false;
+
+		if (!atomic_load(&shard->idle)) continue;
+
+		pthread_mutex_lock(&shard->mutex);
+		pthread_cond_signal(&shard->cond);
+		pthread_mutex_unlock(&shard->mutex);
+	}
+}
+
+/** Decode packets queued by the capture thread
+ *
+ * The thread holds the shard mutex whenever it's running, and only releases it to
+ * sleep, or when the capture thread wants to merge the stats.
+ */
+static void *rs_shard_thread(void *arg)
+{
+	rs_shard_t	*shard = arg;
+	rs_packet_t	*packet = NULL;
+	struct timeval	now, when, wake;
+	struct timespec	wait;
+	int		i;
+
+	pthread_mutex_lock(&shard->mutex);
+	while (!shard->exit) {
+		/*
+		 *	Capture thread wants our stats
+		 */
+		if (atomic_load(&shard->merging)) {
+			pthread_mutex_unlock(&shard->mutex);
+			while (atomic_load(&shard->merging)) sched_yield();
+			pthread_mutex_lock(&shard->mutex);
+			continue;
+		}
+
+		for (i = 0; i < RS_FORCE_YIELD; i++) {
+			if (!packet && !fr_atomic_queue_pop(shard->queue, (void **) &packet)) break;
+
+			shard->event.in = packet->in;
+			rs_packet_process(packet->count, &shard->event, &packet->header, packet->data);
+			fr_atomic_queue_push(shard->free, packet);
+			packet = NULL;
+		}
+
+		gettimeofday(&now, NULL);
+		do {
+			when = now;
+		} while (fr_event_timer_run(shard->list, &when) == 1);
+
+		if (i == RS_FORCE_YIELD) continue;
+
+		/*
+		 *	Check the queue again after marking ourselves
+		 *	idle, so we don't miss a wakeup from a packet
+		 *	queued since the last pop.
+		 */
+		atomic_store(&shard->idle, true);
+		if (!fr_atomic_queue_pop(shard->queue, (void **) &packet)) {
+			packet = NULL;
+
+			rs_tv_add_ms(&now, RS_IDLE_WAIT, &wake);
+			if ((when.tv_sec || when.tv_usec) && timercmp(&when, &wake, <)) wake = when;
+
+			wait.tv_sec = wake.tv_sec;
+			wait.tv_nsec = wake.tv_usec * 1000;
+			pthread_cond_timedwait(&shard->cond, &shard->mutex, &wait);
+		}
+		atomic_store(&shard->idle, false);
+	}
+	pthread_mutex_unlock(&shard->mutex);
+
+	return NULL;
+}
+#endif
+
 static void rs_got_packet(fr_event_list_t *el, int fd, void *ctx)
 {
 	static uint64_t	count = 0;	/* Packets seen */
@@ -1805,7 +2384,7 @@ static void rs_got_packet(fr_event_list_t *el, int fd, void *ctx)
 			 *	of the first packet in the trace.
 			 */
 			if (conf->stats.interval && !stats_started) {
-				rs_install_stats_processor(event->stats, el, NULL, &header->ts, false);
+				rs_install_stats_processor(event->shard->stats, el, NULL, &header->ts, false);
 				stats_started = true;
 			}
 
@@ -1828,16 +2407,26 @@ static void rs_got_packet(fr_event_list_t *el, int fd, void *ctx)
 		ret = pcap_next_ex(handle, &header, &data);
 		if (ret == 0) {
 			/* No more packets available at this time */
-			return;
+			break;
 		}
 		if (ret < 0) {
 			ERROR("Error requesting next packet, got (%i): %s", ret, pcap_geterr(handle));
-			return;
+			break;
 		}
 
 		count++;
+#ifdef HAVE_PTHREAD_H
+		if (conf->num_threads) {
+			rs_packet_dispatch(count, event->in, header, data);
+			continue;
+		}
+#endif
 		rs_packet_process(count, event, header, data);
 	}
+
+#ifdef HAVE_PTHREAD_H
+	if (conf->num_threads) rs_shard_wake();
+#endif
 }
 
 static int  _rs_event_status(UNUSED void *ctx, struct timeval *wake)
@@ -1996,6 +2585,120 @@ static void _unmark_link(void *request)
 	this->in_link_tree = false;
 }
 
+/** Allocate the trees and timers used to link requests with responses
+ *
+ * @param[in] ctx	to allocate the shard in.
+ * @param[in] number	of the shard, for logging.
+ * @param[in] list	to insert request cleanup timers into.  If NULL a new event list is created.
+ * @param[in] stats	to write stats to.  If NULL new stats are allocated.
+ * @return
+ *	- A new shard.
+ *	- NULL on error.
+ */
+static rs_shard_t *rs_shard_alloc(TALLOC_CTX *ctx, int number, fr_event_list_t *list, rs_stats_t *stats)
+{
+	rs_shard_t *shard;
+
+	shard = talloc_zero(ctx, rs_shard_t);
+	if (!shard) {
+		ERROR("Out of memory");
+		return NULL;
+	}
+	shard->number = number;
+
+	shard->list = list ? list : fr_event_list_create(shard, NULL, NULL);
+	if (!shard->list) {
+		ERROR("Failed creating event list");
+	error:
+		talloc_free(shard);
+		return NULL;
+	}
+
+	shard->stats = stats ? stats : rs_stats_alloc(shard);
+	if (!shard->stats) {
+		ERROR("Out of memory");
+		goto error;
+	}
+
+	shard->request_tree = rbtree_create(shard, (rbcmp) rs_packet_cmp, _unmark_request, 0);
+	if (!shard->request_tree) {
+		ERROR("Failed creating request tree");
+		goto error;
+	}
+
+	if (conf->link_da_num) {
+		shard->link_tree = rbtree_create(shard, (rbcmp) rs_rtx_cmp, _unmark_link, 0);
+		if (!shard->link_tree) {
+			ERROR("Failed creating RTX tree");
+			goto error;
+		}
+	}
+
+	return shard;
+}
+
+#ifdef HAVE_PTHREAD_H
+static int _rs_shard_free(rs_shard_t *shard)
+{
+	pthread_cond_destroy(&shard->cond);
+	pthread_mutex_destroy(&shard->mutex);
+
+	return 0;
+}
+
+/** Allocate packet buffers for a shard, and start its decode thread
+ *
+ * @param[in] shard	to start a thread for.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int rs_shard_thread_start(rs_shard_t *shard)
+{
+	int i, ret;
+
+	shard->queue = fr_atomic_queue_create(shard, RS_QUEUE_SIZE);
+	shard->free = fr_atomic_queue_create(shard, RS_QUEUE_SIZE);
+	shard->packets = talloc_array(shard, rs_packet_t, RS_QUEUE_SIZE);
+	if (!shard->queue || !shard->free || !shard->packets) {
+		ERROR("Out of memory");
+		return -1;
+	}
+
+	for (i = 0; i < RS_QUEUE_SIZE; i++) fr_atomic_queue_push(shard->free, &shard->packets[i]);
+
+	shard->event.shard = shard;
+	atomic_init(&shard->idle, false);
+	atomic_init(&shard->merging, false);
+
+	pthread_mutex_init(&shard->mutex, NULL);
+	pthread_cond_init(&shard->cond, NULL);
+	talloc_set_destructor(shard, _rs_shard_free);
+
+	ret = pthread_create(&shard->thread, NULL, rs_shard_thread, shard);
+	if (ret != 0) {
+		ERROR("Failed creating decode thread %i: %s", shard->number, fr_syserror(ret));
+		return -1;
+	}
+
+	return 0;
+}
+
+/** Tell a decode thread to exit, and wait for it to do so
+ *
+ * @param[in] shard	whose thread we're stopping.
+ */
+static void rs_shard_thread_stop(rs_shard_t *shard)
+{
+	pthread_mutex_lock(&shard->mutex);
+	shard->exit = true;
+	pthread_cond_signal(&shard->cond);
+	pthread_mutex_unlock(&shard->mutex);
+
+	pthread_join(shard->thread, NULL);
+}
+#endif
+
 #ifdef HAVE_COLLECTDC_H
 /** Re-open the collectd socket
  *
@@ -2106,6 +2809,7 @@ static void NEVER_RETURNS usage(int status)
 	fprintf(output, "  -h                    This help message.\n");
 	fprintf(output, "  -i <interface>        Capture packets from interface (defaults to all if supported).\n");
 	fprintf(output, "  -I <file>             Read packets from <file>\n");
+	fprintf(output, "  -j <threads>          Decode packets using this many threads (live capture only).\n");
 	fprintf(output, "  -l <attr>[,<attr>]    Output packet sig and a list of attributes.\n");
 	fprintf(output, "  -L <attr>[,<attr>]    Detect retransmissions using these attributes to link requests.\n");
 	fprintf(output, "  -m                    Don't put interface(s) into promiscuous mode.\n");
@@ -2150,6 +2854,9 @@ int main(int argc, char *argv[])
 	fr_dict_t *dict = NULL;
 
 	rs_stats_t *stats;
+#ifdef HAVE_PTHREAD_H
+	int threads_started = 0;
+#endif
 
 	fr_debug_lvl = 1;
 	fr_log_fp = stdout;
@@ -2169,7 +2876,11 @@ int main(int argc, char *argv[])
 	conf = talloc_zero(NULL, rs_t);
 	RS_ASSERT(conf);
 
-	stats = talloc_zero(conf, rs_stats_t);
+	stats = rs_stats_alloc(conf);
+	if (!stats) {
+		ERROR("Out of memory");
+		exit(EXIT_FAILURE);
+	}
 
 	/*
 	 *  We don't really want probes taking down machines
@@ -2200,7 +2911,7 @@ int main(int argc, char *argv[])
 	/*
 	 *  Get options
 	 */
-	while ((opt = getopt(argc, argv, "ab:c:C:d:D:e:Ef:hi:I:l:L:mp:P:qr:R:s:Svw:xXW:T:P:N:O:")) != EOF) {
+	while ((opt = getopt(argc, argv, "ab:c:C:d:D:e:Ef:hi:I:j:l:L:mp:P:qr:R:s:Svw:xXW:T:P:N:O:")) != EOF) {
 		switch (opt) {
 		case 'a':
 		{
@@ -2292,6 +3003,14 @@ int main(int argc, char *argv[])
 			conf->from_file = true;
 			break;
 
+		case 'j':
+			conf->num_threads = atoi(optarg);
+			if ((conf->num_threads < 0) || (conf->num_threads > RS_MAX_THREADS)) {
+				ERROR("Number of decode threads must be between 0 and %i", RS_MAX_THREADS);
+				usage(64);
+			}
+			break;
+
 		case 'l':
 			conf->list_attributes = optarg;
 			break;
@@ -2425,6 +3144,27 @@ int main(int argc, char *argv[])
 		usage(64);
 	}
 
+	/*
+	 *	Packets from files are processed using their capture timestamps, which
+	 *	only makes sense in order, and pcap_dump isn't thread safe.
+	 */
+	if (conf->num_threads) {
+#ifdef HAVE_PTHREAD_H
+		if (conf->from_file || conf->from_stdin) {
+			ERROR("Decode threads (-j) can only be used with live capture");
+			usage(64);
+		}
+
+		if (conf->to_file || conf->to_stdout) {
+			ERROR("Decode threads (-j) can't be used when writing PCAP data");
+			usage(64);
+		}
+#else
+		ERROR("Decode threads (-j) require pthread support");
+		usage(64);
+#endif
+	}
+
 	/* Can't set stats export mode if we're not writing stats */
 	if ((conf->stats.out == RS_STATS_OUT_STDIO_CSV) && !conf->stats.interval) {
 		usage(64);
@@ -2520,12 +3260,6 @@ int main(int argc, char *argv[])
 		if (conf->link_da_num < 0) {
 			usage(64);
 		}
-
-		link_tree = rbtree_create(conf, (rbcmp) rs_rtx_cmp, _unmark_link, 0);
-		if (!link_tree) {
-			ERROR("Failed creating RTX tree");
-			goto finish;
-		}
 	}
 
 	if (conf->filter_request) {
@@ -2582,15 +3316,6 @@ int main(int argc, char *argv[])
 		conf->decode_attrs = true;
 	}
 
-	/*
-	 *	Setup the request tree
-	 */
-	request_tree = rbtree_create(conf, (rbcmp) rs_packet_cmp, _unmark_request, 0);
-	if (!request_tree) {
-		ERROR("Failed creating request tree");
-		goto finish;
-	}
-
 	/*
 	 *	Get the default capture device
 	 */
@@ -2652,6 +3377,9 @@ int main(int argc, char *argv[])
 		}
 		if (conf->limit > 0)	{
 			DEBUG2("  Capture limit (packets) : [%" PRIu64 "]", conf->limit);
+		}
+		if (conf->num_threads > 0) {
+			DEBUG2("  Decode threads          : [%i]", conf->num_threads);
 		}
 			DEBUG2("  PCAP filter             : [%s]", conf->pcap_filter);
 			DEBUG2("  RADIUS secret           : [%s]", conf->radius_secret);
@@ -2807,6 +3535,29 @@ int main(int argc, char *argv[])
 			goto finish;
 		}
 
+		/*
+		 *  Setup the request trees.  If we're decoding in the capture
+		 *  thread, there's a single shard using the main event list.
+		 *  Allocated after the event list, so requests are freed first.
+		 */
+		if (!conf->num_threads) {
+			shards = talloc_array(conf, rs_shard_t *, 1);
+			if (!shards) goto finish;
+
+			shards[0] = rs_shard_alloc(conf, 0, events, stats);
+			if (!shards[0]) goto finish;
+		} else {
+			int i;
+
+			shards = talloc_zero_array(conf, rs_shard_t *, conf->num_threads);
+			if (!shards) goto finish;
+
+			for (i = 0; i < conf->num_threads; i++) {
+				shards[i] = rs_shard_alloc(conf, i, NULL, NULL);
+				if (!shards[i]) goto finish;
+			}
+		}
+
 		/*
 		 *  Now add fd's for each of the pcap sessions we opened
 		 */
@@ -2816,10 +3567,9 @@ int main(int argc, char *argv[])
 			rs_event_t *event;
 
 			event = talloc_zero(events, rs_event_t);
-			event->list = events;
 			event->in = in_p;
 			event->out = out;
-			event->stats = stats;
+			event->shard = shards[0];
 
 			if (fr_event_fd_insert(events, in_p->fd, rs_got_packet, NULL, NULL, event) < 0) {
 				ERROR("Failed inserting file descriptor");
@@ -2857,6 +3607,16 @@ int main(int argc, char *argv[])
 #ifdef SIGQUIT
 	fr_set_signal(SIGQUIT, rs_signal_self);
 #endif
+
+	/*
+	 *	Start the decode threads after daemonizing, as they wouldn't
+	 *	survive the fork.
+	 */
+#ifdef HAVE_PTHREAD_H
+	for (threads_started = 0; threads_started < conf->num_threads; threads_started++) {
+		if (rs_shard_thread_start(shards[threads_started]) < 0) goto finish;
+	}
+#endif
 	DEBUG2("Entering event loop");
 
 	fr_event_loop(events);	/* Enter the main event loop */
@@ -2864,6 +3624,9 @@ int main(int argc, char *argv[])
 	DEBUG2("Done sniffing");
 
 finish:
+#ifdef HAVE_PTHREAD_H
+	while (threads_started > 0) rs_shard_thread_stop(shards[--threads_started]);
+#endif
 	cleanup = true;
 
 	/*
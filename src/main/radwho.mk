@@ -1,5 +1,5 @@
 TARGET		:= radwho
 SOURCES		:= radwho.c
 
-TGT_PREREQS	:= libfreeradius-server.a libfreeradius-radius.a
+TGT_PREREQS	:= libfreeradius-server.a libfreeradius-util.a libfreeradius-radius.a
 TGT_LDLIBS	:= $(LIBS)
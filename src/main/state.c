@@ -50,6 +50,12 @@ RCSID("$Id$")
 #include <freeradius-devel/state.h>
 #include <freeradius-devel/rad_assert.h>
 
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/stdatomic.h>
+#endif
+
 /** Holds a state value, and associated VALUE_PAIRs and data
  *
  */
@@ -106,16 +112,35 @@ typedef struct state_entry {
 	request_data_t		*data;				//!< Persistable request data, also parented ctx.
 } fr_state_entry_t;
 
-struct fr_state_tree_t {
+/*
+ *	The state tree is split into shards, selected by the top bits of
+ *	the hash of the State value.  Each shard has its own lock, hash
+ *	table and expiry list, so that threads working on different
+ *	authentication sessions don't contend with each other.
+ */
+#define STATE_SHARD_BITS	(4)
+#define STATE_SHARDS		(1 << STATE_SHARD_BITS)
+
+/** One shard of the state tree
+ *
+ */
+typedef struct state_shard {
 	uint64_t		id;				//!< Next ID to assign.
 	uint64_t		timed_out;			//!< Number of states that were cleaned up due to
 								//!< timeout.
-	uint32_t		max_sessions;			//!< Maximum number of sessions we track.
-	rbtree_t		*tree;				//!< rbtree used to lookup state value.
+	fr_hash_table_t		*hash;				//!< Hash table used to lookup state value.
 
 	fr_state_entry_t	*head, *tail;			//!< Entries to expire.
-	uint32_t		timeout;			//!< How long to wait before cleaning up state entires.
 	pthread_mutex_t		mutex;				//!< Synchronisation mutex.
+} fr_state_shard_t;
+
+struct fr_state_tree_t {
+	uint32_t		max_sessions;			//!< Maximum number of sessions we track.
+	uint32_t		max_shard_sessions;		//!< Maximum number of sessions in any one shard.
+	atomic_uint_fast32_t	num_sessions;			//!< Number of sessions in all of the shards.
+	uint32_t		timeout;			//!< How long to wait before cleaning up state entires.
+
+	fr_state_shard_t	shard[STATE_SHARDS];		//!< Shards, each holding a portion of the entries.
 };
 
 fr_state_tree_t *global_state = NULL;
@@ -123,7 +148,7 @@ fr_state_tree_t *global_state = NULL;
 #define PTHREAD_MUTEX_LOCK if (main_config.spawn_workers) pthread_mutex_lock
 #define PTHREAD_MUTEX_UNLOCK if (main_config.spawn_workers) pthread_mutex_unlock
 
-static void state_entry_unlink(fr_state_tree_t *state, fr_state_entry_t *entry);
+static void state_entry_unlink(fr_state_tree_t *state, fr_state_shard_t *shard, fr_state_entry_t *entry);
 
 /** Compare two fr_state_entry_t based on their state value i.e. the value of the attribute
  *
@@ -136,34 +161,57 @@ static int state_entry_cmp(void const *one, void const *two)
 	return memcmp(a->state, b->state, sizeof(a->state));
 }
 
+/** Hash a fr_state_entry_t based on its state value
+ *
+ */
+static uint32_t state_entry_hash(void const *data)
+{
+	fr_state_entry_t const *entry = data;
+
+	return fr_hash(entry->state, sizeof(entry->state));
+}
+
+/** Return the shard an entry belongs in
+ *
+ * The hash table uses the low bits of the hash to pick buckets,
+ * so we use the high bits to pick the shard.
+ */
+static inline fr_state_shard_t *state_entry_shard(fr_state_tree_t *state, fr_state_entry_t const *entry)
+{
+	return &state->shard[state_entry_hash(entry) >> (32 - STATE_SHARD_BITS)];
+}
+
 /** Free the state tree
  *
  */
 static int _state_tree_free(fr_state_tree_t *state)
 {
 	fr_state_entry_t *this;
-
-	if (main_config.spawn_workers) pthread_mutex_destroy(&state->mutex);
+	int i;
 
 	DEBUG4("Freeing state tree %p", state);
 
-	while (state->head) {
-		this = state->head;
-		state_entry_unlink(state, this);
-		talloc_free(this);
-	}
+	for (i = 0; i < STATE_SHARDS; i++) {
+		fr_state_shard_t *shard = &state->shard[i];
 
-	for (this = state->head; this; this = this->next) DEBUG4("State %" PRIu64 " needs freeing prev was %" PRIu64 "", this->id, this->prev ? this->prev->id : 100000);
+		if (main_config.spawn_workers) pthread_mutex_destroy(&shard->mutex);
 
-	/*
-	 *	Ensure we got *all* the entries
-	 */
-	rad_assert(!state->head);
+		while (shard->head) {
+			this = shard->head;
+			state_entry_unlink(state, shard, this);
+			talloc_free(this);
+		}
 
-	/*
-	 *	Free the rbtree
-	 */
-	rbtree_free(state->tree);
+		/*
+		 *	Ensure we got *all* the entries
+		 */
+		rad_assert(!shard->head);
+
+		/*
+		 *	Free the hash table
+		 */
+		fr_hash_table_free(shard->hash);
+	}
 
 	if (state == global_state) global_state = NULL;
 
@@ -180,11 +228,20 @@ static int _state_tree_free(fr_state_tree_t *state)
 fr_state_tree_t *fr_state_tree_init(TALLOC_CTX *ctx, uint32_t max_sessions, uint32_t timeout)
 {
 	fr_state_tree_t *state;
+	int i;
 
 	state = talloc_zero(NULL, fr_state_tree_t);
 	if (!state) return 0;
 
+	/*
+	 *	The limit is enforced across all of the shards.  Each
+	 *	shard also has a looser limit of twice its share, so
+	 *	that a bad State hash can't put every session into
+	 *	one shard.
+	 */
 	state->max_sessions = max_sessions;
+	state->max_shard_sessions = ((max_sessions + (STATE_SHARDS - 1)) / STATE_SHARDS) * 2;
+	atomic_init(&state->num_sessions, 0);
 	state->timeout = timeout;
 
 	/*
@@ -196,31 +253,42 @@ fr_state_tree_t *fr_state_tree_init(TALLOC_CTX *ctx, uint32_t max_sessions, uint
 	 */
 	fr_talloc_link_ctx(ctx, state);
 
-	if (main_config.spawn_workers && (pthread_mutex_init(&state->mutex, NULL) != 0)) {
-		talloc_free(state);
-		return NULL;
-	}
+	for (i = 0; i < STATE_SHARDS; i++) {
+		fr_state_shard_t *shard = &state->shard[i];
 
-	/*
-	 *	We need to do controlled freeing of the
-	 *	rbtree, so that all the state entries
-	 *	are freed before it's destroyed.  Hence
-	 *	it being parented from the NULL ctx.
-	 */
-	state->tree = rbtree_create(NULL, state_entry_cmp, NULL, 0);
-	if (!state->tree) {
-		talloc_free(state);
-		return NULL;
+		/*
+		 *	We need to do controlled freeing of the
+		 *	hash table, so that all the state entries
+		 *	are freed before it's destroyed.  Hence
+		 *	it being parented from the NULL ctx.
+		 */
+		shard->hash = fr_hash_table_create(NULL, state_entry_hash, state_entry_cmp, NULL);
+		if (!shard->hash) goto error;
+
+		if (main_config.spawn_workers && (pthread_mutex_init(&shard->mutex, NULL) != 0)) {
+			fr_hash_table_free(shard->hash);
+			goto error;
+		}
 	}
 	talloc_set_destructor(state, _state_tree_free);
 
 	return state;
+
+error:
+	while (--i >= 0) {
+		if (main_config.spawn_workers) pthread_mutex_destroy(&state->shard[i].mutex);
+		fr_hash_table_free(state->shard[i].hash);
+	}
+	talloc_free(state);
+
+	return NULL;
 }
 
 /** Unlink an entry and remove if from the tree
  *
+ * @note Called with the shard mutex held.
  */
-static void state_entry_unlink(fr_state_tree_t *state, fr_state_entry_t *entry)
+static void state_entry_unlink(fr_state_tree_t *state, fr_state_shard_t *shard, fr_state_entry_t *entry)
 {
 	fr_state_entry_t *prev, *next;
 
@@ -228,24 +296,25 @@ static void state_entry_unlink(fr_state_tree_t *state, fr_state_entry_t *entry)
 	next = entry->next;
 
 	if (prev) {
-		rad_assert(state->head != entry);
+		rad_assert(shard->head != entry);
 		prev->next = next;
-	} else if (state->head) {
-		rad_assert(state->head == entry);
-		state->head = next;
+	} else if (shard->head) {
+		rad_assert(shard->head == entry);
+		shard->head = next;
 	}
 
 	if (next) {
-		rad_assert(state->tail != entry);
+		rad_assert(shard->tail != entry);
 		next->prev = prev;
-	} else if (state->tail) {
-		rad_assert(state->tail == entry);
-		state->tail = prev;
+	} else if (shard->tail) {
+		rad_assert(shard->tail == entry);
+		shard->tail = prev;
 	}
 	entry->next = NULL;
 	entry->prev = NULL;
 
-	rbtree_deletebydata(state->tree, entry);
+	fr_hash_table_delete(shard->hash, entry);
+	atomic_fetch_sub_explicit(&state->num_sessions, 1, memory_order_relaxed);
 
 	DEBUG4("State ID %" PRIu64 " unlinked", entry->id);
 }
@@ -288,99 +357,46 @@ static int _state_entry_free(fr_state_entry_t *entry)
 	return 0;
 }
 
-/** Create a new state entry
+/** Free a list of entries which have been unlinked from their shard
  *
- * @note Called with the mutex held.
+ * We do it outside of the mutex, as freeing may involve significantly
+ * more work than just freeing the data.
+ *
+ * If there's request data that was persisted it will now be freed
+ * also, and it may have complex destructors associated with it.
  */
-static fr_state_entry_t *state_entry_create(fr_state_tree_t *state, REQUEST *request,
-					    RADIUS_PACKET *packet, fr_state_entry_t *old)
+static void state_entry_list_free(fr_state_entry_t *head)
 {
-	size_t			i;
-	uint32_t		x;
-	time_t			now = time(NULL);
-	VALUE_PAIR		*vp;
-	fr_state_entry_t	*entry, *next;
-	fr_state_entry_t	*free_head = NULL, **free_next = &free_head;
+	fr_state_entry_t *entry, *next;
 
-	uint8_t			old_state[sizeof(old->state)];
-	int			old_tries = 0;
-
-	/*
-	 *	Clean up old entries.
-	 */
-	for (entry = state->head; entry != NULL; entry = next) {
-		next = entry->next;
-
-		if (entry == old) continue;
-
-		/*
-		 *	Too old, we can delete it.
-		 */
-		if (entry->cleanup < now) {
-			state_entry_unlink(state, entry);
-			*free_next = entry;
-			free_next = &(entry->next);
-			state->timed_out++;
-			continue;
-		}
-
-		break;
-	}
-
-	if (rbtree_num_elements(state->tree) >= (uint32_t) state->max_sessions) return NULL;
-
-	/*
-	 *	Record the information from the old state, we may base the
-	 *	new state off the old one.
-	 *
-	 *	Once we release the mutex, the state of old becomes indeterminate
-	 *	so we have to grab the values now.
-	 */
-	if (old) {
-		old_tries = old->tries;
-
-		memcpy(old_state, old->state, sizeof(old_state));
-
-		/*
-		 *	The old one isn't used any more, so we can free it.
-		 */
-		if (!old->data) {
-			state_entry_unlink(state, old);
-			*free_next = old;
-		}
-	}
-	PTHREAD_MUTEX_UNLOCK(&state->mutex);
-
-	/*
-	 *	Now free the unlinked entries.
-	 *
-	 *	We do it here as freeing may involve significantly more
-	 *	work than just freeing the data.
-	 *
-	 *	If there's request data that was persisted it will now
-	 *	be freed also, and it may have complex destructors associated
-	 *	with it.
-	 */
-	for (next = free_head; next;) {
+	for (next = head; next;) {
 		entry = next;
 		next = entry->next;
 		talloc_free(entry);
 	}
+}
+
+/** Create a new state entry
+ *
+ * If the reply doesn't already contain a State attribute, one is
+ * created for the new entry, but it isn't added to the reply.  The
+ * caller adds it once the entry has been inserted into the tree.
+ *
+ * @note Called with no mutexes held.  The entry is not inserted into the tree.
+ */
+static fr_state_entry_t *state_entry_create(fr_state_tree_t *state, REQUEST *request, RADIUS_PACKET *packet,
+					    uint8_t const *old_state, int old_tries, VALUE_PAIR **new_vp)
+{
+	size_t			i;
+	uint32_t		x;
+	VALUE_PAIR		*vp;
+	fr_state_entry_t	*entry;
+
+	*new_vp = NULL;
 
-	/*
-	 *	Allocation doesn't need to occur inside the critical region
-	 *	and would add significantly to contention.
-	 *
-	 *	We reparent the talloc chunk later (when we hold the mutex again)
-	 *	we can't do it now due to thread safety issues with talloc.
-	 */
 	entry = talloc_zero(NULL, fr_state_entry_t);
-	if (!entry) {
-		PTHREAD_MUTEX_LOCK(&state->mutex);	/* Caller expects this to be locked */
-		return NULL;
-	}
+	if (!entry) return NULL;
 	talloc_set_destructor(entry, _state_entry_free);
-	entry->id = state->id++;
 
 	/*
 	 *	Limit the lifetime of this entry based on how long the
@@ -388,7 +404,7 @@ static fr_state_entry_t *state_entry_create(fr_state_tree_t *state, REQUEST *req
 	 *	isn't perfect, but it's reasonable, and it's one less
 	 *	thing for an administrator to configure.
 	 */
-	entry->cleanup = now + state->timeout;
+	entry->cleanup = time(NULL) + state->timeout;
 
 	/*
 	 *	Some modules like rlm_otp create their own magic
@@ -408,7 +424,7 @@ static fr_state_entry_t *state_entry_create(fr_state_tree_t *state, REQUEST *req
 		 *	16 octets of randomness should be enough to
 		 *	have a globally unique state.
 		 */
-		if (!old) {
+		if (!old_state) {
 			for (i = 0; i < sizeof(entry->state) / sizeof(x); i++) {
 				x = fr_rand();
 				memcpy(entry->state + (i * 4), &x, sizeof(x));
@@ -440,22 +456,7 @@ static fr_state_entry_t *state_entry_create(fr_state_tree_t *state, REQUEST *req
 
 		vp = fr_pair_afrom_num(packet, 0, PW_STATE);
 		fr_pair_value_memcpy(vp, entry->state, sizeof(entry->state));
-		fr_pair_add(&packet->vps, vp);
-	}
-
-	if (DEBUG_ENABLED4) {
-		char hex[(sizeof(entry->state) * 2) + 1];
-
-		fr_bin2hex(hex, entry->state, sizeof(entry->state));
-
-		DEBUG4("State ID %" PRIu64 " created, value 0x%s, expires %" PRIu64 "s",
-		       entry->id, hex, (uint64_t)entry->cleanup - now);
-	}
-
-	PTHREAD_MUTEX_LOCK(&state->mutex);
-	if (rbtree_num_elements(state->tree) >= (uint32_t)state->max_sessions) {
-		talloc_free(entry);
-		return NULL;
+		*new_vp = vp;
 	}
 
 	/*
@@ -466,52 +467,189 @@ static fr_state_entry_t *state_entry_create(fr_state_tree_t *state, REQUEST *req
 	 */
 	*((uint32_t *)(&entry->state_comp.server_hash)) ^= fr_hash_string(request->server);
 
-	if (!rbtree_insert(state->tree, entry)) {
-		talloc_free(entry);
-		return NULL;
+	return entry;
+}
+
+/** Reserve room for a new entry in the tree
+ *
+ * @return
+ *	- true if the entry may be inserted.
+ *	- false if we're already tracking max_sessions.
+ */
+static bool state_entry_reserve(fr_state_tree_t *state)
+{
+	if (atomic_fetch_add_explicit(&state->num_sessions, 1, memory_order_relaxed) < state->max_sessions) {
+		return true;
 	}
 
+	atomic_fetch_sub_explicit(&state->num_sessions, 1, memory_order_relaxed);
+	return false;
+}
+
+/** Unlink the expired entries in a shard
+ *
+ * Expired entries are added to the free list for the caller to
+ * free once the mutex is released.
+ *
+ * @note Called with the shard mutex held.
+ *
+ * @return the number of entries which were unlinked.
+ */
+static uint32_t state_shard_reap(fr_state_tree_t *state, fr_state_shard_t *shard, time_t now,
+				 fr_state_entry_t **free_head)
+{
+	uint32_t		reaped = 0;
+	fr_state_entry_t	*this, *next;
+	fr_state_entry_t	**free_next = free_head;
+
+	while (*free_next) free_next = &((*free_next)->next);
+
+	/*
+	 *	The list is ordered by cleanup time, so we stop at
+	 *	the first entry which is still live.
+	 */
+	for (this = shard->head; this != NULL; this = next) {
+		next = this->next;
+
+		if (this->cleanup >= now) break;
+
+		state_entry_unlink(state, shard, this);
+		*free_next = this;
+		free_next = &(this->next);
+		shard->timed_out++;
+		reaped++;
+	}
+
+	return reaped;
+}
+
+/** Unlink and free expired entries when the tree is full
+ *
+ * The shard the new entry will go into is checked first.  Only if
+ * nothing has expired there do we walk the other shards, so the
+ * common case still only takes one mutex.
+ *
+ * @note Called with no mutexes held.
+ *
+ * @return the number of entries which were freed.
+ */
+static uint32_t state_tree_reap(fr_state_tree_t *state, fr_state_shard_t *first)
+{
+	time_t			now = time(NULL);
+	uint32_t		reaped;
+	fr_state_entry_t	*free_head = NULL;
+	int			i;
+
+	PTHREAD_MUTEX_LOCK(&first->mutex);
+	reaped = state_shard_reap(state, first, now, &free_head);
+	PTHREAD_MUTEX_UNLOCK(&first->mutex);
+
+	for (i = 0; !reaped && (i < STATE_SHARDS); i++) {
+		fr_state_shard_t *shard = &state->shard[i];
+
+		if (shard == first) continue;
+
+		PTHREAD_MUTEX_LOCK(&shard->mutex);
+		reaped += state_shard_reap(state, shard, now, &free_head);
+		PTHREAD_MUTEX_UNLOCK(&shard->mutex);
+	}
+
+	state_entry_list_free(free_head);
+
+	return reaped;
+}
+
+/** Insert a new entry into its shard
+ *
+ * Expired entries in the shard are unlinked, and added to the
+ * free list for the caller to free once the mutex is released.
+ *
+ * The caller must already have reserved room for the entry with
+ * state_entry_reserve().
+ *
+ * @note Called with the shard mutex held.
+ */
+static bool state_entry_insert(fr_state_tree_t *state, fr_state_shard_t *shard, fr_state_entry_t *entry,
+			       fr_state_entry_t **free_head)
+{
+	time_t			now = time(NULL);
+
+	(void) state_shard_reap(state, shard, now, free_head);
+
+	if ((uint32_t) fr_hash_table_num_elements(shard->hash) >= state->max_shard_sessions) return false;
+
+	if (!fr_hash_table_insert(shard->hash, entry)) return false;
+
+	entry->id = shard->id++;
+
 	/*
 	 *	Link it to the end of the list, which is implicitely
 	 *	ordered by cleanup time.
 	 */
-	if (!state->head) {
+	if (!shard->head) {
 		entry->prev = entry->next = NULL;
-		state->head = state->tail = entry;
+		shard->head = shard->tail = entry;
 	} else {
-		rad_assert(state->tail != NULL);
+		rad_assert(shard->tail != NULL);
 
-		entry->prev = state->tail;
-		state->tail->next = entry;
+		entry->prev = shard->tail;
+		shard->tail->next = entry;
 
 		entry->next = NULL;
-		state->tail = entry;
+		shard->tail = entry;
 	}
 
-	return entry;
+	if (DEBUG_ENABLED4) {
+		char hex[(sizeof(entry->state) * 2) + 1];
+
+		fr_bin2hex(hex, entry->state, sizeof(entry->state));
+
+		DEBUG4("State ID %" PRIu64 " created, value 0x%s, expires %" PRIu64 "s",
+		       entry->id, hex, (uint64_t)entry->cleanup - now);
+	}
+
+	return true;
 }
 
-/** Find the entry, based on the State attribute
+/** Find the shard which would hold the entry for a State attribute
  *
+ * @param[in] state tree to search.
+ * @param[in] request the packet belongs to.
+ * @param[in] packet containing the State attribute.
+ * @param[out] my_entry populated with the lookup key.
+ * @return
+ *	- The shard to search.
+ *	- NULL if the packet has no valid State attribute.
  */
-static fr_state_entry_t *state_entry_find(fr_state_tree_t *state, REQUEST *request, RADIUS_PACKET *packet)
+static fr_state_shard_t *state_shard_find(fr_state_tree_t *state, REQUEST *request, RADIUS_PACKET *packet,
+					  fr_state_entry_t *my_entry)
 {
 	VALUE_PAIR *vp;
-	fr_state_entry_t *entry, my_entry;
 
 	vp = fr_pair_find_by_num(packet->vps, 0, PW_STATE, TAG_ANY);
 	if (!vp) return NULL;
 
-	if (vp->vp_length != sizeof(my_entry.state)) return NULL;
+	if (vp->vp_length != sizeof(my_entry->state)) return NULL;
 
-	memcpy(my_entry.state, vp->vp_octets, sizeof(my_entry.state));
+	memcpy(my_entry->state, vp->vp_octets, sizeof(my_entry->state));
 
 	/*
 	 *	Make it unique for different virtual servers handling the same request
 	 */
-	my_entry.state_comp.server_hash ^= fr_hash_string(request->server);
+	my_entry->state_comp.server_hash ^= fr_hash_string(request->server);
 
-	entry = rbtree_finddata(state->tree, &my_entry);
+	return state_entry_shard(state, my_entry);
+}
+
+/** Find the entry, based on the State attribute
+ *
+ * @note Called with the shard mutex held.
+ */
+static fr_state_entry_t *state_entry_find(fr_state_shard_t *shard, fr_state_entry_t *my_entry)
+{
+	fr_state_entry_t *entry;
+
+	entry = fr_hash_table_finddata(shard->hash, my_entry);
 
 #ifdef WITH_VERIFY_PTR
 	if (entry) (void) talloc_get_type_abort(entry, fr_state_entry_t);
@@ -525,16 +663,20 @@ static fr_state_entry_t *state_entry_find(fr_state_tree_t *state, REQUEST *reque
  */
 void fr_state_discard(fr_state_tree_t *state, REQUEST *request, RADIUS_PACKET *original)
 {
-	fr_state_entry_t *entry;
+	fr_state_entry_t *entry, my_entry;
+	fr_state_shard_t *shard;
+
+	shard = state_shard_find(state, request, original, &my_entry);
+	if (!shard) return;
 
-	PTHREAD_MUTEX_LOCK(&state->mutex);
-	entry = state_entry_find(state, request, original);
+	PTHREAD_MUTEX_LOCK(&shard->mutex);
+	entry = state_entry_find(shard, &my_entry);
 	if (!entry) {
-		PTHREAD_MUTEX_UNLOCK(&state->mutex);
+		PTHREAD_MUTEX_UNLOCK(&shard->mutex);
 		return;
 	}
-	state_entry_unlink(state, entry);
-	PTHREAD_MUTEX_UNLOCK(&state->mutex);
+	state_entry_unlink(state, shard, entry);
+	PTHREAD_MUTEX_UNLOCK(&shard->mutex);
 
 	/*
 	 *	The state and request must be in the same state
@@ -561,7 +703,8 @@ void fr_state_discard(fr_state_tree_t *state, REQUEST *request, RADIUS_PACKET *o
  */
 void fr_state_to_request(fr_state_tree_t *state, REQUEST *request, RADIUS_PACKET *packet)
 {
-	fr_state_entry_t *entry;
+	fr_state_entry_t *entry, my_entry;
+	fr_state_shard_t *shard;
 	TALLOC_CTX *old_ctx = NULL;
 
 	rad_assert(request->state == NULL);
@@ -575,23 +718,26 @@ void fr_state_to_request(fr_state_tree_t *state, REQUEST *request, RADIUS_PACKET
 		return;
 	}
 
-	PTHREAD_MUTEX_LOCK(&state->mutex);
+	shard = state_shard_find(state, request, packet, &my_entry);
+	if (shard) {
+		PTHREAD_MUTEX_LOCK(&shard->mutex);
 
-	entry = state_entry_find(state, request, packet);
-	if (entry) {
-		if (request->state_ctx) old_ctx = request->state_ctx;
+		entry = state_entry_find(shard, &my_entry);
+		if (entry) {
+			if (request->state_ctx) old_ctx = request->state_ctx;
 
-		request->seq_start = entry->seq_start;
-		request->state_ctx = entry->ctx;
-		request->state = entry->vps;
-		request_data_restore(request, entry->data);
+			request->seq_start = entry->seq_start;
+			request->state_ctx = entry->ctx;
+			request->state = entry->vps;
+			request_data_restore(request, entry->data);
 
-		entry->ctx = NULL;
-		entry->vps = NULL;
-		entry->data = NULL;
-	}
+			entry->ctx = NULL;
+			entry->vps = NULL;
+			entry->data = NULL;
+		}
 
-	PTHREAD_MUTEX_UNLOCK(&state->mutex);
+		PTHREAD_MUTEX_UNLOCK(&shard->mutex);
+	}
 
 	if (request->state) {
 		RDEBUG2("Restored &session-state");
@@ -610,6 +756,39 @@ void fr_state_to_request(fr_state_tree_t *state, REQUEST *request, RADIUS_PACKET
 }
 
 
+/** Lock the shards holding the old and the new entries
+ *
+ * Shards are always locked in the order they appear in the tree, so
+ * two threads locking the same pair of shards can't deadlock.
+ *
+ * @param[in] old_shard holding the old entry, may be NULL.
+ * @param[in] shard the new entry will be inserted into.
+ */
+static void state_shards_lock(fr_state_shard_t *old_shard, fr_state_shard_t *shard)
+{
+	if (!old_shard || (old_shard == shard)) {
+		PTHREAD_MUTEX_LOCK(&shard->mutex);
+		return;
+	}
+
+	if (old_shard < shard) {
+		PTHREAD_MUTEX_LOCK(&old_shard->mutex);
+		PTHREAD_MUTEX_LOCK(&shard->mutex);
+	} else {
+		PTHREAD_MUTEX_LOCK(&shard->mutex);
+		PTHREAD_MUTEX_LOCK(&old_shard->mutex);
+	}
+}
+
+/** Unlock the shards locked by state_shards_lock()
+ *
+ */
+static void state_shards_unlock(fr_state_shard_t *old_shard, fr_state_shard_t *shard)
+{
+	PTHREAD_MUTEX_UNLOCK(&shard->mutex);
+	if (old_shard && (old_shard != shard)) PTHREAD_MUTEX_UNLOCK(&old_shard->mutex);
+}
+
 /** Transfer ownership of the state VALUE_PAIRs and ctx, back to a state entry
  *
  * Put request->state into the State attribute.  Put the State attribute
@@ -619,8 +798,13 @@ void fr_state_to_request(fr_state_tree_t *state, REQUEST *request, RADIUS_PACKET
  */
 bool fr_request_to_state(fr_state_tree_t *state, REQUEST *request, RADIUS_PACKET *original, RADIUS_PACKET *packet)
 {
-	fr_state_entry_t *entry, *old;
-	request_data_t *data;
+	fr_state_entry_t	*entry, *old, my_entry;
+	fr_state_entry_t	*free_head = NULL;
+	fr_state_shard_t	*shard, *old_shard;
+	request_data_t		*data;
+	VALUE_PAIR		*vp;
+	int			old_tries = 0;
+	bool			have_old, reserved = false;
 
 	request_data_by_persistance(&data, request, true);
 
@@ -631,15 +815,83 @@ bool fr_request_to_state(fr_state_tree_t *state, REQUEST *request, RADIUS_PACKET
 		rdebug_pair_list(L_DBG_LVL_2, request, request->state, "&session-state:");
 	}
 
-	PTHREAD_MUTEX_LOCK(&state->mutex);
+	/*
+	 *	The new state is based on the old one, and the shard
+	 *	it goes into depends on the number of tries.  We take
+	 *	that from the State attribute, and check it against
+	 *	the old entry once we hold the mutexes.
+	 */
+	old_shard = original ? state_shard_find(state, request, original, &my_entry) : NULL;
+	have_old = (old_shard != NULL);
+	if (have_old) old_tries = my_entry.state_comp.tries - 1;
 
-	old = original ? state_entry_find(state, request, original) :
-			 NULL;
+	for (;;) {
+		/*
+		 *	Allocation doesn't need to occur inside the
+		 *	critical region and would add significantly
+		 *	to contention.
+		 */
+		entry = state_entry_create(state, request, packet, have_old ? my_entry.state : NULL, old_tries, &vp);
+		if (!entry) goto error;
 
-	entry = state_entry_create(state, request, packet, old);
-	if (!entry) {
-		PTHREAD_MUTEX_UNLOCK(&state->mutex);
-		return false;
+		shard = state_entry_shard(state, entry);
+
+		/*
+		 *	If we're full, free any expired entries and
+		 *	try again.  If we're still full, the old entry
+		 *	is left alone.
+		 */
+		if (!reserved) {
+			if (!state_entry_reserve(state) &&
+			    (!state_tree_reap(state, shard) || !state_entry_reserve(state))) {
+				talloc_free(vp);
+				talloc_free(entry);
+				return false;
+			}
+			reserved = true;
+		}
+
+		/*
+		 *	The lookup of the old entry, unlinking it, and
+		 *	inserting the new one all happen under the same
+		 *	locks, so two requests can't both replace the
+		 *	same entry.
+		 */
+		state_shards_lock(old_shard, shard);
+
+		old = old_shard ? state_entry_find(old_shard, &my_entry) : NULL;
+		if (((old != NULL) == have_old) && (!old || (old->tries == old_tries))) break;
+
+		/*
+		 *	The old entry isn't what we based the new one
+		 *	on.  Either someone else replaced it, or its
+		 *	State didn't come from us.  Build the new entry
+		 *	again from what's really there.
+		 */
+		have_old = (old != NULL);
+		if (old) old_tries = old->tries;
+
+		state_shards_unlock(old_shard, shard);
+
+		talloc_free(vp);
+		talloc_free(entry);
+	}
+
+	/*
+	 *	The old one isn't used any more, so we can free it.
+	 */
+	if (old && !old->data) {
+		state_entry_unlink(state, old_shard, old);
+		free_head = old;
+	}
+
+	if (!state_entry_insert(state, shard, entry, &free_head)) {
+		state_shards_unlock(old_shard, shard);
+
+		state_entry_list_free(free_head);
+		talloc_free(vp);
+		talloc_free(entry);
+		goto error;
 	}
 
 	rad_assert(entry->ctx == NULL);
@@ -653,11 +905,19 @@ bool fr_request_to_state(fr_state_tree_t *state, REQUEST *request, RADIUS_PACKET
 	request->state_ctx = NULL;
 	request->state = NULL;
 
-	PTHREAD_MUTEX_UNLOCK(&state->mutex);
+	state_shards_unlock(old_shard, shard);
+
+	if (vp) fr_pair_add(&packet->vps, vp);
+
+	state_entry_list_free(free_head);
 
 	rad_assert(request->state == NULL);
 	VERIFY_REQUEST(request);
 	return true;
+
+error:
+	if (reserved) atomic_fetch_sub_explicit(&state->num_sessions, 1, memory_order_relaxed);
+	return false;
 }
 
 /** Return number of entries created
@@ -665,7 +925,12 @@ bool fr_request_to_state(fr_state_tree_t *state, REQUEST *request, RADIUS_PACKET
  */
 uint64_t fr_state_entries_created(fr_state_tree_t *state)
 {
-	return state->id;
+	uint64_t	created = 0;
+	int		i;
+
+	for (i = 0; i < STATE_SHARDS; i++) created += state->shard[i].id;
+
+	return created;
 }
 
 /** Return number of entries that timed out
@@ -673,7 +938,12 @@ uint64_t fr_state_entries_created(fr_state_tree_t *state)
  */
 uint64_t fr_state_entries_timeout(fr_state_tree_t *state)
 {
-	return state->timed_out;
+	uint64_t	timed_out = 0;
+	int		i;
+
+	for (i = 0; i < STATE_SHARDS; i++) timed_out += state->shard[i].timed_out;
+
+	return timed_out;
 }
 
 /** Return number of entries we're currently tracking
@@ -681,5 +951,5 @@ uint64_t fr_state_entries_timeout(fr_state_tree_t *state)
  */
 uint32_t fr_state_entries_tracked(fr_state_tree_t *state)
 {
-	return (uint32_t)rbtree_num_elements(state->tree);
+	return atomic_load_explicit(&state->num_sessions, memory_order_relaxed);
 }
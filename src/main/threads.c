@@ -48,6 +48,16 @@ USES_APPLE_DEPRECATED_API	/* OpenSSL API has been deprecated by Apple */
 #  include <gperftools/profiler.h>
 #endif
 
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/stdatomic.h>
+#endif
+
+#ifdef HAVE_SYS_EVENTFD_H
+#  include <sys/eventfd.h>
+#endif
+
 #ifndef WITH_GCD
 /*
  *	Incoming packets are spread across all worker threads.
@@ -73,7 +83,13 @@ typedef struct THREAD_HANDLE {
 	unsigned int		request_count;	//!< The number of requests that this thread has handled.
 	time_t			timestamp;	//!< When the thread started executing.
 	time_t			max_time;	//!< for current request
-	int			pipe_fd[2];	//!< for self signal
+	int			pipe_fd[2];	//!< for self signal.  Both are the same
+						//!< eventfd, if we have one.
+
+	atomic_bool		signalled;	//!< A wakeup is pending, or the thread is
+						//!< busy and will check its backlog anyway.
+	atomic_uint		load;		//!< Published number of queued and
+						//!< runnable requests.
 
 	pthread_mutex_t		backlog_mutex;
 	fr_heap_t		*backlog;
@@ -149,6 +165,10 @@ typedef struct THREAD_POOL {
 
 	uint32_t	total_threads;
 
+	THREAD_HANDLE	**threads;		//!< Array of the threads, for picking one
+						//!< without walking the list.
+	uint32_t	next_thread;		//!< Round robin index into threads.
+
 	pthread_mutex_t	thread_mutex;
 	THREAD_HANDLE	*thread_head;
 	THREAD_HANDLE	*thread_tail;
@@ -255,6 +275,44 @@ static void link_list_tail(THREAD_HANDLE **head_p, THREAD_HANDLE **tail_p, THREA
 	}
 }
 
+/*
+ *	Wake up a thread.
+ */
+static void thread_signal(THREAD_HANDLE *thread)
+{
+#ifdef HAVE_SYS_EVENTFD_H
+	uint64_t count = 1;
+
+	(void) write(thread->pipe_fd[1], &count, sizeof(count));
+#else
+	char data = 0;
+
+	(void) write(thread->pipe_fd[1], &data, 1);
+#endif
+}
+
+/*
+ *	Pick the thread with the least load out of two: the next one
+ *	in round robin order, and a random one.  This gets close to
+ *	always picking the least loaded thread, without looking at all
+ *	of them.
+ */
+static THREAD_HANDLE *thread_pick(void)
+{
+	THREAD_HANDLE	*a, *b;
+	uint32_t	load;
+
+	a = thread_pool.threads[thread_pool.next_thread++ % thread_pool.total_threads];
+
+	load = atomic_load_explicit(&a->load, memory_order_relaxed);
+	if ((load == 0) || (thread_pool.total_threads == 1)) return a;
+
+	b = thread_pool.threads[fr_rand() % thread_pool.total_threads];
+	if (atomic_load_explicit(&b->load, memory_order_relaxed) < load) return b;
+
+	return a;
+}
+
 /*
  *	Add a request to the list of waiting requests.
  *	This function gets called ONLY from the main handler thread...
@@ -264,8 +322,6 @@ static void link_list_tail(THREAD_HANDLE **head_p, THREAD_HANDLE **tail_p, THREA
 void request_enqueue(REQUEST *request)
 {
 	THREAD_HANDLE *thread;
-	THREAD_HANDLE *found = NULL;
-	char data = 0;
 
 	request->component = "<core>";
 
@@ -292,20 +348,7 @@ void request_enqueue(REQUEST *request)
 	request->child_state = REQUEST_QUEUED;
 	request->module = "<queue>";
 
-	found = thread_pool.thread_head;
-
-	for (thread = thread_pool.thread_head;
-	     thread != NULL;
-	     thread = thread->next) {
-		if (fr_heap_num_elements(found->backlog) > fr_heap_num_elements(thread->backlog)) {
-			found = thread;
-		}
-	}
-
-	if (!found) return;	/* should never happen */
-
-	thread = found;
-	DEBUG3("Thread %d being signalled", thread->thread_num);
+	thread = thread_pick();
 
 	pthread_mutex_lock(&thread->backlog_mutex);
 	fr_heap_insert(thread->backlog, request);
@@ -313,11 +356,22 @@ void request_enqueue(REQUEST *request)
 	request->thread_ctx = thread;
 	pthread_mutex_unlock(&thread->backlog_mutex);
 
+	/*
+	 *	The thread republishes its load as it runs, so this
+	 *	only has to hold until then.
+	 */
+	atomic_fetch_add_explicit(&thread->load, 1, memory_order_relaxed);
+
 	/*
 	 *	Tell the thread that there's a request available for
-	 *	it, once we're done all of the above work.
+	 *	it, once we're done all of the above work.  If it has
+	 *	already been told, or it's busy, it will see the
+	 *	request without another wakeup.
 	 */
-	(void) write(thread->pipe_fd[1], &data, 1);
+	if (atomic_exchange(&thread->signalled, true)) return;
+
+	DEBUG3("Thread %d being signalled", thread->thread_num);
+	thread_signal(thread);
 }
 
 /*
@@ -537,11 +591,22 @@ static void *thread_handler(void *arg)
 			pthread_mutex_unlock(&thread->backlog_mutex);
 		}
 
+		atomic_store_explicit(&thread->load, fr_heap_num_elements(local_backlog), memory_order_relaxed);
+
 		/*
 		 *	If there's nothing for us to do, wait to be
 		 *	signalled.
 		 */
 		if (fr_heap_num_elements(local_backlog) == 0) {
+			/*
+			 *	Until now, request_enqueue() hasn't
+			 *	woken us up, as we check the backlog on
+			 *	every round.  Ask for wakeups again,
+			 *	and catch anything queued in between.
+			 */
+			if (atomic_exchange(&thread->signalled, false) &&
+			    (fr_heap_num_elements(thread->backlog) > 0)) continue;
+
 			wait_for_event = true;
 
 			DEBUG2("Thread %d waiting to be assigned a request", thread->thread_num);
@@ -640,6 +705,22 @@ static THREAD_HANDLE *thread_spawn(time_t now, int do_trigger)
 	thread->status = THREAD_NONE;
 	thread->timestamp = now;
 
+	atomic_init(&thread->signalled, false);
+	atomic_init(&thread->load, 0);
+
+#ifdef HAVE_SYS_EVENTFD_H
+	/*
+	 *	An eventfd is one descriptor instead of two, and
+	 *	multiple wakeups collapse into one counter.
+	 */
+	thread->pipe_fd[0] = thread->pipe_fd[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (thread->pipe_fd[0] < 0) {
+		talloc_free(thread);
+		ERROR("Thread create eventfd failed: %s",
+		      fr_syserror(errno));
+		return NULL;
+	}
+#else
 	if (pipe(thread->pipe_fd) < 0) {
 		talloc_free(thread);
 		ERROR("Thread create pipe failed: %s",
@@ -653,6 +734,7 @@ static THREAD_HANDLE *thread_spawn(time_t now, int do_trigger)
 	(void) fcntl(thread->pipe_fd[1], F_SETNOSIGPIPE, &rcode);
 	fr_nonblock(thread->pipe_fd[0]);
 	fr_nonblock(thread->pipe_fd[1]);
+#endif
 #endif
 
 	/*
@@ -895,6 +977,8 @@ int thread_pool_init(void)
 		return -1;
 	}
 
+	MEM(thread_pool.threads = talloc_array(NULL, THREAD_HANDLE *, thread_pool.start_threads));
+
 	/*
 	 *	Create a number of waiting threads.  Note we don't
 	 *	need to lock the mutex, as nothing is sending
@@ -910,7 +994,7 @@ int thread_pool_init(void)
 
 		link_list_tail(&thread_pool.thread_head, &thread_pool.thread_tail, thread);
 
-		thread_pool.total_threads++;
+		thread_pool.threads[thread_pool.total_threads++] = thread;
 	}
 
 	rad_assert(thread_pool.thread_head != NULL);
@@ -946,7 +1030,11 @@ void thread_pool_stop(void)
 
 	for (thread = thread_pool.thread_head; thread; thread = thread->next) {
 		thread->status = THREAD_CANCELLED;
+#ifdef HAVE_SYS_EVENTFD_H
+		thread_signal(thread);
+#else
 		close(thread->pipe_fd[1]);
+#endif
 	}
 
 #  ifdef WNOHANG
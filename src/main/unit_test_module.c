@@ -35,6 +35,10 @@ RCSID("$Id$")
 
 #include <ctype.h>
 
+#ifdef HAVE_PTHREAD_H
+#	include <pthread.h>
+#endif
+
 /*
  *  Global variables.
  */
@@ -52,6 +56,62 @@ char const *radiusd_version = RADIUSD_VERSION_STRING_BUILD("unittest");
  */
 static void usage(int);
 
+#ifdef HAVE_PTHREAD_H
+/*
+ *	A copy of the input request, which is run through the
+ *	server at the same time as the original.
+ */
+typedef struct request_thread_t {
+	pthread_t		pthread_id;
+	REQUEST			*request;		//!< Copy of the input request.
+	VALUE_PAIR		*filter_vps;		//!< Shared by all threads, read only.
+	int			rcode;			//!< EXIT_SUCCESS if the reply matched the filter.
+} request_thread_t;
+
+/*
+ *	Run one copy of the request, and check its reply.
+ */
+static void *request_copy_run(void *arg)
+{
+	request_thread_t	*thread = arg;
+	REQUEST			*request = thread->request;
+	fr_event_list_t		*el;
+	VALUE_PAIR		*vp;
+	VALUE_PAIR const	*failed[2];
+
+	thread->rcode = EXIT_FAILURE;
+
+	el = fr_event_list_create(NULL, NULL, NULL);
+	if (!el) return NULL;
+
+	/*
+	 *	Module thread instance data is thread local.
+	 */
+	if (modules_thread_instantiate(main_config.config, el) < 0) goto done;
+
+	request->el = el;
+
+	rad_virtual_server(request);
+
+	vp = radius_pair_create(request->reply, &request->reply->vps, PW_RESPONSE_PACKET_TYPE, 0);
+	vp->vp_integer = request->reply->code;
+
+	if (thread->filter_vps && !fr_pair_validate(failed, thread->filter_vps, request->reply->vps)) {
+		fr_pair_validate_debug(request, failed);
+		ERROR("Request %" PRIu64 " does not match attributes in filter (%s)",
+		      request->number, fr_strerror());
+		goto done;
+	}
+
+	thread->rcode = EXIT_SUCCESS;
+
+done:
+	request->el = NULL;
+	talloc_free(el);
+	return NULL;
+}
+#endif
+
 int listen_compile(UNUSED CONF_SECTION *server, UNUSED CONF_SECTION *cs)
 {
 	return 0;
@@ -700,6 +760,11 @@ int main(int argc, char *argv[])
 	fr_state_tree_t		*state = NULL;
 	fr_event_list_t		*el = NULL;
 	RADCLIENT		*client = NULL;
+#ifdef HAVE_PTHREAD_H
+	int			i, num_threads = 1, num_started = 0;
+	long			start = 0;
+	request_thread_t	*threads = NULL;
+#endif
 
 	fr_talloc_fault_setup();
 
@@ -736,7 +801,7 @@ int main(int argc, char *argv[])
 	default_log.fd = STDOUT_FILENO;
 
 	/*  Process the options.  */
-	while ((argval = getopt(argc, argv, "d:D:f:hi:mMn:o:O:xX")) != EOF) {
+	while ((argval = getopt(argc, argv, "d:D:f:hi:mMn:o:O:t:xX")) != EOF) {
 
 		switch (argval) {
 			case 'd':
@@ -780,6 +845,19 @@ int main(int argc, char *argv[])
 				fprintf(stderr, "Unknown option '%s'\n", optarg);
 				exit(EXIT_FAILURE);
 
+			case 't':
+#ifdef HAVE_PTHREAD_H
+				num_threads = atoi(optarg);
+				if (num_threads < 1) {
+					fprintf(stderr, "Invalid number of threads '%s'\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				break;
+#else
+				fprintf(stderr, "Threads (-t) are not supported on this platform\n");
+				exit(EXIT_FAILURE);
+#endif
+
 			case 'X':
 				rad_debug_lvl += 2;
 				main_config.log_auth = true;
@@ -880,7 +958,7 @@ int main(int argc, char *argv[])
 	if (modules_instantiate(main_config.config) < 0) goto exit_failure;
 
 	/*
-	 *	Create a dummy event list
+	 *	Create an event list, for modules which yield
 	 */
 	el = fr_event_list_create(NULL, NULL, NULL);
 	rad_assert(el != NULL);
@@ -935,6 +1013,21 @@ int main(int argc, char *argv[])
 		goto finish;
 	}
 
+#ifdef HAVE_PTHREAD_H
+	/*
+	 *	Copies of the request are read by re-reading the
+	 *	input, so it has to be seekable.
+	 */
+	if (num_threads > 1) {
+		if (fp == stdin) {
+			fprintf(stderr, "Threads (-t) require an input file\n");
+			rcode = EXIT_FAILURE;
+			goto finish;
+		}
+		start = ftell(fp);
+	}
+#endif
+
 	/*
 	 *	Grab the VPs from stdin, or from the file.
 	 */
@@ -945,6 +1038,51 @@ int main(int argc, char *argv[])
 		goto finish;
 	}
 
+	/*
+	 *	Modules which yield wait for their events in the
+	 *	interpreter, on this event list.
+	 */
+	request->el = el;
+
+#ifdef HAVE_PTHREAD_H
+	/*
+	 *	Read one copy of the request for each extra thread,
+	 *	and then put the input back where it was.  Each copy
+	 *	has its own request number, so that the tests can
+	 *	tell them apart with %n.
+	 */
+	if (num_threads > 1) {
+		long	here = ftell(fp);
+		bool	done = filedone;
+
+		MEM(threads = talloc_zero_array(NULL, request_thread_t, num_threads - 1));
+		for (i = 0; i < (num_threads - 1); i++) {
+			if (fseek(fp, start, SEEK_SET) < 0) {
+				fprintf(stderr, "Failed seeking in %s: %s\n", input_file, strerror(errno));
+				rcode = EXIT_FAILURE;
+				goto finish;
+			}
+			filedone = false;
+
+			threads[i].request = request_from_file(fp, client);
+			if (!threads[i].request) {
+				fprintf(stderr, "Failed reading input: %s\n", fr_strerror());
+				rcode = EXIT_FAILURE;
+				goto finish;
+			}
+			talloc_steal(threads, threads[i].request);
+			threads[i].request->number = i + 1;
+		}
+
+		if (fseek(fp, here, SEEK_SET) < 0) {
+			fprintf(stderr, "Failed seeking in %s: %s\n", input_file, strerror(errno));
+			rcode = EXIT_FAILURE;
+			goto finish;
+		}
+		filedone = done;
+	}
+#endif
+
 	/*
 	 *	No filter file, OR there's no more input, OR we're
 	 *	reading from a file, and it's different from the
@@ -987,8 +1125,34 @@ int main(int argc, char *argv[])
 		fclose(fp);
 	}
 
+#ifdef HAVE_PTHREAD_H
+	/*
+	 *	Run the copies at the same time as the original.
+	 */
+	for (i = 0; i < (num_threads - 1); i++) {
+		int ret;
+
+		threads[i].filter_vps = filter_vps;
+		ret = pthread_create(&threads[i].pthread_id, NULL, request_copy_run, &threads[i]);
+		if (ret != 0) {
+			fprintf(stderr, "Failed creating thread: %s\n", fr_syserror(ret));
+			rcode = EXIT_FAILURE;
+			break;
+		}
+		num_started++;
+	}
+#endif
+
 	rad_virtual_server(request);
 
+#ifdef HAVE_PTHREAD_H
+	for (i = 0; i < num_started; i++) {
+		pthread_join(threads[i].pthread_id, NULL);
+		if (threads[i].rcode != EXIT_SUCCESS) rcode = EXIT_FAILURE;
+	}
+	if (rcode != EXIT_SUCCESS) goto finish;
+#endif
+
 	if (!output_file || (strcmp(output_file, "-") == 0)) {
 		fp = stdout;
 	} else {
@@ -1025,6 +1189,9 @@ int main(int argc, char *argv[])
 	INFO("Exiting normally");
 
 finish:
+#ifdef HAVE_PTHREAD_H
+	talloc_free(threads);
+#endif
 	talloc_free(request);
 	talloc_free(state);
 
@@ -1081,6 +1248,7 @@ static void NEVER_RETURNS usage(int status)
 	fprintf(output, "  -i file       File containing request attributes.\n");
 	fprintf(output, "  -m            On SIGINT or SIGQUIT exit cleanly instead of immediately.\n");
 	fprintf(output, "  -n name       Read raddb/name.conf instead of raddb/radiusd.conf.\n");
+	fprintf(output, "  -t threads    Run 'threads' copies of the request at the same time.\n");
 	fprintf(output, "  -X            Turn on full debugging.\n");
 	fprintf(output, "  -x            Turn on additional debugging. (-xx gives more debugging).\n");
 	exit(status);
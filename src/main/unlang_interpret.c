@@ -1249,6 +1249,57 @@ rlm_rcode_t unlang_interpret_continue(REQUEST *request)
 	return unlang_run(request, request->stack);
 }
 
+/** Order requests in a synchronous backlog
+ *
+ * Only one request is ever in it, so any stable order will do.
+ */
+static int unlang_synchronous_cmp(void const *one, void const *two)
+{
+	if (one < two) return -1;
+	if (one > two) return +1;
+
+	return 0;
+}
+
+/** Run a yielded request to completion
+ *
+ * Requests run by callers which can't deal with a yield, such as
+ * unit_test_module, have an event list, but no backlog to be resumed
+ * from.  When a module yields, we service the event list here until
+ * the request is marked resumable, and then continue running it.
+ *
+ * @param[in] request	which yielded.
+ * @return the result of the section.
+ */
+static rlm_rcode_t unlang_interpret_synchronous(REQUEST *request)
+{
+	rlm_rcode_t	rcode = RLM_MODULE_YIELD;
+	fr_heap_t	*backlog;
+
+	MEM(backlog = fr_heap_create(unlang_synchronous_cmp, offsetof(REQUEST, heap_id)));
+	request->backlog = backlog;
+
+	while (rcode == RLM_MODULE_YIELD) {
+		while (fr_heap_num_elements(backlog) == 0) {
+			if ((fr_event_corral(request->el, true) < 0) && (errno != EINTR)) {
+				ERROR("Failed waiting for events: %s: Exiting", fr_syserror(errno));
+				fr_exit(EXIT_FAILURE);
+			}
+
+			fr_event_service(request->el);
+		}
+
+		(void) fr_heap_extract(backlog, request);
+
+		rcode = unlang_interpret_continue(request);
+	}
+
+	request->backlog = NULL;
+	fr_heap_delete(backlog);
+
+	return rcode;
+}
+
 /** Call a module, iteratively, with a local stack, rather than recursively
  *
  * What did Paul Graham say about Lisp...?
@@ -1265,6 +1316,16 @@ rlm_rcode_t unlang_interpret(REQUEST *request, CONF_SECTION *cs, rlm_rcode_t act
 	unlang_push_section(request, cs, action);
 
 	rcode = unlang_run(request, stack);
+
+	/*
+	 *	Requests run by the threads have a backlog to be
+	 *	resumed from.  Anything else with an event list is
+	 *	run to completion here.
+	 */
+	if ((rcode == RLM_MODULE_YIELD) && request->el && !request->backlog) {
+		rcode = unlang_interpret_synchronous(request);
+	}
+
 	if (rcode != RLM_MODULE_YIELD) {
 		rad_assert(stack->frame[stack->depth].top_frame);
 		rad_assert(!stack->frame[stack->depth].instruction || /* processed the whole section */
@@ -1307,6 +1368,38 @@ static int _unlang_event_free(unlang_event_t *ev)
 	return 0;
 }
 
+/** Find the module call which is registering an event
+ *
+ * Events are usually registered by a module before it first yields.
+ * They may also be registered by its resume callback, when it has to
+ * wait again.
+ *
+ * @param[in] request		the current request.
+ * @param[out] thread		Thread specific module instance.
+ * @return the module call.
+ */
+static unlang_module_call_t *unlang_event_module_call(REQUEST *request, void **thread)
+{
+	unlang_stack_frame_t	*frame;
+	unlang_stack_t		*stack = request->stack;
+
+	rad_assert(stack->depth > 0);
+
+	frame = &stack->frame[stack->depth];
+
+	if (frame->instruction->type == UNLANG_TYPE_RESUME) {
+		unlang_resumption_t *mr = unlang_generic_to_resumption(frame->instruction);
+
+		*thread = mr->thread;
+		return &mr->module;
+	}
+
+	rad_assert(frame->instruction->type == UNLANG_TYPE_MODULE_CALL);
+
+	*thread = frame->modcall.thread;
+	return unlang_generic_to_module_call(frame->instruction);
+}
+
 /** Call the callback registered for a timeout event
  *
  * @param[in] now	The current time, as held by the event_list.
@@ -1372,17 +1465,11 @@ static void unlang_event_fd_handler(UNUSED fr_event_list_t *el, int fd, void *ct
 int unlang_event_timeout_add(REQUEST *request, fr_unlang_timeout_callback_t callback,
 			     void const *ctx, struct timeval *when)
 {
-	unlang_stack_frame_t	*frame;
-	unlang_stack_t		*stack = request->stack;
 	unlang_event_t		*ev;
 	unlang_module_call_t	*sp;
+	void			*thread;
 
-	rad_assert(stack->depth > 0);
-
-	frame = &stack->frame[stack->depth];
-
-	rad_assert(frame->instruction->type == UNLANG_TYPE_MODULE_CALL);
-	sp = unlang_generic_to_module_call(frame->instruction);
+	sp = unlang_event_module_call(request, &thread);
 
 	ev = talloc_zero(request, unlang_event_t);
 	if (!ev) return -1;
@@ -1391,7 +1478,7 @@ int unlang_event_timeout_add(REQUEST *request, fr_unlang_timeout_callback_t call
 	ev->fd = -1;
 	ev->timeout_callback = callback;
 	ev->inst = sp->module_instance->data;
-	ev->thread = frame->modcall.thread;
+	ev->thread = thread;
 	ev->ctx = ctx;
 
 	if (fr_event_timer_insert(request->el, unlang_event_timeout_handler, ev, when, &(ev->ev)) < 0) {
@@ -1427,17 +1514,11 @@ int unlang_event_timeout_add(REQUEST *request, fr_unlang_timeout_callback_t call
 int unlang_event_fd_readable_add(REQUEST *request, fr_unlang_fd_callback_t callback,
 				 void const *ctx, int fd)
 {
-	unlang_stack_frame_t	*frame;
-	unlang_stack_t		*stack = request->stack;
 	unlang_event_t		*ev;
 	unlang_module_call_t	*sp;
+	void			*thread;
 
-	rad_assert(stack->depth > 0);
-
-	frame = &stack->frame[stack->depth];
-
-	rad_assert(frame->instruction->type == UNLANG_TYPE_MODULE_CALL);
-	sp = unlang_generic_to_module_call(frame->instruction);
+	sp = unlang_event_module_call(request, &thread);
 
 	ev = talloc_zero(request, unlang_event_t);
 	if (!ev) return -1;
@@ -1446,7 +1527,7 @@ int unlang_event_fd_readable_add(REQUEST *request, fr_unlang_fd_callback_t callb
 	ev->fd = fd;
 	ev->fd_callback = callback;
 	ev->inst = sp->module_instance->data;
-	ev->thread = frame->modcall.thread;
+	ev->thread = thread;
 	ev->ctx = ctx;
 
 	if (fr_event_fd_insert(request->el, fd, unlang_event_fd_handler, NULL, NULL, ev) < 0) {
@@ -1542,6 +1623,10 @@ void unlang_action(REQUEST *request, fr_state_action_t action)
 }
 
 /** Yield a request
+ *
+ * May also be called from a resume callback, if the module has to wait
+ * again.  The callbacks and ctx then replace the ones given when the
+ * module first yielded.
  *
  * @param[in] request		The current request.
  * @param[in] callback		to call on unlang_resumable().
@@ -1561,6 +1646,15 @@ rlm_rcode_t unlang_yield(REQUEST *request, fr_unlang_resume_t callback,
 
 	frame = &stack->frame[stack->depth];
 
+	if (frame->instruction->type == UNLANG_TYPE_RESUME) {
+		mr = unlang_generic_to_resumption(frame->instruction);
+		mr->callback = callback;
+		mr->action_callback = action_callback;
+		mr->ctx = ctx;
+
+		return RLM_MODULE_YIELD;
+	}
+
 	rad_assert(frame->instruction->type == UNLANG_TYPE_MODULE_CALL);
 	sp = unlang_generic_to_module_call(frame->instruction);
 
@@ -44,6 +44,11 @@ RCSID("$Id$")
 
 #define USEC (1000000)
 
+/*
+ *	Size of the stdio buffer used to read the detail file.
+ */
+#define DETAIL_READ_BUFFER (64 * 1024)
+
 static FR_NAME_NUMBER state_names[] = {
 	{ "unopened", STATE_UNOPENED },
 	{ "unlocked", STATE_UNLOCKED },
@@ -60,110 +65,68 @@ static FR_NAME_NUMBER state_names[] = {
 };
 
 
+/** Find the entry a packet was sent for
+ *
+ * The packet's ID, ports and destination address are all generated from
+ * data->counter, so we can get the counter back from them.
+ */
+static uint32_t detail_packet_counter(RADIUS_PACKET const *packet)
+{
+	uint32_t counter;
+
+	counter = packet->id & 0xff;
+	counter |= ((packet->src_port - 1024) & 0xff) << 8;
+	counter |= ((packet->dst_port - 1024) & 0xff) << 16;
+	counter |= (ntohl(packet->dst_ipaddr.ipaddr.ip4addr.s_addr) & 0xff) << 24;
+
+	return counter;
+}
+
 /*
- *	If we're limiting outstanding packets, then mark the response
- *	as being sent.
+ *	Tell the reader thread that a packet is done with, and
+ *	whether we got a reply.
  */
 static int detail_send(rad_listen_t *listener, REQUEST *request)
 {
-	char c = 0;
+	detail_ack_t	ack;
 	listen_detail_t *data = listener->data;
 
 	rad_assert(request->listener == listener);
 	rad_assert(listener->send == detail_send);
 
+	ack.counter = detail_packet_counter(request->packet);
+
 	/*
 	 *	This request timed out.  Remember that, and tell the
-	 *	caller it's OK to read more "detail" file stuff.
+	 *	reader thread to retry it later.
 	 */
 	if (request->reply->code == 0) {
-		data->delay_time = data->retry_interval * USEC;
-		data->signal = 1;
-		data->entry_state = STATE_NO_REPLY;
+		ack.rtt = -1;
 
 		RDEBUG("detail (%s): No response to request.  Will retry in %d seconds",
 		       data->name, data->retry_interval);
 	} else {
-		int rtt;
 		struct timeval now;
+
 		/*
 		 *	We call gettimeofday a lot.  But it should be OK,
 		 *	because there's nothing else to do.
 		 */
 		gettimeofday(&now, NULL);
 
-		/*
-		 *	If we haven't sent a packet in the last second, reset
-		 *	the RTT.
-		 */
-		now.tv_sec -= 1;
-		if (fr_timeval_cmp(&data->last_packet, &now) < 0) {
-			data->has_rtt = false;
-		}
-		now.tv_sec += 1;
+		ack.rtt = now.tv_sec - request->packet->timestamp.tv_sec;
+		ack.rtt *= USEC;
+		ack.rtt += now.tv_usec;
+		ack.rtt -= request->packet->timestamp.tv_usec;
 
-		/*
-		 *	Only one detail packet may be outstanding at a time,
-		 *	so it's safe to update some entries in the detail
-		 *	structure.
-		 *
-		 *	We keep smoothed round trip time (SRTT), but not round
-		 *	trip timeout (RTO).  We use SRTT to calculate a rough
-		 *	load factor.
-		 */
-		rtt = now.tv_sec - request->packet->timestamp.tv_sec;
-		rtt *= USEC;
-		rtt += now.tv_usec;
-		rtt -= request->packet->timestamp.tv_usec;
-
-		/*
-		 *	If we're proxying, the RTT is our processing time,
-		 *	plus the network delay there and back, plus the time
-		 *	on the other end to process the packet.  Ideally, we
-		 *	should remove the network delays from the RTT, but we
-		 *	don't know what they are.
-		 *
-		 *	So, to be safe, we over-estimate the total cost of
-		 *	processing the packet.
-		 */
-		if (!data->has_rtt) {
-			data->has_rtt = true;
-			data->srtt = rtt;
-			data->rttvar = rtt / 2;
-
-		} else {
-			data->rttvar -= data->rttvar >> 2;
-			data->rttvar += (data->srtt - rtt);
-			data->srtt -= data->srtt >> 3;
-			data->srtt += rtt >> 3;
-		}
-
-		/*
-		 *	Calculate the time we wait before sending the next
-		 *	packet.
-		 *
-		 *	rtt / (rtt + delay) = load_factor / 100
-		 */
-		data->delay_time = (data->srtt * (100 - data->load_factor)) / (data->load_factor);
-
-		/*
-		 *	Cap delay at no less than 4 packets/s.  If the
-		 *	end system can't handle this, then it's very
-		 *	broken.
-		 */
-		if (data->delay_time > (USEC / 4)) data->delay_time= USEC / 4;
-
-		RDEBUG3("detail (%s): Received response for request %" PRIu64 ".  "
-			"Will read the next packet in %d seconds",
-			data->name, request->number, data->delay_time / USEC);
-
-		data->last_packet = now;
-		data->signal = 1;
-		data->entry_state = STATE_REPLIED;
-		data->counter++;
+		RDEBUG3("detail (%s): Received response for request %" PRIu64, data->name, request->number);
 	}
 
-	if (write(data->child_pipe[1], &c, 1) < 0) {
+	/*
+	 *	Acks are smaller than PIPE_BUF, so writes from
+	 *	multiple workers won't be interleaved.
+	 */
+	if (write(data->child_pipe[1], &ack, sizeof(ack)) < 0) {
 		RERROR("detail (%s): Failed writing ack to reader thread: %s", data->name, fr_syserror(errno));
 	}
 
@@ -288,6 +251,8 @@ static int detail_open(rad_listen_t *this)
 	data->packets = 0;
 	data->tries = 0;
 	data->done_entry = false;
+	data->eof = false;
+	data->unsynced = false;
 
 	return 1;
 }
@@ -310,7 +275,7 @@ static int detail_open(rad_listen_t *this)
  */
 static int detail_recv(rad_listen_t *listener)
 {
-	char c = 0;
+	detail_ack_t ack;
 	ssize_t rcode;
 	RADIUS_PACKET *packet;
 	listen_detail_t *data = listener->data;
@@ -335,16 +300,18 @@ static int detail_recv(rad_listen_t *listener)
 		break;
 
 	default:
-		data->entry_state = STATE_REPLIED;
+		ack.counter = detail_packet_counter(packet);
+		ack.rtt = 0;				/* Nothing to do, treat it as done */
 		goto signal_thread;
 	}
 
 	if (!request_receive(NULL, listener, packet, &data->detail_client, fun)) {
-		data->entry_state = STATE_NO_REPLY;	/* try again later */
+		ack.counter = detail_packet_counter(packet);
+		ack.rtt = -1;				/* try again later */
 
 	signal_thread:
 		fr_radius_free(&packet);
-		if (write(data->child_pipe[1], &c, 1) < 0) {
+		if (write(data->child_pipe[1], &ack, sizeof(ack)) < 0) {
 			ERROR("detail (%s): Failed writing ack to reader thread: %s", data->name,
 			      fr_syserror(errno));
 		}
@@ -356,21 +323,20 @@ static int detail_recv(rad_listen_t *listener)
 	return 0;
 }
 
-static RADIUS_PACKET *detail_poll(rad_listen_t *listener)
+/*
+ *	Lock the detail file and get it ready for reading.
+ *
+ *	Returns true if the file is ready to be read.
+ */
+static bool detail_lock(rad_listen_t *listener)
 {
-	char		key[256], op[8], value[1024];
-	vp_cursor_t	cursor;
-	VALUE_PAIR	*vp;
-	RADIUS_PACKET	*packet;
-	char		buffer[2048];
 	listen_detail_t *data = listener->data;
 
 	switch (data->file_state) {
 	case STATE_UNOPENED:
-open_file:
 		rad_assert(data->work_fd < 0);
 
-		if (!detail_open(listener)) return NULL;
+		if (!detail_open(listener)) return false;
 
 		rad_assert(data->file_state == STATE_UNLOCKED);
 		rad_assert(data->work_fd >= 0);
@@ -405,14 +371,15 @@ open_file:
 			data->fp = NULL;
 			data->work_fd = -1;
 			data->file_state = STATE_UNOPENED;
-			return NULL;
+			return false;
 		}
 
 		/*
-		 *	Only open for writing if we're
-		 *	marking requests as completed.
+		 *	Records are marked as done by writing to
+		 *	work_fd directly, so the stream is only
+		 *	ever read.
 		 */
-		data->fp = fdopen(data->work_fd, data->track ? "r+" : "r");
+		data->fp = fdopen(data->work_fd, "r");
 		if (!data->fp) {
 			ERROR("detail (%s): FATAL: Failed to re-open detail file: %s",
 			      data->name, fr_syserror(errno));
@@ -420,140 +387,75 @@ open_file:
 		}
 
 		/*
-		 *	Look for the header
+		 *	Read the file in large chunks, there may be
+		 *	a lot of it.
 		 */
+		setvbuf(data->fp, NULL, _IOFBF, DETAIL_READ_BUFFER);
+
 		data->file_state = STATE_PROCESSING;
 		data->entry_state = STATE_HEADER;
 		data->delay_time = USEC;
 		data->vps = NULL;
 		break;
 
-		/*
-		 *	Go to the next switch statement.
-		 */
 	case STATE_PROCESSING:
 		break;
 	}
 
+	return true;
+}
 
-	switch (data->entry_state) {
-	case STATE_HEADER:
-	do_header:
-		data->done_entry = false;
-		data->timestamp_offset = 0;
-
-		data->tries = 0;
-		if (!data->fp) {
-			data->file_state = STATE_UNOPENED;
-			goto open_file;
-		}
-
-		{
-			struct stat buf;
-
-			if (fstat(data->work_fd, &buf) < 0) {
-				ERROR("detail (%s): Failed to stat detail file: %s",
-				      data->name, fr_syserror(errno));
-
-				goto cleanup;
-			}
-			if (((off_t) ftell(data->fp)) == buf.st_size) {
-				goto cleanup;
-			}
-		}
-
-		/*
-		 *	End of file.  Delete it, and re-set
-		 *	everything.
-		 */
-		if (feof(data->fp)) {
-		cleanup:
-			DEBUG("detail (%s): Unlinking %s", data->name, data->filename_work);
-			unlink(data->filename_work);
-			if (data->fp) fclose(data->fp);
-			data->fp = NULL;
-			data->work_fd = -1;
-			data->file_state = STATE_UNOPENED;
-			rad_assert(data->vps == NULL);
-
-			if (data->one_shot) {
-				INFO("detail (%s): Finished reading \"one shot\" detail file - Exiting", data->name);
-				radius_signal_self(RADIUS_SIGNAL_SELF_EXIT);
-			}
-
-			return NULL;
-		}
-
-		/*
-		 *	Else go read something.
-		 */
-		break;
-
-	/*
-	 *	Read more value-pair's, unless we're
-	 *	at EOF.  In that case, queue whatever
-	 *	we have.
-	 */
-	case STATE_VPS:
-		if (data->fp && !feof(data->fp)) break;
-		data->entry_state = STATE_QUEUED;
-
-		/* FALL-THROUGH */
+/*
+ *	We've read, and had replies to, everything in the file.
+ *	Delete it, and re-set everything.
+ */
+static void detail_close(rad_listen_t *listener)
+{
+	listen_detail_t *data = listener->data;
 
-	case STATE_QUEUED:
-		goto alloc_packet;
+	rad_assert(data->outstanding == 0);
+	rad_assert(data->vps == NULL);
 
-	/*
-	 *	Periodically check what's going on.
-	 *	If the request is taking too long,
-	 *	retry it.
-	 */
-	case STATE_RUNNING:
-		if (time(NULL) < (data->running + (int)data->retry_interval)) {
-			return NULL;
-		}
+	DEBUG("detail (%s): Unlinking %s", data->name, data->filename_work);
+	unlink(data->filename_work);
+	if (data->fp) fclose(data->fp);
+	data->fp = NULL;
+	data->work_fd = -1;
+	data->file_state = STATE_UNOPENED;
+	data->eof = false;
 
-		DEBUG("detail (%s): No response to detail request.  Retrying", data->name);
-		/* FALL-THROUGH */
+	if (data->one_shot) {
+		INFO("detail (%s): Finished reading \"one shot\" detail file - Exiting", data->name);
+		radius_signal_self(RADIUS_SIGNAL_SELF_EXIT);
+	}
+}
 
-	/*
-	 *	If there's no reply, keep
-	 *	retransmitting the current packet
-	 *	forever.
-	 */
-	case STATE_NO_REPLY:
-		data->entry_state = STATE_QUEUED;
-		goto alloc_packet;
+/** Read the next record from the detail file
+ *
+ * @param[in] listener	the detail listener.
+ * @param[out] entry	to fill in with the record.
+ * @return
+ *	- 1 if a record was read.
+ *	- 0 if there's nothing to read.  If the end of the file was reached,
+ *	  or the file was bad, data->eof is set, and the file should be closed
+ *	  once all outstanding records have been replied to.
+ */
+static int detail_read(rad_listen_t *listener, detail_entry_t *entry)
+{
+	char		key[256], op[8], value[1024];
+	vp_cursor_t	cursor;
+	VALUE_PAIR	*vp;
+	char		buffer[2048];
+	listen_detail_t *data = listener->data;
 
-	/*
-	 *	We have a reply.  Clean up the old
-	 *	request, and go read another one.
-	 */
-	case STATE_REPLIED:
-		if (data->track) {
-			rad_assert(data->fp != NULL);
-
-			if (fseek(data->fp, data->timestamp_offset, SEEK_SET) < 0) {
-				WARN("detail (%s): Failed seeking to timestamp offset: %s",
-				     data->name, fr_syserror(errno));
-			} else if (fwrite("\tDone", 1, 5, data->fp) < 5) {
-				WARN("detail (%s): Failed marking request as done: %s",
-				     data->name, fr_syserror(errno));
-			} else if (fflush(data->fp) != 0) {
-				WARN("detail (%s): Failed flushing marked detail file to disk: %s",
-				     data->name, fr_syserror(errno));
-			}
+	if (data->eof) return 0;
 
-			if (fseek(data->fp, data->offset, SEEK_SET) < 0) {
-				WARN("detail (%s): Failed seeking to next detail request: %s",
-				     data->name, fr_syserror(errno));
-			}
-		}
+	if (!detail_lock(listener)) return 0;
 
-		fr_pair_list_free(&data->vps);
-		data->entry_state = STATE_HEADER;
-		goto do_header;
-	}
+next_record:
+	data->entry_state = STATE_HEADER;
+	data->done_entry = false;
+	data->timestamp_offset = 0;
 
 	fr_pair_cursor_init(&cursor, &data->vps);
 
@@ -562,7 +464,7 @@ open_file:
 	 */
 	while (fgets(buffer, sizeof(buffer), data->fp)) {
 		data->last_offset = data->offset;
-		data->offset = ftell(data->fp); /* for statistics */
+		data->offset += strlen(buffer);	/* for statistics, and marking records done */
 
 		/*
 		 *	Badly formatted file: delete it.
@@ -571,7 +473,8 @@ open_file:
 		 */
 		if (!strchr(buffer, '\n')) {
 			fr_pair_list_free(&data->vps);
-			goto cleanup;
+			data->eof = true;
+			return 0;
 		}
 
 		/*
@@ -635,7 +538,8 @@ open_file:
 				ERROR("detail (%s): Failed parsing Client-IP-Address", data->name);
 
 				fr_pair_list_free(&data->vps);
-				goto cleanup;
+				data->eof = true;
+				return 0;
 			}
 			continue;
 		}
@@ -682,54 +586,66 @@ open_file:
 	}
 
 	/*
-	 *	Some kind of error.
+	 *	Some kind of error, or the end of the file.
 	 *
 	 *	FIXME: Leave the file in-place, and warn the
 	 *	administrator?
 	 */
-	if (ferror(data->fp)) goto cleanup;
+	if (data->entry_state != STATE_QUEUED) {
+		/*
+		 *	The writer doesn't check that the record was
+		 *	completely written.  If the disk is full, this can
+		 *	result in a truncated record.  When that happens,
+		 *	treat it as EOF.
+		 */
+		if (data->entry_state == STATE_VPS) {
+			ERROR("detail (%s): Truncated record: treating it as EOF for detail file %s",
+			      data->name, data->filename_work);
+		}
+		fr_pair_list_free(&data->vps);
+		data->eof = true;
+		return 0;
+	}
 
-	data->tries = 0;
 	data->packets++;
 
-	/*
-	 *	Process the packet.
-	 */
- alloc_packet:
 	if (data->done_entry) {
 		DEBUG2("detail (%s): Skipping record for timestamp %lu", data->name, data->timestamp);
 		fr_pair_list_free(&data->vps);
-		data->entry_state = STATE_HEADER;
-		goto do_header;
+		goto next_record;
 	}
 
-	data->tries++;
-
 	/*
-	 *	The writer doesn't check that the record was
-	 *	completely written.  If the disk is full, this can
-	 *	result in a truncated record.  When that happens,
-	 *	treat it as EOF.
-	 */
-	if (data->entry_state != STATE_QUEUED) {
-		ERROR("detail (%s): Truncated record: treating it as EOF for detail file %s",
-		      data->name, data->filename_work);
-		fr_pair_list_free(&data->vps);
-		goto cleanup;
-	}
-
-	/*
-	 *	We're done reading the file, but we didn't read
-	 *	anything.  Clean up, and don't return anything.
+	 *	We didn't read anything.  Skip it.
 	 */
 	if (!data->vps) {
 		WARN("detail (%s): Read empty packet from file %s",
 		     data->name, data->filename_work);
-		data->entry_state = STATE_HEADER;
-		if (!data->fp || feof(data->fp)) goto cleanup;
-		return NULL;
+		goto next_record;
 	}
 
+	entry->vps = data->vps;
+	data->vps = NULL;
+	entry->timestamp = data->timestamp;
+	entry->timestamp_offset = data->timestamp_offset;
+	entry->client_ip = data->client_ip;
+	entry->tries = 0;
+	entry->retry = 0;
+	entry->in_use = true;
+
+	return 1;
+}
+
+/*
+ *	Create a packet from a record we've read.
+ */
+static RADIUS_PACKET *detail_packet_alloc(listen_detail_t *data, detail_entry_t *entry)
+{
+	RADIUS_PACKET	*packet;
+	VALUE_PAIR	*vp;
+	time_t		timestamp = entry->timestamp;
+	uint32_t	counter;
+
 	/*
 	 *	Allocate the packet.  If we fail, it's a serious
 	 *	problem.
@@ -750,7 +666,7 @@ open_file:
 	 *	Otherwise, it lets us re-send the original packet
 	 *	contents, unmolested.
 	 */
-	packet->vps = fr_pair_list_copy(packet, data->vps);
+	packet->vps = fr_pair_list_copy(packet, entry->vps);
 
 	packet->code = PW_CODE_ACCOUNTING_REQUEST;
 	vp = fr_pair_find_by_num(packet->vps, 0, PW_PACKET_TYPE, TAG_ANY);
@@ -762,8 +678,8 @@ open_file:
 	 *	Remember where it came from, so that we don't
 	 *	proxy it to the place it came from...
 	 */
-	if (data->client_ip.af != AF_UNSPEC) {
-		packet->src_ipaddr = data->client_ip;
+	if (entry->client_ip.af != AF_UNSPEC) {
+		packet->src_ipaddr = entry->client_ip;
 	}
 
 	vp = fr_pair_find_by_num(packet->vps, 0, PW_PACKET_SRC_IP_ADDRESS, TAG_ANY);
@@ -797,14 +713,19 @@ open_file:
 	}
 
 	/*
-	 *	Generate packet ID, ports, IP via a counter.
+	 *	Generate packet ID, ports, IP via a counter.  The
+	 *	counter identifies the entry when the reply comes
+	 *	back, see detail_packet_counter().
 	 */
-	packet->id = data->counter & 0xff;
-	packet->src_port = 1024 + ((data->counter >> 8) & 0xff);
-	packet->dst_port = 1024 + ((data->counter >> 16) & 0xff);
+	counter = data->counter++;
+	entry->counter = counter;
+
+	packet->id = counter & 0xff;
+	packet->src_port = 1024 + ((counter >> 8) & 0xff);
+	packet->dst_port = 1024 + ((counter >> 16) & 0xff);
 
 	packet->dst_ipaddr.af = AF_INET;
-	packet->dst_ipaddr.ipaddr.ip4addr.s_addr = htonl((INADDR_LOOPBACK & ~0xffffff) | ((data->counter >> 24) & 0xff));
+	packet->dst_ipaddr.ipaddr.ip4addr.s_addr = htonl((INADDR_LOOPBACK & ~0xffffff) | ((counter >> 24) & 0xff));
 
 	/*
 	 *	Create / update accounting attributes.
@@ -818,7 +739,7 @@ open_file:
 		 */
 		vp = fr_pair_find_by_num(packet->vps, 0, PW_EVENT_TIMESTAMP, TAG_ANY);
 		if (vp) {
-			data->timestamp = vp->vp_integer;
+			timestamp = vp->vp_integer;
 		}
 
 		/*
@@ -831,11 +752,14 @@ open_file:
 			rad_assert(vp != NULL);
 			fr_pair_add(&packet->vps, vp);
 		}
-		if (data->timestamp != 0) {
-			vp->vp_integer += time(NULL) - data->timestamp;
+		if (timestamp != 0) {
+			vp->vp_integer += time(NULL) - timestamp;
 		}
 	}
 
+	entry->tries++;
+	data->tries = entry->tries;
+
 	/*
 	 *	Set the transmission count.
 	 */
@@ -845,14 +769,227 @@ open_file:
 		rad_assert(vp != NULL);
 		fr_pair_add(&packet->vps, vp);
 	}
-	vp->vp_integer = data->tries;
+	vp->vp_integer = entry->tries;
 
-	data->entry_state = STATE_RUNNING;
-	data->running = packet->timestamp.tv_sec;
+	entry->running = packet->timestamp.tv_sec;
 
 	return packet;
 }
 
+/*
+ *	Send a record to the server.
+ */
+static void detail_entry_send(listen_detail_t *data, detail_entry_t *entry)
+{
+	RADIUS_PACKET *packet;
+
+	packet = detail_packet_alloc(data, entry);
+	if (write(data->master_pipe[1], &packet, sizeof(packet)) < 0) {
+		ERROR("detail (%s): Failed passing detail packet pointer to master: %s",
+		      data->name, fr_syserror(errno));
+		fr_radius_free(&packet);
+
+		/*
+		 *	Retry it later, as if it hadn't been replied to.
+		 */
+		entry->retry = time(NULL) + data->retry_interval;
+	}
+}
+
+/*
+ *	Update the smoothed RTT, and the delay between packets.
+ */
+static void detail_rtt(listen_detail_t *data, int rtt)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+
+	/*
+	 *	If we haven't sent a packet in the last second, reset
+	 *	the RTT.
+	 */
+	now.tv_sec -= 1;
+	if (fr_timeval_cmp(&data->last_packet, &now) < 0) {
+		data->has_rtt = false;
+	}
+	now.tv_sec += 1;
+
+	/*
+	 *	Only the reader thread updates these entries, so it's
+	 *	safe to update them without locking.
+	 *
+	 *	We keep smoothed round trip time (SRTT), but not round
+	 *	trip timeout (RTO).  We use SRTT to calculate a rough
+	 *	load factor.
+	 *
+	 *	If we're proxying, the RTT is our processing time,
+	 *	plus the network delay there and back, plus the time
+	 *	on the other end to process the packet.  Ideally, we
+	 *	should remove the network delays from the RTT, but we
+	 *	don't know what they are.
+	 *
+	 *	So, to be safe, we over-estimate the total cost of
+	 *	processing the packet.
+	 */
+	if (!data->has_rtt) {
+		data->has_rtt = true;
+		data->srtt = rtt;
+		data->rttvar = rtt / 2;
+
+	} else {
+		data->rttvar -= data->rttvar >> 2;
+		data->rttvar += (data->srtt - rtt);
+		data->srtt -= data->srtt >> 3;
+		data->srtt += rtt >> 3;
+	}
+
+	/*
+	 *	Calculate the time we wait before sending the next
+	 *	packet.
+	 *
+	 *	rtt / (rtt + delay) = load_factor / 100
+	 */
+	data->delay_time = (data->srtt * (100 - data->load_factor)) / (data->load_factor);
+
+	/*
+	 *	Cap delay at no less than 4 packets/s.  If the
+	 *	end system can't handle this, then it's very
+	 *	broken.
+	 */
+	if (data->delay_time > (USEC / 4)) data->delay_time= USEC / 4;
+
+	data->last_packet = now;
+}
+
+/*
+ *	Process an ack from detail_send() or detail_recv().
+ */
+static void detail_ack(listen_detail_t *data, detail_ack_t const *ack)
+{
+	uint32_t	i;
+	detail_entry_t	*entry = NULL;
+
+	for (i = 0; i < data->max_outstanding; i++) {
+		if (!data->entries[i].in_use || (data->entries[i].retry != 0) ||
+		    (data->entries[i].counter != ack->counter)) continue;
+
+		entry = &data->entries[i];
+		break;
+	}
+
+	/*
+	 *	We already gave up waiting for this one, and sent
+	 *	it again.
+	 */
+	if (!entry) return;
+
+	if (ack->rtt < 0) {
+		entry->retry = time(NULL) + data->retry_interval;
+		return;
+	}
+
+	detail_rtt(data, ack->rtt);
+
+	/*
+	 *	Mark the record as done by overwriting the start of
+	 *	its "Timestamp" line, turning it into "Donestamp".
+	 *	We write to the fd directly, so we don't disturb the
+	 *	read buffer of the stream.
+	 */
+	if (data->track && (entry->timestamp_offset > 0)) {
+		if (pwrite(data->work_fd, "\tDone", 5, entry->timestamp_offset) < 5) {
+			WARN("detail (%s): Failed marking request as done: %s",
+			     data->name, fr_syserror(errno));
+		} else {
+			data->unsynced = true;
+		}
+	}
+
+	fr_pair_list_free(&entry->vps);
+	entry->in_use = false;
+	data->outstanding--;
+}
+
+/*
+ *	Wait for acks from the server, or until the next record needs
+ *	to be retried.
+ */
+static void detail_wait(listen_detail_t *data)
+{
+	detail_ack_t	acks[64];
+	time_t		now, next;
+	uint32_t	i;
+	fd_set		fds;
+	struct timeval	tv;
+	ssize_t		len;
+	int		fd = data->child_pipe[0];
+
+	now = time(NULL);
+	next = now + data->retry_interval;
+
+	for (i = 0; i < data->max_outstanding; i++) {
+		detail_entry_t *entry = &data->entries[i];
+		time_t when;
+
+		if (!entry->in_use) continue;
+
+		when = entry->retry ? entry->retry : entry->running + data->retry_interval;
+		if (when < next) next = when;
+	}
+
+	if (fd < 0) return;
+
+	tv.tv_sec = (next > now) ? (next - now) : 0;
+	tv.tv_usec = 0;
+
+	FD_ZERO(&fds);
+	FD_SET(fd, &fds);
+
+	if (select(fd + 1, &fds, NULL, NULL, &tv) > 0) {
+		/*
+		 *	Each ack is written atomically, so we only
+		 *	ever read whole ones.
+		 */
+		len = read(fd, acks, sizeof(acks));
+		if (len < 0) {
+			ERROR("detail (%s): Failed getting detail packet ack from master: %s",
+			      data->name, fr_syserror(errno));
+			return;
+		}
+
+		for (i = 0; i < (len / sizeof(acks[0])); i++) detail_ack(data, &acks[i]);
+	}
+
+	/*
+	 *	Make the "done" marks for all the acks we've just
+	 *	processed durable, so that we don't replay them if
+	 *	we crash.
+	 */
+	if (data->unsynced) {
+		if (fsync(data->work_fd) < 0) {
+			WARN("detail (%s): Failed syncing marked detail file to disk: %s",
+			     data->name, fr_syserror(errno));
+		}
+		data->unsynced = false;
+	}
+
+	/*
+	 *	If the request is taking too long, retry it.
+	 */
+	now = time(NULL);
+	for (i = 0; i < data->max_outstanding; i++) {
+		detail_entry_t *entry = &data->entries[i];
+
+		if (!entry->in_use || entry->retry) continue;
+
+		if (now >= (entry->running + (int)data->retry_interval)) {
+			DEBUG("detail (%s): No response to detail request.  Retrying", data->name);
+			entry->retry = now;
+		}
+	}
+}
+
 /*
  *	Free detail-specific stuff.
  */
@@ -962,28 +1099,25 @@ static int detail_decode(rad_listen_t *this, REQUEST *request)
 
 static void *detail_handler_thread(void *arg)
 {
-	char c;
 	rad_listen_t *this = arg;
 	listen_detail_t *data = this->data;
 
 	while (true) {
-		RADIUS_PACKET *packet;
+		uint32_t	i;
+		time_t		now;
 
-		while ((packet = detail_poll(this)) == NULL) {
-			usleep(detail_delay(data));
+		/*
+		 *	If we're supposed to exit then tell
+		 *	the master thread we've exited.
+		 */
+		if (data->child_pipe[0] < 0) {
+			RADIUS_PACKET *packet = NULL;
 
-			/*
-			 *	If we're supposed to exit then tell
-			 *	the master thread we've exited.
-			 */
-			if (data->child_pipe[0] < 0) {
-				packet = NULL;
-				if (write(data->master_pipe[1], &packet, sizeof(packet)) < 0) {
-					ERROR("detail (%s): Failed writing exit status to master: %s",
-					      data->name, fr_syserror(errno));
-				}
-				return NULL;
+			if (write(data->master_pipe[1], &packet, sizeof(packet)) < 0) {
+				ERROR("detail (%s): Failed writing exit status to master: %s",
+				      data->name, fr_syserror(errno));
 			}
+			return NULL;
 		}
 
 		/*
@@ -991,23 +1125,45 @@ static void *detail_handler_thread(void *arg)
 		 *
 		 *	FIXME: cap the retries.
 		 */
-		do {
-			if (write(data->master_pipe[1], &packet, sizeof(packet)) < 0) {
-				ERROR("detail (%s): Failed passing detail packet pointer to master: %s",
-				      data->name, fr_syserror(errno));
-			}
+		now = time(NULL);
+		for (i = 0; i < data->max_outstanding; i++) {
+			detail_entry_t *entry = &data->entries[i];
 
-			if (read(data->child_pipe[0], &c, 1) < 0) {
-				ERROR("detail (%s): Failed getting detail packet ack from master: %s",
-				      data->name, fr_syserror(errno));
-				break;
-			}
+			if (!entry->in_use || !entry->retry || (entry->retry > now)) continue;
+
+			entry->retry = 0;
+			detail_entry_send(data, entry);
+		}
+
+		/*
+		 *	Read more records, until we have as many
+		 *	outstanding as we're allowed.
+		 */
+		for (i = 0; (i < data->max_outstanding) && (data->outstanding < data->max_outstanding); i++) {
+			detail_entry_t *entry = &data->entries[i];
+
+			if (entry->in_use) continue;
+
+			if (detail_read(this, entry) <= 0) break;
+
+			if (data->has_rtt && (data->delay_time > 0)) usleep(data->delay_time);
 
-			if (data->delay_time > 0) usleep(data->delay_time);
+			data->outstanding++;
+			detail_entry_send(data, entry);
+		}
+
+		/*
+		 *	Nothing outstanding.  If we've read the whole
+		 *	file, delete it.  Then wait for more.
+		 */
+		if (data->outstanding == 0) {
+			if (data->eof) detail_close(this);
 
-			packet = detail_poll(this);
-			if (!packet) break;
-		} while (data->entry_state != STATE_REPLIED);
+			usleep(detail_delay(data));
+			continue;
+		}
+
+		detail_wait(data);
 	}
 
 	return NULL;
@@ -1022,6 +1178,7 @@ static const CONF_PARSER detail_config[] = {
 	{ FR_CONF_OFFSET("retry_interval", PW_TYPE_INTEGER, listen_detail_t, retry_interval), .dflt = STRINGIFY(30) },
 	{ FR_CONF_OFFSET("one_shot", PW_TYPE_BOOLEAN, listen_detail_t, one_shot), .dflt = "no" },
 	{ FR_CONF_OFFSET("track", PW_TYPE_BOOLEAN, listen_detail_t, track), .dflt = "no" },
+	{ FR_CONF_OFFSET("max_outstanding", PW_TYPE_INTEGER, listen_detail_t, max_outstanding), .dflt = STRINGIFY(1) },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -1065,6 +1222,9 @@ static int detail_parse(CONF_SECTION *cs, rad_listen_t *this)
 	FR_INTEGER_BOUND_CHECK("retry_interval", data->retry_interval, >=, 4);
 	FR_INTEGER_BOUND_CHECK("retry_interval", data->retry_interval, <=, 3600);
 
+	FR_INTEGER_BOUND_CHECK("max_outstanding", data->max_outstanding, >=, 1);
+	FR_INTEGER_BOUND_CHECK("max_outstanding", data->max_outstanding, <=, 1024);
+
 	/*
 	 *	Only checking the config.  Don't start threads or anything else.
 	 */
@@ -1114,7 +1274,13 @@ static int detail_parse(CONF_SECTION *cs, rad_listen_t *this)
 	data->file_state = STATE_UNOPENED;
 	data->entry_state = STATE_HEADER;
 	data->delay_time = data->poll_interval * USEC;
-	data->signal = 1;
+	data->outstanding = 0;
+
+	data->entries = talloc_zero_array(data, detail_entry_t, data->max_outstanding);
+	if (!data->entries) {
+		cf_log_err_cs(cs, "Failed allocating detail entries");
+		return -1;
+	}
 
 	/*
 	 *	Initialize the fake client.
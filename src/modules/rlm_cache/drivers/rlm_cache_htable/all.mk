@@ -0,0 +1,3 @@
+TARGET		:= rlm_cache_htable.a
+SOURCES		:= rlm_cache_htable.c
+TGT_LDLIBS	:= $(LIBS)
@@ -0,0 +1,630 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file rlm_cache_htable.c
+ * @brief Sharded hash table based cache.
+ *
+ * Entries are distributed over a power of two number of shards, using the high
+ * bits of the key's hash.  Each shard has its own mutex, hash table and CLOCK
+ * ring, so requests for keys in different shards never contend.
+ *
+ * A handle locks the shard of the first key it's used with, and keeps it locked
+ * until it's released, as rlm_cache continues to use the entry returned by find
+ * after the lookup.
+ *
+ * @copyright 2017 The FreeRADIUS server project
+ */
+#include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/rad_assert.h>
+
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/stdatomic.h>
+#endif
+
+#include "../../rlm_cache.h"
+
+/*
+ *	How many entries the CLOCK hand looks at on each insert,
+ *	when the shard isn't over its memory limit, to reclaim
+ *	expired entries.
+ */
+#define HTABLE_REAP_MAX		4
+
+typedef struct rlm_cache_htable_entry rlm_cache_htable_entry_t;
+
+struct rlm_cache_htable_entry {
+	rlm_cache_entry_t	fields;		//!< Entry data.
+
+	uint32_t		hash;		//!< Hash of the key.
+	size_t			size;		//!< Memory used by the entry, recorded on insert.
+	bool			referenced;	//!< Set on lookup, cleared as the CLOCK hand passes.
+
+	rlm_cache_htable_entry_t *prev;		//!< Previous entry in the shard's CLOCK ring.
+	rlm_cache_htable_entry_t *next;		//!< Next entry in the shard's CLOCK ring.
+};
+
+typedef struct rlm_cache_htable_shard {
+	pthread_mutex_t		mutex;		//!< Protects everything in the shard.
+
+	fr_hash_table_t		*cache;		//!< Hash table for looking up cache keys.
+	rlm_cache_htable_entry_t *hand;		//!< CLOCK hand.  NULL if the shard is empty.
+
+	uint32_t		num_entries;	//!< Number of entries in the shard.
+	size_t			memory;		//!< Memory used by entries in the shard.
+
+	uint64_t		hits;		//!< Lookups which found a live entry.
+	uint64_t		misses;		//!< Lookups which didn't.
+	uint64_t		evictions;	//!< Entries removed to stay under the memory limit.
+	uint64_t		expired;	//!< Entries removed because their TTL had passed.
+} rlm_cache_htable_shard_t;
+
+typedef struct rlm_cache_htable {
+	uint32_t		num_shards;	//!< Number of shards, rounded up to a power of two.
+	size_t			max_memory;	//!< Memory limit for all entries.  0 means no limit.
+
+	uint32_t		shard_shift;	//!< Shift the hash right by this much to get the shard.
+	size_t			shard_max_memory; //!< Memory limit for each shard.
+
+	rlm_cache_htable_shard_t *shards;	//!< Array of num_shards shards.
+
+	atomic_uint_fast32_t	num_entries;	//!< Entries in all shards.
+
+	char const		*xlat_name;	//!< Name of the statistics xlat.
+} rlm_cache_htable_t;
+
+typedef struct rlm_cache_htable_handle {
+	rlm_cache_htable_shard_t *shard;	//!< Shard we currently hold the lock for.
+} rlm_cache_htable_handle_t;
+
+static const CONF_PARSER driver_config[] = {
+	{ FR_CONF_OFFSET("shards", PW_TYPE_INTEGER, rlm_cache_htable_t, num_shards), .dflt = "64" },
+	{ FR_CONF_OFFSET("max_memory", PW_TYPE_SIZE, rlm_cache_htable_t, max_memory), .dflt = "0" },
+	CONF_PARSER_TERMINATOR
+};
+
+static uint32_t cache_entry_hash(void const *data)
+{
+	rlm_cache_htable_entry_t const *c = data;
+
+	return c->hash;
+}
+
+/** Compare two entries by key
+ *
+ * There may only be one entry with the same key.
+ */
+static int cache_entry_cmp(void const *one, void const *two)
+{
+	rlm_cache_entry_t const *a = one;
+	rlm_cache_entry_t const *b = two;
+
+	if (a->key_len < b->key_len) return -1;
+	if (a->key_len > b->key_len) return +1;
+
+	return memcmp(a->key, b->key, a->key_len);
+}
+
+/** Lock the shard a key belongs to, releasing any other shard held by the handle
+ *
+ * @param[in] driver	instance.
+ * @param[in] handle	to lock the shard with.
+ * @param[in] hash	of the key.
+ * @return the locked shard.
+ */
+static rlm_cache_htable_shard_t *cache_shard_lock(rlm_cache_htable_t *driver,
+						  rlm_cache_htable_handle_t *handle, uint32_t hash)
+{
+	rlm_cache_htable_shard_t *shard;
+
+	shard = &driver->shards[driver->shard_shift < 32 ? (hash >> driver->shard_shift) : 0];
+	if (handle->shard == shard) return shard;
+
+	if (handle->shard) pthread_mutex_unlock(&handle->shard->mutex);
+	pthread_mutex_lock(&shard->mutex);
+	handle->shard = shard;
+
+	return shard;
+}
+
+/** Add an entry to a shard's CLOCK ring, just behind the hand
+ *
+ * New entries are the last ones the hand will reach.
+ */
+static void cache_ring_link(rlm_cache_htable_shard_t *shard, rlm_cache_htable_entry_t *c)
+{
+	if (!shard->hand) {
+		c->prev = c->next = c;
+		shard->hand = c;
+		return;
+	}
+
+	c->next = shard->hand;
+	c->prev = shard->hand->prev;
+	c->prev->next = c;
+	shard->hand->prev = c;
+}
+
+/** Remove an entry from its shard, and free it
+ *
+ */
+static void cache_shard_remove(rlm_cache_htable_t *driver, rlm_cache_htable_shard_t *shard,
+			       rlm_cache_htable_entry_t *c)
+{
+	fr_hash_table_yank(shard->cache, c);
+
+	if (c->next == c) {
+		shard->hand = NULL;
+	} else {
+		if (shard->hand == c) shard->hand = c->next;
+		c->prev->next = c->next;
+		c->next->prev = c->prev;
+	}
+
+	shard->num_entries--;
+	shard->memory -= c->size;
+	atomic_fetch_sub_explicit(&driver->num_entries, 1, memory_order_relaxed);
+
+	talloc_free(c);
+}
+
+/** Advance the CLOCK hand of a shard
+ *
+ * Expired entries the hand passes are always freed.  If the shard is over its memory
+ * limit, the hand keeps going, evicting entries which haven't been referenced since
+ * it last passed them, until the shard is back under the limit.  Otherwise it stops
+ * after #HTABLE_REAP_MAX entries.
+ *
+ * @param[in] driver	instance.
+ * @param[in] shard	to sweep.
+ * @param[in] now	current time.
+ * @param[in] keep	entry which must not be evicted (the one just inserted).
+ */
+static void cache_shard_sweep(rlm_cache_htable_t *driver, rlm_cache_htable_shard_t *shard,
+			      time_t now, rlm_cache_htable_entry_t *keep)
+{
+	unsigned int checked = 0;
+
+	while (shard->hand) {
+		rlm_cache_htable_entry_t	*c = shard->hand;
+		bool				over;
+
+		over = driver->shard_max_memory && (shard->memory > driver->shard_max_memory);
+		if (!over && (checked >= HTABLE_REAP_MAX)) break;
+		checked++;
+
+		if (c == keep) {
+			if (shard->num_entries == 1) break;
+			shard->hand = c->next;
+			continue;
+		}
+
+		if (c->fields.expires < now) {
+			shard->expired++;
+			cache_shard_remove(driver, shard, c);
+			continue;
+		}
+
+		/*
+		 *	Under the limit, we're only looking for
+		 *	expired entries, so leave the referenced
+		 *	bit alone.
+		 */
+		if (!over) {
+			shard->hand = c->next;
+			continue;
+		}
+
+		if (c->referenced) {
+			c->referenced = false;
+			shard->hand = c->next;
+			continue;
+		}
+
+		shard->evictions++;
+		cache_shard_remove(driver, shard, c);
+	}
+}
+
+/** Return cache statistics
+ *
+ * Accepts "hits", "misses", "evictions", "expired", "entries" or "memory",
+ * and returns the total across all shards.
+ */
+static ssize_t cache_stats_xlat(UNUSED TALLOC_CTX *ctx, char **out, size_t outlen,
+				void const *mod_inst, UNUSED void const *xlat_inst,
+				REQUEST *request, char const *fmt)
+{
+	rlm_cache_htable_t const	*driver = mod_inst;
+	uint64_t			hits = 0, misses = 0, evictions = 0, expired = 0;
+	uint64_t			entries = 0, memory = 0, value;
+	uint32_t			i;
+
+	for (i = 0; i < driver->num_shards; i++) {
+		rlm_cache_htable_shard_t *shard = &driver->shards[i];
+
+		pthread_mutex_lock(&shard->mutex);
+		hits += shard->hits;
+		misses += shard->misses;
+		evictions += shard->evictions;
+		expired += shard->expired;
+		entries += shard->num_entries;
+		memory += shard->memory;
+		pthread_mutex_unlock(&shard->mutex);
+	}
+
+	if (strcmp(fmt, "hits") == 0) {
+		value = hits;
+	} else if (strcmp(fmt, "misses") == 0) {
+		value = misses;
+	} else if (strcmp(fmt, "evictions") == 0) {
+		value = evictions;
+	} else if (strcmp(fmt, "expired") == 0) {
+		value = expired;
+	} else if (strcmp(fmt, "entries") == 0) {
+		value = entries;
+	} else if (strcmp(fmt, "memory") == 0) {
+		value = memory;
+	} else {
+		REDEBUG("Unknown statistic \"%s\"", fmt);
+		return -1;
+	}
+
+	return snprintf(*out, outlen, "%" PRIu64, value);
+}
+
+/** Walk over a shard's hash table
+ *
+ * Used to free any entries left in the table on detach.
+ */
+static int _cache_entry_free(UNUSED void *ctx, void *data)
+{
+	talloc_free(data);
+
+	return 0;
+}
+
+/** Cleanup a cache_htable instance
+ *
+ */
+static int mod_detach(void *instance)
+{
+	rlm_cache_htable_t *driver = instance;
+	uint32_t i;
+
+	if (driver->xlat_name) xlat_unregister(driver, driver->xlat_name, cache_stats_xlat);
+
+	if (!driver->shards) return 0;
+
+	for (i = 0; i < driver->num_shards; i++) {
+		rlm_cache_htable_shard_t *shard = &driver->shards[i];
+
+		if (!shard->cache) continue;
+
+		fr_hash_table_walk(shard->cache, _cache_entry_free, NULL);
+		fr_hash_table_free(shard->cache);
+		pthread_mutex_destroy(&shard->mutex);
+	}
+
+	return 0;
+}
+
+/** Create a new cache_htable instance
+ *
+ * @copydetails cache_instantiate_t
+ */
+static int mod_instantiate(rlm_cache_config_t const *config, void *instance, CONF_SECTION *conf)
+{
+	rlm_cache_htable_t	*driver = instance;
+	uint32_t		bits = 0;
+	uint32_t		i;
+
+	FR_INTEGER_BOUND_CHECK("shards", driver->num_shards, >=, 1);
+	FR_INTEGER_BOUND_CHECK("shards", driver->num_shards, <=, 4096);
+
+	while ((1U << bits) < driver->num_shards) bits++;
+	if (driver->num_shards != (1U << bits)) {
+		WARN("Rounding \"shards = %u\" up to \"shards = %u\"", driver->num_shards, 1U << bits);
+		driver->num_shards = 1U << bits;
+	}
+	driver->shard_shift = 32 - bits;
+	driver->shard_max_memory = driver->max_memory / driver->num_shards;
+
+	if (driver->max_memory && (driver->shard_max_memory == 0)) {
+		cf_log_err_cs(conf, "max_memory must be at least one byte per shard");
+		return -1;
+	}
+
+	driver->shards = talloc_zero_array(driver, rlm_cache_htable_shard_t, driver->num_shards);
+	if (!driver->shards) {
+		ERROR("Failed allocating cache shards");
+		return -1;
+	}
+	atomic_init(&driver->num_entries, 0);
+
+	for (i = 0; i < driver->num_shards; i++) {
+		rlm_cache_htable_shard_t *shard = &driver->shards[i];
+
+		/*
+		 *	The hash table allocates its nodes in the NULL
+		 *	ctx, so the driver's memory limit doesn't apply.
+		 */
+		shard->cache = fr_hash_table_create(NULL, cache_entry_hash, cache_entry_cmp, NULL);
+		if (!shard->cache) {
+			ERROR("Failed to create cache");
+			return -1;
+		}
+
+		if (pthread_mutex_init(&shard->mutex, NULL) < 0) {
+			ERROR("Failed initializing mutex: %s", fr_syserror(errno));
+			fr_hash_table_free(shard->cache);
+			shard->cache = NULL;
+			return -1;
+		}
+	}
+
+	driver->xlat_name = talloc_typed_asprintf(driver, "%s_stats", config->name);
+	if (!driver->xlat_name) return -1;
+
+	if (xlat_register(driver, driver->xlat_name, cache_stats_xlat, NULL, NULL, 0, XLAT_DEFAULT_BUF_LEN) < 0) {
+		cf_log_err_cs(conf, "Failed registering xlat %s", driver->xlat_name);
+		return -1;
+	}
+
+	return 0;
+}
+
+/** Custom allocation function for the driver
+ *
+ * Allows allocation of cache entry structures with additional fields.
+ *
+ * @copydetails cache_entry_alloc_t
+ */
+static rlm_cache_entry_t *cache_entry_alloc(UNUSED rlm_cache_config_t const *config, UNUSED void *instance,
+					    REQUEST *request)
+{
+	rlm_cache_htable_entry_t *c;
+
+	c = talloc_zero(NULL, rlm_cache_htable_entry_t);
+	if (!c) {
+		RERROR("Failed allocating cache entry");
+		return NULL;
+	}
+
+	return (rlm_cache_entry_t *)c;
+}
+
+/** Locate a cache entry
+ *
+ * Locks the shard the key belongs to.  The lock is held until the handle is released.
+ *
+ * @copydetails cache_entry_find_t
+ */
+static cache_status_t cache_entry_find(rlm_cache_entry_t **out,
+				       UNUSED rlm_cache_config_t const *config, void *instance,
+				       REQUEST *request, void *handle, uint8_t const *key, size_t key_len)
+{
+	rlm_cache_htable_t		*driver = instance;
+	rlm_cache_htable_shard_t	*shard;
+	rlm_cache_htable_entry_t	*c, my_c;
+
+	rad_assert(handle);
+
+	my_c.fields.key = key;
+	my_c.fields.key_len = key_len;
+	my_c.hash = fr_hash(key, key_len);
+
+	shard = cache_shard_lock(driver, handle, my_c.hash);
+
+	c = fr_hash_table_finddata(shard->cache, &my_c);
+	if (c && (c->fields.expires < request->packet->timestamp.tv_sec)) {
+		shard->expired++;
+		cache_shard_remove(driver, shard, c);
+		c = NULL;
+	}
+
+	if (!c) {
+		shard->misses++;
+		*out = NULL;
+		return CACHE_MISS;
+	}
+
+	shard->hits++;
+	c->referenced = true;
+	*out = &c->fields;
+
+	return CACHE_OK;
+}
+
+/** Free an entry and remove it from the data store
+ *
+ * @copydetails cache_entry_expire_t
+ */
+static cache_status_t cache_entry_expire(UNUSED rlm_cache_config_t const *config, void *instance,
+					 REQUEST *request, void *handle,
+					 uint8_t const *key, size_t key_len)
+{
+	rlm_cache_htable_t		*driver = instance;
+	rlm_cache_htable_shard_t	*shard;
+	rlm_cache_htable_entry_t	*c, my_c;
+
+	if (!request) return CACHE_ERROR;
+
+	rad_assert(handle);
+
+	my_c.fields.key = key;
+	my_c.fields.key_len = key_len;
+	my_c.hash = fr_hash(key, key_len);
+
+	shard = cache_shard_lock(driver, handle, my_c.hash);
+
+	c = fr_hash_table_finddata(shard->cache, &my_c);
+	if (!c) return CACHE_MISS;
+
+	cache_shard_remove(driver, shard, c);
+
+	return CACHE_OK;
+}
+
+/** Insert a new entry into the data store
+ *
+ * Any existing entry with the same key is replaced.  If the shard is then over its
+ * memory limit, other entries are evicted.
+ *
+ * @copydetails cache_entry_insert_t
+ */
+static cache_status_t cache_entry_insert(UNUSED rlm_cache_config_t const *config, void *instance,
+					 REQUEST *request, void *handle,
+					 rlm_cache_entry_t const *to_insert)
+{
+	rlm_cache_htable_t		*driver = instance;
+	rlm_cache_htable_shard_t	*shard;
+	rlm_cache_htable_entry_t	*c, *old;
+
+	if (!request) return CACHE_ERROR;
+
+	rad_assert(handle);
+
+	memcpy(&c, &to_insert, sizeof(c));
+
+	c->hash = fr_hash(c->fields.key, c->fields.key_len);
+
+	shard = cache_shard_lock(driver, handle, c->hash);
+
+	/*
+	 *	Allow overwriting
+	 */
+	old = fr_hash_table_finddata(shard->cache, c);
+	if (old == c) return CACHE_OK;
+	if (old) cache_shard_remove(driver, shard, old);
+
+	if (!fr_hash_table_insert(shard->cache, c)) {
+		RERROR("Failed adding entry");
+		return CACHE_ERROR;
+	}
+
+	c->size = talloc_total_size(c);
+	c->referenced = false;
+	cache_ring_link(shard, c);
+
+	shard->num_entries++;
+	shard->memory += c->size;
+	atomic_fetch_add_explicit(&driver->num_entries, 1, memory_order_relaxed);
+
+	cache_shard_sweep(driver, shard, request->packet->timestamp.tv_sec, c);
+
+	return CACHE_OK;
+}
+
+/** Update the TTL of an entry
+ *
+ * Expiry times aren't indexed, so there's nothing to do beyond what rlm_cache
+ * already did to the entry.
+ *
+ * @copydetails cache_entry_set_ttl_t
+ */
+static cache_status_t cache_entry_set_ttl(UNUSED rlm_cache_config_t const *config, UNUSED void *instance,
+					  REQUEST *request, void *handle,
+					  UNUSED rlm_cache_entry_t *c)
+{
+	rlm_cache_htable_handle_t *h = handle;
+
+	if (!request) return CACHE_ERROR;
+
+	/*
+	 *	The entry must have come from find, so we
+	 *	should already hold the lock for its shard.
+	 */
+	if (!h->shard) {
+		RERROR("Entry's shard not locked");
+		return CACHE_ERROR;
+	}
+
+	return CACHE_OK;
+}
+
+/** Return the number of entries in the cache
+ *
+ * @copydetails cache_entry_count_t
+ */
+static uint32_t cache_entry_count(UNUSED rlm_cache_config_t const *config, void *instance,
+				  UNUSED REQUEST *request, UNUSED void *handle)
+{
+	rlm_cache_htable_t *driver = instance;
+
+	return atomic_load_explicit(&driver->num_entries, memory_order_relaxed);
+}
+
+/** Allocate a handle
+ *
+ * No locks are taken until the handle is used with a key.
+ *
+ * @copydetails cache_acquire_t
+ */
+static int cache_acquire(void **handle, UNUSED rlm_cache_config_t const *config, UNUSED void *instance,
+			 REQUEST *request)
+{
+	rlm_cache_htable_handle_t *h;
+
+	h = talloc_zero(request, rlm_cache_htable_handle_t);
+	if (!h) {
+		RERROR("Failed allocating handle");
+		return -1;
+	}
+	*handle = h;
+
+	return 0;
+}
+
+/** Release a handle, unlocking any shard it holds
+ *
+ * @copydetails cache_release_t
+ */
+static void cache_release(UNUSED rlm_cache_config_t const *config, UNUSED void *instance, REQUEST *request,
+			  rlm_cache_handle_t *handle)
+{
+	rlm_cache_htable_handle_t *h = handle;
+
+	if (h->shard) {
+		pthread_mutex_unlock(&h->shard->mutex);
+		RDEBUG3("Mutex released");
+	}
+
+	talloc_free(h);
+}
+
+extern cache_driver_t rlm_cache_htable;
+cache_driver_t rlm_cache_htable = {
+	.name		= "rlm_cache_htable",
+	.magic		= RLM_MODULE_INIT,
+	.instantiate	= mod_instantiate,
+	.detach		= mod_detach,
+	.inst_size	= sizeof(rlm_cache_htable_t),
+	.config		= driver_config,
+	.alloc		= cache_entry_alloc,
+
+	.find		= cache_entry_find,
+	.insert		= cache_entry_insert,
+	.expire		= cache_entry_expire,
+	.set_ttl	= cache_entry_set_ttl,
+	.count		= cache_entry_count,
+
+	.acquire	= cache_acquire,
+	.release	= cache_release,
+};
@@ -25,6 +25,8 @@
  */
 RCSID("$Id$")
 
+#include <freeradius-devel/rad_assert.h>
+
 #include "rlm_cache.h"
 #include "serialize.h"
 
@@ -106,6 +108,13 @@ int cache_deserialize(rlm_cache_entry_t *c, char *in, ssize_t inlen)
 
 	if (inlen < 0) inlen = strlen(in);
 
+	/*
+	 *	Entries written by cache_serialize_binary().
+	 */
+	if ((inlen > 0) && ((uint8_t) in[0] == CACHE_BINARY_MAGIC)) {
+		return cache_deserialize_binary(c, (uint8_t const *) in, inlen);
+	}
+
 	p = in;
 
 	while (((size_t)(p - in)) < (size_t)inlen) {
@@ -172,3 +181,514 @@ int cache_deserialize(rlm_cache_entry_t *c, char *in, ssize_t inlen)
 
 	return 0;
 }
+
+/*
+ *	Binary entries are laid out as follows.  All integers are in
+ *	network byte order.
+ *
+ *	uint8_t		magic (CACHE_BINARY_MAGIC)
+ *	uint8_t		version (CACHE_BINARY_VERSION)
+ *	uint64_t	created
+ *	uint64_t	expires
+ *
+ *	Followed by zero or more maps:
+ *
+ *	uint32_t	vendor
+ *	uint32_t	attribute
+ *	uint8_t		request reference
+ *	uint8_t		list
+ *	int8_t		tag
+ *	uint8_t		operator
+ *	uint8_t		data type
+ *	uint32_t	length of the value, which for fixed size types
+ *			must be the size of its wire format
+ *	uint8_t[]	value.  For strings and octets this is the data.
+ *			Integers are in network byte order, with "size"
+ *			widened to 64 bits.  Time values are two 64-bit
+ *			integers (seconds, microseconds).  Decimals are
+ *			the 64 bits of the IEEE 754 double.  Addresses,
+ *			prefixes, interface IDs and filters are stored
+ *			as is, as they're already in network byte order.
+ */
+#define CACHE_BINARY_HDR_LEN	(1 + 1 + 8 + 8)
+#define CACHE_BINARY_MAP_LEN	(4 + 4 + 1 + 1 + 1 + 1 + 1 + 4)
+
+/*
+ *	Size of each type of value in a binary entry.  Types with no
+ *	size can't be serialized.
+ */
+static size_t const cache_value_sizes[PW_TYPE_MAX] = {
+	[PW_TYPE_IPV4_ADDR]			= 4,
+	[PW_TYPE_IPV4_PREFIX]			= SIZEOF_MEMBER(value_box_t, datum.ipv4prefix),
+	[PW_TYPE_IPV6_ADDR]			= 16,
+	[PW_TYPE_IPV6_PREFIX]			= SIZEOF_MEMBER(value_box_t, datum.ipv6prefix),
+	[PW_TYPE_IFID]				= SIZEOF_MEMBER(value_box_t, datum.ifid),
+	[PW_TYPE_ETHERNET]			= SIZEOF_MEMBER(value_box_t, datum.ether),
+
+	[PW_TYPE_BOOLEAN]			= 1,
+	[PW_TYPE_BYTE]				= 1,
+	[PW_TYPE_SHORT]				= 2,
+	[PW_TYPE_INTEGER]			= 4,
+	[PW_TYPE_INTEGER64]			= 8,
+	[PW_TYPE_SIZE]				= 8,
+
+	[PW_TYPE_SIGNED]			= 4,
+
+	[PW_TYPE_TIMEVAL]			= 16,
+	[PW_TYPE_DECIMAL]			= 8,
+	[PW_TYPE_DATE]				= 4,
+
+	[PW_TYPE_ABINARY]			= SIZEOF_MEMBER(value_box_t, datum.filter),
+};
+
+static inline uint8_t *cache_put_uint16(uint8_t *p, uint16_t num)
+{
+	num = htons(num);
+	memcpy(p, &num, sizeof(num));
+	return p + sizeof(num);
+}
+
+static inline uint8_t *cache_put_uint32(uint8_t *p, uint32_t num)
+{
+	num = htonl(num);
+	memcpy(p, &num, sizeof(num));
+	return p + sizeof(num);
+}
+
+static inline uint8_t *cache_put_uint64(uint8_t *p, uint64_t num)
+{
+	num = htonll(num);
+	memcpy(p, &num, sizeof(num));
+	return p + sizeof(num);
+}
+
+static inline uint16_t cache_get_uint16(uint8_t const *p)
+{
+	uint16_t num;
+
+	memcpy(&num, p, sizeof(num));
+	return ntohs(num);
+}
+
+static inline uint32_t cache_get_uint32(uint8_t const *p)
+{
+	uint32_t num;
+
+	memcpy(&num, p, sizeof(num));
+	return ntohl(num);
+}
+
+static inline uint64_t cache_get_uint64(uint8_t const *p)
+{
+	uint64_t num;
+
+	memcpy(&num, p, sizeof(num));
+	return ntohll(num);
+}
+
+/** Write a value in the binary format
+ *
+ * @param p Where to write the value.  Must have room for
+ *	cache_value_sizes[value->type] bytes.
+ * @param value to write.
+ * @return a pointer to the byte after the value.
+ */
+static uint8_t *cache_put_value(uint8_t *p, value_box_t const *value)
+{
+	uint64_t num;
+
+	switch (value->type) {
+	case PW_TYPE_BOOLEAN:
+		*p++ = value->datum.boolean;
+		break;
+
+	case PW_TYPE_BYTE:
+		*p++ = value->datum.byte;
+		break;
+
+	case PW_TYPE_SHORT:
+		p = cache_put_uint16(p, value->datum.ushort);
+		break;
+
+	case PW_TYPE_INTEGER:
+		p = cache_put_uint32(p, value->datum.integer);
+		break;
+
+	case PW_TYPE_SIGNED:
+		p = cache_put_uint32(p, (uint32_t) value->datum.sinteger);
+		break;
+
+	case PW_TYPE_DATE:
+		p = cache_put_uint32(p, value->datum.date);
+		break;
+
+	case PW_TYPE_INTEGER64:
+		p = cache_put_uint64(p, value->datum.integer64);
+		break;
+
+	case PW_TYPE_SIZE:
+		p = cache_put_uint64(p, (uint64_t) value->datum.size);
+		break;
+
+	case PW_TYPE_TIMEVAL:
+		p = cache_put_uint64(p, (uint64_t) value->datum.timeval.tv_sec);
+		p = cache_put_uint64(p, (uint64_t) value->datum.timeval.tv_usec);
+		break;
+
+	case PW_TYPE_DECIMAL:
+		memcpy(&num, &value->datum.decimal, sizeof(num));
+		p = cache_put_uint64(p, num);
+		break;
+
+	case PW_TYPE_IPV4_ADDR:
+		memcpy(p, &value->datum.ipaddr.s_addr, 4);
+		p += 4;
+		break;
+
+	case PW_TYPE_IPV6_ADDR:
+		memcpy(p, value->datum.ipv6addr.s6_addr, 16);
+		p += 16;
+		break;
+
+	/*
+	 *	Arrays of bytes.
+	 */
+	default:
+		memcpy(p, ((uint8_t const *) value) + value_box_offsets[value->type], cache_value_sizes[value->type]);
+		p += cache_value_sizes[value->type];
+		break;
+	}
+
+	return p;
+}
+
+/** Read a value in the binary format
+ *
+ * @param value to write to.  The type must already be set.
+ * @param p value data, cache_value_sizes[value->type] bytes long.
+ * @return
+ *	- 0 on success.
+ *	- -1 if the value can't be represented on this system.
+ */
+static int cache_get_value(value_box_t *value, uint8_t const *p)
+{
+	uint64_t num;
+
+	switch (value->type) {
+	case PW_TYPE_BOOLEAN:
+		value->datum.boolean = (p[0] != 0);
+		break;
+
+	case PW_TYPE_BYTE:
+		value->datum.byte = p[0];
+		break;
+
+	case PW_TYPE_SHORT:
+		value->datum.ushort = cache_get_uint16(p);
+		break;
+
+	case PW_TYPE_INTEGER:
+		value->datum.integer = cache_get_uint32(p);
+		break;
+
+	case PW_TYPE_SIGNED:
+		value->datum.sinteger = (int32_t) cache_get_uint32(p);
+		break;
+
+	case PW_TYPE_DATE:
+		value->datum.date = cache_get_uint32(p);
+		break;
+
+	case PW_TYPE_INTEGER64:
+		value->datum.integer64 = cache_get_uint64(p);
+		break;
+
+	case PW_TYPE_SIZE:
+		num = cache_get_uint64(p);
+		if (num > SIZE_MAX) {
+			fr_strerror_printf("Size %" PRIu64 " is too large for this system", num);
+			return -1;
+		}
+		value->datum.size = (size_t) num;
+		break;
+
+	case PW_TYPE_TIMEVAL:
+		value->datum.timeval.tv_sec = (time_t) cache_get_uint64(p);
+		value->datum.timeval.tv_usec = (suseconds_t) cache_get_uint64(p + 8);
+		break;
+
+	case PW_TYPE_DECIMAL:
+		num = cache_get_uint64(p);
+		memcpy(&value->datum.decimal, &num, sizeof(num));
+		break;
+
+	case PW_TYPE_IPV4_ADDR:
+		memcpy(&value->datum.ipaddr.s_addr, p, 4);
+		break;
+
+	case PW_TYPE_IPV6_ADDR:
+		memcpy(value->datum.ipv6addr.s6_addr, p, 16);
+		break;
+
+	default:
+		memcpy(((uint8_t *) value) + value_box_offsets[value->type], p, cache_value_sizes[value->type]);
+		break;
+	}
+
+	return 0;
+}
+
+/** Serialize a cache entry in binary form
+ *
+ * Attributes are stored by number, and values in their native
+ * representation, so deserialising the entry requires no parsing.
+ *
+ * @param ctx to alloc the buffer in.
+ * @param out Where to write pointer to serialized cache entry.
+ * @param c Cache entry to serialize.
+ * @return
+ *	- The length of the serialized entry.
+ *	- -1 on failure, including if an attribute can't be found by number
+ *	  in the dictionaries.  The caller may use cache_serialize() instead.
+ */
+ssize_t cache_serialize_binary(TALLOC_CTX *ctx, uint8_t **out, rlm_cache_entry_t const *c)
+{
+	vp_map_t	*map;
+	size_t		len = CACHE_BINARY_HDR_LEN;
+	uint8_t		*buff, *p;
+
+	/*
+	 *	Figure out how much room we need, and check that the
+	 *	entry can be represented.
+	 */
+	for (map = c->maps; map; map = map->next) {
+		fr_dict_attr_t const	*da;
+		value_box_t const	*value;
+
+		if ((map->lhs->type != TMPL_TYPE_ATTR) || (map->rhs->type != TMPL_TYPE_DATA)) {
+			fr_strerror_printf("Can only serialize attribute maps with literal values");
+			return -1;
+		}
+
+		da = map->lhs->tmpl_da;
+		if (fr_dict_attr_by_num(NULL, da->vendor, da->attr) != da) {
+			fr_strerror_printf("Attribute \"%s\" can't be found by number", da->name);
+			return -1;
+		}
+
+		value = &map->rhs->tmpl_value_box;
+		switch (value->type) {
+		case PW_TYPE_STRING:
+		case PW_TYPE_OCTETS:
+			len += CACHE_BINARY_MAP_LEN + value->length;
+			break;
+
+		default:
+			if ((value->type <= PW_TYPE_INVALID) || (value->type >= PW_TYPE_MAX) ||
+			    !cache_value_sizes[value->type]) {
+				fr_strerror_printf("Can't serialize values of type %s",
+						   fr_int2str(dict_attr_types, value->type, "<INVALID>"));
+				return -1;
+			}
+			len += CACHE_BINARY_MAP_LEN + cache_value_sizes[value->type];
+			break;
+		}
+	}
+
+	buff = p = talloc_array(ctx, uint8_t, len);
+	if (!buff) return -1;
+
+	*p++ = CACHE_BINARY_MAGIC;
+	*p++ = CACHE_BINARY_VERSION;
+	p = cache_put_uint64(p, (uint64_t) c->created);
+	p = cache_put_uint64(p, (uint64_t) c->expires);
+
+	for (map = c->maps; map; map = map->next) {
+		value_box_t const	*value = &map->rhs->tmpl_value_box;
+
+		p = cache_put_uint32(p, map->lhs->tmpl_da->vendor);
+		p = cache_put_uint32(p, map->lhs->tmpl_da->attr);
+		*p++ = map->lhs->tmpl_request;
+		*p++ = map->lhs->tmpl_list;
+		*p++ = (uint8_t) map->lhs->tmpl_tag;
+		*p++ = map->op;
+		*p++ = value->type;
+
+		switch (value->type) {
+		case PW_TYPE_STRING:
+		case PW_TYPE_OCTETS:
+			p = cache_put_uint32(p, value->length);
+			memcpy(p, value->datum.ptr, value->length);
+			p += value->length;
+			break;
+
+		/*
+		 *	Fixed size values always have the length of
+		 *	their wire format.
+		 */
+		default:
+			p = cache_put_uint32(p, cache_value_sizes[value->type]);
+			p = cache_put_value(p, value);
+			break;
+		}
+	}
+
+	rad_assert((size_t) (p - buff) == len);
+
+	*out = buff;
+
+	return len;
+}
+
+/** Converts a binary cache entry back into a structure
+ *
+ * @param c Cache entry to populate (should already be allocated)
+ * @param in Binary representation of cache entry.
+ * @param inlen Length of the binary data.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int cache_deserialize_binary(rlm_cache_entry_t *c, uint8_t const *in, size_t inlen)
+{
+	vp_map_t	**last = &c->maps;
+	uint8_t const	*p = in, *end = in + inlen;
+
+	if (inlen < CACHE_BINARY_HDR_LEN) {
+		fr_strerror_printf("Binary entry too short");
+		return -1;
+	}
+
+	if ((p[0] != CACHE_BINARY_MAGIC) || (p[1] != CACHE_BINARY_VERSION)) {
+		fr_strerror_printf("Unsupported binary entry version %u", p[1]);
+		return -1;
+	}
+	p += 2;
+
+	c->created = (time_t) cache_get_uint64(p);
+	p += 8;
+	c->expires = (time_t) cache_get_uint64(p);
+	p += 8;
+
+	while (p < end) {
+		fr_dict_attr_t const	*da;
+		vp_map_t		*map;
+		value_box_t		*value;
+		uint32_t		vendor, attr, length;
+		size_t			data_len;
+		PW_TYPE			type;
+
+		if ((size_t) (end - p) < CACHE_BINARY_MAP_LEN) {
+			fr_strerror_printf("Binary entry truncated");
+			return -1;
+		}
+
+		vendor = cache_get_uint32(p);
+		attr = cache_get_uint32(p + 4);
+		type = p[12];
+		length = cache_get_uint32(p + 13);
+
+		da = fr_dict_attr_by_num(NULL, vendor, attr);
+		if (!da) {
+			fr_strerror_printf("Unknown attribute %u.%u.  Check local dictionaries", vendor, attr);
+			return -1;
+		}
+
+		if (da->type != type) {
+			fr_strerror_printf("Attribute \"%s\" has type %s, but entry has type %s.  "
+					   "Check local dictionaries", da->name,
+					   fr_int2str(dict_attr_types, da->type, "<INVALID>"),
+					   fr_int2str(dict_attr_types, type, "<INVALID>"));
+			return -1;
+		}
+
+		switch (type) {
+		case PW_TYPE_STRING:
+		case PW_TYPE_OCTETS:
+			data_len = length;
+			break;
+
+		default:
+			if ((type <= PW_TYPE_INVALID) || (type >= PW_TYPE_MAX) || !cache_value_sizes[type]) {
+				fr_strerror_printf("Invalid type %u for attribute \"%s\"", type, da->name);
+				return -1;
+			}
+			data_len = cache_value_sizes[type];
+			if (length != data_len) {
+				fr_strerror_printf("Invalid length %u for attribute \"%s\", expected %zu",
+						   length, da->name, data_len);
+				return -1;
+			}
+			break;
+		}
+
+		if ((size_t) (end - (p + CACHE_BINARY_MAP_LEN)) < data_len) {
+			fr_strerror_printf("Binary entry truncated");
+			return -1;
+		}
+
+		/*
+		 *	The entry may have been written by something
+		 *	else, so don't trust the qualifiers.
+		 */
+		if (!fr_int2str(request_refs, p[8], NULL)) {
+			fr_strerror_printf("Invalid request qualifier %u for attribute \"%s\"", p[8], da->name);
+			return -1;
+		}
+
+		if (!fr_int2str(pair_lists, p[9], NULL)) {
+			fr_strerror_printf("Invalid list qualifier %u for attribute \"%s\"", p[9], da->name);
+			return -1;
+		}
+
+		if ((p[11] < T_EQSTART) || (p[11] >= T_EQEND)) {
+			fr_strerror_printf("Invalid operator %u for attribute \"%s\"", p[11], da->name);
+			return -1;
+		}
+
+		MEM(map = talloc_zero(c, vp_map_t));
+		map->op = p[11];
+
+		MEM(map->lhs = tmpl_init(talloc(map, vp_tmpl_t), TMPL_TYPE_ATTR, da->name, strlen(da->name), T_BARE_WORD));
+		map->lhs->tmpl_da = da;
+		map->lhs->tmpl_request = p[8];
+		map->lhs->tmpl_list = p[9];
+		map->lhs->tmpl_tag = (int8_t) p[10];
+		map->lhs->tmpl_num = NUM_ANY;
+
+		MEM(map->rhs = tmpl_init(talloc(map, vp_tmpl_t), TMPL_TYPE_DATA, "", 0, T_BARE_WORD));
+		value = &map->rhs->tmpl_value_box;
+
+		p += CACHE_BINARY_MAP_LEN;
+
+		switch (type) {
+		case PW_TYPE_STRING:
+			MEM(value->datum.strvalue = talloc_bstrndup(map->rhs, (char const *) p, data_len));
+			map->rhs->quote = is_printable(value->datum.strvalue, data_len) ?
+				T_SINGLE_QUOTED_STRING : T_DOUBLE_QUOTED_STRING;
+			break;
+
+		case PW_TYPE_OCTETS:
+			MEM(value->datum.octets = talloc_memdup(map->rhs, p, data_len));
+			break;
+
+		default:
+			value->type = type;
+			if (cache_get_value(value, p) < 0) {
+				talloc_free(map);
+				return -1;
+			}
+			if (fr_dict_enum_types[type]) value->datum.enumv = da;
+			break;
+		}
+		value->type = type;
+		value->length = length;
+
+		*last = map;
+		last = &(*last)->next;
+
+		p += data_len;
+	}
+
+	return 0;
+}
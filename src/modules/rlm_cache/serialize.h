@@ -25,5 +25,11 @@
  */
 RCSIDH(serialize_h, "$Id$")
 
+#define CACHE_BINARY_MAGIC	(0xfc)	//!< First byte of a binary entry.  Text entries start with '&'.
+#define CACHE_BINARY_VERSION	(2)	//!< Version of the binary format.
+
 int cache_serialize(TALLOC_CTX *ctx, char **out, rlm_cache_entry_t const *c);
 int cache_deserialize(rlm_cache_entry_t *c, char *in, ssize_t inlen);
+
+ssize_t cache_serialize_binary(TALLOC_CTX *ctx, uint8_t **out, rlm_cache_entry_t const *c);
+int cache_deserialize_binary(rlm_cache_entry_t *c, uint8_t const *in, size_t inlen);
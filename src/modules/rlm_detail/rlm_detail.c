@@ -71,6 +71,11 @@ typedef struct detail_instance {
 
 	exfile_t    	*ef;		//!< Log file handler
 
+	bool		write_behind;	//!< Hand writes off to a dedicated I/O thread.
+	uint32_t	buffer_size;	//!< Size of the write-behind buffer.
+	uint32_t	fsync_records;	//!< fsync() after this many records.
+	uint32_t	fsync_interval;	//!< fsync() at least this often.
+
 	fr_hash_table_t *ht;		//!< Holds suppressed attributes.
 } rlm_detail_t;
 
@@ -82,6 +87,10 @@ static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("locking", PW_TYPE_BOOLEAN, rlm_detail_t, locking), .dflt = "no" },
 	{ FR_CONF_OFFSET("escape_filenames", PW_TYPE_BOOLEAN, rlm_detail_t, escape), .dflt = "no" },
 	{ FR_CONF_OFFSET("log_packet_header", PW_TYPE_BOOLEAN, rlm_detail_t, log_srcdst), .dflt = "no" },
+	{ FR_CONF_OFFSET("write_behind", PW_TYPE_BOOLEAN, rlm_detail_t, write_behind), .dflt = "no" },
+	{ FR_CONF_OFFSET("buffer_size", PW_TYPE_INTEGER, rlm_detail_t, buffer_size), .dflt = "1048576" },
+	{ FR_CONF_OFFSET("fsync_records", PW_TYPE_INTEGER, rlm_detail_t, fsync_records), .dflt = "0" },
+	{ FR_CONF_OFFSET("fsync_interval", PW_TYPE_INTEGER, rlm_detail_t, fsync_interval), .dflt = "0" },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -138,6 +147,16 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 		return -1;
 	}
 
+	if (inst->write_behind) {
+		FR_INTEGER_BOUND_CHECK("buffer_size", inst->buffer_size, >=, 65536);
+
+		if (exfile_enable_write_behind(inst->ef, inst->buffer_size,
+					       inst->fsync_records, inst->fsync_interval) < 0) {
+			cf_log_err_cs(conf, "%s", fr_strerror());
+			return -1;
+		}
+	}
+
 	/*
 	 *	Suppress certain attributes.
 	 */
@@ -193,10 +212,24 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 	return 0;
 }
 
+/*
+ *	Append a VP to the entry, in the same format as fr_pair_fprint().
+ */
+static void detail_pair_append(char **out, VALUE_PAIR const *vp)
+{
+	char buffer[1024];
+	char *p;
+
+	if (!fr_pair_snprint(buffer, sizeof(buffer), vp)) return;
+
+	p = talloc_asprintf_append_buffer(*out, "\t%s\n", buffer);
+	if (p) *out = p;
+}
+
 /*
  *	Wrapper for VPs allocated on the stack.
  */
-static void detail_fr_pair_fprint(TALLOC_CTX *ctx, FILE *out, VALUE_PAIR const *stacked)
+static void detail_stacked_pair_append(TALLOC_CTX *ctx, char **out, VALUE_PAIR const *stacked)
 {
 	VALUE_PAIR *vp;
 
@@ -205,20 +238,20 @@ static void detail_fr_pair_fprint(TALLOC_CTX *ctx, FILE *out, VALUE_PAIR const *
 
 	memcpy(vp, stacked, sizeof(*vp));
 	vp->op = T_OP_EQ;
-	fr_pair_fprint(out, vp);
+	detail_pair_append(out, vp);
 	talloc_free(vp);
 }
 
 
-/** Write a single detail entry to file pointer
+/** Format a single detail entry
  *
- * @param[in] out Where to write entry.
+ * @param[in,out] out talloc'd buffer to append the entry to.
  * @param[in] inst Instance of rlm_detail.
  * @param[in] request The current request.
  * @param[in] packet associated with the request (request, reply, proxy-request, proxy-reply...).
  * @param[in] compat Write out entry in compatibility mode.
  */
-static int detail_write(FILE *out, rlm_detail_t const *inst, REQUEST *request, RADIUS_PACKET *packet, bool compat)
+static int detail_write(char **out, rlm_detail_t const *inst, REQUEST *request, RADIUS_PACKET *packet, bool compat)
 {
 	VALUE_PAIR *vp;
 	char timestamp[256];
@@ -232,12 +265,7 @@ static int detail_write(FILE *out, rlm_detail_t const *inst, REQUEST *request, R
 		return 0;
 	}
 
-#define WRITE(fmt, ...) do {\
-	if (fprintf(out, fmt, ## __VA_ARGS__) < 0) {\
-		RERROR("Failed writing to detail file: %s", fr_syserror(errno));\
-		return -1;\
-	}\
-} while(0)
+#define WRITE(fmt, ...) MEM(*out = talloc_asprintf_append_buffer(*out, fmt, ## __VA_ARGS__))
 
 	WRITE("%s\n", timestamp);
 
@@ -284,16 +312,16 @@ static int detail_write(FILE *out, rlm_detail_t const *inst, REQUEST *request, R
 			break;
 		}
 
-		detail_fr_pair_fprint(request, out, &src_vp);
-		detail_fr_pair_fprint(request, out, &dst_vp);
+		detail_stacked_pair_append(request, out, &src_vp);
+		detail_stacked_pair_append(request, out, &dst_vp);
 
 		src_vp.da = fr_dict_attr_by_num(NULL, 0, PW_PACKET_SRC_PORT);
 		src_vp.vp_integer = packet->src_port;
 		dst_vp.da = fr_dict_attr_by_num(NULL, 0, PW_PACKET_DST_PORT);
 		dst_vp.vp_integer = packet->dst_port;
 
-		detail_fr_pair_fprint(request, out, &src_vp);
-		detail_fr_pair_fprint(request, out, &dst_vp);
+		detail_stacked_pair_append(request, out, &src_vp);
+		detail_stacked_pair_append(request, out, &dst_vp);
 	}
 
 	{
@@ -316,7 +344,7 @@ static int detail_write(FILE *out, rlm_detail_t const *inst, REQUEST *request, R
 			 */
 			op = vp->op;
 			vp->op = T_OP_EQ;
-			fr_pair_fprint(out, vp);
+			detail_pair_append(out, vp);
 			vp->op = op;
 		}
 	}
@@ -348,13 +376,12 @@ static int detail_write(FILE *out, rlm_detail_t const *inst, REQUEST *request, R
 static rlm_rcode_t CC_HINT(nonnull) detail_do(void const *instance, REQUEST *request,
 					      RADIUS_PACKET *packet, bool compat)
 {
-	int		outfd;
 	char		buffer[DIRLEN];
+	char		*entry;
+	struct iovec	vector;
 
-	FILE		*outfp;
-
+	gid_t		gid = -1;
 #ifdef HAVE_GRP_H
-	gid_t		gid;
 	char		*endptr;
 #endif
 
@@ -388,45 +415,35 @@ static rlm_rcode_t CC_HINT(nonnull) detail_do(void const *instance, REQUEST *req
 #endif
 #endif
 
-	outfd = exfile_open(inst->ef, request, buffer, inst->perm, true);
-	if (outfd < 0) {
-		RERROR("Couldn't open file %s: %s", buffer, fr_strerror());
+	entry = talloc_strdup(request, "");
+	if (detail_write(&entry, inst, request, packet, compat) < 0) {
+		talloc_free(entry);
 		return RLM_MODULE_FAIL;
 	}
 
+#ifdef HAVE_GRP_H
 	if (inst->group != NULL) {
 		gid = strtol(inst->group, &endptr, 10);
-		if (*endptr != '\0') {
-			if (rad_getgid(request, &gid, inst->group) < 0) {
-				RDEBUG2("Unable to find system group '%s'", inst->group);
-				goto skip_group;
-			}
-		}
-
-		if (chown(buffer, -1, gid) == -1) {
-			RDEBUG2("Unable to change system group of '%s'", buffer);
+		if ((*endptr != '\0') && (rad_getgid(request, &gid, inst->group) < 0)) {
+			RDEBUG2("Unable to find system group '%s'", inst->group);
+			gid = -1;
 		}
 	}
+#endif
 
-skip_group:
 	/*
-	 *	Open the output fp for buffering.
+	 *	Append the entry to the file, or queue it for the
+	 *	write-behind thread.
 	 */
-	if ((outfp = fdopen(outfd, "a")) == NULL) {
-		RERROR("Couldn't open file %s: %s", buffer, fr_syserror(errno));
-	fail:
-		if (outfp) fclose(outfp);
-		exfile_unlock(inst->ef, request, outfd);
+	vector.iov_base = entry;
+	vector.iov_len = talloc_array_length(entry) - 1;
+
+	if (exfile_write(inst->ef, request, buffer, inst->perm, gid, &vector, 1) < 0) {
+		RERROR("Couldn't write to file %s: %s", buffer, fr_strerror());
+		talloc_free(entry);
 		return RLM_MODULE_FAIL;
 	}
-
-	if (detail_write(outfp, inst, request, packet, compat) < 0) goto fail;
-
-	/*
-	 *	Flush everything
-	 */
-	fclose(outfp);
-	exfile_unlock(inst->ef, request, outfd); /* do NOT close outfp */
+	talloc_free(entry);
 
 	/*
 	 *	And everything is fine.
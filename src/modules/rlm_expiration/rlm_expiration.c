@@ -102,7 +102,7 @@ static int expirecmp(UNUSED void *instance, REQUEST *req, UNUSED VALUE_PAIR *req
  *	that must be referenced in later calls, store a handle to it
  *	in *instance otherwise put a null pointer there.
  */
-static int mod_instantiate(UNUSED CONF_SECTION *conf, void *instance)
+static int mod_bootstrap(UNUSED CONF_SECTION *conf, void *instance)
 {
 	/*
 	 *	Register the expiration comparison operation.
@@ -125,7 +125,7 @@ rad_module_t rlm_expiration = {
 	.magic		= RLM_MODULE_INIT,
 	.name		= "expiration",
 	.type		= RLM_TYPE_THREAD_SAFE,
-	.instantiate	= mod_instantiate,
+	.bootstrap	= mod_bootstrap,
 	.methods = {
 		[MOD_AUTHORIZE]		= mod_authorize,
 		[MOD_POST_AUTH]		= mod_authorize
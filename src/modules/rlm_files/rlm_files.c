@@ -30,40 +30,70 @@ RCSID("$Id$")
 #include	<ctype.h>
 #include	<fcntl.h>
 
+/** How an entry's check items are compared against the request
+ *
+ */
+typedef enum rlm_files_check {
+	FILES_CHECK_NONE = 0,			//!< No check items to compare, the entry always matches.
+	FILES_CHECK_DIRECT,			//!< Check items can be compared in place.
+	FILES_CHECK_COPY			//!< Check items contain xlats, regexes, or attributes with
+						//!< compare callbacks, and must be copied for each request
+						//!< before they're compared.
+} rlm_files_check_t;
+
+typedef struct rlm_files_entry rlm_files_entry_t;
+
+/** An entry in a users file, with its compare strategy worked out at load time
+ *
+ */
+struct rlm_files_entry {
+	PAIR_LIST const		*pl;		//!< Parsed entry.
+	rlm_files_check_t	check;		//!< How to compare the check items.
+	rlm_files_entry_t	*next;		//!< Next entry for the same name, in file order.
+};
+
+/** Compiled form of a users file
+ *
+ */
+typedef struct rlm_files_index {
+	fr_hash_table_t		*users;		//!< First entry for each name, indexed by name.
+	rlm_files_entry_t	*defaults;	//!< DEFAULT entries, in file order.
+} rlm_files_index_t;
+
 typedef struct rlm_files_t {
 	char const *compat_mode;
 
 	char const *key;
 
 	char const *filename;
-	rbtree_t *common;
+	rlm_files_index_t *common;
 
 	/* autz */
 	char const *usersfile;
-	rbtree_t *users;
+	rlm_files_index_t *users;
 
 
 	/* authenticate */
 	char const *auth_usersfile;
-	rbtree_t *auth_users;
+	rlm_files_index_t *auth_users;
 
 	/* preacct */
 	char const *acct_usersfile;
-	rbtree_t *acct_users;
+	rlm_files_index_t *acct_users;
 
 #ifdef WITH_PROXY
 	/* pre-proxy */
 	char const *preproxy_usersfile;
-	rbtree_t *preproxy_users;
+	rlm_files_index_t *preproxy_users;
 
 	/* post-proxy */
 	char const *postproxy_usersfile;
-	rbtree_t *postproxy_users;
+	rlm_files_index_t *postproxy_users;
 #endif
 
 	/* post-authenticate */
 	char const *postauth_usersfile;
-	rbtree_t *postauth_users;
+	rlm_files_index_t *postauth_users;
 } rlm_files_t;
 
 
@@ -94,22 +124,70 @@ static const CONF_PARSER module_config[] = {
 };
 
 
-static int pairlist_cmp(void const *a, void const *b)
+static uint32_t files_entry_hash(void const *data)
+{
+	return fr_hash_string(((rlm_files_entry_t const *)data)->pl->name);
+}
+
+static int files_entry_cmp(void const *a, void const *b)
 {
-	return strcmp(((PAIR_LIST const *)a)->name,
-		      ((PAIR_LIST const *)b)->name);
+	return strcmp(((rlm_files_entry_t const *)a)->pl->name,
+		      ((rlm_files_entry_t const *)b)->pl->name);
 }
 
-static int getusersfile(TALLOC_CTX *ctx, char const *filename, rbtree_t **ptree, char const *compat_mode_str)
+/** Work out how the check items of an entry need to be compared
+ *
+ * Comparing check items which need expanding, or which are regular expressions
+ * modifies or allocates under them, so those must be copied for each request.
+ * So must check items which have a paircompare callback, as the callbacks are
+ * passed the whole list, and may write to it (e.g. Prefix and Suffix set
+ * Stripped-User-Name).  Anything else can be compared against the entry directly.
+ *
+ * Callbacks are registered when modules are bootstrapped, so they're all known
+ * by the time we're instantiated.
+ *
+ * @param[in] pl	entry to examine.
+ * @return how to compare the check items.
+ */
+static rlm_files_check_t files_entry_check(PAIR_LIST const *pl)
+{
+	vp_cursor_t	cursor;
+	VALUE_PAIR	*vp;
+	VALUE_PAIR	*check;
+
+	if (!pl->check) return FILES_CHECK_NONE;
+
+	memcpy(&check, &pl->check, sizeof(check));
+	for (vp = fr_pair_cursor_init(&cursor, &check);
+	     vp;
+	     vp = fr_pair_cursor_next(&cursor)) {
+		if (vp->type == VT_XLAT) return FILES_CHECK_COPY;
+
+		if (radius_find_compare(vp->da)) return FILES_CHECK_COPY;
+
+		switch (vp->op) {
+		case T_OP_REG_EQ:
+		case T_OP_REG_NE:
+			return FILES_CHECK_COPY;
+
+		default:
+			break;
+		}
+	}
+
+	return FILES_CHECK_DIRECT;
+}
+
+static int getusersfile(TALLOC_CTX *ctx, char const *filename, rlm_files_index_t **pidx, char const *compat_mode_str)
 {
 	int rcode;
 	PAIR_LIST *users = NULL;
 	PAIR_LIST *entry, *next;
-	PAIR_LIST *user_list, *default_list, **default_tail;
-	rbtree_t *tree;
+	rlm_files_entry_t *e, *user_list, **default_tail;
+	rlm_files_index_t *idx;
 
 	if (!filename) {
-		*ptree = NULL;
+		*pidx = NULL;
 		return 0;
 	}
 
@@ -235,14 +313,15 @@ static int getusersfile(TALLOC_CTX *ctx, char const *filename, rbtree_t **ptree,
 		}
 	}
 
-	tree = rbtree_create(ctx, pairlist_cmp, NULL, RBTREE_FLAG_NONE);
-	if (!tree) {
+	idx = talloc_zero(ctx, rlm_files_index_t);
+	if (idx) idx->users = fr_hash_table_create(idx, files_entry_hash, files_entry_cmp, NULL);
+	if (!idx || !idx->users) {
+		talloc_free(idx);
 		pairlist_free(&users);
 		return -1;
 	}
 
-	default_list = NULL;
-	default_tail = &default_list;
+	default_tail = &idx->defaults;
 
 	/*
 	 *	We've read the entries in linearly, but putting them
@@ -255,47 +334,37 @@ static int getusersfile(TALLOC_CTX *ctx, char const *filename, rbtree_t **ptree,
 		 */
 		next = entry->next;
 		entry->next = NULL;
-		(void) talloc_steal(tree, entry);
+		(void) talloc_steal(idx, entry);
+
+		e = talloc_zero(idx, rlm_files_entry_t);
+		if (!e) {
+		error:
+			pairlist_free(&next);
+			talloc_free(idx);
+			return -1;
+		}
+		e->pl = entry;
+		e->check = files_entry_check(entry);
 
 		/*
-		 *	DEFAULT entries get their own list.
+		 *	DEFAULT entries get their own list, so they
+		 *	don't need to be looked up for every request.
 		 */
 		if (strcmp(entry->name, "DEFAULT") == 0) {
-			if (!default_list) {
-				default_list = entry;
-
-				/*
-				 *	Insert the first DEFAULT into the tree.
-				 */
-				if (!rbtree_insert(tree, entry)) {
-				error:
-					pairlist_free(&entry);
-					pairlist_free(&next);
-					rbtree_free(tree);
-					return -1;
-				}
-
-			} else {
-				/*
-				 *	Tack this entry onto the tail
-				 *	of the DEFAULT list.
-				 */
-				*default_tail = entry;
-			}
-
-			default_tail = &entry->next;
+			*default_tail = e;
+			default_tail = &e->next;
 			continue;
 		}
 
 		/*
 		 *	Not DEFAULT, must be a normal user.
 		 */
-		user_list = rbtree_finddata(tree, entry);
+		user_list = fr_hash_table_finddata(idx->users, e);
 		if (!user_list) {
 			/*
 			 *	Insert the first one.
 			 */
-			if (!rbtree_insert(tree, entry)) goto error;
+			if (!fr_hash_table_insert(idx->users, e)) goto error;
 		} else {
 			/*
 			 *	Find the tail of this list, and add it
@@ -303,11 +372,11 @@ static int getusersfile(TALLOC_CTX *ctx, char const *filename, rbtree_t **ptree,
 			 */
 			while (user_list->next) user_list = user_list->next;
 
-			user_list->next = entry;
+			user_list->next = e;
 		}
 	}
 
-	*ptree = tree;
+	*pidx = idx;
 
 	return 0;
 }
@@ -342,16 +411,18 @@ static int mod_instantiate(UNUSED CONF_SECTION *conf, void *instance)
 /*
  *	Common code called by everything below.
  */
-static rlm_rcode_t file_common(rlm_files_t const *inst, REQUEST *request, char const *filename, rbtree_t *tree,
+static rlm_rcode_t file_common(rlm_files_t const *inst, REQUEST *request, char const *filename,
+			       rlm_files_index_t const *idx,
 			       RADIUS_PACKET *request_packet, RADIUS_PACKET *reply_packet)
 {
-	char const	*name, *match;
-	VALUE_PAIR	*check_tmp;
-	VALUE_PAIR	*reply_tmp;
-	PAIR_LIST const *user_pl, *default_pl;
-	bool		found = false;
-	PAIR_LIST	my_pl;
-	char		buffer[256];
+	char const		*name, *match;
+	VALUE_PAIR		*check_tmp;
+	VALUE_PAIR		*reply_tmp;
+	rlm_files_entry_t const	*user_e, *default_e;
+	bool			found = false;
+	PAIR_LIST		my_pl;
+	rlm_files_entry_t	my_e;
+	char			buffer[256];
 
 	if (!inst->key) {
 		VALUE_PAIR	*namepair;
@@ -369,58 +440,88 @@ static rlm_rcode_t file_common(rlm_files_t const *inst, REQUEST *request, char c
 		name = len ? buffer : "NONE";
 	}
 
-	if (!tree) return RLM_MODULE_NOOP;
+	if (!idx) return RLM_MODULE_NOOP;
 
 	my_pl.name = name;
-	user_pl = rbtree_finddata(tree, &my_pl);
-	my_pl.name = "DEFAULT";
-	default_pl = rbtree_finddata(tree, &my_pl);
+	my_e.pl = &my_pl;
+	user_e = fr_hash_table_finddata(idx->users, &my_e);
+	default_e = idx->defaults;
 
 	/*
 	 *	Find the entry for the user.
 	 */
-	while (user_pl || default_pl) {
+	while (user_e || default_e) {
 		vp_cursor_t cursor;
 		VALUE_PAIR *vp;
+		rlm_files_entry_t const *e;
 		PAIR_LIST const *pl;
+		int rcode;
 
 		/*
 		 *	Figure out which entry to match on.
 		 */
 
-		if (!default_pl && user_pl) {
-			pl = user_pl;
+		if (!default_e && user_e) {
+			e = user_e;
 			match = name;
-			user_pl = user_pl->next;
+			user_e = user_e->next;
 
-		} else if (!user_pl && default_pl) {
-			pl = default_pl;
+		} else if (!user_e && default_e) {
+			e = default_e;
 			match = "DEFAULT";
-			default_pl = default_pl->next;
+			default_e = default_e->next;
 
-		} else if (user_pl->lineno < default_pl->lineno) {
-			pl = user_pl;
+		} else if (user_e->pl->lineno < default_e->pl->lineno) {
+			e = user_e;
 			match = name;
-			user_pl = user_pl->next;
+			user_e = user_e->next;
 
 		} else {
-			pl = default_pl;
+			e = default_e;
 			match = "DEFAULT";
-			default_pl = default_pl->next;
+			default_e = default_e->next;
 		}
+		pl = e->pl;
 
-		check_tmp = fr_pair_list_copy(request, pl->check);
-		for (vp = fr_pair_cursor_init(&cursor, &check_tmp);
-		     vp;
-		     vp = fr_pair_cursor_next(&cursor)) {
-			if (xlat_eval_do(request, vp) < 0) {
-				RWARN("Failed parsing expanded value for check item, skipping entry: %s", fr_strerror());
+		switch (e->check) {
+		case FILES_CHECK_NONE:
+			check_tmp = NULL;
+			rcode = 0;
+			break;
+
+		/*
+		 *	Nothing in the check items will be modified
+		 *	by the comparison, so only copy them if the
+		 *	entry matches.
+		 */
+		case FILES_CHECK_DIRECT:
+			memcpy(&check_tmp, &pl->check, sizeof(check_tmp));
+			rcode = paircompare(request, request_packet->vps, check_tmp, &reply_packet->vps);
+			check_tmp = (rcode == 0) ? fr_pair_list_copy(request, pl->check) : NULL;
+			break;
+
+		case FILES_CHECK_COPY:
+		default:
+			check_tmp = fr_pair_list_copy(request, pl->check);
+			for (vp = fr_pair_cursor_init(&cursor, &check_tmp);
+			     vp;
+			     vp = fr_pair_cursor_next(&cursor)) {
+				if (xlat_eval_do(request, vp) < 0) {
+					RWARN("Failed parsing expanded value for check item, skipping entry: %s",
+					      fr_strerror());
+					break;
+				}
+			}
+			if (vp) {
 				fr_pair_list_free(&check_tmp);
 				continue;
 			}
+
+			rcode = paircompare(request, request_packet->vps, check_tmp, &reply_packet->vps);
+			break;
 		}
 
-		if (paircompare(request, request_packet->vps, check_tmp, &reply_packet->vps) == 0) {
+		if (rcode == 0) {
 			RDEBUG2("Found match \"%s\" one line %d of %s", match, pl->lineno, filename);
 			found = true;
 
@@ -434,6 +535,8 @@ static rlm_rcode_t file_common(rlm_files_t const *inst, REQUEST *request, char c
 			 *	Fallthrough?
 			 */
 			if (!fall_through(pl->reply)) break;
+		} else {
+			fr_pair_list_free(&check_tmp);
 		}
 	}
 
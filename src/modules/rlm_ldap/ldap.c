@@ -550,38 +550,28 @@ char const *rlm_ldap_error_str(ldap_handle_t const *conn)
 	return ldap_err2string(lib_errno);
 }
 
-/** Parse response from LDAP server dealing with any errors
- *
- * Should be called after an LDAP operation. Will check result of operation
- * and if it was successful, then attempt to retrieve and parse the result.
- *
- * Will also produce extended error output including any messages the server
- * sent, and information about partial DN matches.
+/** Parse a result from the LDAP server, dealing with any errors
  *
  * @param[in] inst	of LDAP module.
  * @param[in] conn	Current connection.
- * @param[in] msgid	returned from last operation. May be -1 if no result
- *			processing is required.
+ * @param[in] lib_errno	LDAP_SUCCESS if *result holds a complete result, else the
+ *			error that occurred sending the operation or waiting for
+ *			its result.
  * @param[in] dn	Last search or bind DN.
- * @param[in] timeout	Override the default result timeout.
- * @param[out] result	Where to write result, if NULL result will be freed.
- * @param[out] error	Where to write the error string, may be NULL, must
- *			not be freed.
+ * @param[in,out] result The result to parse.  Will be NULL on return if freeit is
+ *			true, or the operation failed.
+ * @param[in] freeit	Free the result once it's been parsed.
+ * @param[out] error	Where to write the error string, must not be freed.
  * @param[out] extra	Where to write additional error string to, may be NULL
  *			(faster) or must be freed (with talloc_free).
  * @return One of the LDAP_PROC_* (#ldap_rcode_t) values.
  */
-ldap_rcode_t rlm_ldap_result(rlm_ldap_t const *inst,
-			     ldap_handle_t const *conn,
-			     int msgid,
-			     char const *dn,
-			     struct timeval const *timeout,
-			     LDAPMessage **result,
-			     char const **error, char **extra)
+static ldap_rcode_t rlm_ldap_result_parse(rlm_ldap_t const *inst, ldap_handle_t const *conn, int lib_errno,
+					  char const *dn, LDAPMessage **result, bool freeit,
+					  char const **error, char **extra)
 {
 	ldap_rcode_t status = LDAP_PROC_SUCCESS;
 
-	int lib_errno = LDAP_SUCCESS;	// errno returned by the library.
 	int srv_errno = LDAP_SUCCESS;	// errno in the result message.
 
 	char *part_dn = NULL;		// Partial DN match.
@@ -589,59 +579,9 @@ ldap_rcode_t rlm_ldap_result(rlm_ldap_t const *inst,
 	char *srv_err = NULL;		// Server's extended error message.
 	char *p, *a;
 
-	bool freeit = false;		// Whether the message should be freed after being processed.
 	int len;
 
-	struct timeval tv;		// Holds timeout values.
-
-	LDAPMessage *tmp_msg = NULL;	// Temporary message pointer storage if we weren't provided with one.
-
-	char const *tmp_err;		// Temporary error pointer storage if we weren't provided with one.
-
-	if (!error) error = &tmp_err;
-	*error = NULL;
-
-	if (extra) *extra = NULL;
-	if (result) *result = NULL;
-
-	/*
-	 *	We always need the result, but our caller may not
-	 */
-	if (!result) {
-		result = &tmp_msg;
-		freeit = true;
-	}
-
-	/*
-	 *	Check if there was an error sending the request
-	 */
-	ldap_get_option(conn->handle, LDAP_OPT_ERROR_NUMBER, &lib_errno);
 	if (lib_errno != LDAP_SUCCESS) goto process_error;
-	if (msgid < 0) return LDAP_SUCCESS;	/* No msgid and no error, return now */
-
-	if (!timeout) {
-		tv.tv_sec = inst->res_timeout;
-		tv.tv_usec = 0;
-	} else {
-		tv = *timeout;
-	}
-
-	/*
-	 *	Now retrieve the result and check for errors
-	 *	ldap_result returns -1 on failure, and 0 on timeout
-	 */
-	lib_errno = ldap_result(conn->handle, msgid, 1, &tv, result);
-	if (lib_errno == 0) {
-		lib_errno = LDAP_TIMEOUT;
-
-		goto process_error;
-	}
-
-	if (lib_errno == -1) {
-		ldap_get_option(conn->handle, LDAP_OPT_ERROR_NUMBER, &lib_errno);
-
-		goto process_error;
-	}
 
 	/*
 	 *	Parse the result and check for errors sent by the server
@@ -798,6 +738,90 @@ process_error:
 	return status;
 }
 
+/** Parse response from LDAP server dealing with any errors
+ *
+ * Should be called after an LDAP operation. Will check result of operation
+ * and if it was successful, then attempt to retrieve and parse the result.
+ *
+ * Will also produce extended error output including any messages the server
+ * sent, and information about partial DN matches.
+ *
+ * @param[in] inst	of LDAP module.
+ * @param[in] conn	Current connection.
+ * @param[in] msgid	returned from last operation. May be -1 if no result
+ *			processing is required.
+ * @param[in] dn	Last search or bind DN.
+ * @param[in] timeout	Override the default result timeout.
+ * @param[out] result	Where to write result, if NULL result will be freed.
+ * @param[out] error	Where to write the error string, may be NULL, must
+ *			not be freed.
+ * @param[out] extra	Where to write additional error string to, may be NULL
+ *			(faster) or must be freed (with talloc_free).
+ * @return One of the LDAP_PROC_* (#ldap_rcode_t) values.
+ */
+ldap_rcode_t rlm_ldap_result(rlm_ldap_t const *inst,
+			     ldap_handle_t const *conn,
+			     int msgid,
+			     char const *dn,
+			     struct timeval const *timeout,
+			     LDAPMessage **result,
+			     char const **error, char **extra)
+{
+	int lib_errno = LDAP_SUCCESS;	// errno returned by the library.
+
+	bool freeit = false;		// Whether the message should be freed after being processed.
+
+	struct timeval tv;		// Holds timeout values.
+
+	LDAPMessage *tmp_msg = NULL;	// Temporary message pointer storage if we weren't provided with one.
+
+	char const *tmp_err;		// Temporary error pointer storage if we weren't provided with one.
+
+	if (!error) error = &tmp_err;
+	*error = NULL;
+
+	if (extra) *extra = NULL;
+	if (result) *result = NULL;
+
+	/*
+	 *	We always need the result, but our caller may not
+	 */
+	if (!result) {
+		result = &tmp_msg;
+		freeit = true;
+	}
+
+	/*
+	 *	Check if there was an error sending the request
+	 */
+	ldap_get_option(conn->handle, LDAP_OPT_ERROR_NUMBER, &lib_errno);
+	if (lib_errno != LDAP_SUCCESS) return rlm_ldap_result_parse(inst, conn, lib_errno, dn, result, freeit,
+								     error, extra);
+	if (msgid < 0) return LDAP_SUCCESS;	/* No msgid and no error, return now */
+
+	if (!timeout) {
+		tv.tv_sec = inst->res_timeout;
+		tv.tv_usec = 0;
+	} else {
+		tv = *timeout;
+	}
+
+	/*
+	 *	Now retrieve the result and check for errors
+	 *	ldap_result returns -1 on failure, and 0 on timeout
+	 */
+	lib_errno = ldap_result(conn->handle, msgid, 1, &tv, result);
+	if (lib_errno == 0) {
+		lib_errno = LDAP_TIMEOUT;
+	} else if (lib_errno == -1) {
+		ldap_get_option(conn->handle, LDAP_OPT_ERROR_NUMBER, &lib_errno);
+	} else {
+		lib_errno = LDAP_SUCCESS;
+	}
+
+	return rlm_ldap_result_parse(inst, conn, lib_errno, dn, result, freeit, error, extra);
+}
+
 /** Bind to the LDAP directory as a user
  *
  * Performs a simple bind to the LDAP directory, and handles any errors that occur.
@@ -1141,6 +1165,271 @@ finish:
 	return status;
 }
 
+/** Send a search to the LDAP directory, without waiting for the result
+ *
+ * Binds as the administrative user if required, and sends the search.  The result should be
+ * collected with #rlm_ldap_search_async_result when the connection's file descriptor becomes
+ * readable, and #rlm_ldap_search_async_end must be called before the connection is used for
+ * anything else.
+ *
+ * libldap chases referrals on connections of its own, which the caller can't watch, so
+ * referral chasing is turned off until #rlm_ldap_search_async_end is called.  Referrals are
+ * returned as LDAP_PROC_REFERRAL instead.
+ *
+ * @param[out] msgid of the search.
+ * @param[in] inst rlm_ldap configuration.
+ * @param[in] request Current request.
+ * @param[in,out] pconn to use. May change as this function calls functions which auto re-connect.
+ * @param[in] dn to use as base for the search.
+ * @param[in] scope to use (LDAP_SCOPE_BASE, LDAP_SCOPE_ONE, LDAP_SCOPE_SUB).
+ * @param[in] filter to use, should be pre-escaped.
+ * @param[in] attrs to retrieve.
+ * @param[in] serverctrls Search controls to pass to the server.  May be NULL.
+ * @param[in] clientctrls Search controls for ldap_search.  May be NULL.
+ * @return
+ *	- LDAP_PROC_SUCCESS if the search was sent.
+ *	- Another LDAP_PROC_* (#ldap_rcode_t) value on failure.
+ */
+ldap_rcode_t rlm_ldap_search_async(int *msgid, rlm_ldap_t const *inst, REQUEST *request,
+				   ldap_handle_t **pconn,
+				   char const *dn, int scope, char const *filter, char const * const *attrs,
+				   LDAPControl **serverctrls, LDAPControl **clientctrls)
+{
+	ldap_rcode_t	status;
+
+	struct timeval	tv;		// Holds timeout values.
+
+	char const 	*error = NULL;
+	char		*extra = NULL;
+
+	int 		i;
+
+	int		conn_available;
+
+	LDAPControl	*our_serverctrls[LDAP_MAX_CONTROLS];
+	LDAPControl	*our_clientctrls[LDAP_MAX_CONTROLS];
+
+	char		**search_attrs;
+
+	rlm_ldap_control_merge(our_serverctrls, our_clientctrls,
+			       sizeof(our_serverctrls) / sizeof(*our_serverctrls),
+			       sizeof(our_clientctrls) / sizeof(*our_clientctrls),
+			       *pconn, serverctrls, clientctrls);
+
+	rad_assert(*pconn && (*pconn)->handle);
+
+	if (RDEBUG_ENABLED4) rlm_ldap_timeout_debug(inst, request, *pconn, NULL, __FUNCTION__);
+
+	/*
+	 *	OpenLDAP library doesn't declare attrs array as const, but
+	 *	it really should be *sigh*.
+	 */
+	memcpy(&search_attrs, &attrs, sizeof(attrs));
+
+	/*
+	 *	Do all searches as the admin user.
+	 */
+	if ((*pconn)->rebound) {
+		status = rlm_ldap_bind(inst, request, pconn, (*pconn)->pool_inst->admin_identity,
+				       (*pconn)->pool_inst->admin_password, &(*pconn)->pool_inst->admin_sasl, true,
+				       NULL, NULL, NULL);
+		if (status != LDAP_PROC_SUCCESS) return LDAP_PROC_ERROR;
+
+		rad_assert(*pconn);
+
+		(*pconn)->rebound = false;
+	}
+
+	if (filter) {
+		RDEBUG("Performing search in \"%s\" with filter \"%s\", scope \"%s\"", dn, filter,
+		       fr_int2str(ldap_scope, scope, "<INVALID>"));
+	} else {
+		RDEBUG("Performing unfiltered search in \"%s\", scope \"%s\"", dn,
+		       fr_int2str(ldap_scope, scope, "<INVALID>"));
+	}
+
+	memset(&tv, 0, sizeof(tv));
+	tv.tv_sec = inst->res_timeout;
+
+	conn_available = fr_connection_pool_state(inst->pool)->num;
+
+	/*
+	 *	Only errors sending the search are dealt with here,
+	 *	errors in the result are dealt with by
+	 *	rlm_ldap_search_async_result.
+	 */
+	for (i = conn_available; i >= 0; i--) {
+		int chase = 0;
+
+		if (!(*pconn)->referrals_off &&
+		    (ldap_get_option((*pconn)->handle, LDAP_OPT_REFERRALS, &chase) == LDAP_OPT_SUCCESS) && chase) {
+			if (ldap_set_option((*pconn)->handle, LDAP_OPT_REFERRALS, LDAP_OPT_OFF) != LDAP_OPT_SUCCESS) {
+				REDEBUG("Failed disabling referral chasing: %s", rlm_ldap_error_str(*pconn));
+				return LDAP_PROC_ERROR;
+			}
+			(*pconn)->referrals_off = true;
+		}
+
+		if (ldap_search_ext((*pconn)->handle, dn, scope, filter, search_attrs,
+				    0, our_serverctrls, our_clientctrls, &tv, 0, msgid) == LDAP_SUCCESS) {
+			return LDAP_PROC_SUCCESS;
+		}
+
+		status = rlm_ldap_result(inst, *pconn, -1, dn, NULL, NULL, &error, &extra);
+		switch (status) {
+		case LDAP_PROC_RETRY:
+			*pconn = fr_connection_reconnect(inst->pool, request, *pconn);
+			if (*pconn) {
+				RWDEBUG("Search failed: %s. Got new socket, retrying...", error);
+
+				talloc_free(extra); /* don't leak debug info */
+
+				continue;
+			}
+
+			status = LDAP_PROC_ERROR;
+
+			/* FALL-THROUGH */
+		default:
+			if (status >= 0) {				/* no error was recorded */
+				status = LDAP_PROC_ERROR;
+				error = "Unknown error";
+			}
+
+			REDEBUG("Failed performing search: %s", error);
+			if (extra) REDEBUG("%s", extra);
+			talloc_free(extra);
+
+			return status;
+		}
+	}
+
+	REDEBUG("Hit reconnection limit");
+
+	return LDAP_PROC_ERROR;
+}
+
+/** Collect the result of a search sent with #rlm_ldap_search_async, without blocking
+ *
+ * Should be called when the connection's file descriptor becomes readable.  libldap buffers
+ * partial results internally, so this may be called as many times as required.
+ *
+ * @param[out] result Where to store the result. Must be freed with ldap_msgfree if LDAP_PROC_SUCCESS is returned.
+ * @param[in] inst rlm_ldap configuration.
+ * @param[in] request Current request.
+ * @param[in] conn the search was sent on.
+ * @param[in] msgid of the search.
+ * @param[in] dn used as the base for the search.
+ * @return
+ *	- LDAP_PROC_CONTINUE if the complete result hasn't been received yet.
+ *	- LDAP_PROC_RETRY if the connection failed, and should be reconnected before the search is retried.
+ *	- LDAP_PROC_REFERRAL if the server returned a referral, which would have been chased.
+ *	- One of the other LDAP_PROC_* (#ldap_rcode_t) values, as for #rlm_ldap_search.
+ */
+ldap_rcode_t rlm_ldap_search_async_result(LDAPMessage **result, rlm_ldap_t const *inst, REQUEST *request,
+					  ldap_handle_t const *conn, int msgid, char const *dn)
+{
+	ldap_rcode_t	status;
+
+	int		lib_errno;
+	int		count;
+
+	struct timeval	tv = { 0, 0 };	// Poll, don't block.
+
+	char const 	*error = NULL;
+	char		*extra = NULL;
+
+	*result = NULL;
+
+	lib_errno = ldap_result(conn->handle, msgid, 1, &tv, result);
+	if (lib_errno == 0) return LDAP_PROC_CONTINUE;
+
+	if (lib_errno == -1) {
+		ldap_get_option(conn->handle, LDAP_OPT_ERROR_NUMBER, &lib_errno);
+	} else {
+		lib_errno = LDAP_SUCCESS;
+	}
+
+	/*
+	 *	If libldap would have chased a referral, or a search
+	 *	reference, let the caller repeat the search so that it
+	 *	does.
+	 */
+	if ((lib_errno == LDAP_SUCCESS) && conn->referrals_off) {
+		int srv_errno = LDAP_SUCCESS;
+
+		(void) ldap_parse_result(conn->handle, *result, &srv_errno, NULL, NULL, NULL, NULL, 0);
+		if ((srv_errno == LDAP_REFERRAL) || (ldap_count_references(conn->handle, *result) > 0)) {
+			RDEBUG("Search returned a referral");
+			ldap_msgfree(*result);
+			*result = NULL;
+
+			return LDAP_PROC_REFERRAL;
+		}
+	}
+
+	status = rlm_ldap_result_parse(inst, conn, lib_errno, dn, result, false, &error, &extra);
+	switch (status) {
+	case LDAP_PROC_SUCCESS:
+		break;
+
+	/*
+	 *	Invalid DN isn't a failure when searching.
+	 */
+	case LDAP_PROC_BAD_DN:
+		RDEBUG("%s", error);
+		if (extra) RDEBUG("%s", extra);
+		goto finish;
+
+	case LDAP_PROC_RETRY:
+		RWDEBUG("Search failed: %s", error);
+		if (extra) RWDEBUG("%s", extra);
+		goto finish;
+
+	default:
+		REDEBUG("Failed performing search: %s", error);
+		if (extra) REDEBUG("%s", extra);
+		goto finish;
+	}
+
+	count = ldap_count_entries(conn->handle, *result);
+	if (count < 0) {
+		REDEBUG("Error counting results: %s", rlm_ldap_error_str(conn));
+		status = LDAP_PROC_ERROR;
+	} else if (count == 0) {
+		RDEBUG("Search returned no results");
+		status = LDAP_PROC_NO_RESULT;
+	}
+
+	if (status != LDAP_PROC_SUCCESS) {
+		ldap_msgfree(*result);
+		*result = NULL;
+	}
+
+finish:
+	talloc_free(extra);
+
+	return status;
+}
+
+/** Finish with a search sent with #rlm_ldap_search_async
+ *
+ * Abandons the search if it's still in progress, and turns referral chasing back on if it
+ * was turned off for the search.
+ *
+ * @param[in] conn the search was sent on.
+ * @param[in] msgid of the search, or -1 if its result has been collected.
+ */
+void rlm_ldap_search_async_end(ldap_handle_t *conn, int msgid)
+{
+	if (msgid >= 0) (void) ldap_abandon_ext(conn->handle, msgid, NULL, NULL);
+
+	if (conn->referrals_off) {
+		(void) ldap_set_option(conn->handle, LDAP_OPT_REFERRALS, LDAP_OPT_ON);
+		conn->referrals_off = false;
+	}
+}
+
 /** Modify something in the LDAP directory
  *
  * Binds as the administrative user and attempts to modify an LDAP object.
@@ -1274,10 +1563,8 @@ char const *rlm_ldap_find_user(rlm_ldap_t const *inst, REQUEST *request, ldap_ha
 
 	ldap_rcode_t	status;
 	VALUE_PAIR	*vp = NULL;
-	LDAPMessage	*tmp_msg = NULL, *entry = NULL;
-	int		ldap_errno;
-	int		cnt;
-	char		*dn = NULL;
+	LDAPMessage	*tmp_msg = NULL;
+	char const	*dn;
 	char const	*filter = NULL;
 	char	    	filter_buff[LDAP_MAX_FILTER_STR_LEN];
 	char const	*base_dn;
@@ -1364,46 +1651,128 @@ char const *rlm_ldap_find_user(rlm_ldap_t const *inst, REQUEST *request, ldap_ha
 
 	rad_assert(*pconn);
 
+	dn = rlm_ldap_find_user_result(inst, request, *pconn, *result, rcode);
+	if ((freeit || (*rcode != RLM_MODULE_OK)) && *result) {
+		ldap_msgfree(*result);
+		*result = NULL;
+	}
+
+	return dn;
+}
+
+/** Send a search for a user object, without waiting for the result
+ *
+ * The asynchronous equivalent of #rlm_ldap_find_user, used to search for the user object when the
+ * request can be yielded.  The result should be collected with #rlm_ldap_search_async_result,
+ * and processed with #rlm_ldap_find_user_result.
+ *
+ * @param[out] msgid of the search.
+ * @param[out] base_dn the search was performed in, allocated in the context of the request.
+ * @param[in] inst rlm_ldap configuration.
+ * @param[in] request Current request.
+ * @param[in,out] pconn to use. May change as this function calls functions which auto re-connect.
+ * @param[in] attrs Additional attributes to retrieve, may be NULL.
+ * @return
+ *	- #RLM_MODULE_OK if the search was sent.
+ *	- #RLM_MODULE_INVALID if the filter or base DN couldn't be expanded.
+ *	- #RLM_MODULE_FAIL if the search couldn't be sent.
+ */
+rlm_rcode_t rlm_ldap_find_user_async(int *msgid, char **base_dn, rlm_ldap_t const *inst, REQUEST *request,
+				     ldap_handle_t **pconn, char const *attrs[])
+{
+	char		*filter = NULL;
+	LDAPControl	*serverctrls[] = { inst->userobj_sort_ctrl, NULL };
+	ldap_rcode_t	status;
+
+	*base_dn = NULL;
+
+	if (inst->userobj_filter) {
+		if (tmpl_aexpand(request, &filter, request, inst->userobj_filter, rlm_ldap_escape_func, NULL) < 0) {
+			REDEBUG("Unable to create filter");
+			return RLM_MODULE_INVALID;
+		}
+	}
+
+	if (tmpl_aexpand(request, base_dn, request, inst->userobj_base_dn, rlm_ldap_escape_func, NULL) < 0) {
+		REDEBUG("Unable to create base_dn");
+		talloc_free(filter);
+		return RLM_MODULE_INVALID;
+	}
+
+	status = rlm_ldap_search_async(msgid, inst, request, pconn, *base_dn, inst->userobj_scope, filter,
+				       attrs, serverctrls, NULL);
+	talloc_free(filter);
+	if (status != LDAP_PROC_SUCCESS) {
+		TALLOC_FREE(*base_dn);
+		return RLM_MODULE_FAIL;
+	}
+
+	return RLM_MODULE_OK;
+}
+
+/** Process the result of a user object search
+ *
+ * Checks the result contains a single user object, and adds its DN to the request as
+ * &control:LDAP-UserDN.
+ *
+ * @param[in] inst rlm_ldap configuration.
+ * @param[in] request Current request.
+ * @param[in] conn the search was performed on.
+ * @param[in] result of the search, containing at least one entry.  Is not freed.
+ * @param[out] rcode The status of the operation, one of the RLM_MODULE_* codes.
+ * @return The user's DN or NULL on error.
+ */
+char const *rlm_ldap_find_user_result(rlm_ldap_t const *inst, REQUEST *request, ldap_handle_t const *conn,
+				      LDAPMessage *result, rlm_rcode_t *rcode)
+{
+	VALUE_PAIR	*vp = NULL;
+	LDAPMessage	*entry = NULL;
+	int		ldap_errno;
+	int		cnt;
+	char		*dn = NULL;
+
+	*rcode = RLM_MODULE_FAIL;
+
 	/*
 	 *	Forbid the use of unsorted search results that
 	 *	contain multiple entries, as it's a potential
 	 *	security issue, and likely non deterministic.
 	 */
 	if (!inst->userobj_sort_ctrl) {
-		cnt = ldap_count_entries((*pconn)->handle, *result);
+		cnt = ldap_count_entries(conn->handle, result);
 		if (cnt > 1) {
 			REDEBUG("Ambiguous search result, returned %i unsorted entries (should return 1 or 0).  "
 				"Enable sorting, or specify a more restrictive base_dn, filter or scope", cnt);
 			REDEBUG("The following entries were returned:");
 			RINDENT();
-			for (entry = ldap_first_entry((*pconn)->handle, *result);
+			for (entry = ldap_first_entry(conn->handle, result);
 			     entry;
-			     entry = ldap_next_entry((*pconn)->handle, entry)) {
-				dn = ldap_get_dn((*pconn)->handle, entry);
+			     entry = ldap_next_entry(conn->handle, entry)) {
+				dn = ldap_get_dn(conn->handle, entry);
 				REDEBUG("%s", dn);
 				ldap_memfree(dn);
 			}
 			REXDENT();
 			*rcode = RLM_MODULE_INVALID;
-			goto finish;
+			return NULL;
 		}
 	}
 
-	entry = ldap_first_entry((*pconn)->handle, *result);
+	entry = ldap_first_entry(conn->handle, result);
 	if (!entry) {
-		ldap_get_option((*pconn)->handle, LDAP_OPT_RESULT_CODE, &ldap_errno);
+		ldap_get_option(conn->handle, LDAP_OPT_RESULT_CODE, &ldap_errno);
 		REDEBUG("Failed retrieving entry: %s",
 			ldap_err2string(ldap_errno));
 
-		goto finish;
+		return NULL;
 	}
 
-	dn = ldap_get_dn((*pconn)->handle, entry);
+	dn = ldap_get_dn(conn->handle, entry);
 	if (!dn) {
-		ldap_get_option((*pconn)->handle, LDAP_OPT_RESULT_CODE, &ldap_errno);
+		ldap_get_option(conn->handle, LDAP_OPT_RESULT_CODE, &ldap_errno);
 		REDEBUG("Retrieving object DN from entry failed: %s", ldap_err2string(ldap_errno));
 
-		goto finish;
+		return NULL;
 	}
 	rlm_ldap_normalise_dn(dn, dn);
 
@@ -1423,12 +1792,6 @@ char const *rlm_ldap_find_user(rlm_ldap_t const *inst, REQUEST *request, ldap_ha
 	}
 	ldap_memfree(dn);
 
-finish:
-	if ((freeit || (*rcode != RLM_MODULE_OK)) && *result) {
-		ldap_msgfree(*result);
-		*result = NULL;
-	}
-
 	return vp ? vp->vp_strvalue : NULL;
 }
 
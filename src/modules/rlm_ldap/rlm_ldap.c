@@ -879,57 +879,32 @@ free_result:
 	return rcode;
 }
 
-static rlm_rcode_t mod_authorize(void *instance, UNUSED void *thread, REQUEST *request) CC_HINT(nonnull);
-static rlm_rcode_t mod_authorize(void *instance, UNUSED void *thread, REQUEST *request)
+/** Apply the user object found by mod_authorize
+ *
+ * Checks access, caches group memberships, retrieves eDirectory passwords, applies profiles,
+ * and maps attributes from the user object into the request.
+ *
+ * @param[in] inst		rlm_ldap configuration.
+ * @param[in] request		Current request.
+ * @param[in,out] pconn		to use. May change as this function calls functions which auto re-connect.
+ * @param[in] dn		of the user object.
+ * @param[in] result		of the user object search.
+ * @param[in] expanded		attribute maps.
+ * @return One of the RLM_MODULE_* values.
+ */
+static rlm_rcode_t mod_authorize_user(rlm_ldap_t const *inst, REQUEST *request, ldap_handle_t **pconn,
+				      char const *dn, LDAPMessage *result, rlm_ldap_map_exp_t *expanded)
 {
 	rlm_rcode_t		rcode = RLM_MODULE_OK;
+#ifdef WITH_EDIR
 	ldap_rcode_t		status;
+	VALUE_PAIR		*vp;
+#endif
 	int			ldap_errno;
 	int			i;
-	rlm_ldap_t const	*inst = instance;
 	struct berval		**values;
-	VALUE_PAIR		*vp;
-	ldap_handle_t		*conn;
-	LDAPMessage		*result, *entry;
-	char const 		*dn = NULL;
-	rlm_ldap_map_exp_t	expanded; /* faster than allocing every time */
-
-	/*
-	 *	Don't be tempted to add a check for request->username
-	 *	or request->password here. rlm_ldap.authorize can be used for
-	 *	many things besides searching for users.
-	 */
-
-	if (rlm_ldap_map_expand(&expanded, request, inst->user_map) < 0) return RLM_MODULE_FAIL;
-
-	conn = mod_conn_get(inst, request);
-	if (!conn) return RLM_MODULE_FAIL;
-
-	/*
-	 *	Add any additional attributes we need for checking access, memberships, and profiles
-	 */
-	if (inst->userobj_access_attr) {
-		expanded.attrs[expanded.count++] = inst->userobj_access_attr;
-	}
-
-	if (inst->userobj_membership_attr && (inst->cacheable_group_dn || inst->cacheable_group_name)) {
-		expanded.attrs[expanded.count++] = inst->userobj_membership_attr;
-	}
-
-	if (inst->profile_attr) {
-		expanded.attrs[expanded.count++] = inst->profile_attr;
-	}
-
-	if (inst->valuepair_attr) {
-		expanded.attrs[expanded.count++] = inst->valuepair_attr;
-	}
-
-	expanded.attrs[expanded.count] = NULL;
-
-	dn = rlm_ldap_find_user(inst, request, &conn, expanded.attrs, true, &result, &rcode);
-	if (!dn) {
-		goto finish;
-	}
+	ldap_handle_t		*conn = *pconn;
+	LDAPMessage		*entry;
 
 	entry = ldap_first_entry(conn->handle, result);
 	if (!entry) {
@@ -1060,7 +1035,7 @@ skip_edir:
 			goto finish;
 		}
 
-		switch (rlm_ldap_map_profile(inst, request, &conn, profile, &expanded)) {
+		switch (rlm_ldap_map_profile(inst, request, &conn, profile, expanded)) {
 		case RLM_MODULE_INVALID:
 			rcode = RLM_MODULE_INVALID;
 			goto finish;
@@ -1088,7 +1063,7 @@ skip_edir:
 				char *value;
 
 				value = rlm_ldap_berval_to_string(request, values[i]);
-				ret = rlm_ldap_map_profile(inst, request, &conn, value, &expanded);
+				ret = rlm_ldap_map_profile(inst, request, &conn, value, expanded);
 				talloc_free(value);
 				if (ret == RLM_MODULE_FAIL) {
 					ldap_value_free_len(values);
@@ -1104,15 +1079,339 @@ skip_edir:
 	if (inst->user_map || inst->valuepair_attr) {
 		RDEBUG("Processing user attributes");
 		RINDENT();
-		if (rlm_ldap_map_do(inst, request, conn->handle, &expanded, entry) > 0) rcode = RLM_MODULE_UPDATED;
+		if (rlm_ldap_map_do(inst, request, conn->handle, expanded, entry) > 0) rcode = RLM_MODULE_UPDATED;
 		REXDENT();
 		rlm_ldap_check_reply(inst, request, conn);
 	}
 
 finish:
-	talloc_free(expanded.ctx);
-	if (result) ldap_msgfree(result);
-	mod_conn_release(inst, request, conn);
+	*pconn = conn;
+
+	return rcode;
+}
+
+/** State of a user object search, held across the yield in mod_authorize
+ */
+typedef struct ldap_autz_ctx {
+	rlm_ldap_map_exp_t	expanded;			//!< Attributes to retrieve, and maps to apply.
+	ldap_handle_t		*conn;				//!< Held until the request is resumed or cancelled.
+	int			fd;				//!< libldap's socket, or -1 once we've stopped
+								//!< watching it.
+	int			msgid;				//!< Of the search, or -1 once it's complete.
+	int			retries;			//!< How many more times the search may be sent
+								//!< on a new connection.
+	char			*dn;				//!< Base DN of the search.
+	ldap_rcode_t		status;				//!< Of the search, once it's complete.
+	LDAPMessage		*result;			//!< Of the search, once it's complete.
+} ldap_autz_ctx_t;
+
+/** Release everything held by an asynchronous user object search
+ *
+ * @param[in] inst		rlm_ldap configuration.
+ * @param[in] request		the search was performed for.
+ * @param[in] autz		to free.
+ */
+static void mod_authorize_free(rlm_ldap_t const *inst, REQUEST *request, ldap_autz_ctx_t *autz)
+{
+	if (autz->fd >= 0) {
+		(void) unlang_event_fd_delete(request, autz, autz->fd);
+		(void) unlang_event_timeout_delete(request, autz);
+	}
+
+	if (autz->conn) rlm_ldap_search_async_end(autz->conn, autz->msgid);
+	if (autz->result) ldap_msgfree(autz->result);
+
+	mod_conn_release(inst, request, autz->conn);
+
+	talloc_free(autz->expanded.ctx);
+	talloc_free(autz->dn);
+	talloc_free(autz);
+}
+
+/** Collect the result of the user object search when libldap's socket becomes readable
+ *
+ * @param[in] request		the search was performed for.
+ * @param[in] instance		rlm_ldap configuration.
+ * @param[in] thread		Thread specific module instance.
+ * @param[in] ctx		ldap_autz_ctx_t of the search.
+ * @param[in] fd		libldap's socket.
+ */
+static void mod_authorize_read(REQUEST *request, void *instance, UNUSED void *thread, void *ctx, int fd)
+{
+	rlm_ldap_t const	*inst = instance;
+	ldap_autz_ctx_t		*autz = talloc_get_type_abort(ctx, ldap_autz_ctx_t);
+	ldap_rcode_t		status;
+
+	/*
+	 *	Large results may take several reads.
+	 */
+	status = rlm_ldap_search_async_result(&autz->result, inst, request, autz->conn, autz->msgid, autz->dn);
+	if (status == LDAP_PROC_CONTINUE) return;
+
+	autz->status = status;
+	autz->msgid = -1;
+	rlm_ldap_search_async_end(autz->conn, -1);
+
+	(void) unlang_event_timeout_delete(request, autz);
+	(void) unlang_event_fd_delete(request, autz, fd);
+	autz->fd = -1;
+
+	unlang_resumable(request);
+}
+
+/** Give up on the user object search if the server doesn't respond in time
+ *
+ * @param[in] request		the search was performed for.
+ * @param[in] instance		rlm_ldap configuration.
+ * @param[in] thread		Thread specific module instance.
+ * @param[in] ctx		ldap_autz_ctx_t of the search.
+ * @param[in] fired		When the timeout fired.
+ */
+static void mod_authorize_timeout(REQUEST *request, void *instance, UNUSED void *thread, void *ctx,
+				  UNUSED struct timeval *fired)
+{
+	rlm_ldap_t const	*inst = instance;
+	ldap_autz_ctx_t		*autz = talloc_get_type_abort(ctx, ldap_autz_ctx_t);
+
+	REDEBUG("Timed out waiting for user object search result");
+	trigger_exec(NULL, inst->cs, "modules.ldap.timeout", true, NULL);
+
+	rlm_ldap_search_async_end(autz->conn, autz->msgid);
+	autz->status = LDAP_PROC_RETRY;
+	autz->msgid = -1;
+
+	/*
+	 *	The timeout event is freed when we return.
+	 */
+	(void) unlang_event_fd_delete(request, autz, autz->fd);
+	autz->fd = -1;
+
+	unlang_resumable(request);
+}
+
+static rlm_rcode_t mod_authorize_resume(REQUEST *request, void *instance, UNUSED void *thread, void *ctx);
+static void mod_authorize_action(REQUEST *request, void *instance, UNUSED void *thread, void *ctx,
+				 fr_state_action_t action);
+
+/** Send the user object search, and yield until its result arrives
+ *
+ * Called when the module is first run, and again from the resume callback if the search has
+ * to be retried on a new connection.
+ *
+ * @param[in] inst		rlm_ldap configuration.
+ * @param[in] request		to perform the search for.
+ * @param[in] autz		State of the search.
+ * @return
+ *	- #RLM_MODULE_YIELD if the search was sent.
+ *	- Another RLM_MODULE_* value if it couldn't be.  The caller frees autz.
+ */
+static rlm_rcode_t mod_authorize_search(rlm_ldap_t const *inst, REQUEST *request, ldap_autz_ctx_t *autz)
+{
+	rlm_rcode_t		rcode;
+	struct timeval		now, when;
+
+	rcode = rlm_ldap_find_user_async(&autz->msgid, &autz->dn, inst, request, &autz->conn, autz->expanded.attrs);
+	if (rcode != RLM_MODULE_OK) return rcode;
+
+	if ((ldap_get_option(autz->conn->handle, LDAP_OPT_DESC, &autz->fd) != LDAP_OPT_SUCCESS) || (autz->fd < 0)) {
+		REDEBUG("Failed retrieving LDAP connection's file descriptor");
+		autz->fd = -1;
+		return RLM_MODULE_FAIL;
+	}
+
+	if (unlang_event_fd_readable_add(request, mod_authorize_read, autz, autz->fd) < 0) {
+		REDEBUG("Failed adding LDAP connection's file descriptor to the event list");
+		autz->fd = -1;
+		return RLM_MODULE_FAIL;
+	}
+
+	gettimeofday(&now, NULL);
+	when.tv_sec = inst->res_timeout;
+	when.tv_usec = 0;
+	fr_timeval_add(&when, &now, &when);
+
+	if (unlang_event_timeout_add(request, mod_authorize_timeout, autz, &when) < 0) {
+		REDEBUG("Failed adding LDAP search timeout");
+		(void) unlang_event_fd_delete(request, autz, autz->fd);
+		autz->fd = -1;
+		return RLM_MODULE_FAIL;
+	}
+
+	return unlang_yield(request, mod_authorize_resume, mod_authorize_action, autz);
+}
+
+/** Continue authorization once the user object search is complete
+ *
+ * @param[in] request		the search was performed for.
+ * @param[in] instance		rlm_ldap configuration.
+ * @param[in] thread		Thread specific module instance.
+ * @param[in] ctx		ldap_autz_ctx_t of the search.
+ * @return One of the RLM_MODULE_* values.
+ */
+static rlm_rcode_t mod_authorize_resume(REQUEST *request, void *instance, UNUSED void *thread, void *ctx)
+{
+	rlm_ldap_t const	*inst = instance;
+	ldap_autz_ctx_t		*autz = talloc_get_type_abort(ctx, ldap_autz_ctx_t);
+	rlm_rcode_t		rcode;
+	char const		*dn = NULL;
+
+	switch (autz->status) {
+	case LDAP_PROC_SUCCESS:
+		dn = rlm_ldap_find_user_result(inst, request, autz->conn, autz->result, &rcode);
+		break;
+
+	case LDAP_PROC_BAD_DN:
+	case LDAP_PROC_NO_RESULT:
+		rcode = RLM_MODULE_NOTFOUND;
+		break;
+
+	/*
+	 *	The connection failed, or the server didn't respond
+	 *	in time.  Get a new connection, send the search again,
+	 *	and wait for it as before.
+	 */
+	case LDAP_PROC_RETRY:
+		if (autz->retries-- <= 0) {
+			REDEBUG("Hit reconnection limit");
+			rcode = RLM_MODULE_FAIL;
+			break;
+		}
+
+		autz->conn = fr_connection_reconnect(inst->pool, request, autz->conn);
+		if (!autz->conn) {
+			rcode = RLM_MODULE_FAIL;
+			break;
+		}
+
+		RWDEBUG("Got new socket, retrying...");
+
+		TALLOC_FREE(autz->dn);
+		rcode = mod_authorize_search(inst, request, autz);
+		if (rcode == RLM_MODULE_YIELD) return rcode;
+		break;
+
+	/*
+	 *	Referral chasing was off while we waited.  libldap
+	 *	chases referrals on connections we can't watch, so
+	 *	the search is repeated synchronously, with chasing on.
+	 *	This blocks the worker until the search completes.
+	 */
+	case LDAP_PROC_REFERRAL:
+		RDEBUG2("Repeating search synchronously to follow referral");
+		dn = rlm_ldap_find_user(inst, request, &autz->conn, autz->expanded.attrs, true, &autz->result, &rcode);
+		break;
+
+	default:
+		rcode = RLM_MODULE_FAIL;
+		break;
+	}
+
+	if (dn) rcode = mod_authorize_user(inst, request, &autz->conn, dn, autz->result, &autz->expanded);
+
+	mod_authorize_free(inst, request, autz);
+
+	return rcode;
+}
+
+/** Cancel the user object search if the request is stopped
+ *
+ * @param[in] request		being cancelled.
+ * @param[in] instance		rlm_ldap configuration.
+ * @param[in] thread		Thread specific module instance.
+ * @param[in] ctx		ldap_autz_ctx_t of the search.
+ * @param[in] action		What happened.
+ */
+static void mod_authorize_action(REQUEST *request, void *instance, UNUSED void *thread, void *ctx,
+				 fr_state_action_t action)
+{
+	rlm_ldap_t const	*inst = instance;
+	ldap_autz_ctx_t		*autz = talloc_get_type_abort(ctx, ldap_autz_ctx_t);
+
+	if (action != FR_ACTION_DONE) return;
+
+	RDEBUG("Cancelling pending user object search");
+
+	mod_authorize_free(inst, request, autz);
+}
+
+static rlm_rcode_t mod_authorize(void *instance, UNUSED void *thread, REQUEST *request) CC_HINT(nonnull);
+static rlm_rcode_t mod_authorize(void *instance, UNUSED void *thread, REQUEST *request)
+{
+	rlm_rcode_t		rcode = RLM_MODULE_OK;
+	rlm_ldap_t const	*inst = instance;
+	ldap_autz_ctx_t		*autz;
+	char const 		*dn;
+
+	/*
+	 *	Don't be tempted to add a check for request->username
+	 *	or request->password here. rlm_ldap.authorize can be used for
+	 *	many things besides searching for users.
+	 */
+
+	MEM(autz = talloc_zero(request, ldap_autz_ctx_t));
+	autz->fd = -1;
+	autz->msgid = -1;
+
+	if (rlm_ldap_map_expand(&autz->expanded, request, inst->user_map) < 0) {
+		talloc_free(autz);
+		return RLM_MODULE_FAIL;
+	}
+
+	autz->conn = mod_conn_get(inst, request);
+	if (!autz->conn) {
+		rcode = RLM_MODULE_FAIL;
+		goto finish;
+	}
+
+	/*
+	 *	Add any additional attributes we need for checking access, memberships, and profiles
+	 */
+	if (inst->userobj_access_attr) {
+		autz->expanded.attrs[autz->expanded.count++] = inst->userobj_access_attr;
+	}
+
+	if (inst->userobj_membership_attr && (inst->cacheable_group_dn || inst->cacheable_group_name)) {
+		autz->expanded.attrs[autz->expanded.count++] = inst->userobj_membership_attr;
+	}
+
+	if (inst->profile_attr) {
+		autz->expanded.attrs[autz->expanded.count++] = inst->profile_attr;
+	}
+
+	if (inst->valuepair_attr) {
+		autz->expanded.attrs[autz->expanded.count++] = inst->valuepair_attr;
+	}
+
+	autz->expanded.attrs[autz->expanded.count] = NULL;
+
+	/*
+	 *	Without an event list there's nothing to yield to.
+	 */
+	if (!request->el) {
+		dn = rlm_ldap_find_user(inst, request, &autz->conn, autz->expanded.attrs, true, &autz->result, &rcode);
+		if (dn) rcode = mod_authorize_user(inst, request, &autz->conn, dn, autz->result, &autz->expanded);
+
+		goto finish;
+	}
+
+	/*
+	 *	Send the search, and yield until libldap's socket
+	 *	becomes readable, so the worker can process other
+	 *	requests in the meantime.  If the connection fails,
+	 *	or the search times out, it's sent again on a new
+	 *	connection, as many times as rlm_ldap_search would.
+	 *
+	 *	Only the user object search is done this way.  Group,
+	 *	profile and eDirectory lookups in mod_authorize_user,
+	 *	and following referrals, still block the worker.
+	 */
+	autz->retries = fr_connection_pool_state(inst->pool)->num;
+
+	rcode = mod_authorize_search(inst, request, autz);
+	if (rcode == RLM_MODULE_YIELD) return rcode;
+
+finish:
+	mod_authorize_free(inst, request, autz);
 
 	return rcode;
 }
@@ -407,6 +407,8 @@ typedef struct ldap_handle {
 							//!< other than the admin user.
 	bool		referred;			//!< Whether the connection is now established a server
 							//!< other than the configured one.
+	bool		referrals_off;			//!< Referral chasing was turned off for an asynchronous
+							//!< search, and must be turned back on when it's done.
 
 	rlm_ldap_control_t serverctrls[LDAP_MAX_CONTROLS + 1];	//!< Server controls to use for all operations with
 								//!< this handle.
@@ -462,7 +464,10 @@ typedef enum {
 
 	LDAP_PROC_BAD_DN = -5,				//!< Specified an invalid object in a bind or search DN.
 
-	LDAP_PROC_NO_RESULT = -6			//!< Got no results.
+	LDAP_PROC_NO_RESULT = -6,			//!< Got no results.
+
+	LDAP_PROC_REFERRAL = -7				//!< Asynchronous search was referred elsewhere, caller
+							//!< should repeat it synchronously to follow the referral.
 } ldap_rcode_t;
 
 /*
@@ -502,6 +507,16 @@ ldap_rcode_t rlm_ldap_search(LDAPMessage **result, rlm_ldap_t const *inst, REQUE
 			     char const *dn, int scope, char const *filter, char const * const *attrs,
 			     LDAPControl **serverctrls, LDAPControl **clientctrls);
 
+ldap_rcode_t rlm_ldap_search_async(int *msgid, rlm_ldap_t const *inst, REQUEST *request,
+				   ldap_handle_t **pconn,
+				   char const *dn, int scope, char const *filter, char const * const *attrs,
+				   LDAPControl **serverctrls, LDAPControl **clientctrls);
+
+ldap_rcode_t rlm_ldap_search_async_result(LDAPMessage **result, rlm_ldap_t const *inst, REQUEST *request,
+					  ldap_handle_t const *conn, int msgid, char const *dn);
+
+void rlm_ldap_search_async_end(ldap_handle_t *conn, int msgid);
+
 ldap_rcode_t rlm_ldap_modify(rlm_ldap_t const *inst, REQUEST *request, ldap_handle_t **pconn,
 			     char const *dn, LDAPMod *mods[],
 			     LDAPControl **serverctrls, LDAPControl **clientctrls);
@@ -509,6 +524,12 @@ ldap_rcode_t rlm_ldap_modify(rlm_ldap_t const *inst, REQUEST *request, ldap_hand
 char const *rlm_ldap_find_user(rlm_ldap_t const *inst, REQUEST *request, ldap_handle_t **pconn,
 			       char const *attrs[], bool force, LDAPMessage **result, rlm_rcode_t *rcode);
 
+rlm_rcode_t rlm_ldap_find_user_async(int *msgid, char **base_dn, rlm_ldap_t const *inst, REQUEST *request,
+				     ldap_handle_t **pconn, char const *attrs[]);
+
+char const *rlm_ldap_find_user_result(rlm_ldap_t const *inst, REQUEST *request, ldap_handle_t const *conn,
+				      LDAPMessage *result, rlm_rcode_t *rcode);
+
 rlm_rcode_t rlm_ldap_check_access(rlm_ldap_t const *inst, REQUEST *request, ldap_handle_t const *conn,
 				  LDAPMessage *entry);
 
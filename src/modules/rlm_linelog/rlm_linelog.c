@@ -106,6 +106,11 @@ typedef struct linelog_instance_t {
 		exfile_t		*ef;			//!< Exclusive file access handle.
 		bool			escape;			//!< Do filename escaping, yes / no.
 		xlat_escape_t		escape_func;		//!< Escape function.
+
+		bool			write_behind;		//!< Hand writes off to a dedicated I/O thread.
+		uint32_t		buffer_size;		//!< Size of the write-behind buffer.
+		uint32_t		fsync_records;		//!< fsync() after this many records.
+		uint32_t		fsync_interval;		//!< fsync() at least this often.
 	} file;
 
 	struct {
@@ -129,6 +134,10 @@ static const CONF_PARSER file_config[] = {
 	{ FR_CONF_OFFSET("permissions", PW_TYPE_INTEGER, linelog_instance_t, file.permissions), .dflt = "0600" },
 	{ FR_CONF_OFFSET("group", PW_TYPE_STRING, linelog_instance_t, file.group_str) },
 	{ FR_CONF_OFFSET("escape_filenames", PW_TYPE_BOOLEAN, linelog_instance_t, file.escape), .dflt = "no" },
+	{ FR_CONF_OFFSET("write_behind", PW_TYPE_BOOLEAN, linelog_instance_t, file.write_behind), .dflt = "no" },
+	{ FR_CONF_OFFSET("buffer_size", PW_TYPE_INTEGER, linelog_instance_t, file.buffer_size), .dflt = "1048576" },
+	{ FR_CONF_OFFSET("fsync_records", PW_TYPE_INTEGER, linelog_instance_t, file.fsync_records), .dflt = "0" },
+	{ FR_CONF_OFFSET("fsync_interval", PW_TYPE_INTEGER, linelog_instance_t, file.fsync_interval), .dflt = "0" },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -342,6 +351,16 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 			return -1;
 		}
 
+		if (inst->file.write_behind) {
+			FR_INTEGER_BOUND_CHECK("buffer_size", inst->file.buffer_size, >=, 65536);
+
+			if (exfile_enable_write_behind(inst->file.ef, inst->file.buffer_size,
+						       inst->file.fsync_records, inst->file.fsync_interval) < 0) {
+				cf_log_err_cs(conf, "%s", fr_strerror());
+				return -1;
+			}
+		}
+
 		if (inst->file.group_str) {
 			char *endptr;
 
@@ -667,6 +686,20 @@ build_vector:
 			*p = '/';
 		}
 
+		/*
+		 *	Queue the data for the write-behind thread.
+		 */
+		if (inst->file.write_behind) {
+			if (exfile_write(inst->file.ef, request, path, inst->file.permissions,
+					 inst->file.group_str ? inst->file.group : (gid_t) -1,
+					 vector_p, vector_len) < 0) {
+				RERROR("Failed queueing data for \"%s\": %s", path, fr_strerror());
+				rcode = RLM_MODULE_FAIL;
+				goto finish;
+			}
+			break;
+		}
+
 		fd = exfile_open(inst->file.ef, request, path, inst->file.permissions, true);
 		if (fd < 0) {
 			RERROR("Failed to open %s: %s", path, fr_syserror(errno));
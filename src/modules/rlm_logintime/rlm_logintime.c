@@ -201,15 +201,10 @@ static rlm_rcode_t CC_HINT(nonnull) mod_authorize(void *instance, UNUSED void *t
  *	that must be referenced in later calls, store a handle to it
  *	in *instance otherwise put a null pointer there.
  */
-static int mod_instantiate(CONF_SECTION *conf, void *instance)
+static int mod_bootstrap(UNUSED CONF_SECTION *conf, void *instance)
 {
 	rlm_logintime_t *inst = instance;
 
-	if (inst->min_time == 0) {
-		cf_log_err_cs(conf, "Invalid value '0' for minimum_timeout");
-		return -1;
-	}
-
 	/*
 	 * Register a Current-Time comparison function
 	 */
@@ -219,6 +214,18 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 	return 0;
 }
 
+static int mod_instantiate(CONF_SECTION *conf, void *instance)
+{
+	rlm_logintime_t *inst = instance;
+
+	if (inst->min_time == 0) {
+		cf_log_err_cs(conf, "Invalid value '0' for minimum_timeout");
+		return -1;
+	}
+
+	return 0;
+}
+
 /*
  *	The module name should be the only globally exported symbol.
  *	That is, everything else should be 'static'.
@@ -234,6 +241,7 @@ rad_module_t rlm_logintime = {
 	.name		= "logintime",
 	.inst_size	= sizeof(rlm_logintime_t),
 	.config		= module_config,
+	.bootstrap	= mod_bootstrap,
 	.instantiate	= mod_instantiate,
 	.methods = {
 		[MOD_AUTHORIZE]		= mod_authorize,
@@ -35,6 +35,14 @@ src/tests/modules/default-input.attrs
 endif
 endef
 
+#
+#  Tests with a "THREADS: <num>" line are run in that many threads
+#  at once, if the server was built with thread support.
+#
+ifneq "$(findstring thread,${CFLAGS})" ""
+MODULE_TEST_THREADS = $$(grep THREADS: $< | awk '{ print "-t " $$3 }')
+endif
+
 #
 #  Files in the output dir depend on the unit tests
 #
@@ -52,11 +60,11 @@ endef
 $(BUILD_DIR)/tests/modules/%: src/tests/modules/%.unlang $(BUILD_DIR)/tests/modules/%.attrs $(TESTBINDIR)/unit_test_module | build.raddb
 	@mkdir -p $(dir $@)
 	@echo MODULE-TEST $(lastword $(subst /, ,$(dir $@))) $(basename $(notdir $@))
-	@if ! MODULE_TEST_DIR=$(dir $<) MODULE_TEST_UNLANG=$< $(TESTBIN)/unit_test_module -D share -d src/tests/modules/ -i $@.attrs -f $@.attrs -xxx > $@.log 2>&1; then \
+	@if ! MODULE_TEST_DIR=$(dir $<) MODULE_TEST_UNLANG=$< $(TESTBIN)/unit_test_module $(MODULE_TEST_THREADS) -D share -d src/tests/modules/ -i $@.attrs -f $@.attrs -xxx > $@.log 2>&1; then \
 		if ! grep ERROR $< 2>&1 > /dev/null; then \
 			cat $@.log; \
 			echo "# $@.log"; \
-			echo MODULE_TEST_DIR=$(dir $<) MODULE_TEST_UNLANG=$< $(TESTBIN)/unit_test_module -D share -d src/tests/modules/ -i $@.attrs -f $@.attrs -xx; \
+			echo MODULE_TEST_DIR=$(dir $<) MODULE_TEST_UNLANG=$< $(TESTBIN)/unit_test_module $(MODULE_TEST_THREADS) -D share -d src/tests/modules/ -i $@.attrs -f $@.attrs -xx; \
 			exit 1; \
 		fi; \
 		FOUND=$$(grep ^$< $@.log | head -1 | sed 's/:.*//;s/.*\[//;s/\].*//'); \
@@ -64,7 +72,7 @@ $(BUILD_DIR)/tests/modules/%: src/tests/modules/%.unlang $(BUILD_DIR)/tests/modu
 		if [ "$$EXPECTED" != "$$FOUND" ]; then \
 			cat $@.log; \
 			echo "# $@.log"; \
-			echo MODULE_TEST_DIR=$(dir $<) MODULE_TEST_UNLANG=$< $(TESTBIN)/unit_test_module -D share -d src/tests/modules/ -i $@.attrs -f $@.attrs -xx; \
+			echo MODULE_TEST_DIR=$(dir $<) MODULE_TEST_UNLANG=$< $(TESTBIN)/unit_test_module $(MODULE_TEST_THREADS) -D share -d src/tests/modules/ -i $@.attrs -f $@.attrs -xx; \
 			exit 1; \
 		fi \
 	fi
@@ -0,0 +1,342 @@
+/*
+ * cache_serialize_test.c	Tests for binary rlm_cache entries
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * Copyright 2016  The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/rad_assert.h>
+
+#include "rlm_cache.h"
+#include "serialize.h"
+
+#ifdef HAVE_GETOPT_H
+#	include <getopt.h>
+#endif
+
+/*
+ *	Where the value of the first map starts in a binary entry.
+ */
+#define VALUE_OFFSET	(1 + 1 + 8 + 8 + 4 + 4 + 1 + 1 + 1 + 1 + 1 + 4)
+
+/*
+ *	Where the qualifiers, operator and length of the first map are.
+ */
+#define REQUEST_OFFSET	(1 + 1 + 8 + 8 + 4 + 4)
+#define LIST_OFFSET	(REQUEST_OFFSET + 1)
+#define OP_OFFSET	(REQUEST_OFFSET + 3)
+#define LENGTH_OFFSET	(REQUEST_OFFSET + 5)
+
+/*
+ *	One value of each type, and how it should look in a binary entry.
+ *	There's no timeval or decimal, as attributes can't be of those types.
+ */
+typedef struct {
+	PW_TYPE		type;
+	uint8_t		wire[32];
+	size_t		wire_len;
+} test_value_t;
+
+static int		debug_lvl = 0;
+
+static test_value_t const test_values[] = {
+	{ PW_TYPE_STRING,	{ 'h', 'e', 'l', 'l', 'o' }, 5 },
+	{ PW_TYPE_OCTETS,	{ 0x00, 0x01, 0xfe, 0xff }, 4 },
+	{ PW_TYPE_IPV4_ADDR,	{ 192, 0, 2, 1 }, 4 },
+	{ PW_TYPE_IPV4_PREFIX,	{ 0, 24, 192, 0, 2, 0 }, 6 },
+	{ PW_TYPE_IPV6_ADDR,	{ 0x20, 0x01, 0x0d, 0xb8, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x01 }, 16 },
+	{ PW_TYPE_IPV6_PREFIX,	{ 0, 64, 0x20, 0x01, 0x0d, 0xb8, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 }, 18 },
+	{ PW_TYPE_IFID,		{ 1, 2, 3, 4, 5, 6, 7, 8 }, 8 },
+	{ PW_TYPE_ETHERNET,	{ 0x00, 0x11, 0x22, 0x33, 0x44, 0x55 }, 6 },
+	{ PW_TYPE_BOOLEAN,	{ 1 }, 1 },
+	{ PW_TYPE_BYTE,		{ 0xa5 }, 1 },
+	{ PW_TYPE_SHORT,	{ 0x12, 0x34 }, 2 },
+	{ PW_TYPE_INTEGER,	{ 0x12, 0x34, 0x56, 0x78 }, 4 },
+	{ PW_TYPE_INTEGER64,	{ 0x01, 0x23, 0x45, 0x67, 0x89, 0xab, 0xcd, 0xef }, 8 },
+	{ PW_TYPE_SIZE,		{ 0, 0, 0, 0, 0x12, 0x34, 0x56, 0x78 }, 8 },
+	{ PW_TYPE_SIGNED,	{ 0xff, 0xff, 0xff, 0xfe }, 4 },
+	{ PW_TYPE_DATE,		{ 0x58, 0x00, 0x00, 0x01 }, 4 },
+	{ PW_TYPE_ABINARY,	{ 1, 0, 1, 0, 192, 0, 2, 1, 0, 0, 0, 0, 24, 0, 6, 0,
+				  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 }, 32 },
+};
+
+static void NEVER_RETURNS usage(void)
+{
+	fprintf(stderr, "usage: cache_serialize_test [OPTS]\n");
+	fprintf(stderr, "  -D <dict_dir>          Set the dictionary directory (default is %s).\n", DICTDIR);
+	fprintf(stderr, "  -x                     Debugging mode.\n");
+
+	exit(1);
+}
+
+static void NEVER_RETURNS fail(PW_TYPE type, char const *msg)
+{
+	fprintf(stderr, "%s: %s\n", fr_int2str(dict_attr_types, type, "<INVALID>"), msg);
+	exit(1);
+}
+
+/** Fill in a value from its wire format, independently of serialize.c
+ *
+ */
+static void value_from_wire(TALLOC_CTX *ctx, value_box_t *value, test_value_t const *tv)
+{
+	uint8_t const	*p = tv->wire;
+	uint64_t	num;
+
+	memset(value, 0, sizeof(*value));
+	value->type = tv->type;
+	value->length = tv->wire_len;
+
+	switch (tv->type) {
+	case PW_TYPE_STRING:
+		value->datum.strvalue = talloc_bstrndup(ctx, (char const *) p, tv->wire_len);
+		break;
+
+	case PW_TYPE_OCTETS:
+		value->datum.octets = talloc_memdup(ctx, p, tv->wire_len);
+		break;
+
+	case PW_TYPE_BOOLEAN:
+		value->datum.boolean = p[0];
+		break;
+
+	case PW_TYPE_BYTE:
+		value->datum.byte = p[0];
+		break;
+
+	case PW_TYPE_SHORT:
+		value->datum.ushort = (p[0] << 8) | p[1];
+		break;
+
+	case PW_TYPE_INTEGER:
+	case PW_TYPE_DATE:
+	case PW_TYPE_SIGNED:
+		value->datum.integer = ((uint32_t) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+		break;
+
+	case PW_TYPE_INTEGER64:
+	case PW_TYPE_SIZE:
+		num = 0;
+		for (p = tv->wire; p < tv->wire + 8; p++) num = (num << 8) | *p;
+
+		if (tv->type == PW_TYPE_INTEGER64) {
+			value->datum.integer64 = num;
+		} else {
+			value->datum.size = num;
+		}
+		break;
+
+	default:
+		memcpy(((uint8_t *) value) + value_box_offsets[tv->type], p, tv->wire_len);
+		break;
+	}
+}
+
+static bool value_equal(value_box_t const *a, value_box_t const *b)
+{
+	if ((a->type != b->type) || (a->length != b->length)) return false;
+
+	switch (a->type) {
+	case PW_TYPE_STRING:
+	case PW_TYPE_OCTETS:
+		return (memcmp(a->datum.octets, b->datum.octets, a->length) == 0);
+
+	case PW_TYPE_BOOLEAN:
+		return (a->datum.boolean == b->datum.boolean);
+
+	default:
+		return (memcmp(((uint8_t const *) a) + value_box_offsets[a->type],
+			       ((uint8_t const *) b) + value_box_offsets[a->type],
+			       value_box_field_sizes[a->type]) == 0);
+	}
+}
+
+/** Serialize a map holding one value, check the wire format, and read it back
+ *
+ */
+static void test_round_trip(TALLOC_CTX *ctx, fr_dict_attr_t const *da, test_value_t const *tv)
+{
+	rlm_cache_entry_t	in, out;
+	vp_map_t		*map;
+	uint8_t			*data;
+	ssize_t			len;
+
+	memset(&in, 0, sizeof(in));
+	in.created = 1476000000;
+	in.expires = 1476003600;
+
+	map = talloc_zero(ctx, vp_map_t);
+	map->op = T_OP_SET;
+	map->lhs = tmpl_init(talloc(map, vp_tmpl_t), TMPL_TYPE_ATTR, da->name, strlen(da->name), T_BARE_WORD);
+	map->lhs->tmpl_da = da;
+	map->lhs->tmpl_request = REQUEST_CURRENT;
+	map->lhs->tmpl_list = PAIR_LIST_REPLY;
+	map->lhs->tmpl_tag = TAG_NONE;
+	map->lhs->tmpl_num = NUM_ANY;
+	map->rhs = tmpl_init(talloc(map, vp_tmpl_t), TMPL_TYPE_DATA, "", 0, T_BARE_WORD);
+	value_from_wire(map->rhs, &map->rhs->tmpl_value_box, tv);
+	in.maps = map;
+
+	len = cache_serialize_binary(ctx, &data, &in);
+	if (len < 0) fail(tv->type, fr_strerror());
+
+	if ((size_t) len != (VALUE_OFFSET + tv->wire_len)) fail(tv->type, "Wrong length");
+	if (memcmp(data + VALUE_OFFSET, tv->wire, tv->wire_len) != 0) fail(tv->type, "Wrong wire format");
+
+	memset(&out, 0, sizeof(out));
+	if (cache_deserialize_binary(&out, data, len) < 0) fail(tv->type, fr_strerror());
+
+	if ((out.created != in.created) || (out.expires != in.expires)) fail(tv->type, "Wrong timestamps");
+	if (!out.maps || out.maps->next) fail(tv->type, "Wrong number of maps");
+
+	if (out.maps->lhs->tmpl_da != da) fail(tv->type, "Wrong attribute");
+	if (out.maps->op != map->op) fail(tv->type, "Wrong operator");
+	if (out.maps->lhs->tmpl_list != map->lhs->tmpl_list) fail(tv->type, "Wrong list");
+	if (out.maps->lhs->tmpl_tag != map->lhs->tmpl_tag) fail(tv->type, "Wrong tag");
+	if (!value_equal(&out.maps->rhs->tmpl_value_box, &map->rhs->tmpl_value_box)) fail(tv->type, "Wrong value");
+
+	if (debug_lvl) printf("%s OK\n", fr_int2str(dict_attr_types, tv->type, "<INVALID>"));
+
+	talloc_free(out.maps);
+	talloc_free(map);
+	talloc_free(data);
+}
+
+/** Check that entries with out of range fields are rejected
+ *
+ */
+static void test_reject(TALLOC_CTX *ctx, fr_dict_attr_t const *da, test_value_t const *tv)
+{
+	static struct {
+		size_t		offset;
+		uint8_t		value;
+		char const	*name;
+	} const bad[] = {
+		{ REQUEST_OFFSET,	REQUEST_UNKNOWN,	"Accepted invalid request qualifier" },
+		{ REQUEST_OFFSET,	0xff,			"Accepted invalid request qualifier" },
+		{ LIST_OFFSET,		PAIR_LIST_UNKNOWN,	"Accepted invalid list qualifier" },
+		{ LIST_OFFSET,		0xff,			"Accepted invalid list qualifier" },
+		{ OP_OFFSET,		T_INVALID,		"Accepted invalid operator" },
+		{ OP_OFFSET,		0xff,			"Accepted invalid operator" },
+		{ LENGTH_OFFSET + 3,	0xff,			"Accepted invalid length" },
+	};
+	rlm_cache_entry_t	in, out;
+	vp_map_t		*map;
+	uint8_t			*data;
+	ssize_t			len;
+	size_t			i;
+
+	memset(&in, 0, sizeof(in));
+
+	map = talloc_zero(ctx, vp_map_t);
+	map->op = T_OP_SET;
+	map->lhs = tmpl_init(talloc(map, vp_tmpl_t), TMPL_TYPE_ATTR, da->name, strlen(da->name), T_BARE_WORD);
+	map->lhs->tmpl_da = da;
+	map->lhs->tmpl_request = REQUEST_CURRENT;
+	map->lhs->tmpl_list = PAIR_LIST_REPLY;
+	map->lhs->tmpl_tag = TAG_NONE;
+	map->lhs->tmpl_num = NUM_ANY;
+	map->rhs = tmpl_init(talloc(map, vp_tmpl_t), TMPL_TYPE_DATA, "", 0, T_BARE_WORD);
+	value_from_wire(map->rhs, &map->rhs->tmpl_value_box, tv);
+	in.maps = map;
+
+	len = cache_serialize_binary(ctx, &data, &in);
+	if (len < 0) fail(tv->type, fr_strerror());
+
+	for (i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+		uint8_t old = data[bad[i].offset];
+
+		data[bad[i].offset] = bad[i].value;
+
+		memset(&out, 0, sizeof(out));
+		if (cache_deserialize_binary(&out, data, len) == 0) fail(tv->type, bad[i].name);
+		talloc_free(out.maps);
+
+		if (debug_lvl) printf("%s rejected: %s\n", fr_int2str(dict_attr_types, tv->type, "<INVALID>"), fr_strerror());
+
+		data[bad[i].offset] = old;
+	}
+
+	talloc_free(map);
+	talloc_free(data);
+}
+
+int main(int argc, char *argv[])
+{
+	int			c;
+	size_t			i;
+	char const		*dict_dir = DICTDIR;
+	fr_dict_t		*dict = NULL;
+	fr_dict_attr_flags_t	flags;
+	TALLOC_CTX		*autofree = talloc_init("main");
+
+	while ((c = getopt(argc, argv, "D:hx")) != EOF) switch (c) {
+		case 'D':
+			dict_dir = optarg;
+			break;
+
+		case 'x':
+			debug_lvl++;
+			break;
+
+		case 'h':
+		default:
+			usage();
+	}
+
+	if (fr_dict_from_file(autofree, &dict, dict_dir, FR_DICTIONARY_FILE, "radius") < 0) {
+		fr_perror("cache_serialize_test");
+		exit(1);
+	}
+
+	/*
+	 *	Add an attribute of each type, so that every type of
+	 *	value can be written and read back.
+	 */
+	memset(&flags, 0, sizeof(flags));
+	flags.internal = 1;
+
+	for (i = 0; i < sizeof(test_values) / sizeof(test_values[0]); i++) {
+		char			name[64];
+		fr_dict_attr_t const	*da;
+
+		snprintf(name, sizeof(name), "Cache-Serialize-Test-%s",
+			 fr_int2str(dict_attr_types, test_values[i].type, "<INVALID>"));
+
+		if (fr_dict_attr_add(dict, fr_dict_root(dict), name, 3900 + i, test_values[i].type, flags) < 0) {
+			fr_perror("cache_serialize_test");
+			exit(1);
+		}
+
+		da = fr_dict_attr_by_name(dict, name);
+		if (!da) {
+			fprintf(stderr, "Failed finding attribute %s\n", name);
+			exit(1);
+		}
+
+		test_round_trip(autofree, da, &test_values[i]);
+		if (test_values[i].type == PW_TYPE_INTEGER) test_reject(autofree, da, &test_values[i]);
+	}
+
+	talloc_free(autofree);
+
+	return 0;
+}
@@ -0,0 +1,8 @@
+TARGET := cache_serialize_test
+
+SOURCES		:= cache_serialize_test.c ../../modules/rlm_cache/serialize.c
+
+SRC_CFLAGS	:= -I${top_srcdir}/src/modules/rlm_cache
+
+TGT_PREREQS	:= libfreeradius-util.a libfreeradius-server.a libfreeradius-radius.a
+TGT_LDLIBS	:= $(LIBS)
@@ -39,6 +39,7 @@ RCSID("$Id$")
 #define MAX_MESSAGES		(2048)
 #define MAX_CONTROL_PLANE	(1024)
 #define MAX_KEVENTS		(10)
+#define MAX_BURST		(64)
 
 #define MPRINT1 if (debug_lvl) printf
 #define MPRINT2 if (debug_lvl > 1) printf
@@ -50,11 +51,13 @@ static fr_control_t	*control_master, *control_worker;
 static int		max_messages = 10;
 static int		max_control_plane = 0;
 static int		max_outstanding = 1;
+static int		burst_size = 1;
 static bool		touch_memory = false;
 
 static void NEVER_RETURNS usage(void)
 {
 	fprintf(stderr, "usage: channel_test [OPTS]\n");
+	fprintf(stderr, "  -b <burst>             Send messages in bursts of this size.\n");
 	fprintf(stderr, "  -c <control-plane>     Size of the control plane queue.\n");
 	fprintf(stderr, "  -m <messages>	  Send number of messages.\n");
 	fprintf(stderr, "  -o <outstanding>       Keep number of messages outstanding.\n");
@@ -107,7 +110,7 @@ static void *channel_master(void *arg)
 
 	while (running) {
 		fr_time_t now;
-		int num_to_send;
+		int num_to_send, burst;
 		fr_channel_data_t *cd, *reply;
 
 #if 0
@@ -137,39 +140,58 @@ static void *channel_master(void *arg)
 		}
 		MPRINT1("Master sending %d messages\n", num_to_send);
 
-		for (i = 0; i < num_to_send; i++) {
-			cd = (fr_channel_data_t *) fr_message_alloc(ms, NULL, 100);
-			rad_assert(cd != NULL);
+		for (i = 0; i < num_to_send; i += burst) {
+			int j;
+			fr_channel_data_t *cds[MAX_BURST];
 
-			num_outstanding++;
-			num_messages++;
+			burst = num_to_send - i;
+			if (burst > burst_size) burst = burst_size;
 
-			cd->m.when = fr_time();
+			for (j = 0; j < burst; j++) {
+				cd = (fr_channel_data_t *) fr_message_alloc(ms, NULL, 100);
+				rad_assert(cd != NULL);
 
-			if (touch_memory) {
-				size_t j, k;
+				num_outstanding++;
+				num_messages++;
 
-				for (j = k = 0; j < cd->m.data_size; j++) {
-					k += cd->m.data[j];
+				cd->m.when = fr_time();
+
+				if (touch_memory) {
+					size_t k, l;
+
+					for (k = l = 0; k < cd->m.data_size; k++) {
+						l += cd->m.data[k];
+					}
+
+					cd->m.data[4] = l;
 				}
 
-				cd->m.data[4] = k;
-			}
+				memcpy(cd->m.data, &num_messages, sizeof(num_messages));
 
-			memcpy(cd->m.data, &num_messages, sizeof(num_messages));
+				MPRINT1("Master sent message %d\n", num_messages);
+				cds[j] = cd;
+			}
 
-			MPRINT1("Master sent message %d\n", num_messages);
-			rcode = fr_channel_send_request(channel, cd, &reply);
+			if (burst == 1) {
+				rcode = fr_channel_send_request(channel, cds[0], &reply);
+			} else {
+				rcode = fr_channel_send_request_burst(channel, cds, burst, &reply);
+				if (rcode == burst) rcode = 0;
+			}
 			if (rcode < 0) {
 				fprintf(stderr, "Failed sending request: %s\n", strerror(errno));
 			}
 			rad_assert(rcode == 0);
-			if (reply) {
+
+			while (reply) {
 				num_replies++;
 				num_outstanding--;
 				MPRINT1("Master got reply %d, outstanding=%d, %d/%d sent.\n",
 					num_replies, num_outstanding, num_messages, max_messages);
 				fr_message_done(&reply->m);
+
+				if (burst == 1) break;
+				reply = fr_channel_recv_reply(channel);
 			}
 		}
 
@@ -391,33 +413,48 @@ static void *channel_worker(void *arg)
 				}
 
 				while (cd) {
-					int message_id;
+					int num = 0;
+					fr_channel_data_t *replies[MAX_BURST];
 
-					worker_messages++;
+					/*
+					 *	Gather up to burst_size replies,
+					 *	and send them all at once.
+					 */
+					do {
+						int message_id;
 
-					rad_assert(cd->m.data != NULL);
-					memcpy(&message_id, cd->m.data, sizeof(message_id));
-					MPRINT1("\tWorker got message %d (says %d)\n", worker_messages, message_id);
+						worker_messages++;
 
-					reply = (fr_channel_data_t *) fr_message_alloc(ms, NULL, 100);
-					rad_assert(reply != NULL);
+						rad_assert(cd->m.data != NULL);
+						memcpy(&message_id, cd->m.data, sizeof(message_id));
+						MPRINT1("\tWorker got message %d (says %d)\n", worker_messages, message_id);
 
-					reply->m.when = fr_time();
-					fr_message_done(&cd->m);
+						reply = (fr_channel_data_t *) fr_message_alloc(ms, NULL, 100);
+						rad_assert(reply != NULL);
 
-					if (touch_memory) {
-						size_t j, k;
+						reply->m.when = fr_time();
+						fr_message_done(&cd->m);
 
-						for (j = k = 0; j < reply->m.data_size; j++) {
-							k += reply->m.data[j];
-						}
+						if (touch_memory) {
+							size_t j, k;
 
-						reply->m.data[4] = k;
-					}
+							for (j = k = 0; j < reply->m.data_size; j++) {
+								k += reply->m.data[j];
+							}
 
+							reply->m.data[4] = k;
+						}
 
-					MPRINT1("\tWorker sending reply to messages %d\n", worker_messages);
-					rcode = fr_channel_send_reply(channel, reply, &cd);
+						replies[num++] = reply;
+					} while ((num < burst_size) && ((cd = fr_channel_recv_request(channel)) != NULL));
+
+					MPRINT1("\tWorker sending %d replies, up to message %d\n", num, worker_messages);
+					if (num == 1) {
+						rcode = fr_channel_send_reply(channel, replies[0], &cd);
+					} else {
+						rcode = fr_channel_send_reply_burst(channel, replies, num, &cd);
+						if (rcode == num) rcode = 0;
+					}
 					if (rcode < 0) {
 						fprintf(stderr, "Failed sending reply: %s\n", strerror(errno));
 					}
@@ -480,11 +517,17 @@ int main(int argc, char *argv[])
 
 	fr_time_start();
 
-	while ((c = getopt(argc, argv, "c:hm:o:tx")) != EOF) switch (c) {
+	while ((c = getopt(argc, argv, "b:c:hm:o:tx")) != EOF) switch (c) {
 		case 'x':
 			debug_lvl++;
 			break;
 
+		case 'b':
+			burst_size = atoi(optarg);
+			if (burst_size < 1) burst_size = 1;
+			if (burst_size > MAX_BURST) burst_size = MAX_BURST;
+			break;
+
 		case 'c':
 			max_control_plane = atoi(optarg);
 			break;
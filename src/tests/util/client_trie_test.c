@@ -0,0 +1,265 @@
+/*
+ * client_trie_test.c	Tests for the client prefix trie
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * Copyright 2016  The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include <freeradius-devel/radiusd.h>
+
+#ifdef HAVE_GETOPT_H
+#	include <getopt.h>
+#endif
+
+static int		debug_lvl = 0;
+
+/*
+ *	client.c refers to these, but only for clients which have
+ *	virtual servers or CoA servers, and none of ours do.
+ */
+main_config_t		main_config;
+
+bool realm_home_server_add(UNUSED home_server_t *home)
+{
+	return false;
+}
+
+home_server_t *home_server_afrom_cs(UNUSED TALLOC_CTX *ctx, UNUSED realm_config_t *rc, UNUSED CONF_SECTION *cs)
+{
+	return NULL;
+}
+
+CONF_SECTION *home_server_cs_afrom_client(UNUSED CONF_SECTION *client)
+{
+	return NULL;
+}
+
+#ifdef WITH_COA
+home_server_t *home_server_byname(UNUSED char const *name, UNUSED int type)
+{
+	return NULL;
+}
+#endif
+
+home_pool_t *home_pool_byname(UNUSED char const *name, UNUSED int type)
+{
+	return NULL;
+}
+
+/*
+ *	Networks which are added to the list.  Some of them contain
+ *	others, so that the longest prefix has to win.
+ */
+static char const	*networks[] = {
+	"0.0.0.0/0",
+	"10.0.0.0/8",
+	"10.1.0.0/16",
+	"10.1.128.0/17",
+	"10.1.2.3/32",
+	"192.0.2.0/24",
+	"::/0",
+	"2001:db8::/32",
+	"2001:db8:1::/48",
+	"2001:db8::1/128",
+};
+
+#define NUM_NETWORKS (sizeof(networks) / sizeof(networks[0]))
+
+/*
+ *	Addresses to look up, and the network which should be found
+ *	for them.
+ */
+typedef struct {
+	char const	*address;
+	char const	*network;		//!< NULL if no client should match.
+} test_lookup_t;
+
+static void NEVER_RETURNS usage(void)
+{
+	fprintf(stderr, "usage: client_trie_test [OPTS]\n");
+	fprintf(stderr, "  -x                     Debugging mode.\n");
+
+	exit(1);
+}
+
+static void NEVER_RETURNS fail(char const *msg, char const *what)
+{
+	fprintf(stderr, "%s: %s\n", what, msg);
+	exit(1);
+}
+
+static RADCLIENT *client_add_network(RADCLIENT_LIST *clients, char const *network)
+{
+	RADCLIENT *client;
+
+	client = talloc_zero(clients, RADCLIENT);
+	if (fr_inet_pton(&client->ipaddr, network, -1, AF_UNSPEC, false, true) < 0) fail(fr_strerror(), network);
+
+	client->longname = client->shortname = talloc_strdup(client, network);
+	client->secret = "testing123";
+	client->proto = IPPROTO_UDP;
+	client->dynamic = true;		/* so that it can be deleted */
+
+	if (!client_add(clients, client)) fail("Failed adding client", network);
+
+	return client;
+}
+
+static void client_check(RADCLIENT_LIST *clients, test_lookup_t const *lookup, size_t num)
+{
+	size_t		i;
+	fr_ipaddr_t	ipaddr;
+	RADCLIENT	*client;
+
+	for (i = 0; i < num; i++) {
+		memset(&ipaddr, 0, sizeof(ipaddr));	/* pton doesn't set zone_id */
+		if (fr_inet_pton(&ipaddr, lookup[i].address, -1, AF_UNSPEC, false, false) < 0) {
+			fail(fr_strerror(), lookup[i].address);
+		}
+
+		client = client_find(clients, &ipaddr, IPPROTO_UDP);
+		if (!lookup[i].network) {
+			if (client) fail(client->shortname, lookup[i].address);
+			continue;
+		}
+
+		if (!client) fail("No client found", lookup[i].address);
+		if (strcmp(client->shortname, lookup[i].network) != 0) fail(client->shortname, lookup[i].address);
+
+		if (debug_lvl) printf("%s -> %s\n", lookup[i].address, client->shortname);
+	}
+}
+
+/*
+ *	Count the trie nodes, which are all allocated in the client list.
+ */
+static void trie_node_count(void const *ptr, int depth, UNUSED int max_depth, UNUSED int is_ref, void *uctx)
+{
+	int *count = uctx;
+
+	if ((depth == 1) && (strcmp(talloc_get_name(ptr), "client_trie_node_t") == 0)) (*count)++;
+}
+
+static int trie_nodes(RADCLIENT_LIST *clients)
+{
+	int count = 0;
+
+	talloc_report_depth_cb(clients, 0, 1, trie_node_count, &count);
+
+	return count;
+}
+
+int main(int argc, char *argv[])
+{
+	int			c;
+	size_t			i;
+	TALLOC_CTX		*autofree = talloc_init("main");
+	RADCLIENT_LIST		*clients;
+	RADCLIENT		*client[NUM_NETWORKS];
+
+	static test_lookup_t const all[] = {
+		{ "10.1.2.3",		"10.1.2.3/32" },
+		{ "10.1.2.4",		"10.1.0.0/16" },
+		{ "10.1.200.1",		"10.1.128.0/17" },
+		{ "10.2.0.1",		"10.0.0.0/8" },
+		{ "192.0.2.7",		"192.0.2.0/24" },
+		{ "192.0.3.7",		"0.0.0.0/0" },
+		{ "2001:db8::1",	"2001:db8::1/128" },
+		{ "2001:db8::2",	"2001:db8::/32" },
+		{ "2001:db8:1::1",	"2001:db8:1::/48" },
+		{ "2001:db9::1",	"::/0" },
+	};
+
+	/*
+	 *	After deleting 10.1.2.3/32, 10.1.0.0/16, 0.0.0.0/0
+	 *	and 2001:db8::/32.
+	 */
+	static test_lookup_t const some[] = {
+		{ "10.1.2.3",		"10.0.0.0/8" },
+		{ "10.1.200.1",		"10.1.128.0/17" },
+		{ "192.0.2.7",		"192.0.2.0/24" },
+		{ "192.0.3.7",		NULL },
+		{ "2001:db8::1",	"2001:db8::1/128" },
+		{ "2001:db8::2",	"::/0" },
+		{ "2001:db8:1::1",	"2001:db8:1::/48" },
+	};
+
+	static test_lookup_t const none[] = {
+		{ "10.1.2.3",		NULL },
+		{ "2001:db8::1",	NULL },
+	};
+
+	while ((c = getopt(argc, argv, "hx")) != EOF) switch (c) {
+		case 'x':
+			debug_lvl++;
+			break;
+
+		case 'h':
+		default:
+			usage();
+	}
+
+	clients = client_list_init(NULL);
+	if (!clients) fail("Failed creating client list", "main");
+	talloc_steal(autofree, clients);
+
+	for (i = 0; i < NUM_NETWORKS; i++) client[i] = client_add_network(clients, networks[i]);
+	client_check(clients, all, sizeof(all) / sizeof(all[0]));
+
+#ifdef WITH_DYNAMIC_CLIENTS
+	client_delete(clients, client[4]);	/* 10.1.2.3/32 */
+	client_delete(clients, client[2]);	/* 10.1.0.0/16 */
+	client_delete(clients, client[0]);	/* 0.0.0.0/0 */
+	client_delete(clients, client[7]);	/* 2001:db8::/32 */
+	client_check(clients, some, sizeof(some) / sizeof(some[0]));
+
+	for (i = 0; i < NUM_NETWORKS; i++) {
+		if ((i == 0) || (i == 2) || (i == 4) || (i == 7)) continue;
+		client_delete(clients, client[i]);
+	}
+	client_check(clients, none, sizeof(none) / sizeof(none[0]));
+
+	if (trie_nodes(clients) != 0) fail("Trie nodes left after deleting every client", "main");
+
+	/*
+	 *	Two host routes need a node to join them.  When one is
+	 *	deleted, the other should be all that's left.
+	 */
+	client[0] = client_add_network(clients, "192.0.2.1/32");
+	client[1] = client_add_network(clients, "192.0.2.2/32");
+	if (trie_nodes(clients) != 3) fail("Expected three trie nodes for two host routes", "main");
+
+	client_delete(clients, client[1]);
+	if (trie_nodes(clients) != 1) fail("Joining node wasn't merged after delete", "main");
+
+	{
+		static test_lookup_t const one[] = {
+			{ "192.0.2.1",	"192.0.2.1/32" },
+			{ "192.0.2.2",	NULL },
+		};
+
+		client_check(clients, one, sizeof(one) / sizeof(one[0]));
+	}
+#endif
+
+	talloc_free(autofree);
+
+	return 0;
+}
@@ -0,0 +1,6 @@
+TARGET := client_trie_test
+
+SOURCES		:= client_trie_test.c ../../main/client.c
+
+TGT_PREREQS	:= libfreeradius-util.a libfreeradius-server.a libfreeradius-radius.a
+TGT_LDLIBS	:= $(LIBS)
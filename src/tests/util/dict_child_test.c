@@ -0,0 +1,301 @@
+/*
+ * dict_child_test.c	Tests for indexed dictionary child lookups
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * Copyright 2016  The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include <freeradius-devel/libradius.h>
+#include <sys/time.h>
+
+#ifdef HAVE_GETOPT_H
+#	include <getopt.h>
+#endif
+
+typedef struct {
+	fr_dict_attr_t const	*parent;
+	unsigned int		attr;
+} lookup_t;
+
+typedef struct {
+	fr_dict_attr_t		*parent;
+	fr_dict_attr_t const	**child_index;
+} hidden_t;
+
+static int		debug_lvl = 0;
+
+static unsigned int	num_direct, num_hashed, num_unindexed;
+static lookup_t		*lookups;		//!< Every child in the dictionary.
+static unsigned int	num_lookups;
+static lookup_t		*sparse;		//!< Children of parents which need a perfect hash.
+static unsigned int	num_sparse;
+static hidden_t		*hidden;		//!< Parents whose index is hidden from the library.
+static unsigned int	num_hidden;
+
+static void NEVER_RETURNS usage(void)
+{
+	fprintf(stderr, "usage: dict_child_test [OPTS]\n");
+	fprintf(stderr, "  -D <dict_dir>          Set the dictionary directory (default is %s).\n", DICTDIR);
+	fprintf(stderr, "  -n count               number of lookups to benchmark (0 to skip).\n");
+	fprintf(stderr, "  -x                     Debugging mode.\n");
+
+	exit(1);
+}
+
+/** Find a child by walking its bin, the way lookups work without an index
+ *
+ */
+static fr_dict_attr_t const *child_by_bin(fr_dict_attr_t const *parent, unsigned int attr)
+{
+	fr_dict_attr_t const *bin;
+
+	for (bin = parent->children[attr & 0xff]; bin; bin = bin->next) if (bin->attr == attr) return bin;
+
+	return NULL;
+}
+
+static void check_lookup(fr_dict_attr_t const *parent, unsigned int attr)
+{
+	fr_dict_attr_t const *expected, *found;
+
+	expected = child_by_bin(parent, attr);
+	found = fr_dict_attr_child_by_num(parent, attr);
+	if (found != expected) {
+		fprintf(stderr, "Lookup of %u in %s returned %s, expected %s\n", attr, parent->name,
+			found ? found->name : "nothing", expected ? expected->name : "nothing");
+		exit(1);
+	}
+}
+
+static void test_children(TALLOC_CTX *ctx, fr_dict_attr_t const *parent)
+{
+	fr_dict_attr_t const	*da;
+	size_t			i, len;
+
+	if (!parent->children) return;
+
+	if (!parent->child_index) {
+		if (debug_lvl) printf("%s (%u) is not indexed\n", parent->name, parent->attr);
+		num_unindexed++;
+	} else if (parent->child_index_disp) {
+		num_hashed++;
+	} else {
+		num_direct++;
+	}
+
+	len = talloc_array_length(parent->children);
+	for (i = 0; i < len; i++) {
+		for (da = parent->children[i]; da; da = da->next) {
+			check_lookup(parent, da->attr);
+
+			/*
+			 *	Numbers either side, which usually aren't
+			 *	defined, and may hash to an occupied slot.
+			 */
+			check_lookup(parent, da->attr + 1);
+			check_lookup(parent, da->attr - 1);
+			check_lookup(parent, da->attr + 256);
+			check_lookup(parent, fr_rand());
+
+			if ((num_lookups % 1024) == 0) {
+				lookups = talloc_realloc(ctx, lookups, lookup_t, num_lookups + 1024);
+			}
+			lookups[num_lookups].parent = parent;
+			lookups[num_lookups].attr = da->attr;
+			num_lookups++;
+
+			if (parent->child_index_disp) {
+				if ((num_sparse % 1024) == 0) sparse = talloc_realloc(ctx, sparse, lookup_t, num_sparse + 1024);
+				sparse[num_sparse].parent = parent;
+				sparse[num_sparse].attr = da->attr;
+				num_sparse++;
+			}
+
+			test_children(ctx, da);
+		}
+	}
+}
+
+/** Add a child after the dictionary has been loaded
+ *
+ * The parent's index is stale until the next fr_dict_read(), so lookups
+ * have to walk the bins, and still find the new child.
+ */
+static void test_child_add(fr_dict_t *dict)
+{
+	fr_dict_attr_t const	*root = fr_dict_root(dict);
+	fr_dict_attr_t const	*da;
+	fr_dict_attr_flags_t	flags;
+
+	memset(&flags, 0, sizeof(flags));
+
+	if (fr_dict_attr_add(dict, root, "Dict-Child-Test-Attribute", -1, PW_TYPE_INTEGER, flags) < 0) {
+		fr_perror("dict_child_test");
+		exit(1);
+	}
+
+	da = fr_dict_attr_by_name(dict, "Dict-Child-Test-Attribute");
+	if (!da) {
+		fprintf(stderr, "Failed finding the added attribute by name\n");
+		exit(1);
+	}
+
+	if (root->child_index) {
+		fprintf(stderr, "Adding a child didn't mark the index of %s as stale\n", root->name);
+		exit(1);
+	}
+
+	if (fr_dict_attr_child_by_num(root, da->attr) != da) {
+		fprintf(stderr, "Lookup of added attribute %u in %s failed\n", da->attr, root->name);
+		exit(1);
+	}
+
+	check_lookup(root, da->attr - 1);
+	check_lookup(root, PW_USER_NAME);
+}
+
+static uint64_t usec_since(struct timeval const *start)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+
+	return ((now.tv_sec - start->tv_sec) * 1000000) + (now.tv_usec - start->tv_usec);
+}
+
+/** Hide the indexes, so that the library falls back to walking the bins
+ *
+ */
+static void hide_index(TALLOC_CTX *ctx, fr_dict_attr_t const *parent)
+{
+	fr_dict_attr_t const	*da;
+	size_t			i, len;
+
+	if (!parent->children) return;
+
+	if (parent->child_index) {
+		if ((num_hidden % 64) == 0) hidden = talloc_realloc(ctx, hidden, hidden_t, num_hidden + 64);
+		memcpy(&hidden[num_hidden].parent, &parent, sizeof(hidden[num_hidden].parent));
+		hidden[num_hidden].child_index = parent->child_index;
+		hidden[num_hidden].parent->child_index = NULL;
+		num_hidden++;
+	}
+
+	len = talloc_array_length(parent->children);
+	for (i = 0; i < len; i++) {
+		for (da = parent->children[i]; da; da = da->next) hide_index(ctx, da);
+	}
+}
+
+static void restore_index(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < num_hidden; i++) hidden[i].parent->child_index = hidden[i].child_index;
+	num_hidden = 0;
+}
+
+static uint64_t time_lookups(lookup_t const *list, unsigned int num, unsigned int count, uintptr_t *sum)
+{
+	unsigned int	i;
+	struct timeval	start;
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < count; i++) {
+		lookup_t const *l = &list[i % num];
+
+		*sum += (uintptr_t) fr_dict_attr_child_by_num(l->parent, l->attr);
+	}
+
+	return usec_since(&start);
+}
+
+static void benchmark(TALLOC_CTX *ctx, fr_dict_attr_t const *root, char const *what,
+		      lookup_t const *list, unsigned int num, unsigned int count)
+{
+	uintptr_t	indexed_sum = 0, bin_sum = 0;
+	uint64_t	indexed, bin;
+
+	indexed = time_lookups(list, num, count, &indexed_sum);
+
+	hide_index(ctx, root);
+	bin = time_lookups(list, num, count, &bin_sum);
+	restore_index();
+
+	if (indexed_sum != bin_sum) {
+		fprintf(stderr, "Benchmark lookups returned different attributes\n");
+		exit(1);
+	}
+
+	printf("%u lookups over %u %s: bins %" PRIu64 "us, indexed %" PRIu64 "us\n",
+	       count, num, what, bin, indexed);
+}
+
+int main(int argc, char *argv[])
+{
+	int		c;
+	unsigned int	count = 0;
+	char const	*dict_dir = DICTDIR;
+	fr_dict_t	*dict = NULL;
+	TALLOC_CTX	*autofree = talloc_init("main");
+
+	while ((c = getopt(argc, argv, "D:hn:x")) != EOF) switch (c) {
+		case 'D':
+			dict_dir = optarg;
+			break;
+
+		case 'n':
+			count = atoi(optarg);
+			break;
+
+		case 'x':
+			debug_lvl++;
+			break;
+
+		case 'h':
+		default:
+			usage();
+	}
+
+	if (fr_dict_from_file(autofree, &dict, dict_dir, FR_DICTIONARY_FILE, "radius") < 0) {
+		fr_perror("dict_child_test");
+		exit(1);
+	}
+
+	test_children(autofree, fr_dict_root(dict));
+
+	if (debug_lvl) {
+		printf("%u attributes, parents indexed directly %u, by hash %u, not indexed %u\n",
+		       num_lookups, num_direct, num_hashed, num_unindexed);
+	}
+
+	/*
+	 *	The benchmarks compare against the index, so they're run
+	 *	before we make it stale.
+	 */
+	if (count && num_lookups) benchmark(autofree, fr_dict_root(dict), "attributes", lookups, num_lookups, count);
+	if (count && num_sparse) benchmark(autofree, fr_dict_root(dict), "sparsely numbered attributes", sparse, num_sparse, count);
+
+	test_child_add(dict);
+
+	talloc_free(autofree);
+
+	return 0;
+}
@@ -0,0 +1,6 @@
+TARGET := dict_child_test
+
+SOURCES		:= dict_child_test.c
+
+TGT_PREREQS	:= libfreeradius-util.a libfreeradius-server.a libfreeradius-radius.a
+TGT_LDLIBS	:= $(LIBS)
@@ -0,0 +1,380 @@
+/*
+ * dict_image_test.c	Tests for binary dictionary images
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * Copyright 2016  The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include <freeradius-devel/libradius.h>
+#include <sys/time.h>
+
+#ifdef HAVE_SYS_STAT_H
+#	include <sys/stat.h>
+#endif
+
+#ifdef HAVE_GETOPT_H
+#	include <getopt.h>
+#endif
+
+/*
+ *	Local dictionaries, which include the shared ones.  The two
+ *	versions of the local dictionary have the same size, so only
+ *	their contents tell them apart.
+ */
+#define LOCAL_A		"ATTRIBUTE\tDict-Image-Test-A\t3990\tinteger\n"
+#define LOCAL_B		"ATTRIBUTE\tDict-Image-Test-B\t3990\tinteger\n"
+#define OPTIONAL	"ATTRIBUTE\tDict-Image-Test-Optional\t3991\tinteger\n"
+
+/** Attributes of the text dictionary, and their copies in the image
+ *
+ */
+typedef struct {
+	fr_dict_attr_t const	*text;
+	fr_dict_attr_t const	*image;
+} attr_pair_t;
+
+typedef struct {
+	fr_dict_t		*text;
+	fr_dict_t		*image;
+	attr_pair_t		*pairs;
+	unsigned int		num_pairs;
+	unsigned int		num;
+} compare_ctx_t;
+
+static int		debug_lvl = 0;
+
+static void NEVER_RETURNS usage(void)
+{
+	fprintf(stderr, "usage: dict_image_test [OPTS]\n");
+	fprintf(stderr, "  -D <dict_dir>          Set the dictionary directory (default is %s).\n", DICTDIR);
+	fprintf(stderr, "  -x                     Debugging mode.\n");
+
+	exit(1);
+}
+
+static void NEVER_RETURNS fail(char const *what, char const *name)
+{
+	fprintf(stderr, "%s: %s\n", name, what);
+	exit(1);
+}
+
+static void write_file(char const *dir, char const *file, char const *contents)
+{
+	char	path[PATH_MAX];
+	FILE	*fp;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, file);
+
+	fp = fopen(path, "w");
+	if (!fp || (fputs(contents, fp) == EOF) || (fclose(fp) != 0)) {
+		fprintf(stderr, "Failed writing %s: %s\n", path, fr_syserror(errno));
+		exit(1);
+	}
+}
+
+static fr_dict_t *load(TALLOC_CTX *ctx, char const *dir)
+{
+	fr_dict_t *dict = NULL;
+
+	if (fr_dict_from_file(ctx, &dict, dir, FR_DICTIONARY_FILE, "radius") < 0) {
+		fr_perror("dict_image_test");
+		exit(1);
+	}
+
+	return dict;
+}
+
+static bool flags_equal(fr_dict_attr_flags_t const *a, fr_dict_attr_flags_t const *b)
+{
+	return ((a->is_root == b->is_root) && (a->is_unknown == b->is_unknown) && (a->is_raw == b->is_raw) &&
+		(a->internal == b->internal) && (a->has_tag == b->has_tag) && (a->array == b->array) &&
+		(a->has_value == b->has_value) && (a->concat == b->concat) && (a->is_pointer == b->is_pointer) &&
+		(a->virtual == b->virtual) && (a->compare == b->compare) && (a->named == b->named) &&
+		(a->encrypt == b->encrypt) && (a->length == b->length) && (a->type_size == b->type_size));
+}
+
+/** Walk the children of two parents together, and check they're the same
+ *
+ * Images recreate the bins in the same order, so matching attributes are
+ * always at the same place in both trees.
+ */
+static void compare_attrs(TALLOC_CTX *ctx, compare_ctx_t *cc, fr_dict_attr_t const *text, fr_dict_attr_t const *image)
+{
+	fr_dict_attr_t const	*a, *b;
+	size_t			i, len;
+
+	len = talloc_array_length(text->children);
+	if (talloc_array_length(image->children) != len) fail("Different number of child bins", text->name);
+
+	for (i = 0; i < len; i++) {
+		for (a = text->children[i], b = image->children[i]; a && b; a = a->next, b = b->next) {
+			if (strcmp(a->name, b->name) != 0) fail("Different name in the image", a->name);
+			if ((a->vendor != b->vendor) || (a->attr != b->attr)) fail("Different number", a->name);
+			if (a->type != b->type) fail("Different type", a->name);
+			if (!flags_equal(&a->flags, &b->flags)) fail("Different flags", a->name);
+			if ((a->parent != text) || (b->parent != image) || (a->depth != b->depth)) {
+				fail("Different parent", a->name);
+			}
+
+			if ((fr_dict_attr_by_name(cc->text, a->name) == a) !=
+			    (fr_dict_attr_by_name(cc->image, b->name) == b)) fail("Different lookup by name", a->name);
+			if ((fr_dict_attr_child_by_num(text, a->attr) == a) !=
+			    (fr_dict_attr_child_by_num(image, b->attr) == b)) fail("Different lookup by number", a->name);
+
+			if ((cc->num_pairs % 1024) == 0) {
+				cc->pairs = talloc_realloc(ctx, cc->pairs, attr_pair_t, cc->num_pairs + 1024);
+			}
+			cc->pairs[cc->num_pairs].text = a;
+			cc->pairs[cc->num_pairs].image = b;
+			cc->num_pairs++;
+
+			compare_attrs(ctx, cc, a, b);
+		}
+		if (a || b) fail("Different number of children", text->name);
+	}
+}
+
+static int attr_pair_cmp(void const *one, void const *two)
+{
+	attr_pair_t const *a = one;
+	attr_pair_t const *b = two;
+
+	return (a->text > b->text) - (a->text < b->text);
+}
+
+static int count_walk(void *uctx, UNUSED void *data)
+{
+	compare_ctx_t *cc = uctx;
+
+	cc->num++;
+
+	return 0;
+}
+
+static int compare_vendor(void *uctx, void *data)
+{
+	compare_ctx_t		*cc = uctx;
+	fr_dict_vendor_t const	*a = data, *b;
+
+	cc->num++;
+
+	if (fr_dict_vendor_by_name(cc->image, a->name) != (int) a->vendorpec) fail("Vendor missing from the image", a->name);
+
+	/*
+	 *	Vendors may share a number, so the same one must win.
+	 */
+	a = fr_dict_vendor_by_num(cc->text, a->vendorpec);
+	b = fr_dict_vendor_by_num(cc->image, a->vendorpec);
+	if (!b || (strcmp(a->name, b->name) != 0)) fail("Different vendor by number", a->name);
+	if ((a->type != b->type) || (a->length != b->length) || (a->flags != b->flags)) fail("Different format", a->name);
+
+	return 0;
+}
+
+static int compare_enum(void *uctx, void *data)
+{
+	compare_ctx_t		*cc = uctx;
+	fr_dict_enum_t const	*a = data, *b;
+	attr_pair_t		find, *found;
+	char const		*a_name, *b_name;
+
+	cc->num++;
+
+	find.text = a->da;
+	found = bsearch(&find, cc->pairs, cc->num_pairs, sizeof(cc->pairs[0]), attr_pair_cmp);
+	if (!found) fail("Enum attribute isn't in the tree", a->name);
+
+	b = fr_dict_enum_by_name(cc->image, found->image, a->name);
+	if (!b || (b->value != a->value)) fail("Enum missing from the image", a->name);
+
+	/*
+	 *	Names may share a value, so the same one must win.
+	 */
+	a_name = fr_dict_enum_name_by_da(cc->text, a->da, a->value);
+	b_name = fr_dict_enum_name_by_da(cc->image, found->image, a->value);
+	if (!a_name || !b_name || (strcmp(a_name, b_name) != 0)) fail("Different enum by value", a->name);
+
+	return 0;
+}
+
+/** Check that an image holds everything the text dictionaries do
+ *
+ */
+static void test_compare(TALLOC_CTX *ctx, fr_dict_t *text, fr_dict_t *image)
+{
+	compare_ctx_t	cc;
+	unsigned int	num;
+
+	memset(&cc, 0, sizeof(cc));
+	cc.text = text;
+	cc.image = image;
+
+	compare_attrs(ctx, &cc, fr_dict_root(text), fr_dict_root(image));
+	qsort(cc.pairs, cc.num_pairs, sizeof(cc.pairs[0]), attr_pair_cmp);
+
+	cc.num = 0;
+	fr_dict_vendor_walk(image, count_walk, &cc);
+	num = cc.num;
+	cc.num = 0;
+	fr_dict_vendor_walk(text, compare_vendor, &cc);
+	if (cc.num != num) fail("Different number of vendors", "image");
+	if (debug_lvl) printf("%u vendors OK\n", num);
+
+	cc.num = 0;
+	fr_dict_enum_walk(image, count_walk, &cc);
+	num = cc.num;
+	cc.num = 0;
+	fr_dict_enum_walk(text, compare_enum, &cc);
+	if (cc.num != num) fail("Different number of enums", "image");
+	if (debug_lvl) printf("%u enums OK\n", num);
+
+	if (debug_lvl) printf("%u attributes OK\n", cc.num_pairs);
+
+	talloc_free(cc.pairs);
+}
+
+/** Check whether a dictionary was loaded from the image
+ *
+ * Cast attributes are only added the first time the text dictionaries are
+ * read in a process, but an image always has them.
+ */
+static bool from_image(fr_dict_t *dict)
+{
+	return (fr_dict_attr_by_name(dict, "Tmp-Cast-integer") != NULL);
+}
+
+int main(int argc, char *argv[])
+{
+	int		c;
+	char const	*dict_dir = DICTDIR;
+	char		share[PATH_MAX], dir[PATH_MAX], path[PATH_MAX + 32];
+	char		*top;
+	fr_dict_t	*text, *image, *dict;
+	struct timeval	times[2];
+	struct stat	stat_buf;
+	TALLOC_CTX	*autofree = talloc_init("main");
+
+	while ((c = getopt(argc, argv, "D:hx")) != EOF) switch (c) {
+		case 'D':
+			dict_dir = optarg;
+			break;
+
+		case 'x':
+			debug_lvl++;
+			break;
+
+		case 'h':
+		default:
+			usage();
+	}
+
+	if (!realpath(dict_dir, share)) {
+		fprintf(stderr, "Failed resolving %s: %s\n", dict_dir, fr_syserror(errno));
+		exit(1);
+	}
+
+	snprintf(dir, sizeof(dir), "%s/dict_image_test.XXXXXX", getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp");
+	if (!mkdtemp(dir)) {
+		fprintf(stderr, "Failed creating %s: %s\n", dir, fr_syserror(errno));
+		exit(1);
+	}
+
+	top = talloc_asprintf(autofree, "$INCLUDE %s/%s\n$INCLUDE dictionary.local\n$INCLUDE- dictionary.optional\n",
+			      share, FR_DICTIONARY_FILE);
+	write_file(dir, FR_DICTIONARY_FILE, top);
+	write_file(dir, "dictionary.local", LOCAL_A);
+
+	/*
+	 *	Everything in the text dictionaries must come back
+	 *	from the image.
+	 */
+	text = load(autofree, dir);
+	if (!from_image(text)) fail("Cast attributes missing", "text");
+
+	snprintf(path, sizeof(path), "%s/%s%s", dir, FR_DICTIONARY_FILE, FR_DICT_IMAGE_EXT);
+	if (fr_dict_image_write(text, path) < 0) {
+		fr_perror("dict_image_test");
+		exit(1);
+	}
+
+	image = load(autofree, dir);
+	if (!from_image(image)) fail("Image wasn't used", path);
+	test_compare(autofree, text, image);
+
+	/*
+	 *	Changing the modification time alone doesn't make the
+	 *	image stale.
+	 */
+	snprintf(path, sizeof(path), "%s/dictionary.local", dir);
+	if (stat(path, &stat_buf) < 0) {
+		fprintf(stderr, "Failed reading %s: %s\n", path, fr_syserror(errno));
+		exit(1);
+	}
+	times[0].tv_sec = times[1].tv_sec = stat_buf.st_mtime + 3600;
+	times[0].tv_usec = times[1].tv_usec = 0;
+	utimes(path, times);
+
+	dict = load(autofree, dir);
+	if (!from_image(dict)) fail("Image wasn't used after touching a file", path);
+	if (debug_lvl) printf("Touched file OK\n");
+
+	/*
+	 *	Changing the contents does, even when the size and
+	 *	modification time stay the same.
+	 */
+	write_file(dir, "dictionary.local", LOCAL_B);
+	utimes(path, times);
+
+	dict = load(autofree, dir);
+	if (from_image(dict)) fail("Image was used after a file changed", path);
+	if (!fr_dict_attr_by_name(dict, "Dict-Image-Test-B") || fr_dict_attr_by_name(dict, "Dict-Image-Test-A")) {
+		fail("Changed file wasn't read", path);
+	}
+	if (debug_lvl) printf("Changed file OK\n");
+
+	/*
+	 *	So does creating an optional file which didn't exist.
+	 */
+	write_file(dir, "dictionary.local", LOCAL_A);
+	utimes(path, times);
+	image = load(autofree, dir);
+	if (!from_image(image)) fail("Image wasn't used after restoring a file", path);
+
+	write_file(dir, "dictionary.optional", OPTIONAL);
+
+	dict = load(autofree, dir);
+	if (from_image(dict)) fail("Image was used after an optional file was created", path);
+	if (!fr_dict_attr_by_name(dict, "Dict-Image-Test-Optional")) fail("Optional file wasn't read", path);
+	if (debug_lvl) printf("Created file OK\n");
+
+	snprintf(path, sizeof(path), "%s/%s", dir, FR_DICTIONARY_FILE);
+	unlink(path);
+	snprintf(path, sizeof(path), "%s/%s%s", dir, FR_DICTIONARY_FILE, FR_DICT_IMAGE_EXT);
+	unlink(path);
+	snprintf(path, sizeof(path), "%s/dictionary.local", dir);
+	unlink(path);
+	snprintf(path, sizeof(path), "%s/dictionary.optional", dir);
+	unlink(path);
+	rmdir(dir);
+
+	talloc_free(autofree);
+
+	return 0;
+}
@@ -0,0 +1,6 @@
+TARGET := dict_image_test
+
+SOURCES		:= dict_image_test.c
+
+TGT_PREREQS	:= libfreeradius-util.a libfreeradius-server.a libfreeradius-radius.a
+TGT_LDLIBS	:= $(LIBS)
@@ -0,0 +1,298 @@
+/*
+ * histogram_test.c	Tests for log-linear histograms
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * Copyright 2016  The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include <freeradius-devel/libradius.h>
+#include <freeradius-devel/histogram.h>
+#include <sys/time.h>
+
+#ifdef HAVE_GETOPT_H
+#	include <getopt.h>
+#endif
+
+#define HIGHEST		(UINT64_C(1) << 40)
+
+static int		debug_lvl = 0;
+
+static void NEVER_RETURNS usage(void)
+{
+	fprintf(stderr, "usage: histogram_test [OPTS]\n");
+	fprintf(stderr, "  -n count               number of values to benchmark (0 to skip).\n");
+	fprintf(stderr, "  -x                     Debugging mode.\n");
+
+	exit(1);
+}
+
+static void NEVER_RETURNS fail(char const *msg, uint64_t value, uint64_t got, uint64_t expected)
+{
+	fprintf(stderr, "%s: value %" PRIu64 " got %" PRIu64 " expected %" PRIu64 "\n",
+		msg, value, got, expected);
+	exit(1);
+}
+
+/** Return the highest value which shares a bucket with "value"
+ *
+ *  Recording "value" and something much larger, the median is the
+ *  top of the lower value's bucket.
+ */
+static uint64_t bucket_top(fr_histogram_t *h, uint64_t value)
+{
+	uint64_t top;
+
+	fr_histogram_reset(h);
+	fr_histogram_add(h, value);
+	fr_histogram_add(h, HIGHEST);
+
+	top = fr_histogram_percentile(h, 50);
+	if (top == HIGHEST) fail("Bucket runs into the highest value", value, top, 0);
+
+	return top;
+}
+
+static void test_buckets(TALLOC_CTX *ctx)
+{
+	unsigned int	precision;
+	uint64_t	value;
+
+	for (precision = 1; precision <= 14; precision++) {
+		fr_histogram_t	*h;
+
+		h = fr_histogram_alloc(ctx, HIGHEST, precision);
+		if (!h) {
+			fprintf(stderr, "Failed allocating histogram: %s\n", fr_strerror());
+			exit(1);
+		}
+
+		/*
+		 *	Small values get a bucket each.
+		 */
+		for (value = 0; value < (UINT64_C(2) << precision); value++) {
+			uint64_t top = bucket_top(h, value);
+
+			if (top != value) fail("Small value shares a bucket", value, top, value);
+		}
+
+		/*
+		 *	Larger values share buckets, but each bucket is
+		 *	no wider than 1/2^precision of the values in it,
+		 *	and the next value up starts a new bucket.
+		 */
+		for (value = UINT64_C(2) << precision; value < (HIGHEST >> 1); value += (value / 7) + 1) {
+			uint64_t top = bucket_top(h, value);
+
+			if (top < value) fail("Bucket top below value", value, top, value);
+			if ((top - value) > (value >> precision)) {
+				fail("Bucket too wide", value, top, value + (value >> precision));
+			}
+			if (bucket_top(h, top) != top) fail("Bucket top moved", value, bucket_top(h, top), top);
+			if (bucket_top(h, top + 1) <= top) fail("Next bucket overlaps", value, bucket_top(h, top + 1), top);
+		}
+
+		talloc_free(h);
+	}
+
+	if (debug_lvl) printf("Bucket placement OK\n");
+}
+
+static void test_overflow(TALLOC_CTX *ctx)
+{
+	fr_histogram_t	*h;
+	int		i;
+	uint64_t	value;
+
+	if (fr_histogram_alloc(ctx, 1000, 0) || fr_histogram_alloc(ctx, 1000, 15)) {
+		fprintf(stderr, "Histogram allocated with invalid precision\n");
+		exit(1);
+	}
+
+	h = fr_histogram_alloc(ctx, 1000, 4);
+	if (!h) {
+		fprintf(stderr, "Failed allocating histogram: %s\n", fr_strerror());
+		exit(1);
+	}
+
+	for (i = 0; i < 10; i++) fr_histogram_add(h, 1);
+	fr_histogram_add(h, 5000000);
+	fr_histogram_add(h, 2000000);
+
+	/*
+	 *	Values past "highest" share the last bucket, but min
+	 *	and max stay exact.
+	 */
+	if (fr_histogram_count(h) != 12) fail("Wrong count", 0, fr_histogram_count(h), 12);
+	if (fr_histogram_min(h) != 1) fail("Wrong min", 0, fr_histogram_min(h), 1);
+	if (fr_histogram_max(h) != 5000000) fail("Wrong max", 0, fr_histogram_max(h), 5000000);
+	if (fr_histogram_percentile(h, 50) != 1) fail("Wrong median", 0, fr_histogram_percentile(h, 50), 1);
+
+	/*
+	 *	Percentiles in the last bucket saturate at the top of
+	 *	that bucket, which is at least "highest".
+	 */
+	value = fr_histogram_percentile(h, 99);
+	if ((value < 1000) || (value >= 2000000)) fail("Overflowed percentile not saturated", 99, value, 1000);
+	if (fr_histogram_percentile(h, 90) != value) {
+		fail("Overflowed percentiles differ", 90, fr_histogram_percentile(h, 90), value);
+	}
+	if (fr_histogram_percentile(h, 100) != 5000000) fail("Wrong p100", 100, fr_histogram_percentile(h, 100), 5000000);
+
+	fr_histogram_reset(h);
+	if (fr_histogram_count(h) || fr_histogram_min(h) || fr_histogram_max(h) || fr_histogram_percentile(h, 50)) {
+		fprintf(stderr, "Histogram not empty after reset\n");
+		exit(1);
+	}
+
+	talloc_free(h);
+
+	if (debug_lvl) printf("Overflow OK\n");
+}
+
+static void test_percentiles(TALLOC_CTX *ctx)
+{
+	fr_histogram_t	*h, *a, *b;
+	uint64_t	value;
+	size_t		i;
+	static struct {
+		double		percentile;
+		uint64_t	expected;
+	} const		expect[] = {
+		{ 0,	1 },
+		{ 50,	5000 },
+		{ 90,	9000 },
+		{ 99,	9900 },
+		{ 99.9,	9990 },
+		{ 100,	10000 },
+	};
+
+	h = fr_histogram_alloc(ctx, 1000000, 7);
+	a = fr_histogram_alloc(ctx, 1000000, 7);
+	b = fr_histogram_alloc(ctx, 1000000, 7);
+	if (!h || !a || !b) {
+		fprintf(stderr, "Failed allocating histogram: %s\n", fr_strerror());
+		exit(1);
+	}
+
+	/*
+	 *	Record the same values directly, and split across two
+	 *	histograms which are then merged.
+	 */
+	for (value = 1; value <= 10000; value++) {
+		fr_histogram_add(h, value);
+		fr_histogram_add((value & 0x01) ? a : b, value);
+	}
+
+	if (fr_histogram_merge(a, b) < 0) {
+		fprintf(stderr, "Failed merging histograms: %s\n", fr_strerror());
+		exit(1);
+	}
+
+	if (fr_histogram_mean(h) != 5000.5) {
+		fprintf(stderr, "Wrong mean %f, expected 5000.5\n", fr_histogram_mean(h));
+		exit(1);
+	}
+
+	/*
+	 *	With 7 bits of precision, percentiles are within 1%.
+	 */
+	for (i = 0; i < sizeof(expect) / sizeof(expect[0]); i++) {
+		uint64_t got = fr_histogram_percentile(h, expect[i].percentile);
+
+		if ((got < expect[i].expected) || ((got - expect[i].expected) > (expect[i].expected / 100))) {
+			fail("Wrong percentile", (uint64_t) expect[i].percentile, got, expect[i].expected);
+		}
+
+		if (fr_histogram_percentile(a, expect[i].percentile) != got) {
+			fail("Merged percentile differs", (uint64_t) expect[i].percentile,
+			     fr_histogram_percentile(a, expect[i].percentile), got);
+		}
+
+		if (debug_lvl) printf("p%g = %" PRIu64 "\n", expect[i].percentile, got);
+	}
+
+	/*
+	 *	Histograms with different layouts can't be merged.
+	 */
+	talloc_free(b);
+	b = fr_histogram_alloc(ctx, 1000000, 6);
+	if (fr_histogram_merge(a, b) == 0) {
+		fprintf(stderr, "Merged histograms with different layouts\n");
+		exit(1);
+	}
+
+	talloc_free(h);
+	talloc_free(a);
+	talloc_free(b);
+
+	if (debug_lvl) printf("Percentiles OK\n");
+}
+
+static void benchmark(TALLOC_CTX *ctx, unsigned int count)
+{
+	unsigned int	i;
+	fr_histogram_t	*h;
+	struct timeval	start, end;
+	uint64_t	usec;
+
+	h = fr_histogram_alloc(ctx, 10000000, 7);
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < count; i++) fr_histogram_add(h, fr_rand() % 10000000);
+	gettimeofday(&end, NULL);
+
+	usec = ((end.tv_sec - start.tv_sec) * 1000000) + (end.tv_usec - start.tv_usec);
+
+	printf("%u values recorded in %" PRIu64 "us, p99 %" PRIu64 "\n",
+	       count, usec, fr_histogram_percentile(h, 99));
+
+	talloc_free(h);
+}
+
+int main(int argc, char *argv[])
+{
+	int		c;
+	unsigned int	count = 0;
+	TALLOC_CTX	*autofree = talloc_init("main");
+
+	while ((c = getopt(argc, argv, "hn:x")) != EOF) switch (c) {
+		case 'n':
+			count = atoi(optarg);
+			break;
+
+		case 'x':
+			debug_lvl++;
+			break;
+
+		case 'h':
+		default:
+			usage();
+	}
+
+	test_buckets(autofree);
+	test_overflow(autofree);
+	test_percentiles(autofree);
+
+	if (count) benchmark(autofree, count);
+
+	talloc_free(autofree);
+
+	return 0;
+}
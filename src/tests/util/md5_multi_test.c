@@ -0,0 +1,322 @@
+/*
+ * md5_multi_test.c	Tests for multi-buffer MD5 and batch packet signing
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * Copyright 2016  The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include <freeradius-devel/libradius.h>
+#include <freeradius-devel/md5.h>
+#include <string.h>
+#include <sys/time.h>
+
+#ifdef HAVE_GETOPT_H
+#	include <getopt.h>
+#endif
+
+#define MAX_BUFFERS	(37)
+#define MAX_LEN		(300)
+#define HDR_LEN		(20)
+
+static int		debug_lvl = 0;
+
+static void NEVER_RETURNS usage(void)
+{
+	fprintf(stderr, "usage: md5_multi_test [OPTS]\n");
+	fprintf(stderr, "  -l length              packet length to benchmark.\n");
+	fprintf(stderr, "  -n count               number of packets to benchmark (0 to skip).\n");
+	fprintf(stderr, "  -x                     Debugging mode.\n");
+
+	exit(1);
+}
+
+static void rand_buffer(uint8_t *p, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) p[i] = fr_rand() & 0xff;
+}
+
+static void test_md5(void)
+{
+	unsigned int	i, num;
+	uint8_t		data[MAX_BUFFERS][MAX_LEN];
+	uint8_t		suffix[MAX_BUFFERS][MAX_LEN];
+	uint8_t const	*in[MAX_BUFFERS], *sfx[MAX_BUFFERS];
+	size_t		inlen[MAX_BUFFERS], sfxlen[MAX_BUFFERS];
+	uint8_t		out[MAX_BUFFERS][MD5_DIGEST_LENGTH];
+	uint8_t		expected[MD5_DIGEST_LENGTH];
+
+	for (i = 0; i < MAX_BUFFERS; i++) {
+		rand_buffer(data[i], sizeof(data[i]));
+		rand_buffer(suffix[i], sizeof(suffix[i]));
+	}
+
+	/*
+	 *	Vary the number of buffers so every lane count is
+	 *	exercised, and the lengths so that buffers finish on
+	 *	different blocks, and padding spills into a new block.
+	 */
+	for (num = 1; num <= MAX_BUFFERS; num++) {
+		for (i = 0; i < num; i++) {
+			in[i] = data[i];
+			inlen[i] = (num * 7 + i * 13) % MAX_LEN;
+			sfx[i] = suffix[i];
+			sfxlen[i] = (i & 0x01) ? (num + i) % 80 : 0;
+		}
+
+		fr_md5_calc_multi(out, in, inlen, NULL, NULL, num);
+		for (i = 0; i < num; i++) {
+			fr_md5_calc(expected, in[i], inlen[i]);
+			if (memcmp(out[i], expected, sizeof(expected)) != 0) {
+				fprintf(stderr, "MD5 mismatch for buffer %u of %u (length %zu)\n", i, num, inlen[i]);
+				exit(1);
+			}
+		}
+
+		fr_md5_calc_multi(out, in, inlen, sfx, sfxlen, num);
+		for (i = 0; i < num; i++) {
+			FR_MD5_CTX ctx;
+
+			fr_md5_init(&ctx);
+			fr_md5_update(&ctx, in[i], inlen[i]);
+			fr_md5_update(&ctx, sfx[i], sfxlen[i]);
+			fr_md5_final(expected, &ctx);
+			if (memcmp(out[i], expected, sizeof(expected)) != 0) {
+				fprintf(stderr, "MD5 mismatch for buffer %u of %u (length %zu, suffix %zu)\n",
+					i, num, inlen[i], sfxlen[i]);
+				exit(1);
+			}
+		}
+
+		/*
+		 *	Keys longer than a block are hashed first.
+		 */
+		for (i = 0; i < num; i++) sfxlen[i] = (num * 11 + i * 5) % 100;
+
+		fr_hmac_md5_multi(out, in, inlen, sfx, sfxlen, num);
+		for (i = 0; i < num; i++) {
+			fr_hmac_md5(expected, in[i], inlen[i], sfx[i], sfxlen[i]);
+			if (memcmp(out[i], expected, sizeof(expected)) != 0) {
+				fprintf(stderr, "HMAC-MD5 mismatch for buffer %u of %u (length %zu, key %zu)\n",
+					i, num, inlen[i], sfxlen[i]);
+				exit(1);
+			}
+		}
+	}
+
+	if (debug_lvl) printf("MD5 and HMAC-MD5 results match\n");
+}
+
+/** Build a packet with a Message-Authenticator, and some filler attributes
+ *
+ */
+static RADIUS_PACKET *packet_alloc(TALLOC_CTX *ctx, unsigned int code, int id, size_t len)
+{
+	RADIUS_PACKET	*packet;
+	uint8_t		*p, *end;
+
+	if (len < (HDR_LEN + 18)) len = HDR_LEN + 18;
+
+	packet = fr_radius_alloc(ctx, true);
+	packet->code = code;
+	packet->id = id;
+	packet->data_len = len;
+	packet->data = talloc_zero_array(packet, uint8_t, len);
+
+	packet->data[0] = code;
+	packet->data[1] = id;
+	packet->data[2] = (len >> 8) & 0xff;
+	packet->data[3] = len & 0xff;
+	memcpy(packet->data + 4, packet->vector, AUTH_VECTOR_LEN);
+
+	packet->offset = HDR_LEN;
+	packet->data[HDR_LEN] = PW_MESSAGE_AUTHENTICATOR;
+	packet->data[HDR_LEN + 1] = 18;
+
+	p = packet->data + HDR_LEN + 18;
+	end = packet->data + len;
+	while (p < end) {
+		size_t attrlen = end - p;
+
+		if (attrlen > 255) attrlen = 255;
+		if ((end - p - attrlen) == 1) attrlen--;	/* don't leave a 1 byte tail */
+		if (attrlen < 2) break;
+
+		p[0] = PW_USER_NAME;
+		p[1] = attrlen;
+		rand_buffer(p + 2, attrlen - 2);
+		p += attrlen;
+	}
+
+	return packet;
+}
+
+static void test_packets(TALLOC_CTX *ctx)
+{
+	unsigned int	i;
+	RADIUS_PACKET	*request[MAX_BUFFERS], *reply[MAX_BUFFERS], *copy[MAX_BUFFERS];
+	char const	*secret[MAX_BUFFERS], *bad[MAX_BUFFERS];
+	int		rcode[MAX_BUFFERS];
+
+	for (i = 0; i < MAX_BUFFERS; i++) {
+		secret[i] = talloc_asprintf(ctx, "testing%u", i * 7);
+		bad[i] = talloc_asprintf(ctx, "testing%u", i * 7 + 1);
+
+		request[i] = packet_alloc(ctx, (i & 0x01) ? PW_CODE_ACCOUNTING_REQUEST : PW_CODE_ACCESS_REQUEST,
+					  i, 30 + i * 17);
+		reply[i] = packet_alloc(ctx, (i & 0x01) ? PW_CODE_ACCOUNTING_RESPONSE : PW_CODE_ACCESS_ACCEPT,
+					i, 40 + i * 23);
+	}
+
+	if (fr_radius_sign_multi(request, NULL, secret, rcode, MAX_BUFFERS) < 0) {
+		fprintf(stderr, "Failed signing requests: %s\n", fr_strerror());
+		exit(1);
+	}
+	if (fr_radius_sign_multi(reply, (RADIUS_PACKET const * const *) request, secret, rcode, MAX_BUFFERS) < 0) {
+		fprintf(stderr, "Failed signing replies: %s\n", fr_strerror());
+		exit(1);
+	}
+
+	/*
+	 *	The batch signatures must match the ones produced
+	 *	one packet at a time.
+	 */
+	for (i = 0; i < MAX_BUFFERS; i++) {
+		copy[i] = fr_radius_copy(ctx, reply[i]);
+		copy[i]->data = talloc_memdup(copy[i], reply[i]->data, reply[i]->data_len);
+		copy[i]->data_len = reply[i]->data_len;
+		copy[i]->offset = reply[i]->offset;
+		memset(copy[i]->data + 4, 0, AUTH_VECTOR_LEN);
+		memset(copy[i]->data + copy[i]->offset + 2, 0, AUTH_VECTOR_LEN);
+
+		if (fr_radius_sign(copy[i], request[i], secret[i]) < 0) {
+			fprintf(stderr, "Failed signing reply %u: %s\n", i, fr_strerror());
+			exit(1);
+		}
+		if (memcmp(copy[i]->data, reply[i]->data, reply[i]->data_len) != 0) {
+			fprintf(stderr, "Signature mismatch for reply %u\n", i);
+			exit(1);
+		}
+	}
+
+	if (fr_radius_verify_multi(request, NULL, secret, rcode, MAX_BUFFERS) < 0) {
+		fprintf(stderr, "Failed verifying requests: %s\n", fr_strerror());
+		exit(1);
+	}
+	if (fr_radius_verify_multi(reply, request, secret, rcode, MAX_BUFFERS) < 0) {
+		fprintf(stderr, "Failed verifying replies: %s\n", fr_strerror());
+		exit(1);
+	}
+
+	/*
+	 *	Every packet checked with the wrong secret must fail.
+	 */
+	fr_radius_verify_multi(reply, request, bad, rcode, MAX_BUFFERS);
+	for (i = 0; i < MAX_BUFFERS; i++) {
+		if (rcode[i] == 0) {
+			fprintf(stderr, "Reply %u verified with the wrong secret\n", i);
+			exit(1);
+		}
+	}
+
+	if (debug_lvl) printf("Batch sign and verify results match\n");
+}
+
+static uint64_t usec_since(struct timeval const *start)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+
+	return ((now.tv_sec - start->tv_sec) * 1000000) + (now.tv_usec - start->tv_usec);
+}
+
+static void benchmark(TALLOC_CTX *ctx, unsigned int count, size_t len)
+{
+	unsigned int	i;
+	RADIUS_PACKET	**request;
+	char const	**secret;
+	int		*rcode;
+	uint64_t	single, multi;
+	struct timeval	start;
+
+	request = talloc_array(ctx, RADIUS_PACKET *, count);
+	secret = talloc_array(ctx, char const *, count);
+	rcode = talloc_array(ctx, int, count);
+
+	for (i = 0; i < count; i++) {
+		request[i] = packet_alloc(request, PW_CODE_ACCOUNTING_REQUEST, i & 0xff, len);
+		secret[i] = talloc_strdup(secret, "testing123");
+	}
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < count; i++) fr_radius_sign(request[i], NULL, secret[i]);
+	for (i = 0; i < count; i++) fr_radius_verify(request[i], NULL, secret[i]);
+	single = usec_since(&start);
+
+	gettimeofday(&start, NULL);
+	fr_radius_sign_multi(request, NULL, secret, rcode, count);
+	fr_radius_verify_multi(request, NULL, secret, rcode, count);
+	multi = usec_since(&start);
+
+	printf("%u packets of %zu bytes, sign and verify: single %" PRIu64 "us, multi %" PRIu64 "us\n",
+	       count, request[0]->data_len, single, multi);
+
+	talloc_free(request);
+	talloc_free(secret);
+	talloc_free(rcode);
+}
+
+int main(int argc, char *argv[])
+{
+	int		c;
+	unsigned int	count = 0;
+	size_t		len = 200;
+	TALLOC_CTX	*autofree = talloc_init("main");
+
+	while ((c = getopt(argc, argv, "hl:n:x")) != EOF) switch (c) {
+		case 'l':
+			len = atoi(optarg);
+			if (len > 4096) len = 4096;
+			break;
+
+		case 'n':
+			count = atoi(optarg);
+			break;
+
+		case 'x':
+			debug_lvl++;
+			break;
+
+		case 'h':
+		default:
+			usage();
+	}
+
+	test_md5();
+	test_packets(autofree);
+
+	if (count) benchmark(autofree, count, len);
+
+	talloc_free(autofree);
+
+	return 0;
+}
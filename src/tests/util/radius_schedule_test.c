@@ -26,6 +26,7 @@ RCSID("$Id$")
 #include <freeradius-devel/inet.h>
 #include <freeradius-devel/radius.h>
 #include <freeradius-devel/md5.h>
+#include <freeradius-devel/udp.h>
 #include <freeradius-devel/rad_assert.h>
 
 #include <sys/event.h>
@@ -42,13 +43,12 @@ RCSID("$Id$")
 
 #define MPRINT1 if (debug_lvl) printf
 
-typedef struct fr_packet_ctx_t {
-	uint8_t		vector[16];
-	uint8_t		id;
-
-	struct sockaddr_storage src;
-	socklen_t	salen;
-} fr_packet_ctx_t;
+/*
+ *	The receiver owns the packet_ctx, so we remember the request
+ *	vectors ourselves.  Each request is decoded and encoded by the
+ *	same worker thread.
+ */
+static _Thread_local uint8_t	vectors[256][16];
 
 static int		debug_lvl = 0;
 static fr_ipaddr_t	my_ipaddr;
@@ -56,18 +56,84 @@ static int		my_port;
 static char const	*secret = "testing123";
 
 /*
- *	@todo fix this...
- *
- *	Declare these here until we move all of the new field to the REQUEST.
+ *	The receiver checks each batch of requests, and signs each batch
+ *	of replies, with the multi-buffer MD5 functions.
+ */
+static void test_verify(UNUSED void const *ctx, uint8_t * const *packet, size_t const *packet_len,
+			int *rcode, int num)
+{
+	int		i;
+	RADIUS_PACKET	packets[UDP_MMSG_MAX];
+	RADIUS_PACKET	*p[UDP_MMSG_MAX];
+	char const	*secrets[UDP_MMSG_MAX];
+
+	rad_assert(num <= UDP_MMSG_MAX);
+
+	for (i = 0; i < num; i++) {
+		memset(&packets[i], 0, sizeof(packets[i]));
+		packets[i].src_ipaddr.af = AF_INET;
+		packets[i].data = packet[i];
+		packets[i].data_len = packet_len[i];
+		if (packet_len[i] >= 20) {
+			packets[i].code = packet[i][0];
+			packets[i].id = packet[i][1];
+			memcpy(packets[i].vector, packet[i] + 4, sizeof(packets[i].vector));
+		}
+
+		p[i] = &packets[i];
+		secrets[i] = secret;
+	}
+
+	(void) fr_radius_verify_multi(p, NULL, secrets, rcode, num);
+
+	for (i = 0; i < num; i++) {
+		if (rcode[i] < 0) MPRINT1("\t\tVERIFY !!! %s\n", fr_strerror());
+	}
+}
+
+/*
+ *	The replies hold the request authenticator, which is what a
+ *	response authenticator is calculated over.
  */
-extern int		fr_socket_server_base(int proto, fr_ipaddr_t *ipaddr, int *port, char const *port_name, bool async);
-extern int		fr_socket_server_bind(int sockfd, fr_ipaddr_t *ipaddr, int *port, char const *interface);
+static void test_sign(UNUSED void const *ctx, uint8_t * const *packet, size_t const *packet_len,
+		      int *rcode, int num)
+{
+	int		i;
+	RADIUS_PACKET	packets[UDP_MMSG_MAX], originals[UDP_MMSG_MAX];
+	RADIUS_PACKET	*p[UDP_MMSG_MAX];
+	RADIUS_PACKET const *o[UDP_MMSG_MAX];
+	char const	*secrets[UDP_MMSG_MAX];
+
+	rad_assert(num <= UDP_MMSG_MAX);
+
+	for (i = 0; i < num; i++) {
+		memset(&packets[i], 0, sizeof(packets[i]));
+		memset(&originals[i], 0, sizeof(originals[i]));
+		packets[i].data = packet[i];
+		packets[i].data_len = packet_len[i];
+		packets[i].offset = -1;
+		if (packet_len[i] >= 20) {
+			packets[i].code = packet[i][0];
+			packets[i].id = packet[i][1];
+			packets[i].offset = 0;
+			originals[i].code = PW_CODE_ACCESS_REQUEST;
+			memcpy(originals[i].vector, packet[i] + 4, sizeof(originals[i].vector));
+		}
+
+		p[i] = &packets[i];
+		o[i] = &originals[i];
+		secrets[i] = secret;
+	}
+
+	(void) fr_radius_sign_multi(p, o, secrets, rcode, num);
+}
 
 static int test_decode(void const *packet_ctx, uint8_t *const data, size_t data_len, REQUEST *request)
 {
-	fr_packet_ctx_t const *pc = packet_ctx;
+	if (data_len < 20) return -1;
 
-	request->number = pc->id;
+	request->number = data[1];
+	memcpy(vectors[data[1]], data + 4, sizeof(vectors[0]));
 
 	if (!debug_lvl) return 0;
 
@@ -78,22 +144,14 @@ static int test_decode(void const *packet_ctx, uint8_t *const data, size_t data_
 
 static ssize_t test_encode(void const *packet_ctx, REQUEST *request, uint8_t *buffer, size_t buffer_len)
 {
-	FR_MD5_CTX context;
-	fr_packet_ctx_t const *pc = packet_ctx;
-
 	MPRINT1("\t\tENCODE >>> request %zd - data %p %p room %zd\n", request->number, packet_ctx, buffer, buffer_len);
 
 	buffer[0] = PW_CODE_ACCESS_ACCEPT;
-	buffer[1] = pc->id;
+	buffer[1] = request->number;
 	buffer[2] = 0;
 	buffer[3] = 20;
 
-	memcpy(buffer + 4, pc->vector, 16);
-	
-	fr_md5_init(&context);
-	fr_md5_update(&context, buffer, 20);
-	fr_md5_update(&context, (uint8_t const *) secret, strlen(secret));
-	fr_md5_final(buffer + 4, &context);
+	memcpy(buffer + 4, vectors[request->number], 16);
 
 	return 20;
 }
@@ -118,6 +176,8 @@ static fr_transport_t transport = {
 	.encode = test_encode,
 	.nak = test_nak,
 	.process = test_process,
+	.verify = test_verify,
+	.sign = test_sign,
 };
 
 static fr_transport_t *transports = &transport;
@@ -139,7 +199,7 @@ int main(int argc, char *argv[])
 	int num_networks = 1;
 	int num_workers = 2;
 	uint16_t	port16 = 0;
-	int sockfd;
+	int i, sockfd;
 	TALLOC_CTX	*autofree = talloc_init("main");
 	fr_schedule_t	*sched;
 
@@ -185,6 +245,11 @@ int main(int argc, char *argv[])
 			usage();
 	}
 
+	/*
+	 *	The sign and verify functions need talloc'd secrets.
+	 */
+	secret = talloc_strdup(autofree, secret);
+
 #if 0
 	argc -= (optind - 1);
 	argv += (optind - 1);
@@ -196,29 +261,39 @@ int main(int argc, char *argv[])
 		exit(1);
 	}
 
-	sockfd = fr_socket_server_base(IPPROTO_UDP, &my_ipaddr, &my_port, NULL, true);
-	if (sockfd < 0) {
-		fprintf(stderr, "radius_test: Failed creating socket: %s\n", fr_strerror());
-		exit(1);
-	}
-
-	if (fr_socket_server_bind(sockfd, &my_ipaddr, &my_port, NULL) < 0) {
-		fprintf(stderr, "radius_test: Failed binding to socket: %s\n", fr_strerror());
-		exit(1);
-	}
-
-#if 0
 	/*
-	 *	Set up the KQ filter for reading.
+	 *	One socket per network thread, all bound to the same
+	 *	address and port.  The kernel shards packets across
+	 *	them.
 	 */
-	EV_SET(&events[0], sockfd, EVFILT_READ, EV_ADD | EV_ENABLE, 0, 0, NULL);
-	if (kevent(kq_master, events, 1, NULL, 0, NULL) < 0) {
-		fprintf(stderr, "Failed setting KQ for EVFILT_READ: %s\n", fr_strerror());
-		exit(1);
+	for (i = 0; i < fr_schedule_num_inputs(sched); i++) {
+		int *fd_ctx;
+
+		sockfd = fr_socket_server_base(IPPROTO_UDP, &my_ipaddr, &my_port, NULL, true);
+		if (sockfd < 0) {
+			fprintf(stderr, "radius_test: Failed creating socket: %s\n", fr_strerror());
+			exit(1);
+		}
+
+		if ((num_networks > 1) && (fr_socket_server_reuse_port(sockfd) < 0)) {
+			fprintf(stderr, "radius_test: Failed setting SO_REUSEPORT: %s\n", fr_strerror());
+			exit(1);
+		}
+
+		if (fr_socket_server_bind(sockfd, &my_ipaddr, &my_port, NULL) < 0) {
+			fprintf(stderr, "radius_test: Failed binding to socket: %s\n", fr_strerror());
+			exit(1);
+		}
+
+		/*
+		 *	Each socket gets its own context, which lives
+		 *	as long as the scheduler does.
+		 */
+		fd_ctx = talloc(autofree, int);
+		*fd_ctx = sockfd;
+
+		(void) fr_schedule_socket_add(sched, sockfd, fd_ctx, &transport);
 	}
-#endif
-
-	(void) fr_schedule_socket_add(sched, sockfd, &sockfd, &transport);
 
 	sleep(10);
 
@@ -22,6 +22,7 @@
 
 RCSID("$Id$")
 
+#include <freeradius-devel/libradius.h>
 #include <freeradius-devel/util/schedule.h>
 #include <freeradius-devel/util/time.h>
 #include <freeradius-devel/inet.h>
@@ -41,24 +42,37 @@ RCSID("$Id$")
 #include <pthread.h>
 #endif
 
-#define MPRINT1 if (debug_lvl) printf
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/stdatomic.h>
+#endif
 
-typedef struct fr_packet_ctx_t {
-	uint8_t		vector[16];
-	uint8_t		id;
+#define MPRINT1 if (debug_lvl) printf
 
-	struct sockaddr_storage src;
-	socklen_t	salen;
-} fr_packet_ctx_t;
+/*
+ *	The receiver owns the packet_ctx, so we remember the request
+ *	vectors ourselves.  Each request is decoded and encoded by the
+ *	same worker thread.
+ */
+static _Thread_local uint8_t	vectors[256][16];
 
 static int		debug_lvl = 0;
 static char const	*secret = "testing123";
 
+/*
+ *	The first request keeps its worker busy, until we've checked
+ *	that the other workers are picked instead of it.
+ */
+static atomic_int	busy_kq = ATOMIC_VAR_INIT(-1);
+static atomic_bool	busy_done = ATOMIC_VAR_INIT(false);
+
 static int test_decode(void const *packet_ctx, uint8_t *const data, size_t data_len, REQUEST *request)
 {
-	fr_packet_ctx_t const *pc = packet_ctx;
+	if (data_len < 20) return -1;
 
-	request->number = pc->id;
+	request->number = data[1];
+	memcpy(vectors[data[1]], data + 4, sizeof(vectors[0]));
 
 	if (!debug_lvl) return 0;
 
@@ -70,16 +84,15 @@ static int test_decode(void const *packet_ctx, uint8_t *const data, size_t data_
 static ssize_t test_encode(void const *packet_ctx, REQUEST *request, uint8_t *buffer, size_t buffer_len)
 {
 	FR_MD5_CTX context;
-	fr_packet_ctx_t const *pc = packet_ctx;
 
 	MPRINT1("\t\tENCODE >>> request %zd - data %p %p room %zd\n", request->number, packet_ctx, buffer, buffer_len);
 
 	buffer[0] = PW_CODE_ACCESS_ACCEPT;
-	buffer[1] = pc->id;
+	buffer[1] = request->number;
 	buffer[2] = 0;
 	buffer[3] = 20;
 
-	memcpy(buffer + 4, pc->vector, 16);
+	memcpy(buffer + 4, vectors[request->number], 16);
 	
 	fr_md5_init(&context);
 	fr_md5_update(&context, buffer, 20);
@@ -98,7 +111,14 @@ static size_t test_nak(void const *packet_ctx, uint8_t *const packet, size_t pac
 
 static fr_transport_final_t test_process(REQUEST *request, fr_transport_action_t action)
 {
+	int kq = -1;
+
 	MPRINT1("\t\tPROCESS --- request %zd action %d\n", request->number, action);
+
+	if (atomic_compare_exchange_strong(&busy_kq, &kq, fr_event_list_kq(request->el))) {
+		while (!atomic_load(&busy_done)) usleep(1000);
+	}
+
 	return FR_TRANSPORT_REPLY;
 }
 
@@ -113,6 +133,145 @@ static fr_transport_t transport = {
 
 static fr_transport_t *transports = &transport;
 
+static void NEVER_RETURNS fail(char const *what)
+{
+	fprintf(stderr, "schedule_test: %s\n", what);
+	exit(1);
+}
+
+/** Check that a busy worker isn't picked while others are idle
+ *
+ *  One request is sent to the scheduler, and its worker doesn't
+ *  finish it until we're done.  All of the other workers are idle,
+ *  so their load is lower.
+ *
+ * @param[in] sched the scheduler, with at least two workers
+ */
+static void test_busy_worker(fr_schedule_t *sched)
+{
+	int			i, kq, sockfd, clientfd;
+	static int		sock_ctx;
+	struct sockaddr_in	sin;
+	socklen_t		sinlen = sizeof(sin);
+	struct timeval		tv;
+	uint8_t			packet[20];
+	fr_time_t		start;
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+	if ((sockfd < 0) || (bind(sockfd, (struct sockaddr *) &sin, sizeof(sin)) < 0) ||
+	    (getsockname(sockfd, (struct sockaddr *) &sin, &sinlen) < 0) ||
+	    (fr_nonblock(sockfd) < 0)) fail("Failed creating server socket");
+
+	if (fr_schedule_socket_add(sched, sockfd, &sock_ctx, &transport) < 0) fail("Failed adding socket");
+
+	clientfd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (clientfd < 0) fail("Failed creating client socket");
+
+	tv.tv_sec = 5;
+	tv.tv_usec = 0;
+	(void) setsockopt(clientfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+	memset(packet, 0, sizeof(packet));
+	packet[0] = PW_CODE_ACCESS_REQUEST;
+	packet[1] = 1;
+	packet[3] = sizeof(packet);
+
+	if (sendto(clientfd, packet, sizeof(packet), 0, (struct sockaddr *) &sin, sinlen) < 0) {
+		fail("Failed sending request");
+	}
+
+	start = fr_time();
+	while ((kq = atomic_load(&busy_kq)) < 0) {
+		if ((fr_time() - start) > (5 * (fr_time_t) NANOSEC)) fail("Request was never processed");
+		usleep(1000);
+	}
+
+	MPRINT1("Worker with KQ %d is busy\n", kq);
+
+	for (i = 0; i < 1000; i++) {
+		if (fr_schedule_get_worker_kq(sched) == kq) fail("Picked the busy worker");
+	}
+
+	atomic_store(&busy_done, true);
+
+	if (recv(clientfd, packet, sizeof(packet), 0) != sizeof(packet)) fail("No reply from the busy worker");
+	if ((packet[0] != PW_CODE_ACCESS_ACCEPT) || (packet[1] != 1)) fail("Bad reply from the busy worker");
+
+	close(clientfd);
+}
+
+/** Check that a batch of packets is read and answered
+ *
+ *  The packets are queued on the socket before it is added to the
+ *  scheduler, so the receiver reads them all with one call, and
+ *  allocates all of their messages from one reservation.
+ *
+ * @param[in] sched the scheduler
+ * @param[in] num the number of packets to send
+ */
+static void test_batch(fr_schedule_t *sched, int num)
+{
+	int			i, sockfd, clientfd;
+	static int		sock_ctx;
+	struct sockaddr_in	sin;
+	socklen_t		sinlen = sizeof(sin);
+	struct timeval		tv;
+	uint8_t			packet[20];
+	bool			seen[256];
+
+	/*
+	 *	Don't let the first request block its worker.
+	 */
+	atomic_store(&busy_done, true);
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+	if ((sockfd < 0) || (bind(sockfd, (struct sockaddr *) &sin, sizeof(sin)) < 0) ||
+	    (getsockname(sockfd, (struct sockaddr *) &sin, &sinlen) < 0) ||
+	    (fr_nonblock(sockfd) < 0)) fail("Failed creating server socket");
+
+	clientfd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (clientfd < 0) fail("Failed creating client socket");
+
+	tv.tv_sec = 5;
+	tv.tv_usec = 0;
+	(void) setsockopt(clientfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+	memset(seen, 0, sizeof(seen));
+
+	for (i = 0; i < num; i++) {
+		memset(packet, 0, sizeof(packet));
+		packet[0] = PW_CODE_ACCESS_REQUEST;
+		packet[1] = i;
+		packet[3] = sizeof(packet);
+		packet[4] = i;
+
+		if (sendto(clientfd, packet, sizeof(packet), 0, (struct sockaddr *) &sin, sinlen) < 0) {
+			fail("Failed sending request");
+		}
+	}
+
+	if (fr_schedule_socket_add(sched, sockfd, &sock_ctx, &transport) < 0) fail("Failed adding socket");
+
+	for (i = 0; i < num; i++) {
+		if (recv(clientfd, packet, sizeof(packet), 0) != sizeof(packet)) fail("Missing reply to batch");
+		if (packet[0] != PW_CODE_ACCESS_ACCEPT) fail("Bad reply to batch");
+		if ((packet[1] >= num) || seen[packet[1]]) fail("Unexpected reply ID in batch");
+
+		MPRINT1("Got reply %d of %d to batch\n", i + 1, num);
+		seen[packet[1]] = true;
+	}
+
+	close(clientfd);
+}
+
 static void NEVER_RETURNS usage(void)
 {
 	fprintf(stderr, "usage: schedule_test [OPTS]\n");
@@ -167,7 +326,9 @@ int main(int argc, char *argv[])
 		exit(1);
 	}
 
-	sleep(1);
+	if (num_workers > 1) test_busy_worker(sched);
+
+	test_batch(sched, 16);
 
 	(void) fr_schedule_destroy(sched);
 
@@ -0,0 +1,152 @@
+/*
+ * state_test.c	Tests for the session-state tree
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * Copyright 2016  The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/state.h>
+
+#ifdef HAVE_GETOPT_H
+#	include <getopt.h>
+#endif
+
+/*
+ *	The per-shard limit is twice each shard's share, so the tree
+ *	can always be filled to the global limit, given enough tries.
+ */
+#define MAX_SESSIONS	(64)
+#define MAX_TRIES	(MAX_SESSIONS * 16)
+#define TIMEOUT		(2)
+
+/*
+ *	state.c only looks at spawn_workers and state_server_id, and
+ *	we don't spawn any workers.
+ */
+main_config_t		main_config;
+
+static int		debug_lvl = 0;
+
+static void NEVER_RETURNS usage(void)
+{
+	fprintf(stderr, "usage: state_test [OPTS]\n");
+	fprintf(stderr, "  -D <dict_dir>          Set the dictionary directory (default is %s).\n", DICTDIR);
+	fprintf(stderr, "  -x                     Debugging mode.\n");
+
+	exit(1);
+}
+
+static void NEVER_RETURNS fail(char const *msg)
+{
+	fprintf(stderr, "state_test: %s\n", msg);
+	exit(1);
+}
+
+/** Start a new multi-round session
+ *
+ * @param[in] ctx to allocate the request in.
+ * @param[in] state tree to add the session to.
+ * @return the result of fr_request_to_state().
+ */
+static bool session_add(TALLOC_CTX *ctx, fr_state_tree_t *state)
+{
+	REQUEST		*request;
+	VALUE_PAIR	*vp;
+	bool		rcode;
+
+	request = request_alloc(ctx);
+	if (!request) fail("Failed allocating request");
+
+	request->server = "default";
+	request->reply = fr_radius_alloc(request, false);
+	if (!request->reply) fail("Failed allocating reply");
+
+	vp = fr_pair_afrom_num(request->state_ctx, 0, PW_USER_NAME);
+	if (!vp) fail("Failed allocating session-state attribute");
+	fr_pair_value_strcpy(vp, "bob");
+	fr_pair_add(&request->state, vp);
+
+	rcode = fr_request_to_state(state, request, NULL, request->reply);
+	talloc_free(request);
+
+	return rcode;
+}
+
+int main(int argc, char *argv[])
+{
+	int			c, i;
+	char const		*dict_dir = DICTDIR;
+	fr_dict_t		*dict = NULL;
+	fr_state_tree_t		*state;
+	TALLOC_CTX		*autofree = talloc_init("main");
+
+	while ((c = getopt(argc, argv, "D:hx")) != EOF) switch (c) {
+		case 'D':
+			dict_dir = optarg;
+			break;
+
+		case 'x':
+			debug_lvl++;
+			rad_debug_lvl++;
+			break;
+
+		case 'h':
+		default:
+			usage();
+	}
+
+	if (fr_dict_from_file(autofree, &dict, dict_dir, FR_DICTIONARY_FILE, "radius") < 0) {
+		fr_perror("state_test");
+		exit(1);
+	}
+
+	state = fr_state_tree_init(autofree, MAX_SESSIONS, TIMEOUT);
+	if (!state) fail("Failed creating state tree");
+
+	/*
+	 *	Sessions are only rejected when their shard is full, so
+	 *	keep adding them until the tree is full.
+	 */
+	for (i = 0; (i < MAX_TRIES) && (fr_state_entries_tracked(state) < MAX_SESSIONS); i++) {
+		(void) session_add(autofree, state);
+	}
+	if (fr_state_entries_tracked(state) != MAX_SESSIONS) fail("Failed filling the state tree");
+
+	if (debug_lvl) printf("Filled the state tree after %d sessions\n", i);
+
+	if (session_add(autofree, state)) fail("Accepted a session over max_sessions");
+	if (fr_state_entries_tracked(state) != MAX_SESSIONS) fail("Tracking more than max_sessions");
+
+	/*
+	 *	Once every entry has expired, there should be room
+	 *	again, even though nothing has been inserted in the
+	 *	meantime to reap them.
+	 */
+	sleep(TIMEOUT + 2);
+
+	if (!session_add(autofree, state)) fail("Rejected a session after the others expired");
+	if (fr_state_entries_timeout(state) == 0) fail("No entries were timed out");
+	if (fr_state_entries_tracked(state) > MAX_SESSIONS) fail("Tracking more than max_sessions");
+
+	talloc_free(autofree);
+
+	return 0;
+}
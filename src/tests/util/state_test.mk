@@ -0,0 +1,6 @@
+TARGET := state_test
+
+SOURCES		:= state_test.c ../../main/state.c
+
+TGT_PREREQS	:= libfreeradius-util.a libfreeradius-server.a libfreeradius-radius.a
+TGT_LDLIBS	:= $(LIBS)
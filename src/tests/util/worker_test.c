@@ -48,6 +48,7 @@ typedef struct fr_schedule_worker_t {
 	pthread_t	pthread_id;		//!< pthread ID of the worker
 	fr_worker_t	*worker;		//!< pointer to the worker
 	fr_channel_t	*ch;			//!< channel for communicating with the worker
+	fr_worker_steal_stats_t stats;		//!< work stealing counters, saved when the worker exits
 } fr_schedule_worker_t;
 
 static int		debug_lvl = 0;
@@ -60,6 +61,8 @@ static int		max_outstanding = 1;
 static bool		touch_memory = false;
 static int		num_workers = 1;
 static bool		quiet = false;
+static bool		steal_test = false;
+static fr_worker_steal_t *steal = NULL;
 static fr_schedule_worker_t workers[MAX_WORKERS];
 
 static void NEVER_RETURNS usage(void)
@@ -69,6 +72,7 @@ static void NEVER_RETURNS usage(void)
 	fprintf(stderr, "  -m <messages>	  Send number of messages.\n");
 	fprintf(stderr, "  -o <outstanding>       Keep number of messages outstanding.\n");
 	fprintf(stderr, "  -q                     quiet - suppresses worker stats.\n");
+	fprintf(stderr, "  -s                     Send everything to worker 0, and check that its peers steal work.\n");
 	fprintf(stderr, "  -t                     Touch memory for fake packets.\n");
 	fprintf(stderr, "  -w N                   Create N workers.  Default is 1.\n");
 	fprintf(stderr, "  -x                     Debugging mode.\n");
@@ -115,6 +119,13 @@ static size_t test_nak(void const *packet_ctx, uint8_t *const packet, size_t pac
 static fr_transport_final_t test_process(REQUEST *request, fr_transport_action_t action)
 {
 	MPRINT1("\t\tPROCESS --- request %zd action %d\n", request->number, action);
+
+	/*
+	 *	Take long enough that the messages back up, and the
+	 *	worker gives some of them away.
+	 */
+	if (steal_test) usleep(1000);
+
 	return FR_TRANSPORT_REPLY;
 }
 
@@ -148,9 +159,16 @@ static void *worker_thread(void *arg)
 		exit(1);
 	}
 
+	if (steal && (fr_worker_steal_add(worker, steal, sw->id) < 0)) {
+		fprintf(stderr, "worker_test: Failed to add the worker to the steal table\n");
+		exit(1);
+	}
+
 	MPRINT1("\tWorker %d looping.\n", sw->id);
 	fr_worker(worker);
 
+	fr_worker_steal_stats(worker, &sw->stats);
+
 	sw->worker = NULL;
 	MPRINT1("\tWorker %d exiting.\n", sw->id);
 	
@@ -184,6 +202,17 @@ static void master_process(void)
 
 	MPRINT1("Master started.\n");
 
+	/*
+	 *	The table has to exist before the workers start.
+	 */
+	if (steal_test) {
+		steal = fr_worker_steal_create(ctx, num_workers, MAX_MESSAGES);
+		if (!steal) {
+			fprintf(stderr, "Failed creating steal table\n");
+			exit(1);
+		}
+	}
+
 	/*
 	 *	Create the worker threads.
 	 */
@@ -282,7 +311,12 @@ static void master_process(void)
 			if (rcode < 0) {
 				fprintf(stderr, "Failed sending request: %s\n", strerror(errno));
 			}
-			which_worker++;
+
+			/*
+			 *	Everything goes to worker 0, so that
+			 *	the others have to steal it.
+			 */
+			if (!steal_test) which_worker++;
 			if (which_worker >= num_workers) which_worker = 0;
 
 			rad_assert(rcode == 0);
@@ -369,6 +403,16 @@ check_close:
 					continue;
 				}
 
+				/*
+				 *	Replies to stolen messages
+				 *	have to come back through the
+				 *	channel they were sent on.
+				 */
+				if (steal_test && (ch != workers[0].ch)) {
+					fprintf(stderr, "Master got reply on the wrong channel\n");
+					exit(1);
+				}
+
 				do {
 					num_replies++;
 					num_outstanding--;
@@ -432,6 +476,32 @@ check_close:
 
 	} while (num_outstanding > 0);
 
+	/*
+	 *	Every message our peers stole has to have its reply
+	 *	returned to worker 0.
+	 */
+	if (steal_test) {
+		uint64_t num_stolen = 0;
+
+		for (i = 1; i < num_workers; i++) {
+			num_stolen += workers[i].stats.stolen;
+		}
+
+		MPRINT1("Master saw %" PRIu64 " stolen, %" PRIu64 " returned.\n",
+			num_stolen, workers[0].stats.returned);
+
+		if (!num_stolen) {
+			fprintf(stderr, "No messages were stolen\n");
+			exit(1);
+		}
+
+		if (workers[0].stats.returned != num_stolen) {
+			fprintf(stderr, "Stole %" PRIu64 " messages, but %" PRIu64 " replies were returned\n",
+				num_stolen, workers[0].stats.returned);
+			exit(1);
+		}
+	}
+
 	/*
 	 *	Force all messages to be garbage collected
 	 */
@@ -466,7 +536,7 @@ int main(int argc, char *argv[])
 		exit(1);
 	}
 
-	while ((c = getopt(argc, argv, "c:hm:o:qtw:x")) != EOF) switch (c) {
+	while ((c = getopt(argc, argv, "c:hm:o:qstw:x")) != EOF) switch (c) {
 		case 'x':
 			debug_lvl++;
 			break;
@@ -487,6 +557,10 @@ int main(int argc, char *argv[])
 			quiet = true;
 			break;
 
+		case 's':
+			steal_test = true;
+			break;
+
 		case 't':
 			touch_memory = true;
 			break;
@@ -503,6 +577,16 @@ int main(int argc, char *argv[])
 
 	if (max_outstanding > max_messages) max_outstanding = max_messages;
 
+	/*
+	 *	Worker 0 needs peers to steal from it, and enough
+	 *	outstanding messages that it gives some away.
+	 */
+	if (steal_test) {
+		if (num_workers < 2) num_workers = 2;
+		if (max_messages < 256) max_messages = 256;
+		if (max_outstanding < 64) max_outstanding = 64;
+	}
+
 	if (!max_control_plane) {
 		max_control_plane = MAX_CONTROL_PLANE;
 		if (max_outstanding > max_control_plane) max_control_plane = max_outstanding;
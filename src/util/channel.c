@@ -28,6 +28,12 @@ RCSID("$Id$")
 #include <freeradius-devel/util/control.h>
 #include <freeradius-devel/rad_assert.h>
 
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/stdatomic.h>
+#endif
+
 /*
  *	Debugging, mainly for channel_test
  */
@@ -101,6 +107,8 @@ typedef struct fr_channel_end_t {
 
 	size_t			num_resignals;	//!< number of signals resent
 
+	size_t			num_signal_failed; //!< number of signals which couldn't be sent
+
 	size_t			num_kevents;	//!< number of times we've looked at kevents
 
 	uint64_t		sequence;	//!< sequence number for this channel.
@@ -124,6 +132,7 @@ typedef struct fr_channel_end_t {
  *  A full channel, which consists of two ends.
  */
 typedef struct fr_channel_t {
+	uint64_t		id;		//!< unique ID of this channel
 	fr_time_t		cpu_time;	//!< total time used by the worker for this channel
 	fr_time_t		processing_time; //!< time spent by the worker processing requests
 
@@ -132,6 +141,12 @@ typedef struct fr_channel_t {
 	fr_channel_end_t	end[2];		//!< two ends of the channel
 } fr_channel_t;
 
+/*
+ *	IDs for new channels.  Starts at 1, so that 0 is never a
+ *	valid ID.
+ */
+static atomic_uint_fast64_t channel_id = ATOMIC_VAR_INIT(1);
+
 
 /** Create a new channel
  *
@@ -162,6 +177,8 @@ fr_channel_t *fr_channel_create(TALLOC_CTX *ctx, fr_control_t *master, fr_contro
 		return NULL;
 	}
 
+	ch->id = atomic_fetch_add_explicit(&channel_id, 1, memory_order_relaxed);
+
 	ch->end[TO_WORKER].control = worker;
 	ch->end[FROM_WORKER].control = master;
 
@@ -250,62 +267,120 @@ static int fr_channel_data_ready(fr_channel_t *ch, fr_time_t when, fr_channel_en
  * @param[in] cd the message to send
  * @param[out] p_reply a pointer to a reply message
  * @return
- *	- <0 on error
- *	- 0 on success
+ *	- <0 on error, the message was not sent
+ *	- 0 on success, the message was queued
  */
 int fr_channel_send_request(fr_channel_t *ch, fr_channel_data_t *cd, fr_channel_data_t **p_reply)
 {
+	int rcode;
+
+	rcode = fr_channel_send_request_burst(ch, &cd, 1, p_reply);
+	if (rcode < 0) return rcode;
+
+	return 0;
+}
+
+/** Send a burst of request messages into the channel
+ *
+ *  This is the same as calling fr_channel_send_request() for each
+ *  message, except that the other end is signalled at most once for
+ *  the whole burst.
+ *
+ *  The messages should be initialized, other than "sequence" and
+ *  "ack".  If the queue fills up part way through the burst, the
+ *  remaining messages are not sent.  The caller should send them via
+ *  another channel.
+ *
+ *  Once a message has been queued, it belongs to the other end.  If
+ *  signalling the other end fails, the failure is counted in the
+ *  channel statistics, and the messages are still reported as sent.
+ *  The other end will see them when it next looks at the queue.  The
+ *  caller must not send them again.
+ *
+ *  No matter what the function returns, the caller should check the
+ *  reply pointer.  If the reply pointer is not NULL, the caller
+ *  should call fr_channel_recv_reply() until that function returns
+ *  NULL.
+ *
+ * @param[in] ch the channel
+ * @param[in] cd the array of messages to send
+ * @param[in] num the number of messages in the array
+ * @param[out] p_reply a pointer to a reply message
+ * @return
+ *	- <0 if no messages could be sent
+ *	- the number of messages queued, even if signalling failed
+ */
+int fr_channel_send_request_burst(fr_channel_t *ch, fr_channel_data_t **cd, int num, fr_channel_data_t **p_reply)
+{
+	int i, rcode;
 	uint64_t sequence;
 	fr_time_t when, message_interval;
 	fr_channel_end_t *master;
+	bool first;
 
 	master = &(ch->end[TO_WORKER]);
-	when = cd->m.when;
+	*p_reply = NULL;
+
+	if (num <= 0) return 0;
+
+	first = (master->num_outstanding == 0);
+
+	for (i = 0; i < num; i++) {
+		when = cd[i]->m.when;
+
+		sequence = master->sequence + 1;
+		cd[i]->live.sequence = sequence;
+		cd[i]->live.ack = master->ack;
+
+		/*
+		 *	Push the message onto the queue for the other
+		 *	end.  If the push fails, the caller should try
+		 *	another queue.
+		 */
+		if (!fr_atomic_queue_push(master->aq, cd[i])) {
+			MPRINT("QUEUE FULL!\n");
+			break;
+		}
+
+		master->sequence = sequence;
+		message_interval = when - master->last_write;
+
+		if (!master->message_interval) {
+			master->message_interval = message_interval;
+		} else {
+			master->message_interval = RTT(master->message_interval, message_interval);
+		}
+
+		rad_assert(master->last_write <= when);
+		master->last_write = when;
 
-	sequence = master->sequence + 1;
-	cd->live.sequence = sequence;
-	cd->live.ack = master->ack;
+		master->num_outstanding++;
+		master->num_packets++;
+	}
 
 	/*
-	 *	Push the message onto the queue for the other end.  If
-	 *	the push fails, the caller should try another queue.
+	 *	Nothing was sent.  Give the caller any reply which is
+	 *	waiting, so that the queue drains.
 	 */
-	if (!fr_atomic_queue_push(master->aq, cd)) {
-		MPRINT("QUEUE FULL!\n");
+	if (i == 0) {
 		*p_reply = fr_channel_recv_reply(ch);
 		return -1;
 	}
 
-	master->sequence = sequence;
-	message_interval = when - master->last_write;
-
-	if (!master->message_interval) {
-		master->message_interval = message_interval;
-	} else {
-		master->message_interval = RTT(master->message_interval, message_interval);
-	}
-
-	rad_assert(master->last_write <= when);
-	master->last_write = when;
-
-	master->num_outstanding++;
-	master->num_packets++;
+	when = cd[i - 1]->m.when;
 
 	MPRINT("MASTER requests %zd, num_outstanding %zd\n", master->num_packets, master->num_outstanding);
 
 #if ENABLE_SKIPS
 	/*
-	 *	We just sent the first packet.  There can't possibly be a reply, so don't bother looking.
+	 *	If there was nothing outstanding before this burst,
+	 *	there can't possibly be a reply, so don't bother
+	 *	looking.
+	 *
+	 *	Otherwise there is at least one old packet which is
+	 *	outstanding, look for a reply.
 	 */
-	if (master->num_outstanding == 1) {
-		*p_reply = NULL;
-
-
-		/*
-		 *	There is at least one old packet which is
-		 *	outstanding, look for a reply.
-		 */
-	} else if (master->num_outstanding > 1) {
+	if (!first) {
 		*p_reply = fr_channel_recv_reply(ch);
 
 		/*
@@ -313,10 +388,9 @@ int fr_channel_send_request(fr_channel_t *ch, fr_channel_data_t *cd, fr_channel_
 		 *	Or, there is a reply, and there are more packets outstanding.
 		 *	Skip the signal.
 		 */
-		if (!*p_reply ||
-		    ((*p_reply && (master->num_outstanding > 1)))) {
+		if (!*p_reply || (master->num_outstanding > 1)) {
 			MPRINT("MASTER SKIPS signal\n");
-			return 0;
+			return i;
 		}
 	}
 #endif
@@ -325,7 +399,13 @@ int fr_channel_send_request(fr_channel_t *ch, fr_channel_data_t *cd, fr_channel_
 	 *	Tell the other end that there is new data ready.
 	 */
 	MPRINT("MASTER SIGNALS\n");
-	return fr_channel_data_ready(ch, when, master, FR_CHANNEL_SIGNAL_DATA_TO_WORKER);
+	rcode = fr_channel_data_ready(ch, when, master, FR_CHANNEL_SIGNAL_DATA_TO_WORKER);
+	if (rcode < 0) {
+		MPRINT("MASTER failed signalling worker - %d messages already queued\n", i);
+		master->num_signal_failed++;
+	}
+
+	return i;
 }
 
 /** Receive a reply message from the channel
@@ -429,40 +509,79 @@ fr_channel_data_t *fr_channel_recv_request(fr_channel_t *ch)
  * @param[in] cd the message to send
  * @param[out] p_request a pointer to a request message
  * @return
- *	- <0 on error
- *	- 0 on success
+ *	- <0 on error, the message was not sent
+ *	- 0 on success, the message was queued
  */
 int fr_channel_send_reply(fr_channel_t *ch, fr_channel_data_t *cd, fr_channel_data_t **p_request)
 {
+	int rcode;
+
+	rcode = fr_channel_send_reply_burst(ch, &cd, 1, p_request);
+	if (rcode < 0) return rcode;
+
+	return 0;
+}
+
+/** Send a burst of reply messages into the channel
+ *
+ *  This is the same as calling fr_channel_send_reply() for each
+ *  message, except that the other end is signalled at most once for
+ *  the whole burst.
+ *
+ *  The messages should be initialized, other than "sequence" and
+ *  "ack".  If the queue fills up part way through the burst, the
+ *  remaining messages are not sent.
+ *
+ *  As with fr_channel_send_request_burst(), a failure to signal the
+ *  other end doesn't change the number of messages which were sent.
+ *
+ *  No matter what the function returns, the caller should check the
+ *  request pointer.  If the reply pointer is not NULL, the caller
+ *  should call fr_channel_recv_request() until that function returns
+ *  NULL.
+ *
+ * @param[in] ch the channel
+ * @param[in] cd the array of messages to send
+ * @param[in] num the number of messages in the array
+ * @param[out] p_request a pointer to a request message
+ * @return
+ *	- <0 if no messages could be sent
+ *	- the number of messages queued, even if signalling failed
+ */
+int fr_channel_send_reply_burst(fr_channel_t *ch, fr_channel_data_t **cd, int num, fr_channel_data_t **p_request)
+{
+	int i, rcode;
 	uint64_t sequence;
 	fr_time_t when, message_interval;
 	fr_channel_end_t *worker;
 
 	worker = &(ch->end[FROM_WORKER]);
+	*p_request = NULL;
 
-	when = cd->m.when;
+	if (num <= 0) return 0;
 
-	sequence = worker->sequence + 1;
-	cd->live.sequence = sequence;
-	cd->live.ack = worker->ack;
+	for (i = 0; i < num; i++) {
+		when = cd[i]->m.when;
 
-	if (!fr_atomic_queue_push(worker->aq, cd)) {
-		*p_request = fr_channel_recv_request(ch);
-		return -1;
-	}
+		sequence = worker->sequence + 1;
+		cd[i]->live.sequence = sequence;
+		cd[i]->live.ack = worker->ack;
 
-	rad_assert(worker->num_outstanding > 0);
-	worker->num_outstanding--;
-	worker->num_packets++;
+		if (!fr_atomic_queue_push(worker->aq, cd[i])) break;
 
-	MPRINT("\tWORKER replies %zd, num_outstanding %zd\n", worker->num_packets, worker->num_outstanding);
+		rad_assert(worker->num_outstanding > 0);
+		worker->num_outstanding--;
+		worker->num_packets++;
+
+		worker->sequence = sequence;
+		message_interval = when - worker->last_write;
+		worker->message_interval = RTT(worker->message_interval, message_interval);
 
-	worker->sequence = sequence;
-	message_interval = when - worker->last_write;
-	worker->message_interval = RTT(worker->message_interval, message_interval);
+		rad_assert(worker->last_write <= when);
+		worker->last_write = when;
+	}
 
-	rad_assert(worker->last_write <= when);
-	worker->last_write = when;
+	MPRINT("\tWORKER replies %zd, num_outstanding %zd\n", worker->num_packets, worker->num_outstanding);
 
 	/*
 	 *	Even if we think we have no more packets to process,
@@ -471,12 +590,22 @@ int fr_channel_send_reply(fr_channel_t *ch, fr_channel_data_t *cd, fr_channel_da
 	 */
 	*p_request = fr_channel_recv_request(ch);
 
+	if (i == 0) return -1;
+
+	when = cd[i - 1]->m.when;
+
 	/*
 	 *	No packets outstanding, we HAVE to signal the master
 	 *	thread.
 	 */
 	if (worker->num_outstanding == 0) {
-		return fr_channel_data_ready(ch, when, worker, FR_CHANNEL_SIGNAL_DATA_DONE_WORKER);
+		rcode = fr_channel_data_ready(ch, when, worker, FR_CHANNEL_SIGNAL_DATA_DONE_WORKER);
+		if (rcode < 0) {
+			MPRINT("\tWORKER failed signalling master - %d messages already queued\n", i);
+			worker->num_signal_failed++;
+		}
+
+		return i;
 	}
 
 	MPRINT("\twhen - last_read_other = %zd - %zd = %zd\n", when, worker->last_read_other, when - worker->last_read_other);
@@ -492,7 +621,7 @@ int fr_channel_send_reply(fr_channel_t *ch, fr_channel_data_t *cd, fr_channel_da
 	 *	But... this doesn't appear to work on the Linux
 	 *	libkqueue implementation.
 	 */
-	if (worker->sequence_at_last_signal > worker->their_view_of_my_sequence) return 0;
+	if (worker->sequence_at_last_signal > worker->their_view_of_my_sequence) return i;
 #endif
 
 	/*
@@ -510,12 +639,18 @@ int fr_channel_send_reply(fr_channel_t *ch, fr_channel_data_t *cd, fr_channel_da
 	    ((when - worker->last_read_other < SIGNAL_INTERVAL) ||
 	     ((when - worker->last_sent_signal) < SIGNAL_INTERVAL))) {
 		MPRINT("\tWORKER SKIPS signal\n");
-		return 0;
+		return i;
 	}
 #endif
 
 	MPRINT("\tWORKER SIGNALS num_outstanding %zd\n", worker->num_outstanding);
-	return fr_channel_data_ready(ch, when, worker, FR_CHANNEL_SIGNAL_DATA_FROM_WORKER);
+	rcode = fr_channel_data_ready(ch, when, worker, FR_CHANNEL_SIGNAL_DATA_FROM_WORKER);
+	if (rcode < 0) {
+		MPRINT("\tWORKER failed signalling master - %d messages already queued\n", i);
+		worker->num_signal_failed++;
+	}
+
+	return i;
 }
 
 
@@ -701,6 +836,19 @@ bool fr_channel_active(fr_channel_t *ch)
 	return ch->active;
 }
 
+/** Get the ID of a channel
+ *
+ *  Channel IDs are never re-used, so they can be used to check that
+ *  a channel pointer still refers to the same channel.
+ *
+ * @param[in] ch the channel
+ * @return the ID of the channel.
+ */
+uint64_t fr_channel_id(fr_channel_t const *ch)
+{
+	return ch->id;
+}
+
 /** Signal a worker that the channel is closing
  *
  * @param[in] ch	The channel.
@@ -830,12 +978,14 @@ void fr_channel_debug(fr_channel_t *ch, FILE *fp)
 	fprintf(fp, "to worker\n");
 	fprintf(fp, "\tnum_signals sent = %zd\n", ch->end[TO_WORKER].num_signals);
 	fprintf(fp, "\tnum_signals re-sent = %zd\n", ch->end[TO_WORKER].num_resignals);
+	fprintf(fp, "\tnum_signals failed = %zd\n", ch->end[TO_WORKER].num_signal_failed);
 	fprintf(fp, "\tnum_kevents checked = %zd\n", ch->end[TO_WORKER].num_kevents);
 	fprintf(fp, "\tsequence = %zd\n", ch->end[TO_WORKER].sequence);
 	fprintf(fp, "\tack = %zd\n", ch->end[TO_WORKER].ack);
 
 	fprintf(fp, "to receive\n");
 	fprintf(fp, "\tnum_signals sent = %zd\n", ch->end[FROM_WORKER].num_signals);
+	fprintf(fp, "\tnum_signals failed = %zd\n", ch->end[FROM_WORKER].num_signal_failed);
 	fprintf(fp, "\tnum_kevents checked = %zd\n", ch->end[FROM_WORKER].num_kevents);
 	fprintf(fp, "\tsequence = %zd\n", ch->end[FROM_WORKER].sequence);
 	fprintf(fp, "\tack = %zd\n", ch->end[FROM_WORKER].ack);
@@ -107,9 +107,13 @@ typedef struct fr_channel_data_t {
 fr_channel_t *fr_channel_create(TALLOC_CTX *ctx, fr_control_t *master, fr_control_t *worker) CC_HINT(nonnull);
 
 int fr_channel_send_request(fr_channel_t *ch, fr_channel_data_t *cm, fr_channel_data_t **p_reply) CC_HINT(nonnull);
+int fr_channel_send_request_burst(fr_channel_t *ch, fr_channel_data_t **cm, int num,
+				  fr_channel_data_t **p_reply) CC_HINT(nonnull);
 fr_channel_data_t *fr_channel_recv_request(fr_channel_t *ch) CC_HINT(nonnull);
 
 int fr_channel_send_reply(fr_channel_t *ch, fr_channel_data_t *cm, fr_channel_data_t **p_request) CC_HINT(nonnull);
+int fr_channel_send_reply_burst(fr_channel_t *ch, fr_channel_data_t **cm, int num,
+				fr_channel_data_t **p_request) CC_HINT(nonnull);
 fr_channel_data_t *fr_channel_recv_reply(fr_channel_t *ch) CC_HINT(nonnull);
 
 int fr_channel_worker_sleeping(fr_channel_t *ch) CC_HINT(nonnull);
@@ -118,6 +122,7 @@ int fr_channel_service_kevent(fr_channel_t *ch, fr_control_t *c, struct kevent c
 fr_channel_event_t fr_channel_service_message(fr_time_t when, fr_channel_t **p_channel, void const *data, size_t data_size) CC_HINT(nonnull);
 
 bool fr_channel_active(fr_channel_t *ch) CC_HINT(nonnull);
+uint64_t fr_channel_id(fr_channel_t const *ch) CC_HINT(nonnull);
 
 int fr_channel_signal_open(fr_channel_t *ch) CC_HINT(nonnull);
 
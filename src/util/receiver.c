@@ -25,11 +25,14 @@
 RCSID("$Id$")
 
 #include <talloc.h>
+#include <sys/socket.h>
 
 #include <freeradius-devel/event.h>
+#include <freeradius-devel/udp.h>
 #include <freeradius-devel/util/queue.h>
 #include <freeradius-devel/util/channel.h>
 #include <freeradius-devel/util/control.h>
+#include <freeradius-devel/util/message.h>
 #include <freeradius-devel/util/worker.h>
 #include <freeradius-devel/util/receiver.h>
 
@@ -44,13 +47,24 @@ RCSID("$Id$")
 #define MPRINT(...)
 #endif
 
+/*
+ *	How many packets we read from a socket with one system call,
+ *	and the largest packet we accept.
+ */
+#define RECEIVER_BATCH_SIZE		(UDP_MMSG_MAX)
+#define RECEIVER_MAX_PACKET_SIZE	(4096)
+
 typedef struct fr_receiver_worker_t {
+	int			kq;			//!< the KQ of the worker
 	int			heap_id;		//!< workers are in a heap
 	fr_time_t		cpu_time;		//!< how much CPU time this worker has spent
 	fr_time_t		processing_time;	//!< predicted processing time for one packet
 
 	fr_channel_t		*channel;		//!< channel to the worker
 	fr_worker_t		*worker;		//!< worker pointer
+
+	fr_channel_data_t	*pending[RECEIVER_BATCH_SIZE]; //!< requests from this read, which haven't been sent
+	int			num_pending;		//!< number of pending requests
 } fr_receiver_worker_t;
 
 typedef struct fr_receiver_socket_t {
@@ -58,6 +72,9 @@ typedef struct fr_receiver_socket_t {
 	void			*ctx;			//!< transport context
 	fr_transport_t		*transport;		//!< the transport
 	int			heap_id;		//!< for the heap
+
+	bool			datagram;		//!< packets can be read in batches
+	struct fr_receiver_socket_t *next_paused;	//!< next socket we've stopped reading from
 } fr_receiver_socket_t;
 
 
@@ -70,16 +87,27 @@ struct fr_receiver_t {
 
 	fr_ring_buffer_t	*rb;			//!< ring buffer for my control-plane messages
 
+	fr_message_set_t	*ms;			//!< message set for packets read from the sockets
+	fr_receiver_packet_t	*free_packets;		//!< packet contexts which aren't in use
+
 	fr_event_list_t		*el;			//!< our event list
 
 	fr_heap_t		*replies;		//!< replies from the worker, ordered by priority / origin time
 	fr_heap_t		*workers;		//!< workers, ordered by total CPU time spent
 	fr_heap_t		*closing;		//!< workers which are being closed
 
+	fr_receiver_worker_t	**worker_array;		//!< all of the workers, in the order they were added
+	int			num_workers;		//!< number of entries in the worker array
+
+	fr_receiver_worker_select_t select;		//!< picks a worker, or NULL to use the heap
+	void			*select_ctx;		//!< context for the select function
+
 	uint64_t		num_requests;		//!< number of requests we sent
 	uint64_t		num_replies;		//!< number of replies we received
+	uint64_t		num_dropped;		//!< number of packets we couldn't read, send to a worker, or reply to
 
 	fr_heap_t		*sockets;		//!< list of sockets we're managing
+	fr_receiver_socket_t	*paused;		//!< stream sockets we've stopped reading, as the message set is full
 
 	uint32_t		num_transports;		//!< how many transport layers we have
 	fr_transport_t		**transports;		//!< array of active transports.
@@ -139,23 +167,319 @@ static void fr_receiver_drain_input(fr_receiver_t *rc, fr_channel_t *ch, fr_chan
 	}
 
 	do {
+		fr_receiver_worker_t *worker;
+
 		rc->num_replies++;
 		MPRINT("MASTER received reply %zd\n", rc->num_replies);
 
+		/*
+		 *	Update our view of how busy the worker is.
+		 *	NAKs don't have a processing time.
+		 */
+		worker = fr_channel_master_ctx_get(ch);
+		if (worker) {
+			bool in_heap;
+
+			/*
+			 *	The worker isn't in the heap if we're
+			 *	in the middle of sending it a request.
+			 */
+			in_heap = (fr_heap_extract(rc->workers, worker) > 0);
+
+			worker->cpu_time = cd->reply.cpu_time;
+			if (cd->reply.processing_time) worker->processing_time = cd->reply.processing_time;
+
+			if (in_heap) (void) fr_heap_insert(rc->workers, worker);
+		}
+
 		cd->channel.ch = ch;
 		(void) fr_heap_insert(rc->replies, cd);
 	} while ((cd = fr_channel_recv_reply(ch)) != NULL);
+}
+
+/** Get a packet context
+ *
+ * @param rc the receiver
+ * @return
+ *	- NULL on error
+ *	- fr_receiver_packet_t on success
+ */
+static fr_receiver_packet_t *fr_receiver_packet_alloc(fr_receiver_t *rc)
+{
+	fr_receiver_packet_t *packet;
+
+	packet = rc->free_packets;
+	if (packet) {
+		rc->free_packets = packet->next;
+		return packet;
+	}
+
+	return talloc(rc, fr_receiver_packet_t);
+}
+
+/** Return a packet context to the free list
+ *
+ * @param rc the receiver
+ * @param packet the packet context to free
+ */
+static void fr_receiver_packet_free(fr_receiver_t *rc, fr_receiver_packet_t *packet)
+{
+	packet->next = rc->free_packets;
+	rc->free_packets = packet;
+}
+
+static void fr_receiver_read(fr_event_list_t *el, int sockfd, void *ctx);
+
+/** Stop reading from a stream socket
+ *
+ *  When there's no room in the message set for new packets, we can't
+ *  read from a stream socket, and we can't drop what's waiting on it.
+ *  The socket stays readable, so we stop watching it until the
+ *  workers have finished with some requests.
+ *
+ * @param rc the receiver
+ * @param s the socket to pause
+ */
+static void fr_receiver_socket_pause(fr_receiver_t *rc, fr_receiver_socket_t *s)
+{
+	MPRINT("MASTER pausing socket %d\n", s->fd);
+
+	(void) fr_event_fd_delete(rc->el, s->fd);
+
+	s->next_paused = rc->paused;
+	rc->paused = s;
+}
+
+/** Start reading from all of the paused stream sockets again
+ *
+ *  If there still isn't enough room, the sockets will be paused
+ *  again on their next read.
+ *
+ * @param rc the receiver
+ */
+static void fr_receiver_socket_resume(fr_receiver_t *rc)
+{
+	fr_receiver_socket_t *s, *next;
+
+	for (s = rc->paused; s != NULL; s = next) {
+		next = s->next_paused;
+		s->next_paused = NULL;
+
+		MPRINT("MASTER resuming socket %d\n", s->fd);
+
+		if (fr_event_fd_insert(rc->el, s->fd, fr_receiver_read, NULL, NULL, s) < 0) {
+			MPRINT("MASTER failed resuming socket %d: %s\n", s->fd, fr_strerror());
+		}
+	}
+
+	rc->paused = NULL;
+}
+
+/** Stop reading from a stream socket which has been closed, or has failed
+ *
+ *  Any replies for the socket which are still with the workers are
+ *  dropped when we fail to write them.
+ *
+ * @param rc the receiver
+ * @param s the socket to close
+ */
+static void fr_receiver_socket_close(fr_receiver_t *rc, fr_receiver_socket_t *s)
+{
+	MPRINT("MASTER closing socket %d\n", s->fd);
+
+	(void) fr_event_fd_delete(rc->el, s->fd);
+	(void) fr_heap_extract(rc->sockets, s);
+	close(s->fd);
+	talloc_free(s);
+}
+
+/** Read and drop datagrams from a socket
+ *
+ *  When there's no room in the message set for new packets, the
+ *  socket would otherwise stay readable, and we would be called again
+ *  immediately.  Each datagram is dropped in full, and the client
+ *  will retransmit it.
+ *
+ * @param rc the receiver
+ * @param sockfd the socket to read from
+ */
+static void fr_receiver_discard(fr_receiver_t *rc, int sockfd)
+{
+	int i;
+	uint8_t buffer[1];
+
+	for (i = 0; i < RECEIVER_BATCH_SIZE; i++) {
+		if (recv(sockfd, buffer, sizeof(buffer), MSG_DONTWAIT) < 0) break;
+
+		rc->num_dropped++;
+	}
+}
+
+/** Send a batch of replies to one socket
+ *
+ *  If the transport signs replies, the whole batch is signed first.
+ *  Replies which can't be signed or sent are dropped.  The client
+ *  will retransmit the request.
+ *
+ * @param rc the receiver
+ * @param fd the socket to write to
+ * @param packets the packets to send
+ * @param replies the messages containing the packets
+ * @param num the number of packets
+ */
+static void fr_receiver_write_batch(fr_receiver_t *rc, int fd, udp_mmsg_t *packets,
+				    fr_channel_data_t **replies, int num)
+{
+	int i, sent, ready = num;
+	fr_receiver_packet_t *packet = replies[0]->ctx;
+
+	if (packet->transport->sign) {
+		uint8_t *data[RECEIVER_BATCH_SIZE];
+		size_t data_len[RECEIVER_BATCH_SIZE];
+		int rcode[RECEIVER_BATCH_SIZE];
+
+		for (i = 0; i < num; i++) {
+			data[i] = packets[i].data;
+			data_len[i] = packets[i].data_len;
+		}
+
+		packet->transport->sign(packet->ctx, data, data_len, rcode, num);
+
+		for (i = 0, ready = 0; i < num; i++) {
+			if (rcode[i] < 0) continue;
+
+			if (i != ready) packets[ready] = packets[i];
+			ready++;
+		}
+	}
+
+	sent = 0;
+	if (ready) sent = udp_send_mmsg(fd, packets, ready, packet->connected ? UDP_FLAGS_CONNECTED : UDP_FLAGS_NONE);
+	if (sent < 0) {
+		MPRINT("MASTER write to socket %d failed: %s\n", fd, fr_strerror());
+		sent = 0;
+	}
+
+	rc->num_dropped += num - sent;
+
+	for (i = 0; i < num; i++) {
+		fr_receiver_packet_free(rc, replies[i]->ctx);
+		fr_message_done(&replies[i]->m);
+	}
+}
+
+/** Write all pending replies to the network
+ *
+ *  Consecutive replies for the same socket are sent with one
+ *  system call.
+ *
+ * @param rc the receiver
+ */
+static void fr_receiver_write_replies(fr_receiver_t *rc)
+{
+	int num = 0, fd = -1;
+	fr_channel_data_t *cd;
+	udp_mmsg_t packets[RECEIVER_BATCH_SIZE];
+	fr_channel_data_t *replies[RECEIVER_BATCH_SIZE];
+	bool got_reply = false;
+
+	while ((cd = fr_heap_pop(rc->replies)) != NULL) {
+		fr_receiver_packet_t *packet = cd->ctx;
+		udp_mmsg_t *reply;
+
+		got_reply = true;
+
+		/*
+		 *	The worker decided not to reply.
+		 */
+		if (!cd->m.data_size) {
+			fr_receiver_packet_free(rc, packet);
+			fr_message_done(&cd->m);
+			continue;
+		}
+
+		if (num && ((packet->fd != fd) || (num == RECEIVER_BATCH_SIZE))) {
+			fr_receiver_write_batch(rc, fd, packets, replies, num);
+			num = 0;
+		}
+
+		fd = packet->fd;
+
+		/*
+		 *	Send the reply from the address the request
+		 *	was sent to.
+		 */
+		reply = &packets[num];
+		reply->data = cd->m.data;
+		reply->data_len = cd->m.data_size;
+		reply->src_ipaddr = packet->dst_ipaddr;
+		reply->src_port = packet->dst_port;
+		reply->dst_ipaddr = packet->src_ipaddr;
+		reply->dst_port = packet->src_port;
+		reply->if_index = packet->if_index;
+
+		replies[num++] = cd;
+	}
+
+	if (num) fr_receiver_write_batch(rc, fd, packets, replies, num);
 
 	/*
-	 *	@todo get CPU time and processing time from the message, and update the worker.
+	 *	The workers have finished with some requests, so there
+	 *	may now be room for reading new ones.
 	 */
+	if (got_reply && rc->paused) fr_receiver_socket_resume(rc);
+}
+
+/** Pick the "best" worker for a message
+ *
+ *  If there's a select function, it picks the worker.  Otherwise,
+ *  or if the worker it picked is busy, we use the worker with the
+ *  least total CPU time.
+ *
+ *  The worker is removed from the heap.  The caller must insert it
+ *  again.
+ *
+ * @param rc the receiver
+ * @return
+ *	- NULL if there are no workers left to try
+ *	- the worker on success
+ */
+static fr_receiver_worker_t *fr_receiver_worker_pick(fr_receiver_t *rc)
+{
+	fr_receiver_worker_t *worker = NULL;
+
+	if (rc->select) {
+		int i;
+
+		i = rc->select(rc->select_ctx);
+		if ((i >= 0) && (i < rc->num_workers)) worker = rc->worker_array[i];
+
+		/*
+		 *	It's not in the heap if we've already tried
+		 *	it for this message.
+		 */
+		if (worker && (fr_heap_extract(rc->workers, worker) <= 0)) worker = NULL;
+	}
+
+	/*
+	 *	Grab the worker with the least total CPU time.
+	 */
+	if (!worker) worker = fr_heap_pop(rc->workers);
+
+	return worker;
 }
 
-#if 0
 /** Send a message on the "best" channel.
+ *
+ *  If there's a select function, it picks the worker.  Otherwise,
+ *  or if the worker it picked is busy, we use the worker with the
+ *  least total CPU time.
  *
  * @param rc the receiver
  * @param cd the message we've received
+ * @return
+ *	- <0 if no worker would accept the message
+ *	- 0 on success
  */
 static int fr_receiver_send_request(fr_receiver_t *rc, fr_channel_data_t *cd)
 {
@@ -166,11 +490,8 @@ static int fr_receiver_send_request(fr_receiver_t *rc, fr_channel_data_t *cd)
 	(void) talloc_get_type_abort(rc, fr_receiver_t);
 #endif
 
-	/*
-	 *	Grab the worker with the least total CPU time.
-	 */
-	worker = fr_heap_pop(rc->workers);
-	if (!worker) return 0;
+	worker = fr_receiver_worker_pick(rc);
+	if (!worker) return -1;
 
 	/*
 	 *	Send the message to the channel.  If we fail, recurse.
@@ -223,7 +544,6 @@ static int fr_receiver_send_request(fr_receiver_t *rc, fr_channel_data_t *cd)
 
 	return 0;
 }
-#endif
 
 /** Run the event loop 'idle' callback
  *
@@ -293,6 +613,7 @@ static void fr_receiver_channel_callback(void *ctx, void const *data, size_t dat
 		rad_assert(ch != NULL);
 		MPRINT("MASTER aq data ready\n");
 		fr_receiver_drain_input(rc, ch, NULL);
+		fr_receiver_write_replies(rc);
 		break;
 
 	case FR_CHANNEL_DATA_READY_WORKER:
@@ -312,20 +633,315 @@ static void fr_receiver_channel_callback(void *ctx, void const *data, size_t dat
 	}
 }
 
-static void fr_receiver_read(UNUSED fr_event_list_t *el, int sockfd, UNUSED void *ctx)
+/** Send the requests from one read to a worker
+ *
+ *  All of the requests are sent with one burst, so the worker is
+ *  signalled at most once.  Any requests which don't fit into the
+ *  channel are sent to other workers, one at a time.
+ *
+ * @param rc the receiver
+ * @param worker the worker, with pending requests
+ */
+static void fr_receiver_send_pending(fr_receiver_t *rc, fr_receiver_worker_t *worker)
+{
+	int i, sent;
+	fr_channel_data_t *cd, *reply;
+
+	/*
+	 *	The return value is the number of requests which were
+	 *	queued, even if the worker couldn't be signalled.
+	 *	Those requests now belong to the worker, so only the
+	 *	ones after them are sent elsewhere.
+	 */
+	sent = fr_channel_send_request_burst(worker->channel, worker->pending, worker->num_pending, &reply);
+	if (sent < 0) sent = 0;
+
+	if (reply) fr_receiver_drain_input(rc, worker->channel, reply);
+
+	if (sent < worker->num_pending) {
+		/*
+		 *	Don't pick this worker again for the rest of
+		 *	the requests, and mark it as still busy, just
+		 *	like fr_receiver_send_request() does.
+		 */
+		(void) fr_heap_extract(rc->workers, worker);
+
+		for (i = sent; i < worker->num_pending; i++) {
+			cd = worker->pending[i];
+
+			if (fr_receiver_send_request(rc, cd) < 0) {
+				MPRINT("MASTER failed sending packet to a worker\n");
+				rc->num_dropped++;
+				fr_receiver_packet_free(rc, cd->ctx);
+				fr_message_done(&cd->m);
+			}
+		}
+
+		worker->cpu_time = worker->pending[sent]->m.when + worker->processing_time;
+		(void) fr_heap_insert(rc->workers, worker);
+	}
+
+	worker->num_pending = 0;
+}
+
+/** Read one packet from a stream socket
+ *
+ *  Stream sockets don't keep packet boundaries, so we can't read a
+ *  batch of packets into fixed size slots.  Instead, each read is one
+ *  message, and is sent to a worker on its own.
+ *
+ * @param rc the receiver
+ * @param s the socket to read from
+ */
+static void fr_receiver_read_stream(fr_receiver_t *rc, fr_receiver_socket_t *s)
 {
-//	fr_receiver_socket_t *m = ctx;
-//	fr_receiver_t *rc = talloc_parent(m);
 	ssize_t data_size;
-	struct sockaddr_storage ss;
-	socklen_t salen = sizeof(ss);
-	uint8_t buffer[256];
+	fr_channel_data_t *cd;
+	fr_receiver_packet_t *packet;
+
+	cd = (fr_channel_data_t *) fr_message_reserve(rc->ms, RECEIVER_MAX_PACKET_SIZE);
+	if (!cd) {
+		MPRINT("MASTER failed reserving message for socket %d\n", s->fd);
+		fr_receiver_socket_pause(rc, s);
+		return;
+	}
+
+	data_size = read(s->fd, cd->m.data, RECEIVER_MAX_PACKET_SIZE);
+	if (data_size <= 0) {
+		(void) fr_message_alloc(rc->ms, &cd->m, 0);
+		fr_message_done(&cd->m);
+
+		if ((data_size < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR))) return;
+
+		fr_receiver_socket_close(rc, s);
+		return;
+	}
+
+	(void) fr_message_alloc(rc->ms, &cd->m, data_size);
+
+	if (s->transport->verify) {
+		uint8_t *data = cd->m.data;
+		size_t data_len = data_size;
+		int rcode;
+
+		s->transport->verify(s->ctx, &data, &data_len, &rcode, 1);
+		if (rcode < 0) {
+			rc->num_dropped++;
+			fr_message_done(&cd->m);
+			return;
+		}
+	}
+
+	packet = fr_receiver_packet_alloc(rc);
+	if (!packet) {
+		rc->num_dropped++;
+		fr_message_done(&cd->m);
+		return;
+	}
+
+	/*
+	 *	The socket is connected, so replies go back to the
+	 *	peer, and the addresses aren't needed.
+	 */
+	memset(packet, 0, sizeof(*packet));
+	packet->ctx = s->ctx;
+	packet->transport = s->transport;
+	packet->fd = s->fd;
+	packet->connected = true;
+
+	cd->m.when = fr_time();
+	cd->ctx = packet;
+	cd->transport = s->transport->id;
+	cd->priority = 0;
+	cd->request.start_time = NULL;
+
+	rc->num_requests++;
+	MPRINT("MASTER read packet %" PRIu64 " of size %zd from socket %d\n",
+	       rc->num_requests, data_size, s->fd);
+
+	if (fr_receiver_send_request(rc, cd) < 0) {
+		MPRINT("MASTER failed sending packet to a worker\n");
+		rc->num_dropped++;
+		fr_receiver_packet_free(rc, packet);
+		fr_message_done(&cd->m);
+		return;
+	}
+
+	fr_receiver_write_replies(rc);
+}
+
+/** Read a batch of packets from a socket
+ *
+ *  All of the packets waiting on the socket (up to
+ *  RECEIVER_BATCH_SIZE) are read with one system call, directly into
+ *  a reservation in the message set.  Each packet is read into a
+ *  fixed size slot, so that the messages can then be allocated from
+ *  the reservation in place, without copying the packet data.
+ *
+ *  If the transport verifies packets, the whole batch is verified
+ *  before any of it is sent to the workers.  The packets are then
+ *  spread over the workers as usual, and each worker is sent its
+ *  share of the batch in one burst.
+ *
+ *  Only datagram sockets are read in batches.  Other sockets are
+ *  read one packet at a time, by fr_receiver_read_stream().
+ *
+ * @param[in] el the event list
+ * @param[in] sockfd the socket which is ready to read
+ * @param[in] ctx the fr_receiver_socket_t
+ */
+static void fr_receiver_read(UNUSED fr_event_list_t *el, int sockfd, void *ctx)
+{
+	fr_receiver_socket_t *s = ctx;
+	fr_receiver_t *rc = talloc_parent(s);
+	udp_mmsg_t packets[RECEIVER_BATCH_SIZE];
+	fr_receiver_worker_t *workers[RECEIVER_BATCH_SIZE];
+	fr_receiver_worker_t *worker;
+	fr_channel_data_t *cd, *next;
+	fr_time_t now;
+	int i, num, num_workers;
+
+	if (!s->datagram) {
+		fr_receiver_read_stream(rc, s);
+		return;
+	}
+
+	cd = (fr_channel_data_t *) fr_message_reserve(rc->ms, RECEIVER_BATCH_SIZE * RECEIVER_MAX_PACKET_SIZE);
+	if (!cd) {
+		MPRINT("MASTER failed reserving messages for socket %d\n", sockfd);
+		fr_receiver_discard(rc, sockfd);
+		return;
+	}
+
+	for (i = 0; i < RECEIVER_BATCH_SIZE; i++) {
+		packets[i].data = cd->m.data + (i * RECEIVER_MAX_PACKET_SIZE);
+		packets[i].data_len = RECEIVER_MAX_PACKET_SIZE;
+	}
+
+	num = udp_recv_mmsg(sockfd, packets, RECEIVER_BATCH_SIZE, UDP_FLAGS_NONE);
+	if (num <= 0) {
+		MPRINT("MASTER read from socket %d failed: %s\n", sockfd, fr_strerror());
+		(void) fr_message_alloc(rc->ms, &cd->m, 0);
+		fr_message_done(&cd->m);
+		return;
+	}
+
+	/*
+	 *	Packets which fail verification are treated as
+	 *	empty, and dropped below.
+	 */
+	if (s->transport->verify) {
+		uint8_t *data[RECEIVER_BATCH_SIZE];
+		size_t data_len[RECEIVER_BATCH_SIZE];
+		int rcode[RECEIVER_BATCH_SIZE];
+
+		for (i = 0; i < num; i++) {
+			data[i] = packets[i].data;
+			data_len[i] = packets[i].data_len;
+		}
+
+		s->transport->verify(s->ctx, data, data_len, rcode, num);
+
+		for (i = 0; i < num; i++) {
+			if (rcode[i] < 0) packets[i].data_len = 0;
+		}
+	}
+
+	now = fr_time();
+	num_workers = 0;
+
+	for (i = 0; i < num; i++) {
+		fr_receiver_packet_t *packet;
+
+		/*
+		 *	Allocate this packets slot, and reserve the
+		 *	slots of the rest of the batch.  The last
+		 *	packet releases the unused part of the
+		 *	reservation.
+		 */
+		if (i < (num - 1)) {
+			next = (fr_channel_data_t *) fr_message_alloc_reserve(rc->ms, &cd->m, RECEIVER_MAX_PACKET_SIZE,
+									      (num - i - 1) * RECEIVER_MAX_PACKET_SIZE);
+			cd->m.data_size = packets[i].data_len;
+
+			/*
+			 *	The new message is returned with
+			 *	data_size set to the room left in the
+			 *	reservation.  It has to be zero before
+			 *	we allocate the next packet from it.
+			 */
+			if (next) next->m.data_size = 0;
+		} else {
+			next = NULL;
+			(void) fr_message_alloc(rc->ms, &cd->m, packets[i].data_len);
+		}
+
+		packet = NULL;
+		if (packets[i].data_len) packet = fr_receiver_packet_alloc(rc);
+		if (!packet) {
+			rc->num_dropped++;
+			fr_message_done(&cd->m);
+			goto next;
+		}
+
+		packet->ctx = s->ctx;
+		packet->transport = s->transport;
+		packet->fd = sockfd;
+		packet->connected = false;
+		packet->src_ipaddr = packets[i].src_ipaddr;
+		packet->src_port = packets[i].src_port;
+		packet->dst_ipaddr = packets[i].dst_ipaddr;
+		packet->dst_port = packets[i].dst_port;
+		packet->if_index = packets[i].if_index;
+
+		cd->m.when = now;
+		cd->ctx = packet;
+		cd->transport = s->transport->id;
+		cd->priority = 0;
+		cd->request.start_time = NULL;
+
+		rc->num_requests++;
+		MPRINT("MASTER read packet %" PRIu64 " of size %zd from socket %d\n",
+		       rc->num_requests, packets[i].data_len, sockfd);
+
+		worker = fr_receiver_worker_pick(rc);
+		if (!worker) {
+			MPRINT("MASTER failed sending packet to a worker\n");
+			rc->num_dropped++;
+			fr_receiver_packet_free(rc, packet);
+			fr_message_done(&cd->m);
+			goto next;
+		}
+
+		/*
+		 *	We're projecting that the worker will use more
+		 *	CPU time, so that the rest of the batch is
+		 *	spread over the other workers.
+		 */
+		worker->cpu_time += worker->processing_time;
+		(void) fr_heap_insert(rc->workers, worker);
+
+		if (!worker->num_pending) workers[num_workers++] = worker;
+		worker->pending[worker->num_pending++] = cd;
+
+	next:
+		/*
+		 *	We couldn't carve out the rest of the batch.
+		 */
+		if ((i < (num - 1)) && !next) {
+			rc->num_dropped += num - i - 1;
+			break;
+		}
 
-	data_size = recvfrom(sockfd, buffer, sizeof(buffer), 0,
-			     (struct sockaddr *) &ss, &salen);
-	fprintf(stderr, "Got packet size %zd\n", data_size);
+		cd = next;
+	}
 
-	fprintf(stderr, "READ FROM SOCKET %d - %zd bytes\n", sockfd, data_size);
+	for (i = 0; i < num_workers; i++) fr_receiver_send_pending(rc, workers[i]);
+
+	/*
+	 *	Sending the requests may have picked up replies.
+	 */
+	fr_receiver_write_replies(rc);
 }
 
 /** Handle a receiver control message callback for a new socket
@@ -339,6 +955,8 @@ static void fr_receiver_socket_callback(void *ctx, void const *data, size_t data
 {
 	fr_receiver_t *rc = ctx;
 	fr_receiver_socket_t *m;
+	int type;
+	socklen_t type_len = sizeof(type);
 
 	rad_assert(data_size == sizeof(*m));
 
@@ -348,6 +966,13 @@ static void fr_receiver_socket_callback(void *ctx, void const *data, size_t data
 	rad_assert(m != NULL);
 	memcpy(m, data, sizeof(*m));
 
+	/*
+	 *	Only datagram sockets keep packet boundaries, so only
+	 *	they can be read in batches.
+	 */
+	m->datagram = ((getsockopt(m->fd, SOL_SOCKET, SO_TYPE, &type, &type_len) == 0) && (type == SOCK_DGRAM));
+	m->next_paused = NULL;
+
 	if (fr_event_fd_insert(rc->el, m->fd, fr_receiver_read, NULL, NULL, m) < 0) {
 		fprintf(stderr, "FAILED ADDING NEW SOCKET\n");
 		close(m->fd);
@@ -434,6 +1059,17 @@ fr_receiver_t *fr_receiver_create(TALLOC_CTX *ctx, uint32_t num_transports, fr_t
 		return NULL;
 	}
 
+	/*
+	 *	The largest reservation is a full batch, which can be
+	 *	at most half of the ring buffer.
+	 */
+	rc->ms = fr_message_set_create(rc, 1024, sizeof(fr_channel_data_t),
+				       4 * RECEIVER_BATCH_SIZE * RECEIVER_MAX_PACKET_SIZE);
+	if (!rc->ms) {
+		talloc_free(rc);
+		return NULL;
+	}
+
 	if (fr_control_callback_add(rc->control, FR_CONTROL_ID_CHANNEL, rc, fr_receiver_channel_callback) < 0) {
 		talloc_free(rc);
 		return NULL;
@@ -464,13 +1100,13 @@ fr_receiver_t *fr_receiver_create(TALLOC_CTX *ctx, uint32_t num_transports, fr_t
 		return NULL;
 	}
 
-	rc->workers = fr_heap_create(worker_cmp, offsetof(fr_channel_data_t, channel.heap_id));
+	rc->workers = fr_heap_create(worker_cmp, offsetof(fr_receiver_worker_t, heap_id));
 	if (!rc->workers) {
 		talloc_free(rc);
 		return NULL;
 	}
 
-	rc->closing = fr_heap_create(worker_cmp, offsetof(fr_channel_data_t, channel.heap_id));
+	rc->closing = fr_heap_create(worker_cmp, offsetof(fr_receiver_worker_t, heap_id));
 	if (!rc->closing) {
 		talloc_free(rc);
 		return NULL;
@@ -570,3 +1206,76 @@ int fr_receiver_socket_add(fr_receiver_t *rc, int fd, void *ctx, fr_transport_t
 
 	return fr_control_message_send(rc->control, rc->rb, FR_CONTROL_ID_SOCKET, &m, sizeof(m));
 }
+
+/** Open a channel to a worker
+ *
+ *  This function MUST be called from the receivers thread, as the
+ *  channel is allocated from the receivers talloc context.
+ *
+ * @param rc the receiver
+ * @param worker the worker to send packets to
+ * @return
+ *	- <0 on error
+ *	- 0 on success
+ */
+int fr_receiver_worker_add(fr_receiver_t *rc, fr_worker_t *worker)
+{
+	fr_receiver_worker_t *w, **array;
+
+#ifndef NDEBUG
+	(void) talloc_get_type_abort(rc, fr_receiver_t);
+#endif
+
+	w = talloc_zero(rc, fr_receiver_worker_t);
+	if (!w) return -1;
+
+	w->worker = worker;
+	w->kq = fr_worker_kq(worker);
+
+	/*
+	 *	A guess, until the worker tells us how long it takes
+	 *	to process a packet.
+	 */
+	w->processing_time = NANOSEC / 10000;
+
+	w->channel = fr_worker_channel_create(worker, w, rc->control);
+	if (!w->channel) {
+		talloc_free(w);
+		return -1;
+	}
+
+	fr_channel_master_ctx_add(w->channel, w);
+
+	if (fr_channel_signal_open(w->channel) < 0) {
+		talloc_free(w);
+		return -1;
+	}
+
+	array = talloc_realloc(rc, rc->worker_array, fr_receiver_worker_t *, rc->num_workers + 1);
+	if (!array) {
+		talloc_free(w);
+		return -1;
+	}
+	rc->worker_array = array;
+	rc->worker_array[rc->num_workers++] = w;
+
+	(void) fr_heap_insert(rc->workers, w);
+
+	return 0;
+}
+
+/** Set the function which picks a worker for each packet
+ *
+ *  The function returns the index of a worker, counting in the order
+ *  the workers were added with fr_receiver_worker_add().  If it
+ *  fails, or the worker is busy, the receiver picks one itself.
+ *
+ * @param rc the receiver
+ * @param func the function which picks a worker, or NULL
+ * @param ctx for the select function
+ */
+void fr_receiver_worker_select_set(fr_receiver_t *rc, fr_receiver_worker_select_t func, void *ctx)
+{
+	rc->select = func;
+	rc->select_ctx = ctx;
+}
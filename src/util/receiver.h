@@ -25,11 +25,36 @@
  */
 RCSIDH(receiver_h, "$Id$")
 
+#include <freeradius-devel/inet.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 typedef struct fr_receiver_t fr_receiver_t;
+typedef int (*fr_receiver_worker_select_t)(void *ctx);
+
+/**
+ *  The packet context for packets read by a receiver.
+ *
+ *  This is passed to the transport as "packet_ctx", and MUST be
+ *  returned unchanged in the reply.  The receiver uses it to send the
+ *  reply back to where the request came from.
+ */
+typedef struct fr_receiver_packet_t {
+	void			*ctx;		//!< transport context of the socket
+	fr_transport_t		*transport;	//!< transport of the socket
+	int			fd;		//!< socket the packet was read from
+	bool			connected;	//!< socket is connected, so replies go to the peer
+
+	fr_ipaddr_t		src_ipaddr;	//!< where the packet came from
+	uint16_t		src_port;	//!< source port of the packet
+	fr_ipaddr_t		dst_ipaddr;	//!< where the packet was sent to
+	uint16_t		dst_port;	//!< destination port of the packet
+	int			if_index;	//!< interface the packet was received on
+
+	struct fr_receiver_packet_t *next;	//!< next unused packet context
+} fr_receiver_packet_t;
 
 fr_receiver_t *fr_receiver_create(TALLOC_CTX *ctx, uint32_t num_transports, fr_transport_t **transports);
 void fr_receiver_exit(fr_receiver_t *rc);
@@ -37,6 +62,8 @@ int fr_receiver_destroy(fr_receiver_t *rc) CC_HINT(nonnull);
 void fr_receiver(fr_receiver_t *rc) CC_HINT(nonnull);
 
 int fr_receiver_socket_add(fr_receiver_t *rc, int fd, void *ctx, fr_transport_t *transport) CC_HINT(nonnull);
+int fr_receiver_worker_add(fr_receiver_t *rc, fr_worker_t *worker) CC_HINT(nonnull);
+void fr_receiver_worker_select_set(fr_receiver_t *rc, fr_receiver_worker_select_t func, void *ctx) CC_HINT(nonnull(1));
 
 #ifdef __cplusplus
 }
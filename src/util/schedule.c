@@ -32,6 +32,12 @@ RCSID("$Id$")
 
 #include <freeradius-devel/util/receiver.h>
 
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/stdatomic.h>
+#endif
+
 #ifdef HAVE_PTHREAD_H
 #include <pthread.h>
 #define PTHREAD_MUTEX_LOCK   pthread_mutex_lock
@@ -70,6 +76,11 @@ RCSID("$Id$")
 
 #define SEM_WAIT_INTR(_x) do {if (sem_wait(_x) == 0) break;} while (errno == EINTR)
 
+/*
+ *	How many messages each worker can offer to its peers.
+ */
+#define STEAL_QUEUE_SIZE	(256)
+
 /**
  *  Track the child thread status.
  */
@@ -88,9 +99,7 @@ typedef struct fr_schedule_worker_t {
 	pthread_t	pthread_id;		//!< the thread of this worker
 
 	int		id;			//!< a unique ID
-	int		uses;			//!< how many network threads are using it
-	fr_time_t	cpu_time;		//!< how much CPU time this worker has used
-	int		heap_id;		//!< for the heap of workers
+	int		kq;			//!< the KQ of the worker
 
 	fr_schedule_t	*sc;			//!< the scheduler we are running under
 
@@ -104,9 +113,12 @@ typedef struct fr_schedule_worker_t {
 typedef struct fr_schedule_receiver_t {
 	pthread_t	pthread_id;		//!< the thread of this receiver
 
+	int		id;			//!< a unique ID
+
 	fr_schedule_t	*sc;			//!< the scheduler we are running under
 
 	fr_schedule_child_status_t status;	//!< status of the worker
+	TALLOC_CTX	*ctx;			//!< freed once the workers have exited
 	fr_receiver_t	*rc;			//!< the receive data structure
 } fr_schedule_receiver_t;
 
@@ -115,7 +127,7 @@ typedef struct fr_schedule_receiver_t {
  *  The scheduler
  */
 struct fr_schedule_t {
-	bool		running;		//!< is the scheduler running?
+	atomic_bool	running;		//!< is the scheduler running?
 
 	fr_log_t	*log;			//!< log destination
 
@@ -125,6 +137,9 @@ struct fr_schedule_t {
 	int		num_workers;		//!< number of worker threads
 	int		num_workers_exited;	//!< number of exited workers
 
+	int		num_inputs;		//!< number of network threads we tried to start
+	int		next_input;		//!< next network thread to get a new socket
+
 #ifdef HAVE_PTHREAD_H
 	pthread_mutex_t	mutex;			//!< for thread safey
 
@@ -134,28 +149,95 @@ struct fr_schedule_t {
 	fr_schedule_thread_instantiate_t	worker_thread_instantiate;	//!< thread instantiation callback
 	void					*worker_instantiate_ctx;	//!< thread instantiation context
 
-	fr_heap_t	*workers;		//!< heap of workers
-	fr_heap_t	*done_workers;		//!< heap of done workers
+	fr_worker_steal_t *steal;		//!< so workers can steal work from each other
 
-	fr_schedule_receiver_t *sr;		//!< pointer to the (one) network thread
+	_Atomic(fr_schedule_worker_t *) *active; //!< array of running workers, for lock-free selection
+	_Atomic(int)	num_active;		//!< number of entries in the active array
+	_Atomic(uint32_t) choice;		//!< sequence number for picking workers
+
+	fr_schedule_receiver_t *sr;		//!< array of network threads
 
 	uint32_t	num_transports;		//!< how many transport layers we have
 	fr_transport_t	**transports;		//!< array of active transports.
 };
 
 
-static int worker_cmp(void const *one, void const *two)
+/** Remove a worker from the array of active workers
+ *
+ *  The last entry is moved into the workers slot, and only then is
+ *  the array shortened.  A reader which loaded the old count will
+ *  see either the exiting worker, or the moved one.  A reader which
+ *  loaded the new count sees the moved one.
+ *
+ *  Must be called with the mutex held.
+ *
+ * @param[in] sc the scheduler
+ * @param[in] sw the worker to remove
+ */
+static void fr_schedule_active_remove(fr_schedule_t *sc, fr_schedule_worker_t *sw)
 {
-	fr_schedule_worker_t const *a = one;
-	fr_schedule_worker_t const *b = two;
+	int i, last;
 
-	if (a->uses < b->uses) return -1;
-	if (a->uses > b->uses) return +1;
+	last = atomic_load_explicit(&sc->num_active, memory_order_relaxed) - 1;
 
-	if (a->cpu_time < b->cpu_time) return -1;
-	if (a->cpu_time > b->cpu_time) return +1;
+	for (i = 0; i <= last; i++) {
+		if (atomic_load_explicit(&sc->active[i], memory_order_relaxed) != sw) continue;
 
-	return 0;
+		atomic_store_explicit(&sc->active[i],
+				      atomic_load_explicit(&sc->active[last], memory_order_relaxed),
+				      memory_order_release);
+		atomic_store_explicit(&sc->num_active, last, memory_order_release);
+		return;
+	}
+}
+
+
+/** Pick a worker
+ *
+ *  We use "power of two choices".  Pick two workers at random, and
+ *  return the one with the lowest load.  This is nearly as good as
+ *  picking the least loaded worker, but needs no locks, and doesn't
+ *  herd every caller onto the same worker.
+ *
+ *  Workers are added to the array of active workers as they start,
+ *  and removed as they exit, so it's read with acquire ordering.
+ *  The network threads are stopped before any worker is told to
+ *  exit, so no one is looking at a worker when it is removed.
+ *
+ * @param[in] sc the scheduler
+ * @return
+ *	- <0 on error, or no free worker
+ *	- the index of the worker in the array of active workers
+ */
+static int fr_schedule_worker_pick(fr_schedule_t *sc)
+{
+	int num_active;
+	uint32_t hash, a, b;
+	fr_schedule_worker_t *sw, *other;
+
+	if (!atomic_load_explicit(&sc->running, memory_order_acquire)) return -1;
+
+	num_active = atomic_load_explicit(&sc->num_active, memory_order_acquire);
+	if (num_active <= 0) return -1;
+
+	if (num_active == 1) return 0;
+
+	/*
+	 *	Spread the sequence number over the 32-bit space.
+	 *	This is much cheaper than fr_rand(), and unlike
+	 *	fr_rand(), it's thread-safe.
+	 */
+	hash = atomic_fetch_add_explicit(&sc->choice, 1, memory_order_relaxed);
+	hash *= 2654435761U;
+
+	a = hash % num_active;
+	b = (a + 1 + ((hash >> 16) % (num_active - 1))) % num_active;
+
+	sw = atomic_load_explicit(&sc->active[a], memory_order_acquire);
+	other = atomic_load_explicit(&sc->active[b], memory_order_acquire);
+	if (fr_worker_load(other->worker) < fr_worker_load(sw->worker)) return b;
+
+	return a;
 }
 
 
@@ -168,25 +250,31 @@ static int worker_cmp(void const *one, void const *two)
  */
 int fr_schedule_get_worker_kq(fr_schedule_t *sc)
 {
-	int kq;
+	int i;
 	fr_schedule_worker_t *sw;
 
-	PTHREAD_MUTEX_LOCK(&sc->mutex);
+	i = fr_schedule_worker_pick(sc);
+	if (i < 0) return -1;
 
-	sw = fr_heap_pop(sc->workers);
-	if (!sw) {
-		PTHREAD_MUTEX_UNLOCK(&sc->mutex);
-		return -1;
-	}
+	sw = atomic_load_explicit(&sc->active[i], memory_order_acquire);
 
-	kq = fr_worker_kq(sw->worker);
-	rad_assert(kq >= 0);
-	sw->uses++;
-	(void) fr_heap_insert(sc->workers, sw);
+	return sw->kq;
+}
 
-	PTHREAD_MUTEX_UNLOCK(&sc->mutex);
 
-	return kq;
+/** Pick a worker for a network thread
+ *
+ *  Each network thread opens channels to the workers in the order
+ *  they appear in the array of active workers.  The array doesn't
+ *  change while the network threads are running, so an index into
+ *  it is also an index into the network threads list of workers.
+ *
+ * @param[in] ctx the scheduler
+ * @return the index of the worker, or <0 on error.
+ */
+static int fr_schedule_worker_select(void *ctx)
+{
+	return fr_schedule_worker_pick(ctx);
 }
 
 
@@ -197,6 +285,7 @@ int fr_schedule_get_worker_kq(fr_schedule_t *sc)
  */
 static void *fr_schedule_worker_thread(void *arg)
 {
+	int i;
 	TALLOC_CTX *ctx;
 	fr_schedule_worker_t *sw = arg;
 	fr_schedule_t *sc = sw->sc;
@@ -212,6 +301,10 @@ static void *fr_schedule_worker_thread(void *arg)
 		goto fail;
 	}
 
+	if (sc->steal && (fr_worker_steal_add(sw->worker, sc->steal, sw->id) < 0)) {
+		goto fail;
+	}
+
 	/*
 	 *	@todo make this a registry
 	 */
@@ -221,9 +314,13 @@ static void *fr_schedule_worker_thread(void *arg)
 	}
 
 	sw->status = FR_CHILD_RUNNING;
+	sw->kq = fr_worker_kq(sw->worker);
+	rad_assert(sw->kq >= 0);
 
 	PTHREAD_MUTEX_LOCK(&sc->mutex);
-	(void) fr_heap_insert(sc->workers, sw);
+	i = atomic_load_explicit(&sc->num_active, memory_order_relaxed);
+	atomic_store_explicit(&sc->active[i], sw, memory_order_release);
+	atomic_store_explicit(&sc->num_active, i + 1, memory_order_release);
 	sc->num_workers++;
 	PTHREAD_MUTEX_UNLOCK(&sc->mutex);
 
@@ -243,6 +340,22 @@ static void *fr_schedule_worker_thread(void *arg)
 
 	fr_log(sc->log, L_DBG, "Worker %d finished\n", sw->id);
 
+	if (sc->steal) {
+		fr_worker_steal_stats_t stats;
+
+		fr_worker_steal_stats(sw->worker, &stats);
+		fr_log(sc->log, L_DBG, "Worker %d donated %" PRIu64 ", stole %" PRIu64 ", and had %" PRIu64 " replies returned\n",
+		       sw->id, stats.donated, stats.stolen, stats.returned);
+	}
+
+	/*
+	 *	Stop anyone from picking us, before the worker goes
+	 *	away.
+	 */
+	PTHREAD_MUTEX_LOCK(&sc->mutex);
+	fr_schedule_active_remove(sc, sw);
+	PTHREAD_MUTEX_UNLOCK(&sc->mutex);
+
 	/*
 	 *	Talloc ordering issues. We want to be independent of
 	 *	how talloc walks it's children, and ensure that some
@@ -255,7 +368,6 @@ static void *fr_schedule_worker_thread(void *arg)
 	 *	Remove ourselves from the list of live workers.
 	 */
 	PTHREAD_MUTEX_LOCK(&sc->mutex);
-	(void) fr_heap_extract(sc->workers, sw);
 	sc->num_workers--;
 	PTHREAD_MUTEX_UNLOCK(&sc->mutex);
 
@@ -265,11 +377,10 @@ fail:
 	if (ctx) talloc_free(ctx);
 
 	/*
-	 *	Add outselves to the list of dead workers.
+	 *	Count ourselves as a dead worker.
 	 */
 	PTHREAD_MUTEX_LOCK(&sc->mutex);
 	sw->status = status;
-	(void) fr_heap_insert(sc->done_workers, sw);
 	sc->num_workers_exited++;
 	PTHREAD_MUTEX_UNLOCK(&sc->mutex);
 
@@ -291,19 +402,46 @@ fail:
  */
 static void *fr_schedule_receiver_thread(void *arg)
 {
-	TALLOC_CTX *ctx;
+	int i, num_active;
 	fr_schedule_receiver_t *sr = arg;
 	fr_schedule_t *sc = sr->sc;
 	fr_schedule_child_status_t status = FR_CHILD_FAIL;
 
-	ctx = talloc_init("receiver");
-	if (!ctx) goto fail;
+	fr_log(sc->log, L_DBG, "Network %d starting\n", sr->id);
 
-	sr->rc = fr_receiver_create(ctx, sc->num_transports, sc->transports);
+	/*
+	 *	The workers have channels which point into this
+	 *	context, so it's freed by fr_schedule_destroy(), once
+	 *	all of the workers have exited.
+	 */
+	sr->ctx = talloc_init("receiver");
+	if (!sr->ctx) goto fail;
+
+	sr->rc = fr_receiver_create(sr->ctx, sc->num_transports, sc->transports);
 	if (!sr->rc) {
 		goto fail;
 	}
 
+	/*
+	 *	Open a channel to each worker.  All of the workers
+	 *	are running before any network thread is created.
+	 */
+	PTHREAD_MUTEX_LOCK(&sc->mutex);
+	num_active = atomic_load_explicit(&sc->num_active, memory_order_relaxed);
+	for (i = 0; i < num_active; i++) {
+		fr_schedule_worker_t *sw = atomic_load_explicit(&sc->active[i], memory_order_relaxed);
+
+		if (fr_receiver_worker_add(sr->rc, sw->worker) < 0) break;
+	}
+	PTHREAD_MUTEX_UNLOCK(&sc->mutex);
+
+	if (i < num_active) {
+		fr_log(sc->log, L_DBG, "Network %d failed opening channel to worker %d\n", sr->id, i);
+		goto fail;
+	}
+
+	fr_receiver_worker_select_set(sr->rc, fr_schedule_worker_select, sc);
+
 	sr->status = FR_CHILD_RUNNING;
 
 	/*
@@ -316,21 +454,15 @@ static void *fr_schedule_receiver_thread(void *arg)
 	 */
 	fr_receiver(sr->rc);
 
-	/*
-	 *	Talloc ordering issues. We want to be independent of
-	 *	how talloc walks it's children, and ensure that some
-	 *	things are freed in a specific order.
-	 */
-	fr_receiver_destroy(sr->rc);
-	sr->rc = NULL;
+	fr_log(sc->log, L_DBG, "Network %d finished\n", sr->id);
 
 	status = FR_CHILD_EXITED;
 
 fail:
-	if (ctx) talloc_free(ctx);
-
 	sr->status = status;
 
+	fr_log(sc->log, L_DBG, "Network %d exiting\n", sr->id);
+
 	/*
 	 *	Tell the scheduler we're done.
 	 */
@@ -382,7 +514,7 @@ fr_schedule_t *fr_schedule_create(TALLOC_CTX *ctx, fr_log_t *log, int max_inputs
 	sc->worker_thread_instantiate = worker_thread_instantiate;
 	sc->worker_instantiate_ctx = worker_thread_ctx;
 
-	sc->running = true;
+	atomic_store_explicit(&sc->running, true, memory_order_relaxed);
 	sc->num_transports = num_transports;
 	sc->transports = transports;
 
@@ -401,19 +533,24 @@ fr_schedule_t *fr_schedule_create(TALLOC_CTX *ctx, fr_log_t *log, int max_inputs
 		return NULL;
 	}
 
-	/*
-	 *	Create the heap which holds the workers.
-	 */
-	sc->workers = fr_heap_create(worker_cmp, offsetof(fr_schedule_worker_t, heap_id));
-	if (!sc->workers) {
+	sc->active = talloc_zero_size(sc, sizeof(sc->active[0]) * sc->max_workers);
+	if (!sc->active) {
 		talloc_free(sc);
 		return NULL;
 	}
+	atomic_store_explicit(&sc->num_active, 0, memory_order_relaxed);
+	atomic_store_explicit(&sc->choice, 0, memory_order_relaxed);
 
-	sc->done_workers = fr_heap_create(worker_cmp, offsetof(fr_schedule_worker_t, heap_id));
-	if (!sc->done_workers) {
-		talloc_free(sc);
-		return NULL;
+	/*
+	 *	Only bother with work stealing if there's someone to
+	 *	steal from.
+	 */
+	if (sc->max_workers > 1) {
+		sc->steal = fr_worker_steal_create(sc, sc->max_workers, STEAL_QUEUE_SIZE);
+		if (!sc->steal) {
+			talloc_free(sc);
+			return NULL;
+		}
 	}
 
 	memset(&sc->semaphore, 0, sizeof(sc->semaphore));
@@ -443,7 +580,7 @@ fr_schedule_t *fr_schedule_create(TALLOC_CTX *ctx, fr_log_t *log, int max_inputs
 
 		rcode = pthread_create(&sw->pthread_id, &attr, fr_schedule_worker_thread, sw);
 		if (rcode != 0) {
-			fr_log(sc->log, L_DBG, "Failed to create worker %d: %s\n", i, strerror(errno));
+			fr_log(sc->log, L_DBG, "Failed to create worker %d: %s\n", i, fr_syserror(rcode));
 			talloc_free(sw);
 			break;
 		}
@@ -461,45 +598,24 @@ fr_schedule_t *fr_schedule_create(TALLOC_CTX *ctx, fr_log_t *log, int max_inputs
 
 	PTHREAD_MUTEX_LOCK(&sc->mutex);
 	if (sc->num_workers != sc->max_workers) {
-		int num_workers_exited = sc->num_workers_exited;
-		fr_schedule_worker_t *sw;
-
 		fr_log(sc->log, L_DBG, "ERROR: Failed to create some workers\n");
 
-		PTHREAD_MUTEX_UNLOCK(&sc->mutex);
-
-		/*
-		 *	Clean up the dead ones which caused the
-		 *	error(s).
-		 */
-		for (i = 0; i < num_workers_exited; i++) {
-			fr_log(sc->log, L_DBG, "Pop exited %d/%d\n", i, num_workers_exited);
-
-			PTHREAD_MUTEX_LOCK(&sc->mutex);
-			sw = fr_heap_pop(sc->done_workers);
-			PTHREAD_MUTEX_UNLOCK(&sc->mutex);
-			rad_assert(sw != NULL);
-
-			talloc_free(sw);
-		}
-
 		/*
-		 *	Tell the active workers to exit.
+		 *	Tell the running workers to exit.  The dead
+		 *	ones which caused the error(s) are freed with
+		 *	the scheduler.
 		 */
+		num_workers = atomic_load_explicit(&sc->num_active, memory_order_relaxed);
 		for (i = 0; i < num_workers; i++) {
 			fr_log(sc->log, L_DBG, "Signal to exit %d/%d\n", i, num_workers);
 
-			PTHREAD_MUTEX_LOCK(&sc->mutex);
-			sw = fr_heap_pop(sc->workers);
-			PTHREAD_MUTEX_UNLOCK(&sc->mutex);
-			rad_assert(sw != NULL);
-
-			fr_worker_exit(sw->worker);
+			fr_worker_exit(atomic_load_explicit(&sc->active[i], memory_order_relaxed)->worker);
 		}
+		PTHREAD_MUTEX_UNLOCK(&sc->mutex);
 
 		/*
-		 *	Clean up the workers which have no exited, and
-		 *	signaled us that they've exited.
+		 *	Wait for the running workers to signal us that
+		 *	they've exited.
 		 */
 		for (i = 0; i < num_workers; i++) {
 			fr_log(sc->log, L_DBG, "Wait for semaphore indicating exit %d/%d\n", i, num_workers);
@@ -514,21 +630,48 @@ fr_schedule_t *fr_schedule_create(TALLOC_CTX *ctx, fr_log_t *log, int max_inputs
 	PTHREAD_MUTEX_UNLOCK(&sc->mutex);
 
 	/*
-	 *	Create the network thread
+	 *	Create the network threads.  They all share the same
+	 *	pool of workers.
 	 */
-	sc->sr = talloc_zero(sc, fr_schedule_receiver_t);
-	sc->sr->sc = sc;
-	
-	rcode = pthread_create(&sc->sr->pthread_id, &attr, fr_schedule_receiver_thread, sc->sr);
-	if (rcode != 0) goto fail;
-
-	SEM_WAIT_INTR(&sc->semaphore);
-	if (sc->sr->status != FR_CHILD_RUNNING) {
+	sc->sr = talloc_zero_array(sc, fr_schedule_receiver_t, sc->max_inputs);
+	if (!sc->sr) {
 	fail:
-		TALLOC_FREE(sc->sr);
 		fr_schedule_destroy(sc);
 		return NULL;
 	}
+
+	for (i = 0; i < sc->max_inputs; i++) {
+		fr_schedule_receiver_t *sr = &sc->sr[i];
+
+		fr_log(sc->log, L_DBG, "Creating %d/%d networks\n", i, sc->max_inputs);
+
+		sr->id = i;
+		sr->sc = sc;
+		sr->status = FR_CHILD_INITIALIZING;
+
+		rcode = pthread_create(&sr->pthread_id, &attr, fr_schedule_receiver_thread, sr);
+		if (rcode != 0) {
+			fr_log(sc->log, L_DBG, "Failed to create network %d: %s\n", i, fr_syserror(rcode));
+			sr->status = FR_CHILD_FAIL;
+			break;
+		}
+
+		sc->num_inputs++;
+	}
+
+	/*
+	 *	Wait for all of the network threads to start.
+	 */
+	for (i = 0; i < sc->num_inputs; i++) {
+		fr_log(sc->log, L_DBG, "Waiting for semaphore from network %d/%d\n", i, sc->num_inputs);
+		SEM_WAIT_INTR(&sc->semaphore);
+	}
+
+	if (sc->num_inputs != sc->max_inputs) goto fail;
+
+	for (i = 0; i < sc->num_inputs; i++) {
+		if (sc->sr[i].status != FR_CHILD_RUNNING) goto fail;
+	}
 #endif
 
 	fr_log(sc->log, L_DBG, "Scheduler created successfully\n");
@@ -546,9 +689,8 @@ fr_schedule_t *fr_schedule_create(TALLOC_CTX *ctx, fr_log_t *log, int max_inputs
 int fr_schedule_destroy(fr_schedule_t *sc)
 {
 	int i, num;		
-	fr_schedule_worker_t *sw;
 
-	sc->running = false;
+	atomic_store_explicit(&sc->running, false, memory_order_release);
 
 #ifdef HAVE_PTHREAD_H
 	rad_assert(sc->num_workers > 0);
@@ -556,14 +698,27 @@ int fr_schedule_destroy(fr_schedule_t *sc)
 	fr_log(sc->log, L_DBG, "Destroying scheduler\n");
 
 	/*
-	 *	Signal the workers to exit.  They will push themselves
-	 *	onto the "exited" stack when they're done.
+	 *	Stop the network threads first, so that they don't
+	 *	send any more packets to the workers.  Ones which
+	 *	failed have already signaled us, and have had their
+	 *	semaphore consumed by fr_schedule_create().
 	 */
-	num = sc->num_workers;
+	for (i = 0; i < sc->num_inputs; i++) {
+		if (sc->sr[i].status != FR_CHILD_RUNNING) continue;
 
+		fr_receiver_exit(sc->sr[i].rc);
+		SEM_WAIT_INTR(&sc->semaphore);
+	}
+
+	/*
+	 *	Signal the workers to exit.  They remove themselves
+	 *	from the array of active workers, but need the mutex
+	 *	to do that.
+	 */
 	PTHREAD_MUTEX_LOCK(&sc->mutex);
-	while ((sw = fr_heap_pop(sc->workers)) != NULL) {
-		fr_worker_exit(sw->worker);
+	num = atomic_load_explicit(&sc->num_active, memory_order_relaxed);
+	for (i = 0; i < num; i++) {
+		fr_worker_exit(atomic_load_explicit(&sc->active[i], memory_order_relaxed)->worker);
 	}
 	PTHREAD_MUTEX_UNLOCK(&sc->mutex);
 
@@ -578,11 +733,13 @@ int fr_schedule_destroy(fr_schedule_t *sc)
 	}
 
 	/*
-	 *	If the network thread is running, tell it to exit.
+	 *	The workers ACK the channel close as they exit, which
+	 *	writes to the receivers control plane.  So the
+	 *	receivers can only be freed now.  There's no one left
+	 *	to tell that they're closing.
 	 */
-	if (sc->sr->status == FR_CHILD_RUNNING) {
-		fr_receiver_exit(sc->sr->rc);
-		SEM_WAIT_INTR(&sc->semaphore);
+	for (i = 0; i < sc->num_inputs; i++) {
+		talloc_free(sc->sr[i].ctx);
 	}
 
 	sem_destroy(&sc->semaphore);
@@ -597,16 +754,48 @@ int fr_schedule_destroy(fr_schedule_t *sc)
 	return 0;
 }
 
+/** Get the number of network threads
+ *
+ *  Callers which want to shard a listener across all network threads
+ *  should open this many sockets (e.g. via
+ *  fr_socket_server_reuse_port()), and add each one with
+ *  fr_schedule_socket_add().
+ *
+ * @param[in] sc the scheduler
+ * @return the number of running network threads.
+ */
+int fr_schedule_num_inputs(fr_schedule_t const *sc)
+{
+	return sc->num_inputs;
+}
+
 /** Add a socket to a scheduler.
+ *
+ *  Sockets are given to the network threads in round-robin order.
+ *  So adding fr_schedule_num_inputs() sockets bound with
+ *  SO_REUSEPORT results in each network thread reading from it's
+ *  own socket.
  *
  * @param sc the scheduler
  * @param fd the file descriptor for the socket
  * @param ctx the context for the transport
  * @param transport the transport
+ * @return
+ *	- <0 on error
+ *	- 0 on success
  */
 int fr_schedule_socket_add(fr_schedule_t *sc, int fd, void *ctx, fr_transport_t *transport)
 {
-	return fr_receiver_socket_add(sc->sr->rc, fd, ctx, transport);
+	fr_schedule_receiver_t *sr;
+
+	if (!sc->num_inputs) return -1;
+
+	PTHREAD_MUTEX_LOCK(&sc->mutex);
+	sr = &sc->sr[sc->next_input];
+	sc->next_input = (sc->next_input + 1) % sc->num_inputs;
+	PTHREAD_MUTEX_UNLOCK(&sc->mutex);
+
+	return fr_receiver_socket_add(sr->rc, fd, ctx, transport);
 }
 
 
@@ -42,6 +42,7 @@ fr_schedule_t *fr_schedule_create(TALLOC_CTX *ctx, fr_log_t *log, int max_inputs
 /* schedulers are async, so there's no fr_schedule_run() */
 int fr_schedule_destroy(fr_schedule_t *sc);
 int fr_schedule_get_worker_kq(fr_schedule_t *sc);
+int fr_schedule_num_inputs(fr_schedule_t const *sc) CC_HINT(nonnull);
 
 int fr_schedule_socket_add(fr_schedule_t *sc, int fd, void *ctx, fr_transport_t *transport) CC_HINT(nonnull);
 
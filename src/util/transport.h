@@ -91,6 +91,22 @@ typedef size_t (*fr_transport_nak_t)(void const *packet_ctx, uint8_t *const pack
  */
 typedef ssize_t (*fr_transport_encode_t)(void const *packet_ctx, REQUEST *request, uint8_t *buffer, size_t buffer_len);
 
+/**
+ *  Check a batch of raw packets in the network thread, before they
+ *  are sent to the workers.  rcode[i] is set to 0 if packet[i] is
+ *  OK, and to -1 if it should be dropped.
+ */
+typedef void (*fr_transport_verify_t)(void const *ctx, uint8_t * const *packet, size_t const *packet_len,
+				      int *rcode, int num);
+
+/**
+ *  Sign a batch of encoded replies in the network thread, before they
+ *  are written to the network.  rcode[i] is set to 0 if packet[i] was
+ *  signed, and to -1 if it should be dropped.
+ */
+typedef void (*fr_transport_sign_t)(void const *ctx, uint8_t * const *packet, size_t const *packet_len,
+				    int *rcode, int num);
+
 /**
  *  Do any worker-specific processing of the request.
  */
@@ -114,6 +130,10 @@ typedef	fr_transport_final_t (*fr_transport_process_t)(REQUEST *, fr_transport_a
 /**
  *  Data structure describing the transport.
  *
+ *  If there's a sign function, the encode and nak functions leave
+ *  replies unsigned, so that the master can sign a whole batch of
+ *  them at once.
+ *
  *  @todo add conf parser, open socket, send_request, recv_reply, send_nak, etc.
  */
 typedef struct fr_transport_t {
@@ -125,6 +145,8 @@ typedef struct fr_transport_t {
 	fr_transport_nak_t		nak;		//!< function to send a NAK
 	fr_transport_send_reply_t	send_reply;	//!< function to send a reply (worker -> master)
 	fr_transport_process_t		process;	//!< process a request
+	fr_transport_verify_t		verify;		//!< check a batch of packets read from the network (master), may be NULL
+	fr_transport_sign_t		sign;		//!< sign a batch of replies before writing them (master), may be NULL
 } fr_transport_t;
 
 typedef enum fr_transport_status_t {
@@ -161,6 +183,8 @@ struct rad_request {
 	fr_transport_process_t	process_async;
 	fr_time_tracking_t	tracking;
 	fr_channel_t		*channel;
+	int			owner;			//!< steal slot of the worker which owns "channel", or -1 if we do
+	uint64_t		channel_id;		//!< ID of "channel", in case it is closed while we run
 	void			*packet_ctx;
 	fr_transport_t		*transport;
 };
@@ -57,6 +57,15 @@
  *  yeilded, it is placed onto the yielded list in the worker
  *  "tracking" data structure.
  *
+ *  Workers may also share load.  When a worker has a large backlog
+ *  in the "to_decode" heap, it moves the newest messages into its
+ *  "steal" atomic queue, and wakes up an idle peer.  Idle workers pop
+ *  messages from their peers' steal queues, and process them as
+ *  normal.  Only the worker which owns a channel may write to it, so
+ *  the thief encodes the reply into a separate buffer, and returns it
+ *  to the owner via the owners control plane.  The owner then sends
+ *  the reply to the network thread.
+ *
  * @copyright 2016 Alan DeKok <aland@freeradius.org>
  */
 RCSID("$Id$")
@@ -67,6 +76,14 @@ RCSID("$Id$")
 #include <freeradius-devel/util/message.h>
 #include <freeradius-devel/rad_assert.h>
 
+#include <stdlib.h>
+
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/stdatomic.h>
+#endif
+
 /*
  *	Debugging, mainly for worker_test
  */
@@ -76,6 +93,26 @@ RCSID("$Id$")
 #define MPRINT(...)
 #endif
 
+/*
+ *	How much room we leave for a NAK.
+ *
+ *	@todo make the reservation size transport-specific
+ */
+#define WORKER_NAK_SIZE		(1024)
+
+/*
+ *	How many replies we send to a channel at once.
+ */
+#define WORKER_REPLY_BURST	(32)
+
+/*
+ *	How long we wait before trying again to return replies for
+ *	stolen messages, in microseconds.  The delay doubles after
+ *	each failure.
+ */
+#define WORKER_STOLEN_RETRY_MIN	(1000)
+#define WORKER_STOLEN_RETRY_MAX	(100000)
+
 /**
  *  Track things by priority and time.
  */
@@ -85,6 +122,66 @@ typedef struct fr_worker_heap_t {
 } fr_worker_heap_t;
 
 
+/**
+ *  One entry in the table of workers which can steal from each other.
+ */
+typedef struct fr_worker_steal_slot_t {
+	fr_atomic_queue_t	*aq;		//!< messages which other workers may steal
+	_Atomic(fr_control_t *)	control;	//!< control plane of the owning worker, NULL if it isn't running
+	atomic_bool		idle;		//!< is the owning worker sleeping?
+} fr_worker_steal_slot_t;
+
+/**
+ *  The table of workers which can steal from each other.
+ *
+ *  This is shared by all of the workers, and is created before any
+ *  of them start.
+ */
+struct fr_worker_steal_t {
+	int			num_workers;	//!< number of entries in the table
+	fr_worker_steal_slot_t	*slot;		//!< array of entries
+};
+
+/**
+ *  Who is responsible for a reply which was returned to its owner.
+ */
+typedef enum fr_worker_stolen_state_t {
+	WORKER_STOLEN_BUSY = 0,			//!< the owner hasn't sent the reply yet
+	WORKER_STOLEN_DONE,			//!< the owner has sent it, and the thief may re-use it
+	WORKER_STOLEN_ORPHANED			//!< the thief has exited, and the owner frees it
+} fr_worker_stolen_state_t;
+
+/**
+ *  A reply which was created by a thief, and is returned to the
+ *  worker which owns the channel.
+ *
+ *  Replies are allocated in the thief's talloc context, and only the
+ *  thief frees them.  The owner marks them done once it has sent
+ *  them, and the thief re-uses them for later replies.
+ */
+typedef struct fr_worker_stolen_t {
+	struct fr_worker_stolen_t *next;	//!< next reply in the same list
+	_Atomic(int)		state;		//!< fr_worker_stolen_state_t, shared with the owner
+
+	int			owner;		//!< steal slot of the worker which owns the channel
+	fr_channel_t		*ch;		//!< channel the original message was received on
+	uint64_t		channel_id;	//!< ID of the channel, so we don't use a re-allocated one
+	void			*ctx;		//!< packet context
+	uint32_t		priority;	//!< priority of the original message
+	uint32_t		transport;	//!< transport ID of the original message
+
+	fr_time_t		when;		//!< when the reply was created
+	fr_time_t		cpu_time;	//!< total CPU time of the thief
+	fr_time_t		processing_time; //!< processing time for this request
+	fr_time_t		request_time;	//!< timestamp of the request packet
+
+	bool			nak;		//!< the reply is a NAK
+
+	size_t			data_size;	//!< size of the encoded reply
+	size_t			data_max;	//!< space allocated for the encoded reply
+	uint8_t			data[];		//!< the encoded reply
+} fr_worker_stolen_t;
+
 /**
  *  A worker which takes packets from a master, and processes them.
  */
@@ -122,12 +219,35 @@ struct fr_worker_t {
 	int			num_replies;	//!< number of messages which were replied to
 	int			num_timeouts;	//!< number of messages which timed out
 
+	fr_worker_steal_t	*steal;		//!< work stealing table, shared with our peers
+	int			steal_id;	//!< our entry in the work stealing table
+	int			steal_next;	//!< the next peer we try to steal from
+	int			steal_threshold; //!< offer messages to peers when the to_decode heap is larger than this
+	fr_ring_buffer_t	*rb;		//!< for control-plane messages we send to our peers
+	fr_worker_stolen_t	*stolen;	//!< replies which we couldn't return to their owner
+	fr_worker_stolen_t	**stolen_tail;	//!< where the next reply is added
+	fr_worker_stolen_t	*stolen_busy;	//!< replies which our peers may still be using
+	fr_worker_stolen_t	*stolen_free;	//!< replies which can be re-used
+	fr_event_timer_t	*stolen_ev;	//!< when we next try to return replies
+	int			stolen_delay;	//!< current retry delay, in microseconds
+
+	_Atomic(uint32_t)	load_backlog;	//!< published number of queued and runnable requests
+	_Atomic(uint64_t)	load_predicted;	//!< published predicted processing time per request
+
+	_Atomic(uint64_t)	num_donated;	//!< number of messages we offered to our peers
+	_Atomic(uint64_t)	num_stolen;	//!< number of messages we stole from our peers
+	_Atomic(uint64_t)	num_returned;	//!< number of replies our peers returned to us
+
 	fr_time_tracking_t	tracking;	//!< how much time the worker has spent doing things.
 
 	uint32_t       		num_transports;	//!< how many transport layers we have
 	fr_transport_t		**transports;	//!< array of active transports.
 
 	fr_channel_t		**channel;	//!< list of channels
+
+	fr_channel_t		*reply_ch;	//!< channel the pending replies are for
+	fr_channel_data_t	*reply[WORKER_REPLY_BURST]; //!< replies which haven't been sent yet
+	int			num_reply;	//!< number of pending replies
 };
 
 /*
@@ -184,6 +304,58 @@ static void fr_worker_drain_input(fr_worker_t *worker, fr_channel_t *ch, fr_chan
 }
 
 
+/** Send the pending replies to the network thread
+ *
+ *  The replies are sent as one burst, so that the network thread is
+ *  signalled at most once for all of them.
+ *
+ * @param[in] worker the worker
+ */
+static void fr_worker_reply_flush(fr_worker_t *worker)
+{
+	fr_channel_t *ch = worker->reply_ch;
+	fr_channel_data_t *cd;
+
+	if (!worker->num_reply) return;
+
+	/*
+	 *	Send the replies, which also polls the request queue.
+	 */
+	if (fr_channel_send_reply_burst(ch, worker->reply, worker->num_reply, &cd) < worker->num_reply) {
+		MPRINT("\tWORKER fails sending reply\n");
+	}
+
+	worker->reply_ch = NULL;
+	worker->num_reply = 0;
+
+	/*
+	 *	Drain the incoming TO_WORKER queue.  We do this every
+	 *	time we send replies.
+	 */
+	if (cd) fr_worker_drain_input(worker, ch, cd);
+}
+
+
+/** Queue a reply for the network thread
+ *
+ *  Replies are held until we run out of requests to process, the
+ *  burst is full, or a reply is for a different channel.
+ *
+ * @param[in] worker the worker
+ * @param[in] ch the channel to send the reply to
+ * @param[in] reply the reply to send
+ */
+static void fr_worker_reply_queue(fr_worker_t *worker, fr_channel_t *ch, fr_channel_data_t *reply)
+{
+	if (worker->num_reply && (worker->reply_ch != ch)) fr_worker_reply_flush(worker);
+
+	worker->reply_ch = ch;
+	worker->reply[worker->num_reply++] = reply;
+
+	if (worker->num_reply == WORKER_REPLY_BURST) fr_worker_reply_flush(worker);
+}
+
+
 /** Handle a worker control message for a channel
  *
  * @param[in] ctx the worker
@@ -272,6 +444,8 @@ static void fr_worker_channel_callback(void *ctx, void const *data, size_t data_
 			 *	wake up after a time and try
 			 *	to close it again.
 			 */
+			if (worker->reply_ch == ch) fr_worker_reply_flush(worker);
+
 			(void) fr_channel_worker_ack_close(ch);
 
 			ms = fr_channel_worker_ctx_get(ch);
@@ -292,6 +466,95 @@ static void fr_worker_channel_callback(void *ctx, void const *data, size_t data_
 }
 
 
+/** Tell the thief that we've finished with a reply it returned to us
+ *
+ *  If the thief has already exited, the reply is ours to free.
+ *
+ * @param[in] stolen the reply
+ */
+static void fr_worker_stolen_done(fr_worker_stolen_t *stolen)
+{
+	int state = WORKER_STOLEN_BUSY;
+
+	if (atomic_compare_exchange_strong_explicit(&stolen->state, &state, WORKER_STOLEN_DONE,
+						    memory_order_release, memory_order_acquire)) return;
+
+	rad_assert(state == WORKER_STOLEN_ORPHANED);
+	talloc_free(stolen);
+}
+
+
+/** Handle a reply which a peer returned to us, for a message it stole
+ *
+ *  An empty message is just a signal that there's work for us to steal.
+ *
+ * @param[in] ctx the worker
+ * @param[in] data the message
+ * @param[in] data_size size of the data
+ * @param[in] now the current time
+ */
+static void fr_worker_stolen_callback(void *ctx, void const *data, size_t data_size, UNUSED fr_time_t now)
+{
+	int i;
+	fr_worker_t *worker = ctx;
+	fr_worker_stolen_t *stolen;
+	fr_channel_data_t *reply, *cd;
+	fr_message_set_t *ms;
+
+	rad_assert(data_size == sizeof(stolen));
+	if (data_size != sizeof(stolen)) return;
+
+	memcpy(&stolen, data, sizeof(stolen));
+	if (!stolen) {
+		MPRINT("\tWORKER woken up to steal\n");
+		return;
+	}
+
+	/*
+	 *	The channel may have been closed while the thief was
+	 *	processing the request.
+	 */
+	for (i = 0; i < worker->max_channels; i++) {
+		if (worker->channel[i] == stolen->ch) break;
+	}
+
+	if ((i == worker->max_channels) || (fr_channel_id(stolen->ch) != stolen->channel_id) ||
+	    !fr_channel_active(stolen->ch)) {
+		MPRINT("\tWORKER discarding stolen reply for closed channel\n");
+		fr_worker_stolen_done(stolen);
+		return;
+	}
+
+	ms = fr_channel_worker_ctx_get(stolen->ch);
+	rad_assert(ms != NULL);
+
+	reply = (fr_channel_data_t *) fr_message_reserve(ms, stolen->data_size);
+	rad_assert(reply != NULL);
+
+	if (stolen->data_size) {
+		memcpy(reply->m.data, stolen->data, stolen->data_size);
+		cd = (fr_channel_data_t *) fr_message_alloc(ms, &reply->m, stolen->data_size);
+		rad_assert(cd == reply);
+	}
+
+	reply->m.when = stolen->when;
+	reply->reply.cpu_time = stolen->cpu_time;
+	reply->reply.processing_time = stolen->processing_time;
+	reply->reply.request_time = stolen->request_time;
+
+	reply->ctx = stolen->ctx;
+	reply->priority = stolen->priority;
+	reply->transport = stolen->transport;
+
+	atomic_fetch_add_explicit(&worker->num_returned, 1, memory_order_relaxed);
+	if (stolen->nak) worker->num_timeouts++;
+
+	fr_worker_reply_queue(worker, stolen->ch, reply);
+
+	fr_worker_stolen_done(stolen);
+}
+
+
 /** Service an EVFILT_USER event
  *
  * @param[in] kq the kq to service
@@ -347,10 +610,7 @@ static void fr_worker_nak(fr_worker_t *worker, fr_channel_data_t *cd, fr_time_t
 	ms = fr_channel_worker_ctx_get(ch);
 	rad_assert(ms != NULL);
 
-	/*
-	 *	@todo make the reservation size transport-specific
-	 */
-	reply = (fr_channel_data_t *) fr_message_reserve(ms, 1024);
+	reply = (fr_channel_data_t *) fr_message_reserve(ms, WORKER_NAK_SIZE);
 	rad_assert(reply != NULL);
 
 	/*
@@ -377,17 +637,243 @@ static void fr_worker_nak(fr_worker_t *worker, fr_channel_data_t *cd, fr_time_t
 	 */
 	fr_message_done(&cd->m);
 
+	fr_worker_reply_queue(worker, ch, reply);
+
+	worker->num_replies++;
+}
+
+
+/** Wake up the main loop, so that it tries again to return replies
+ *
+ *  The event code clears worker->stolen_ev before calling us, which
+ *  is all the main loop needs to see.
+ */
+static void fr_worker_stolen_retry(UNUSED struct timeval *now, UNUSED void *ctx)
+{
+	MPRINT("\tWORKER retrying stolen replies\n");
+}
+
+
+/** Return pending replies to the workers which own their channels
+ *
+ *  Replies which can't be sent are kept, and we try again after a
+ *  delay, which doubles with each failure.  Until then, the kept
+ *  replies don't stop us from sleeping.  If the owner has exited, no
+ *  one can send the reply, so it is discarded.
+ *
+ * @param[in] worker the worker which stole the messages
+ */
+static void fr_worker_stolen_flush(fr_worker_t *worker)
+{
+	fr_worker_stolen_t *stolen, *next;
+	fr_control_t *owner;
+
 	/*
-	 *	Send the reply, which also polls the request queue.
+	 *	Wait for the retry timer.
 	 */
-	if (fr_channel_send_reply(ch, reply, &cd) < 0) {
-		MPRINT("\tWORKER fails sending reply\n");
-		cd = NULL;
+	if (worker->stolen_ev) return;
+
+	while ((stolen = worker->stolen) != NULL) {
+		next = stolen->next;
+
+		owner = atomic_load_explicit(&worker->steal->slot[stolen->owner].control, memory_order_acquire);
+		if (!owner) {
+			MPRINT("\tWORKER discarding stolen reply for exited worker\n");
+			stolen->next = worker->stolen_free;
+			worker->stolen_free = stolen;
+
+		} else {
+			atomic_store_explicit(&stolen->state, WORKER_STOLEN_BUSY, memory_order_relaxed);
+
+			if (fr_control_message_send(owner, worker->rb, FR_CONTROL_ID_WORKER,
+						    &stolen, sizeof(stolen)) < 0) {
+				struct timeval when, delay;
+
+				MPRINT("\tWORKER fails returning stolen reply\n");
+
+				worker->stolen_delay *= 2;
+				if (worker->stolen_delay < WORKER_STOLEN_RETRY_MIN) worker->stolen_delay = WORKER_STOLEN_RETRY_MIN;
+				if (worker->stolen_delay > WORKER_STOLEN_RETRY_MAX) worker->stolen_delay = WORKER_STOLEN_RETRY_MAX;
+
+				delay.tv_sec = 0;
+				delay.tv_usec = worker->stolen_delay;
+
+				fr_event_list_time(&when, worker->el);
+				fr_timeval_add(&when, &when, &delay);
+
+				if (fr_event_timer_insert(worker->el, fr_worker_stolen_retry, worker,
+							  &when, &worker->stolen_ev) < 0) {
+					MPRINT("\tWORKER failed inserting retry timer\n");
+				}
+				return;
+			}
+
+			/*
+			 *	The owner marks the reply done once
+			 *	it has sent it.
+			 */
+			stolen->next = worker->stolen_busy;
+			worker->stolen_busy = stolen;
+		}
+
+		worker->stolen = next;
+		if (!next) worker->stolen_tail = &worker->stolen;
 	}
 
+	worker->stolen_delay = 0;
+}
+
+
+/** Return a reply for a stolen message to the worker which owns the channel
+ *
+ *  The owner sends it to the network thread, and frees it.
+ *
+ * @param[in] worker the worker which stole the message
+ * @param[in] stolen the reply to return.
+ */
+static void fr_worker_stolen_return(fr_worker_t *worker, fr_worker_stolen_t *stolen)
+{
+	stolen->next = NULL;
+	*worker->stolen_tail = stolen;
+	worker->stolen_tail = &stolen->next;
+
 	worker->num_replies++;
 
-	if (cd) fr_worker_drain_input(worker, ch, cd);
+	fr_worker_stolen_flush(worker);
+}
+
+
+/** Allocate a reply for a stolen message
+ *
+ *  Replies which our peers have finished with are re-used, so that
+ *  we only allocate when all of them are still in use.
+ *
+ * @param[in] worker the worker which stole the message
+ * @param[in] size maximum size of the encoded reply
+ * @return
+ *	- NULL on error
+ *	- fr_worker_stolen_t on success
+ */
+static fr_worker_stolen_t *fr_worker_stolen_alloc(fr_worker_t *worker, size_t size)
+{
+	fr_worker_stolen_t *stolen, **last;
+
+	last = &worker->stolen_busy;
+	while ((stolen = *last) != NULL) {
+		if (atomic_load_explicit(&stolen->state, memory_order_acquire) != WORKER_STOLEN_DONE) {
+			last = &stolen->next;
+			continue;
+		}
+
+		*last = stolen->next;
+		stolen->next = worker->stolen_free;
+		worker->stolen_free = stolen;
+	}
+
+	for (last = &worker->stolen_free; (stolen = *last) != NULL; last = &stolen->next) {
+		if (stolen->data_max < size) continue;
+
+		*last = stolen->next;
+		return stolen;
+	}
+
+	stolen = talloc_size(worker, sizeof(*stolen) + size);
+	if (!stolen) return NULL;
+	talloc_set_name_const(stolen, "fr_worker_stolen_t");
+
+	stolen->data_max = size;
+
+	return stolen;
+}
+
+
+/** NAK a message which we stole from another worker
+ *
+ *  The owner counts the NAK as a timeout when it sends it.
+ *
+ * @param[in] worker the worker which stole the message
+ * @param[in] owner the steal slot of the worker which owns the channel
+ * @param[in] cd the message to NAK
+ * @param[in] now when the message is NAKd
+ */
+static void fr_worker_stolen_nak(fr_worker_t *worker, int owner, fr_channel_data_t *cd, fr_time_t now)
+{
+	fr_worker_stolen_t *stolen;
+
+	stolen = fr_worker_stolen_alloc(worker, WORKER_NAK_SIZE);
+	if (!stolen) {
+		fr_message_done(&cd->m);
+		return;
+	}
+
+	stolen->data_size = worker->transports[cd->transport]->nak(cd->ctx, cd->m.data, cd->m.data_size,
+								  stolen->data, WORKER_NAK_SIZE);
+
+	stolen->owner = owner;
+	stolen->ch = cd->channel.ch;
+	stolen->channel_id = fr_channel_id(cd->channel.ch);
+	stolen->ctx = cd->ctx;
+	stolen->priority = cd->priority;
+	stolen->transport = cd->transport;
+	stolen->when = now;
+	stolen->cpu_time = worker->tracking.running;
+	stolen->processing_time = 0;
+	stolen->request_time = cd->m.when;
+	stolen->nak = true;
+
+	fr_message_done(&cd->m);
+
+	fr_worker_stolen_return(worker, stolen);
+}
+
+
+/** Reply to a request which we stole from another worker
+ *
+ *  And clean it up.
+ *
+ * @param[in] worker the worker
+ * @param[in] request the request to process
+ * @param[in] size maximum size of the reply data
+ */
+static void fr_worker_stolen_reply(fr_worker_t *worker, REQUEST *request, size_t size)
+{
+	fr_worker_stolen_t *stolen;
+
+	stolen = fr_worker_stolen_alloc(worker, size);
+	if (!stolen) goto done;
+
+	stolen->data_size = 0;
+	if (size) {
+		ssize_t encoded;
+
+		encoded = request->transport->encode(request->packet_ctx, request, stolen->data, size);
+		if (encoded < 0) {
+			MPRINT("\tWORKER fails encode\n");
+			encoded = 0;
+		}
+
+		stolen->data_size = encoded;
+	}
+
+	fr_time_tracking_end(&request->tracking, fr_time(), &worker->tracking);
+
+	stolen->owner = request->owner;
+	stolen->ch = request->channel;
+	stolen->channel_id = request->channel_id;
+	stolen->ctx = request->packet_ctx;
+	stolen->priority = request->priority;
+	stolen->transport = request->transport->id;
+	stolen->when = request->tracking.when;
+	stolen->cpu_time = worker->tracking.running;
+	stolen->processing_time = request->tracking.running;
+	stolen->request_time = request->recv_time;
+	stolen->nak = false;
+
+	fr_worker_stolen_return(worker, stolen);
+
+done:
+	FR_DLIST_REMOVE(request->time_order);
+	talloc_free(request);
 }
 
 
@@ -405,6 +891,14 @@ static void fr_worker_send_reply(fr_worker_t *worker, REQUEST *request, size_t s
 	fr_channel_t *ch;
 	fr_message_set_t *ms;
 
+	/*
+	 *	We don't own the channel, so we can't write to it.
+	 */
+	if (request->owner >= 0) {
+		fr_worker_stolen_reply(worker, request, size);
+		return;
+	}
+
 	/*
 	 *	Allocate and send the reply.
 	 */
@@ -455,22 +949,10 @@ static void fr_worker_send_reply(fr_worker_t *worker, REQUEST *request, size_t s
 	reply->priority = request->priority;
 	reply->transport = request->transport->id;
 
-	/*
-	 *	Send the reply, which also polls the request queue.
-	 */
-	if (fr_channel_send_reply(ch, reply, &cd) < 0) {
-		MPRINT("\tWORKER fails sending reply\n");
-		cd = NULL;
-	}
+	fr_worker_reply_queue(worker, ch, reply);
 
 	worker->num_replies++;
 
-	/*
-	 *	Drain the incoming TO_WORKER queue.  We do this every
-	 *	time we're done processing a request.
-	 */
-	if (cd) fr_worker_drain_input(worker, ch, cd);
-
 	/*
 	 *	@todo Use a talloc pool for the request.  Clean it up,
 	 *	and insert it back into a slab allocator.
@@ -544,9 +1026,10 @@ static void fr_worker_check_timeouts(fr_worker_t *worker, fr_time_t now)
 		 *	0.01 to 1s.  Localize it.
 		 */
 		WORKER_HEAP_EXTRACT(to_decode, cd, request.list);
-		lm = fr_message_localize(worker, &cd->m, sizeof(cd));
+		lm = fr_message_localize(worker, &cd->m, sizeof(*cd));
 		if (!lm) goto nak;
 
+		cd = (fr_channel_data_t *) lm;
 		WORKER_HEAP_INSERT(localized, cd, request.list);
 	}
 
@@ -605,6 +1088,159 @@ static void fr_worker_check_timeouts(fr_worker_t *worker, fr_time_t now)
 }
 
 
+/** Offer messages in the "to_decode" and "localized" heaps to our peers
+ *
+ *  We give away the newest messages, as they can wait the longest.
+ *  If a peer is sleeping, we wake it up so that it can steal them.
+ *
+ * @param[in] worker the worker
+ */
+static void fr_worker_donate(fr_worker_t *worker)
+{
+	int i, num_donated = 0;
+	fr_dlist_t *entry;
+	fr_worker_steal_slot_t *slot;
+
+	if (!worker->steal) return;
+
+	slot = &worker->steal->slot[worker->steal_id];
+
+	while ((int) fr_heap_num_elements(worker->to_decode.heap) > worker->steal_threshold) {
+		fr_channel_data_t *cd;
+
+		entry = FR_DLIST_FIRST(worker->to_decode.list);
+		if (!entry) break;
+
+		cd = fr_ptr_to_type(fr_channel_data_t, request.list, entry);
+
+		WORKER_HEAP_EXTRACT(to_decode, cd, request.list);
+		if (!fr_atomic_queue_push(slot->aq, cd)) {
+			WORKER_HEAP_INSERT(to_decode, cd, request.list);
+			goto wakeup;
+		}
+
+		num_donated++;
+	}
+
+	/*
+	 *	Localized messages are in our talloc context, so they
+	 *	have to be detached before a peer can free them.
+	 */
+	while ((int) (fr_heap_num_elements(worker->to_decode.heap) +
+		      fr_heap_num_elements(worker->localized.heap)) > worker->steal_threshold) {
+		fr_channel_data_t *cd;
+
+		entry = FR_DLIST_FIRST(worker->localized.list);
+		if (!entry) break;
+
+		cd = fr_ptr_to_type(fr_channel_data_t, request.list, entry);
+
+		WORKER_HEAP_EXTRACT(localized, cd, request.list);
+		(void) talloc_steal(NULL, cd);
+		if (!fr_atomic_queue_push(slot->aq, cd)) {
+			(void) talloc_steal(worker, cd);
+			WORKER_HEAP_INSERT(localized, cd, request.list);
+			break;
+		}
+
+		num_donated++;
+	}
+
+wakeup:
+
+	if (!num_donated) return;
+
+	atomic_fetch_add_explicit(&worker->num_donated, num_donated, memory_order_relaxed);
+
+	/*
+	 *	Wake up one sleeping peer.
+	 */
+	for (i = 0; i < worker->steal->num_workers; i++) {
+		bool idle = true;
+		fr_control_t *control;
+		fr_worker_stolen_t *wakeup = NULL;
+
+		if (i == worker->steal_id) continue;
+
+		slot = &worker->steal->slot[i];
+
+		control = atomic_load_explicit(&slot->control, memory_order_acquire);
+		if (!control) continue;
+
+		if (!atomic_compare_exchange_strong_explicit(&slot->idle, &idle, false,
+							     memory_order_acq_rel, memory_order_relaxed)) continue;
+
+		(void) fr_control_message_send(control, worker->rb, FR_CONTROL_ID_WORKER, &wakeup, sizeof(wakeup));
+		break;
+	}
+}
+
+/** Steal a message from our peers
+ *
+ *  Messages we offered to our peers are taken back first.
+ *
+ * @param[in] worker the worker
+ * @param[out] p_owner the steal slot of the worker which owns the message, or -1 for our own messages.
+ * @return
+ *	- NULL on nothing to steal
+ *	- fr_channel_data_t the stolen message
+ */
+static fr_channel_data_t *fr_worker_steal(fr_worker_t *worker, int *p_owner)
+{
+	int i;
+	fr_channel_data_t *cd;
+
+	*p_owner = -1;
+
+	if (!worker->steal) return NULL;
+
+	if (fr_atomic_queue_pop(worker->steal->slot[worker->steal_id].aq, (void **) &cd)) return cd;
+
+	for (i = 0; i < worker->steal->num_workers; i++) {
+		fr_worker_steal_slot_t *slot;
+		fr_control_t *control;
+
+		worker->steal_next++;
+		if (worker->steal_next >= worker->steal->num_workers) worker->steal_next = 0;
+
+		if (worker->steal_next == worker->steal_id) continue;
+
+		slot = &worker->steal->slot[worker->steal_next];
+
+		control = atomic_load_explicit(&slot->control, memory_order_acquire);
+		if (!control) continue;
+
+		if (!fr_atomic_queue_pop(slot->aq, (void **) &cd)) continue;
+
+		atomic_fetch_add_explicit(&worker->num_stolen, 1, memory_order_relaxed);
+		*p_owner = worker->steal_next;
+		return cd;
+	}
+
+	return NULL;
+}
+
+
+/** Publish our current load, so that the scheduler can read it
+ *
+ *  The scheduler reads these without locks, so a slightly stale
+ *  view is OK.
+ *
+ * @param[in] worker the worker
+ */
+static inline void fr_worker_load_publish(fr_worker_t *worker)
+{
+	uint32_t backlog;
+
+	backlog = fr_heap_num_elements(worker->to_decode.heap);
+	backlog += fr_heap_num_elements(worker->localized.heap);
+	backlog += fr_heap_num_elements(worker->runnable);
+
+	atomic_store_explicit(&worker->load_backlog, backlog, memory_order_relaxed);
+	atomic_store_explicit(&worker->load_predicted, worker->tracking.predicted, memory_order_relaxed);
+}
+
+
 /** Get a runnable request
  *
  * @param[in] worker the worker
@@ -617,6 +1253,7 @@ static REQUEST *fr_worker_get_request(fr_worker_t *worker, fr_time_t now)
 {
 	int rcode;
 	fr_channel_data_t *cd;
+	int owner = -1;
 	REQUEST *request;
 #ifndef HAVE_TALLOC_POOLED_OBJECT
 	TALLOC_CTX *ctx;
@@ -640,6 +1277,7 @@ static REQUEST *fr_worker_get_request(fr_worker_t *worker, fr_time_t now)
 		if (!cd) {
 			WORKER_HEAP_POP(to_decode, cd, request.list);
 		}
+		if (!cd) cd = fr_worker_steal(worker, &owner);
 		if (!cd) return NULL;
 
 		worker->num_decoded++;
@@ -650,7 +1288,11 @@ static REQUEST *fr_worker_get_request(fr_worker_t *worker, fr_time_t now)
 		 */
 		if (cd->request.start_time && (cd->m.when != *cd->request.start_time)) {
 			MPRINT("\tIGNORING old message\n");
-			fr_worker_nak(worker, cd, fr_time());
+			if (owner >= 0) {
+				fr_worker_stolen_nak(worker, owner, cd, fr_time());
+			} else {
+				fr_worker_nak(worker, cd, fr_time());
+			}
 			cd = NULL;
 		}
 	} while (!cd);
@@ -695,6 +1337,8 @@ static REQUEST *fr_worker_get_request(fr_worker_t *worker, fr_time_t now)
 	request->runnable = worker->runnable;
 	request->el = worker->el;
 	request->packet_ctx = cd->ctx;
+	request->owner = owner;
+	request->channel_id = fr_channel_id(cd->channel.ch);
 
 	/*
 	 *	Now that the "request" structure has been initialized, go decode the packet.
@@ -704,7 +1348,11 @@ static REQUEST *fr_worker_get_request(fr_worker_t *worker, fr_time_t now)
 		MPRINT("\tFAILED decode of request %zd\n", request->number);
 		talloc_free(ctx);
 nak:
-		fr_worker_nak(worker, cd, fr_time());
+		if (owner >= 0) {
+			fr_worker_stolen_nak(worker, owner, cd, fr_time());
+		} else {
+			fr_worker_nak(worker, cd, fr_time());
+		}
 		return NULL;
 	}
 
@@ -836,6 +1484,7 @@ static int fr_worker_idle(void *ctx, struct timeval *wake)
 	sleeping = (fr_heap_num_elements(worker->runnable) == 0);
 	if (sleeping) sleeping = (fr_heap_num_elements(worker->localized.heap) == 0);
 	if (sleeping) sleeping = (fr_heap_num_elements(worker->to_decode.heap) == 0);
+	if (sleeping) sleeping = (worker->stolen == NULL) || (worker->stolen_ev != NULL);
 
 	/*
 	 *	Tell the event loop that there is new work to do.  We
@@ -862,6 +1511,13 @@ static int fr_worker_idle(void *ctx, struct timeval *wake)
 		(void) fr_channel_worker_sleeping(worker->channel[i]);
 	}
 
+	/*
+	 *	Tell our peers that we're available to steal work.
+	 */
+	if (worker->steal) {
+		atomic_store_explicit(&worker->steal->slot[worker->steal_id].idle, true, memory_order_release);
+	}
+
 	return 0;
 }
 
@@ -926,6 +1582,52 @@ void fr_worker_destroy(fr_worker_t *worker)
 		fr_message_done(&cd->m);
 	}
 
+	/*
+	 *	Stop our peers from stealing from us, and clean up
+	 *	the messages we offered to them.
+	 */
+	if (worker->steal) {
+		fr_worker_steal_slot_t *slot = &worker->steal->slot[worker->steal_id];
+
+		atomic_store_explicit(&slot->control, NULL, memory_order_release);
+
+		while (fr_atomic_queue_pop(slot->aq, (void **) &cd)) {
+			fr_message_done(&cd->m);
+		}
+
+		/*
+		 *	Try once more to return the replies we have
+		 *	for our peers.
+		 */
+		if (worker->stolen_ev) fr_event_timer_delete(worker->el, &worker->stolen_ev);
+		fr_worker_stolen_flush(worker);
+		while (worker->stolen) {
+			fr_worker_stolen_t *stolen = worker->stolen;
+
+			worker->stolen = stolen->next;
+			talloc_free(stolen);
+		}
+
+		/*
+		 *	Our peers may still be using some of the
+		 *	replies we returned.  Those are left for the
+		 *	peer to free.  They're detached first, so that
+		 *	freeing them doesn't touch our context.
+		 */
+		while (worker->stolen_busy) {
+			fr_worker_stolen_t *stolen = worker->stolen_busy;
+			int state = WORKER_STOLEN_BUSY;
+
+			worker->stolen_busy = stolen->next;
+
+			(void) talloc_steal(NULL, stolen);
+			if (atomic_compare_exchange_strong_explicit(&stolen->state, &state, WORKER_STOLEN_ORPHANED,
+								    memory_order_acq_rel, memory_order_acquire)) continue;
+
+			talloc_free(stolen);
+		}
+	}
+
 	/*
 	 *	Signal the channels that we're closing.
 	 *
@@ -935,6 +1637,8 @@ void fr_worker_destroy(fr_worker_t *worker)
 	 *	the FROM_WORKER queue, as we own those.  They will be
 	 *	automatically freed when our talloc context is freed.
 	 */
+	fr_worker_reply_flush(worker);
+
 	for (i = 0; i < worker->num_channels; i++) {
 		fr_channel_worker_ack_close(worker->channel[i]);
 	}
@@ -973,6 +1677,7 @@ fr_worker_t *fr_worker_create(TALLOC_CTX *ctx, uint32_t num_transports, fr_trans
 	worker->talloc_pool_size = 4096; /* at least enough for a REQUEST */
 	worker->message_set_size = 1024;
 	worker->ring_buffer_size = (1 << 16);
+	worker->steal_threshold = 16;
 
 	worker->el = fr_event_list_create(worker, fr_worker_idle, worker);
 	if (!worker->el) {
@@ -1013,6 +1718,11 @@ fr_worker_t *fr_worker_create(TALLOC_CTX *ctx, uint32_t num_transports, fr_trans
 		return NULL;
 	}
 
+	if (fr_control_callback_add(worker->control, FR_CONTROL_ID_WORKER, worker, fr_worker_stolen_callback) < 0) {
+		talloc_free(worker);
+		return NULL;
+	}
+
 	if (fr_event_user_insert(worker->el, fr_worker_evfilt_user, worker) < 0) {
 		talloc_free(worker);
 		return NULL;
@@ -1046,6 +1756,46 @@ int fr_worker_kq(fr_worker_t *worker)
 }
 
 
+/** Get the current load of a worker
+ *
+ *  This function may be called from any thread.  The load is the
+ *  predicted time for the worker to process everything it has queued,
+ *  plus one new request.  Before the worker has processed any
+ *  requests, the load is just the number of queued requests.
+ *
+ * @param[in] worker the worker data structure
+ * @return the load of the worker.  Lower is better.
+ */
+uint64_t fr_worker_load(fr_worker_t *worker)
+{
+	uint64_t backlog, predicted;
+
+	backlog = atomic_load_explicit(&worker->load_backlog, memory_order_relaxed);
+	predicted = atomic_load_explicit(&worker->load_predicted, memory_order_relaxed);
+
+	if (!predicted) return backlog + 1;
+
+	return (backlog + 1) * predicted;
+}
+
+
+/** Get the work stealing counters of a worker
+ *
+ *  This function may be called from any thread.  The counters are
+ *  read separately, so they may be slightly out of step with each
+ *  other.
+ *
+ * @param[in] worker the worker data structure
+ * @param[out] stats where the counters are written
+ */
+void fr_worker_steal_stats(fr_worker_t *worker, fr_worker_steal_stats_t *stats)
+{
+	stats->donated = atomic_load_explicit(&worker->num_donated, memory_order_relaxed);
+	stats->stolen = atomic_load_explicit(&worker->num_stolen, memory_order_relaxed);
+	stats->returned = atomic_load_explicit(&worker->num_returned, memory_order_relaxed);
+}
+
+
 /** Signal a worker to exit
  *
  *  WARNING: This may be called from another thread!  Care is required.
@@ -1077,6 +1827,11 @@ void fr_worker(fr_worker_t *worker)
 		wait_for_event = (fr_heap_num_elements(worker->runnable) == 0);
 		MPRINT("\tWaiting for events %d\n", wait_for_event);
 
+		/*
+		 *	Don't hold replies while we sleep.
+		 */
+		if (wait_for_event) fr_worker_reply_flush(worker);
+
 		/*
 		 *	Check the event list.  If there's an error
 		 *	(e.g. exit), we stop looping and clean up.
@@ -1085,13 +1840,16 @@ void fr_worker(fr_worker_t *worker)
 		MPRINT("\tGot num_events %d\n", num_events);
 		if (num_events < 0) break;
 
+		if (worker->steal) {
+			atomic_store_explicit(&worker->steal->slot[worker->steal_id].idle, false, memory_order_release);
+		}
+
 		/*
-		 *	Service outstanding events.
+		 *	Service outstanding events, and any timers
+		 *	which have fired.
 		 */
-		if (num_events > 0) {
-			MPRINT("\tservicing events\n");
-			fr_event_service(worker->el);
-		}
+		MPRINT("\tservicing events\n");
+		fr_event_service(worker->el);
 
 		now = fr_time();
 
@@ -1103,6 +1861,18 @@ void fr_worker(fr_worker_t *worker)
 			fr_worker_check_timeouts(worker, now);
 		}
 
+		/*
+		 *	If we're overloaded, let our peers help.
+		 */
+		fr_worker_donate(worker);
+
+		/*
+		 *	Retry returning replies to their owners.
+		 */
+		if (worker->stolen) fr_worker_stolen_flush(worker);
+
+		fr_worker_load_publish(worker);
+
 		/*
 		 *	Get a runnable request.  If there isn't one, continue.
 		 */
@@ -1145,9 +1915,15 @@ void worker_resume_request(REQUEST *request)
  */
 void fr_worker_debug(fr_worker_t *worker, FILE *fp)
 {
+	fr_worker_steal_stats_t stats;
+
 	fprintf(fp, "\tkq = %d\n", worker->kq);
 	fprintf(fp, "\tnum_channels = %d\n", worker->num_channels);
 	fprintf(fp, "\tnum_requests = %d\n", worker->num_requests);
+	fr_worker_steal_stats(worker, &stats);
+	fprintf(fp, "\tnum_donated = %" PRIu64 "\n", stats.donated);
+	fprintf(fp, "\tnum_stolen = %" PRIu64 "\n", stats.stolen);
+	fprintf(fp, "\tnum_returned = %" PRIu64 "\n", stats.returned);
 
 	fprintf(fp, "\tcalculated (predicted) total CPU time = %zd\n", worker->tracking.predicted * worker->num_requests);
 	fprintf(fp, "\tcalculated (counted) per request time = %zd\n", worker->tracking.running / worker->num_requests);
@@ -1175,3 +1951,77 @@ fr_channel_t *fr_worker_channel_create(fr_worker_t const *worker, TALLOC_CTX *ct
 
 	return fr_channel_create(ctx, master, worker->control);
 }
+
+/** Create a work stealing table
+ *
+ *  The table MUST be created before any of the workers which use it
+ *  are started.
+ *
+ * @param[in] ctx the talloc context
+ * @param[in] num_workers the maximum number of workers which will share the table
+ * @param[in] size the maximum number of messages each worker can offer to its peers
+ * @return
+ *	- NULL on error
+ *	- fr_worker_steal_t on success
+ */
+fr_worker_steal_t *fr_worker_steal_create(TALLOC_CTX *ctx, int num_workers, int size)
+{
+	int i;
+	fr_worker_steal_t *steal;
+
+	if ((num_workers <= 0) || (size <= 0)) return NULL;
+
+	steal = talloc_zero(ctx, fr_worker_steal_t);
+	if (!steal) return NULL;
+
+	steal->slot = talloc_zero_array(steal, fr_worker_steal_slot_t, num_workers);
+	if (!steal->slot) {
+		talloc_free(steal);
+		return NULL;
+	}
+
+	for (i = 0; i < num_workers; i++) {
+		steal->slot[i].aq = fr_atomic_queue_create(steal, size);
+		if (!steal->slot[i].aq) {
+			talloc_free(steal);
+			return NULL;
+		}
+
+		atomic_store_explicit(&steal->slot[i].control, NULL, memory_order_relaxed);
+		atomic_store_explicit(&steal->slot[i].idle, false, memory_order_relaxed);
+	}
+	atomic_thread_fence(memory_order_seq_cst);
+
+	steal->num_workers = num_workers;
+
+	return steal;
+}
+
+/** Allow a worker to share work with its peers
+ *
+ *  This function MUST be called from the worker thread, before
+ *  fr_worker() is run.
+ *
+ * @param[in] worker the worker
+ * @param[in] steal the work stealing table, shared by all workers
+ * @param[in] id the entry in the table for this worker
+ * @return
+ *	- <0 on error
+ *	- 0 on success
+ */
+int fr_worker_steal_add(fr_worker_t *worker, fr_worker_steal_t *steal, int id)
+{
+	if ((id < 0) || (id >= steal->num_workers)) return -1;
+
+	worker->rb = fr_ring_buffer_create(worker, FR_CONTROL_MAX_MESSAGES * FR_CONTROL_MAX_SIZE);
+	if (!worker->rb) return -1;
+
+	worker->steal = steal;
+	worker->steal_id = id;
+	worker->steal_next = id;
+	worker->stolen_tail = &worker->stolen;
+
+	atomic_store_explicit(&steal->slot[id].control, worker->control, memory_order_release);
+
+	return 0;
+}
@@ -43,14 +43,33 @@ extern "C" {
  */
 typedef struct fr_worker_t fr_worker_t;
 
+/**
+ *  A table of workers which can steal work from each other.
+ */
+typedef struct fr_worker_steal_t fr_worker_steal_t;
+
+/**
+ *  Work stealing counters for one worker.
+ */
+typedef struct fr_worker_steal_stats_t {
+	uint64_t	donated;		//!< messages the worker offered to its peers
+	uint64_t	stolen;			//!< messages the worker stole from its peers
+	uint64_t	returned;		//!< replies which its peers returned to it
+} fr_worker_steal_stats_t;
+
 fr_worker_t *fr_worker_create(TALLOC_CTX *ctx, uint32_t num_transports, fr_transport_t **transports);
 void fr_worker_destroy(fr_worker_t *worker) CC_HINT(nonnull);
 int fr_worker_kq(fr_worker_t *worker) CC_HINT(nonnull);
+uint64_t fr_worker_load(fr_worker_t *worker) CC_HINT(nonnull);
+void fr_worker_steal_stats(fr_worker_t *worker, fr_worker_steal_stats_t *stats) CC_HINT(nonnull);
 void fr_worker(fr_worker_t *worker) CC_HINT(nonnull);
 void fr_worker_exit(fr_worker_t *worker) CC_HINT(nonnull);
 void fr_worker_debug(fr_worker_t *worker, FILE *fp) CC_HINT(nonnull);
 fr_channel_t *fr_worker_channel_create(fr_worker_t const *worker, TALLOC_CTX *ctx, fr_control_t *master) CC_HINT(nonnull);
 
+fr_worker_steal_t *fr_worker_steal_create(TALLOC_CTX *ctx, int num_workers, int size);
+int fr_worker_steal_add(fr_worker_t *worker, fr_worker_steal_t *steal, int id) CC_HINT(nonnull);
+
 #ifdef __cplusplus
 }
 #endif